@@ -0,0 +1,102 @@
+#include "advance.h"
+
+#include <string.h>
+
+//Perturb and observe: time for the velocity loop to settle after the advance changes,
+//then to average the speed per duty over, and how much better a trial has to do
+#define ADVANCE_SETTLE_MS 1500
+#define ADVANCE_MEASURE_MS 1000
+#define ADVANCE_MARGIN 0.002f
+
+//Below this duty the speed per duty is mostly friction and noise
+#define ADVANCE_MIN_DUTY 0.05f
+
+AdvanceTable::AdvanceTable(float maxVelocity, float limit, float step, float dt)
+    : _maxVelocity(maxVelocity), _limit(limit), _step(step),
+      _settleTicks((int)(ADVANCE_SETTLE_MS*1e-3f/dt)), _measureTicks((int)(ADVANCE_MEASURE_MS*1e-3f/dt)),
+      _cell(-1), _phase(BASE), _ticks(0), _sum(0), _score(0), _trial(0) {
+    clear();
+}
+
+void AdvanceTable::clear() {
+    for (int i = 0; i < ADVANCE_SPEEDS*ADVANCE_DUTIES; i++) {
+        _advance[i] = 0;
+        _dir[i] = 1;
+    }
+    _changed = false;
+    _cell = -1;
+}
+
+int AdvanceTable::speedBin(float velocity) const {
+    int s = (int)(velocity/_maxVelocity*ADVANCE_SPEEDS);
+    return (s < 0) ? 0 : (s >= ADVANCE_SPEEDS) ? ADVANCE_SPEEDS - 1 : s;
+}
+
+int AdvanceTable::cell(float velocity, float duty) const {
+    int d = (int)(duty*ADVANCE_DUTIES);
+    d = (d < 0) ? 0 : (d >= ADVANCE_DUTIES) ? ADVANCE_DUTIES - 1 : d;
+    return speedBin(velocity)*ADVANCE_DUTIES + d;
+}
+
+float AdvanceTable::lookup(float velocity, float duty) const {
+    return _advance[cell(velocity, duty)];
+}
+
+//The cell's advance a step the way it last did better, turning back at the limits
+void AdvanceTable::startTrial() {
+    float a = _advance[_cell];
+    if (a + _dir[_cell]*_step > _limit || a + _dir[_cell]*_step < -_limit) {
+        _dir[_cell] = -_dir[_cell];
+    }
+    _trial = a + _dir[_cell]*_step;
+    _phase = TRIAL;
+}
+
+float AdvanceTable::optimise(float velocity, float duty) {
+    //the cell stays put through a trial as long as the speed does: the duty is what
+    //the trial changes
+    if (_cell < 0 || speedBin(velocity) != _cell/ADVANCE_DUTIES) {
+        _cell = cell(velocity, duty);
+        _phase = BASE;
+        _ticks = 0;
+        _sum = 0;
+    }
+    if (++_ticks > _settleTicks) {
+        _sum += (duty > ADVANCE_MIN_DUTY) ? velocity/duty : 0;
+        if (_ticks == _settleTicks + _measureTicks) {
+            float score = _sum/_measureTicks;
+            _ticks = 0;
+            _sum = 0;
+            if (_phase == BASE) {
+                _score = score;
+                startTrial();
+            }
+            else if (score > _score*(1 + ADVANCE_MARGIN)) {
+                _advance[_cell] = _trial;
+                _score = score;
+                _changed = true;
+                startTrial();
+            }
+            else {
+                //worse or no better: measure where it was again, as the speed or load
+                //may have moved, then try the other way
+                _dir[_cell] = -_dir[_cell];
+                _phase = BASE;
+            }
+        }
+    }
+    return (_phase == TRIAL) ? _trial : _advance[_cell];
+}
+
+void AdvanceTable::get(float* cells) const {
+    memcpy(cells, _advance, sizeof(_advance));
+}
+
+void AdvanceTable::set(const float* cells) {
+    for (int i = 0; i < ADVANCE_SPEEDS*ADVANCE_DUTIES; i++) {
+        float a = cells[i];
+        _advance[i] = (a > _limit) ? _limit : (a < -_limit) ? -_limit : a;
+    }
+    _changed = false;
+    _cell = -1;
+}
@@ -0,0 +1,78 @@
+#ifndef ADVANCE_H
+#define ADVANCE_H
+
+#include "mbed.h"
+
+//Six-step phase advance: how far ahead of the hall edge to commutate, in sectors (a
+//sixth of an electrical turn), by speed and duty.
+//
+//At speed the winding inductance holds the current back, so switching at the hall
+//edge gives less torque than switching a little before it, and more so the higher
+//the current. The photointerrupters can also just sit off the ideal point, which
+//is the same at every speed. Neither is worth modelling: optimise() finds the
+//advance instead, while the velocity loop holds a steady speed, by perturb and
+//observe on the cell that speed and duty are in. It measures the speed per unit duty
+//for ADVANCE_MEASURE_MS once ADVANCE_SETTLE_MS have let the loop settle, tries the
+//advance a step one way, and keeps it if that does better by ADVANCE_MARGIN, or
+//measures again and tries the other way if not. Held at a steady speed, better is
+//less duty, so it settles on the advance that takes the least.
+//
+//The cells are kept across resets with the rest of the calibration (calibration.h),
+//so a reset carries on from what was learnt.
+
+#define ADVANCE_SPEEDS 8
+#define ADVANCE_DUTIES 4
+
+class AdvanceTable {
+public:
+    //Cells up to maxVelocity rev/s and duty 1, advance within +-limit sectors, tried
+    //step at a time with optimise() called every dt seconds
+    AdvanceTable(float maxVelocity, float limit, float step, float dt);
+
+    //Advance for the cell velocity (in the direction of rotation) and duty are in
+    float lookup(float velocity, float duty) const;
+
+    //A cell by its speed and duty steps
+    float at(int speed, int duty) const { return _advance[speed*ADVANCE_DUTIES + duty]; }
+
+    //From the control tick while the speed is steady: the advance to drive with,
+    //which may be a trial one
+    float optimise(float velocity, float duty);
+
+    //Not steady: start measuring again next time
+    void pause() { _cell = -1; }
+
+    //Cells changed since the last set() or saved()
+    bool changed() const { return _changed; }
+    void saved() { _changed = false; }
+
+    //All ADVANCE_SPEEDS*ADVANCE_DUTIES cells, speed by speed, to keep and to put back
+    void get(float* cells) const;
+    void set(const float* cells);
+
+    //Forget everything learnt, in RAM
+    void clear();
+
+private:
+    enum Phase { BASE, TRIAL };
+
+    int cell(float velocity, float duty) const;
+    int speedBin(float velocity) const;
+    void startTrial();
+
+    float _maxVelocity, _limit, _step;
+    int _settleTicks, _measureTicks;
+    float _advance[ADVANCE_SPEEDS*ADVANCE_DUTIES];
+    bool _changed;
+
+    //Perturb and observe
+    int _cell;                  //being optimised, -1 for none
+    int _phase;
+    int _ticks;                 //since the phase started
+    float _sum;                 //of speed per duty while measuring
+    float _score;               //the cell's advance, measured
+    float _trial;
+    int8_t _dir[ADVANCE_SPEEDS*ADVANCE_DUTIES];     //which way to try next
+};
+
+#endif
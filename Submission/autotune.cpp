@@ -0,0 +1,110 @@
+#include "autotune.h"
+
+#include <math.h>
+
+//Forgetting factor, close to 1: the plant only changes when the flywheel does
+#define RLS_FORGET 0.998f
+//Initial covariance, large for no prior
+#define RLS_P0 1000.0f
+
+Autotuner::Autotuner() : _running(false), _u0(0), _amplitude(0), _halfPeriod(1), _length(0), _calls(0),
+                         _decimate(1), _dt(0), _lastV(0), _lastU(0), _haveLast(false), _u(0) {
+    for (int i = 0; i < 3; i++) {
+        _theta[i] = 0;
+        for (int j = 0; j < 3; j++) {
+            _p[i][j] = 0;
+        }
+    }
+}
+
+void Autotuner::start(float u0, float amplitude, float period, float duration, float dt, int decimate) {
+    _u0 = u0;
+    _amplitude = amplitude;
+    _dt = dt;
+    _decimate = (decimate > 0) ? decimate : 1;
+    _halfPeriod = (int)(period/(2*dt));
+    if (_halfPeriod < 1) {
+        _halfPeriod = 1;
+    }
+    _length = (int)(duration/dt);
+    _calls = 0;
+    for (int i = 0; i < 3; i++) {
+        _theta[i] = 0;
+        for (int j = 0; j < 3; j++) {
+            _p[i][j] = (i == j) ? RLS_P0 : 0;
+        }
+    }
+    _haveLast = false;
+    _u = u0;
+    _running = true;
+}
+
+float Autotuner::update(float velocity) {
+    if (!_running) {
+        return _u0;
+    }
+    if (_calls % _decimate == 0) {
+        fit(velocity);
+        //The drive only changes at samples, so each sample sees one u
+        bool high = (_calls/_halfPeriod) & 1;
+        _u = _u0 + (high ? _amplitude : -_amplitude);
+        if (_u < 0) {
+            _u = 0;
+        }
+        else if (_u > 1) {
+            _u = 1;
+        }
+        _lastU = _u;
+    }
+    if (++_calls >= _length) {
+        _running = false;
+        return _u0;
+    }
+    return _u;
+}
+
+//One recursive least squares step for the sample ending now
+void Autotuner::fit(float velocity) {
+    if (_haveLast) {
+        float phi[3] = {_lastV, _lastU, 1.0f};
+        float pphi[3];
+        float denom = RLS_FORGET;
+        for (int i = 0; i < 3; i++) {
+            pphi[i] = _p[i][0]*phi[0] + _p[i][1]*phi[1] + _p[i][2]*phi[2];
+            denom += phi[i]*pphi[i];
+        }
+        float error = velocity - (_theta[0]*phi[0] + _theta[1]*phi[1] + _theta[2]*phi[2]);
+        for (int i = 0; i < 3; i++) {
+            _theta[i] += pphi[i]*error/denom;
+        }
+        //P = (P - P*phi*phi'*P/denom)/forget, P symmetric so phi'*P = pphi'
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                _p[i][j] = (_p[i][j] - pphi[i]*pphi[j]/denom)/RLS_FORGET;
+            }
+        }
+    }
+    _lastV = velocity;
+    _haveLast = true;
+}
+
+PlantEstimate Autotuner::estimate() const {
+    PlantEstimate e;
+    float a = _theta[0], b = _theta[1], c = _theta[2];
+    e.valid = (a > 0.0f && a < 1.0f && b > 0.0f);
+    if (!e.valid) {
+        e.gain = e.tau = e.friction = 0;
+        return e;
+    }
+    e.gain = b/(1.0f - a);
+    e.tau = -(_dt*_decimate)/logf(a);
+    e.friction = -c/b;
+    return e;
+}
+
+PidConfig Autotuner::gains(float lambda, float dt, float outMin, float outMax) const {
+    PlantEstimate e = estimate();
+    PidConfig c = pidConfig(e.tau/(e.gain*lambda), 1.0f/(e.gain*lambda), 0.0f, dt, outMin, outMax);
+    c.kff = 1.0f/e.gain;
+    return c;
+}
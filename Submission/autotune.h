@@ -0,0 +1,73 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "pid.h"
+
+//Online identification of the velocity loop plant and PI gains from it.
+//
+//While running, update() replaces the velocity controller: it holds the drive at the
+//operating point u0 plus a square wave of +-amplitude, so the motor keeps spinning
+//near its speed, and fits the model
+//
+//  v[k+1] = a*v[k] + b*u[k] + c
+//
+//to the encoder velocity by recursive least squares, one sample every `decimate`
+//calls. Each step is a 3x3 update, so nothing is ever computed in one go.
+//
+//The fit gives the gain K = b/(1 - a) (rev/s per unit drive), the time constant
+//tau = -T/ln(a), and the drive needed just to overcome friction, -c/b. Inertia scales
+//with tau (see inertia()). The PI gains are the internal model choice for a closed
+//loop time constant lambda: kp = tau/(K*lambda), ki = 1/(K*lambda), and 1/K as
+//velocity feed-forward.
+
+struct PlantEstimate {
+    bool valid;
+    float gain;             //rev/s per unit drive
+    float tau;              //s
+    float friction;         //drive to overcome friction
+};
+
+class Autotuner {
+public:
+    Autotuner();
+
+    //Identify around drive u0 for duration seconds, with update() called every dt
+    //seconds. The square wave has the given period in seconds.
+    void start(float u0, float amplitude, float period, float duration, float dt, int decimate);
+    void stop() { _running = false; }
+    bool running() const { return _running; }
+
+    //Feed the measured velocity, get the drive to apply. Finishes by itself.
+    float update(float velocity);
+
+    PlantEstimate estimate() const;
+
+    //PI gains, with feed-forward, for closed loop time constant lambda
+    PidConfig gains(float lambda, float dt, float outMin, float outMax) const;
+
+    //Inertia in kg.m^2, for electrical damping (N.m per rad/s) dominating the
+    //friction: tau = J/damping
+    float inertia(float damping) const { return estimate().tau*damping; }
+
+    //Drive at the end of the run, to start the integral from
+    float operatingPoint() const { return _u0; }
+
+private:
+    void fit(float velocity);
+
+    bool _running;
+    float _u0, _amplitude;
+    int _halfPeriod;            //calls per half square wave
+    int _length, _calls;        //calls in the run, so far
+    int _decimate;
+    float _dt;
+
+    //Least squares state: parameters (a, b, c) and covariance
+    float _theta[3];
+    float _p[3][3];
+    float _lastV, _lastU;       //regressors of the pending sample
+    bool _haveLast;
+    float _u;                   //drive applied since the last sample
+};
+
+#endif
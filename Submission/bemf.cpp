@@ -0,0 +1,238 @@
+#include "bemf.h"
+#include "pinmap.h"
+
+#if SENSORLESS_FALLBACK
+
+//Sector times from a crossing with no next crossing before the lock is lost, and
+//clean crossings in a row that lock the ramp
+#define BEMF_LOST_SECTORS 2
+#define BEMF_LOCK_SECTORS 4
+
+//Blanking after a commutation, as a share of the sector time and at least in PWM periods
+#define BEMF_BLANK_SHARE 0.25f
+#define BEMF_MIN_BLANK 2
+
+//Weight of each new crossing interval in the sector time
+#define BEMF_FILTER 0.25f
+
+//Longest sector time the deadline fits in TIM15's 16 bits
+#define BEMF_MAX_SECTOR (0xFFFF/BEMF_LOST_SECTORS)
+
+static COMP_TypeDef* const comparators[3] = {COMP2, COMP4, COMP6};
+
+//Their non-inverting inputs, phase 1 to 3, and the star
+static const PinName comparatorPins[4] = {PA_7, PB_0, MBED_CONF_APP_BEMF_V3_PIN, PA_4};
+
+static const DriveImage* bemfImages;
+static float pwmPerTick;            //PWM periods per TIM15 tick
+static float delayShare;
+static void (*onCrossed)(int state, bool forward);
+static void (*onLost)();
+
+//Each drive state's floating phase, and whether its comparator goes high at the
+//crossing, stepping forward [1] and back [0]
+static int8_t floating[6];
+static bool rising[2][6];
+
+static volatile uint8_t bemfMode = BEMF_OFF;
+static volatile int8_t bemfDrive;
+static volatile int8_t bemfStep;
+static volatile float sectorTicks;  //TIM15 ticks
+static volatile bool waiting;       //for this sector's crossing
+static volatile bool before;        //and the comparator has been seen before it
+static volatile int blank;          //PWM periods left not looking
+static volatile bool crossed;       //lastCross is good for an interval
+static volatile uint16_t lastCross;
+static volatile int locked;         //ramp sectors in a row with a clean crossing
+static volatile float rampSpeed;    //sectors/s
+static volatile float rampTo;
+static volatile float rampAccel;
+
+static void sampleFloating();
+static void timerCompare();
+
+void bemfInit(const int8_t* driveTable, const DriveImage* driveImages, int pwmHz, float delay,
+              void (*crossed)(int state, bool forward), void (*lost)()) {
+    bemfImages = driveImages;
+    pwmPerTick = (float)pwmHz/BEMF_TICK_HZ;
+    delayShare = delay;
+    onCrossed = crossed;
+    onLost = lost;
+    for (int s = 0; s < 6; s++) {
+        int8_t used = driveTable[s];
+        for (int k = 0; k < 3; k++) {
+            if (!(used & (3 << 2*k))) floating[s] = k;
+        }
+        //high side bits are 0x02, 0x08, 0x20
+        rising[1][s] = driveTable[(s + 1) % 6] & (2 << 2*floating[s]);
+        rising[0][s] = driveTable[(s + 5) % 6] & (2 << 2*floating[s]);
+    }
+
+    for (int k = 0; k < 4; k++) {
+        pin_function(comparatorPins[k], STM_PIN_DATA(STM_MODE_ANALOG, GPIO_NOPULL, 0));
+    }
+
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+    for (int k = 0; k < 3; k++) {
+        //inverting input on PA4
+        comparators[k]->CSR = COMP_CSR_COMPxINSEL_2 | COMP_CSR_COMPxEN;
+    }
+
+    RCC->APB2ENR |= RCC_APB2ENR_TIM15EN;
+    TIM15->CR1 = 0;
+    TIM15->PSC = SystemCoreClock/BEMF_TICK_HZ - 1;
+    TIM15->ARR = 0xFFFF;
+    TIM15->EGR = TIM_EGR_UG;
+    TIM15->SR = 0;
+    TIM15->DIER = 0;
+    NVIC_SetVector(TIM1_BRK_TIM15_IRQn, (uintptr_t)timerCompare);
+    NVIC_EnableIRQ(TIM1_BRK_TIM15_IRQn);
+    TIM15->CR1 = TIM_CR1_CEN;
+}
+
+//Switch to the next drive state and start looking for its crossing
+static void stepDrive() {
+    int8_t d = bemfDrive + bemfStep;
+    d = (d < 0) ? d + 6 : (d > 5) ? d - 6 : d;
+    bemfDrive = d;
+    bridgeWrite(bemfImages[d]);
+    int b = (int)(BEMF_BLANK_SHARE*sectorTicks*pwmPerTick);
+    blank = (b < BEMF_MIN_BLANK) ? BEMF_MIN_BLANK : b;
+    before = false;
+    waiting = true;
+}
+
+static void loseLock() {
+    bemfStop();
+    onLost();
+}
+
+//TIM1 update: look at the floating phase
+static void sampleFloating() {
+    bridgeUpdateClear();
+    if (!waiting) {
+        return;
+    }
+    if (blank > 0) {
+        blank = blank - 1;
+        return;
+    }
+    int8_t d = bemfDrive;
+    bool high = comparators[floating[d]]->CSR & COMP_CSR_COMPxOUT;
+    if (high != rising[bemfStep > 0][d]) {
+        before = true;
+        return;
+    }
+    uint16_t now = TIM15->CNT;
+    waiting = false;
+    if (crossed) {
+        float t = sectorTicks + BEMF_FILTER*((uint16_t)(now - lastCross) - sectorTicks);
+        sectorTicks = (t > BEMF_MAX_SECTOR) ? BEMF_MAX_SECTOR : t;
+    }
+    lastCross = now;
+    crossed = true;
+    if (bemfMode == BEMF_RAMP) {
+        //a crossing already there when blanking ended could be anywhere
+        locked = before ? locked + 1 : 0;
+        if (locked < BEMF_LOCK_SECTORS) {
+            return;
+        }
+        bemfMode = BEMF_RUN;
+    }
+    onCrossed(d, bemfStep > 0);
+    int32_t delay = (int32_t)(delayShare*sectorTicks);
+    TIM15->CCR1 = (uint16_t)(now + ((delay < 2) ? 2 : delay));
+}
+
+//TIM15 compare: commutate, or the deadline has passed
+static void timerCompare() {
+    TIM15->SR = ~TIM_SR_CC1IF;
+    if (bemfMode == BEMF_RAMP) {
+        float v = rampSpeed;
+        if (v >= rampTo) {
+            loseLock();
+            return;
+        }
+        //one sector on at constant acceleration
+        v = sqrtf(v*v + 2*rampAccel);
+        rampSpeed = v;
+        sectorTicks = BEMF_TICK_HZ/v;
+        TIM15->CCR1 = (uint16_t)(TIM15->CCR1 + (uint16_t)sectorTicks);
+        stepDrive();
+        return;
+    }
+    if (bemfMode != BEMF_RUN) {
+        return;
+    }
+    if (waiting) {
+        loseLock();
+        return;
+    }
+    stepDrive();
+    TIM15->CCR1 = (uint16_t)(TIM15->CNT + BEMF_LOST_SECTORS*(uint16_t)sectorTicks);
+}
+
+//Common to both starts, in a critical section, with sectorTicks set
+static void beginDrive(int first, int dir, uint8_t mode) {
+    bemfDrive = first;
+    bemfStep = (dir > 0) ? 1 : -1;
+    if (sectorTicks > BEMF_MAX_SECTOR) {
+        sectorTicks = BEMF_MAX_SECTOR;
+    }
+    bridgeWrite(bemfImages[first]);
+    blank = 0;
+    before = false;
+    waiting = true;
+    crossed = false;
+    locked = 0;
+    bemfMode = mode;
+    bridgeAttach(sampleFloating, 1);
+    TIM15->SR = ~TIM_SR_CC1IF;
+    TIM15->DIER |= TIM_DIER_CC1IE;
+}
+
+void bemfStart(int first, int dir, float sectorUs) {
+    core_util_critical_section_enter();
+    sectorTicks = sectorUs*(BEMF_TICK_HZ/1000000.0f);
+    beginDrive(first, dir, BEMF_RUN);
+    TIM15->CCR1 = (uint16_t)(TIM15->CNT + BEMF_LOST_SECTORS*(uint16_t)sectorTicks);
+    core_util_critical_section_exit();
+}
+
+void bemfRamp(int first, int dir, float from, float to, float accel) {
+    core_util_critical_section_enter();
+    rampSpeed = from;
+    rampTo = to;
+    rampAccel = accel;
+    sectorTicks = BEMF_TICK_HZ/from;
+    beginDrive(first, dir, BEMF_RAMP);
+    TIM15->CCR1 = (uint16_t)(TIM15->CNT + (uint16_t)sectorTicks);
+    core_util_critical_section_exit();
+}
+
+void bemfStop() {
+    core_util_critical_section_enter();
+    //the TIM1 update may be someone else's by now
+    if (bemfMode != BEMF_OFF) {
+        bemfMode = BEMF_OFF;
+        waiting = false;
+        TIM15->DIER &= ~TIM_DIER_CC1IE;
+        bridgeDetach();
+    }
+    core_util_critical_section_exit();
+}
+
+BemfState bemfState() {
+    return (BemfState)bemfMode;
+}
+
+#else
+
+void bemfStop() {
+}
+
+BemfState bemfState() {
+    return BEMF_OFF;
+}
+
+#endif
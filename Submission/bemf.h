@@ -0,0 +1,76 @@
+#ifndef BEMF_H
+#define BEMF_H
+
+#include "mbed.h"
+#include "bridge.h"
+
+//Sensorless six-step: commutation timed from the back-EMF of the floating phase, for
+//when the photointerrupters can't be trusted.
+//
+//Each phase terminal is divided down onto a comparator's non-inverting input, and
+//the star of the three dividers goes to PA4, which all three can take as the
+//inverting input:
+//
+//  phase 1  COMP2  PA_7 (A6)       phase 2  COMP4  PB_0        phase 3  COMP6  PB_11
+//  star     PA_4 (A3)
+//
+//Those are the only non-inverting inputs the comparators have. On the Nucleo-F303K8
+//PB_0 is D3, which is photointerrupter I1 with HALL_CAPTURE and the L2L gate without,
+//and PB_11 isn't on the package, so phases 2 and 3 need a board that brings them out.
+//mbed_app.json's sensorless-fallback says whether the board does, and bemf-v3-pin
+//names PB_11 for a target that has it. Without them bemf.cpp only has bemfStop() and
+//bemfState(), which stays BEMF_OFF.
+//
+//In each drive state one phase floats, and its back-EMF crosses the star point part
+//way through, towards the polarity the next state drives it at. The TIM1 update
+//interrupt reads that phase's comparator once a PWM period, at the underflow in the
+//middle of the on-time and away from the switching edges. For the blanking time
+//after each commutation it doesn't look, while the phase that has just been let go
+//freewheels through a diode. A crossing puts TIM15's compare delay sector times
+//later, and the compare interrupt switches the bridge: the commutation is a timer
+//compare, not a Timeout. TIM15 (free running at BEMF_TICK_HZ; TIM2 is mbed's
+//us_ticker and TIM3 has the halls) also times the crossings, and the sector time is
+//the filtered interval between them.
+//
+//Until the crossing, the compare is a deadline instead: none for BEMF_LOST_SECTORS
+//sector times after a commutation and the lock is lost. Standing still there is no
+//back-EMF at all, so bemfRamp() steps the drive states open loop, speeding up at a
+//fixed rate, until crossings come in BEMF_LOCK_SECTORS sectors in a row.
+//
+//bemfInit() puts the comparator pins in the GPIO analog mode, as AnalogIn does for
+//the current sense pins.
+
+#define BEMF_TICK_HZ 250000
+
+#define SENSORLESS_FALLBACK MBED_CONF_APP_SENSORLESS_FALLBACK
+
+enum BemfState {
+    BEMF_OFF,
+    BEMF_RAMP,                  //stepping open loop, looking for crossings
+    BEMF_RUN                    //commutating from them
+};
+
+//Set up the comparators and TIM15. images[] are the bridge images for the drive
+//states of driveTable, which gives each state's floating phase; delay is from a
+//crossing to the commutation, as a share of the sector time (0.5 is 30 degrees).
+//crossed runs in the TIM1 update interrupt at each crossing once locked, with the
+//drive state and direction: the rotor is then 90 degrees short of that state's rest
+//position. lost runs in the TIM15 interrupt once it has stopped for want of crossings.
+void bemfInit(const int8_t* driveTable, const DriveImage* images, int pwmHz, float delay,
+              void (*crossed)(int state, bool forward), void (*lost)());
+
+//Take over a spinning rotor in drive state, stepping dir (1 or -1) a state at a time,
+//sectorUs apart to begin with
+void bemfStart(int state, int dir, float sectorUs);
+
+//Start a rotor from rest: drive state, which should be ahead of it as for a hall
+//start, then step on at from sectors/s, faster by accel sectors/s^2, until the
+//crossings lock or the steps get to to sectors/s
+void bemfRamp(int state, int dir, float from, float to, float accel);
+
+//Stop commutating, leaving the bridge as it is
+void bemfStop();
+
+BemfState bemfState();
+
+#endif
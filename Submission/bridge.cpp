@@ -0,0 +1,260 @@
+#include "bridge.h"
+
+//Output compare modes, in the OC1M position
+#define OC_FORCE_INACTIVE   (TIM_CCMR1_OC1M_2)
+#define OC_FORCE_ACTIVE     (TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_0)
+#define OC_PWM1             (TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1)
+#define OC_PWM2             (TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1M_0)
+
+//Largest dead time that DTG takes directly, 1.76us at 72MHz
+#define DEAD_TICKS_MAX 127
+
+//Where each gate of phases 1 and 2 has its OCxM field and the modes that give the
+//PWM, switch off and switch on at its pin, in driveTable bit order. A CHxN pin is the
+//inverse of OCxREF, and the high side CHxN pins are inverted again by CCxNP.
+struct BridgeGate {
+    uint32_t DriveImage::*reg;
+    int shift;                  //0 for channels 1 and 3, 8 for 2 and 4
+    bool high;                  //PMOS high side, PWM when its driveTable bit is clear
+    uint32_t pwm, off, on;
+};
+
+static const BridgeGate gates[4] = {
+    {&DriveImage::tim17Ccmr1, 0, false, OC_PWM2, OC_FORCE_ACTIVE, OC_FORCE_INACTIVE},   //L1L TIM17_CH1N
+    {&DriveImage::tim16Ccmr1, 0, true, OC_PWM1, OC_FORCE_ACTIVE, OC_FORCE_INACTIVE},    //L1H TIM16_CH1N
+    {&DriveImage::tim1Ccmr1, 8, false, OC_PWM2, OC_FORCE_ACTIVE, OC_FORCE_INACTIVE},    //L2L TIM1_CH2N
+    {&DriveImage::tim1Ccmr2, 0, true, OC_PWM1, OC_FORCE_ACTIVE, OC_FORCE_INACTIVE},     //L2H TIM1_CH3N
+};
+
+//driveTable bits of phase 3, L3L TIM1_CH1 and L3H TIM1_CH1N
+#define PHASE3_LOW  0x10
+#define PHASE3_HIGH 0x20
+
+//Channels 2 and 3, one output of each reaching a pin, see bridge.h
+#define CCER_PHASE2 (TIM_CCER_CC2E | TIM_CCER_CC2NE | TIM_CCER_CC3E | TIM_CCER_CC3NE | TIM_CCER_CC3NP)
+//Phase 3 as a complementary pair, and with CH1 held at its inactive level (BDTR.OSSR)
+//so CH1N is OC1REF on its own
+#define CCER_PHASE3_PAIR (TIM_CCER_CC1E | TIM_CCER_CC1NE | TIM_CCER_CC1NP)
+#define CCER_PHASE3_HIGH (TIM_CCER_CC1NE | TIM_CCER_CC1NP)
+
+static uint32_t deadTicks = 0;  //dead time in timer clocks
+
+static void setMode(DriveImage& image, const BridgeGate& gate, uint32_t mode) {
+    uint32_t& reg = image.*gate.reg;
+    reg = (reg & ~(TIM_CCMR1_OC1M << gate.shift)) | (mode << gate.shift);
+}
+
+//Phase 3's OC1M and outputs. With both on, CH1 is OC1REF and CH1N its inverse, each
+//turning on the dead time late; with CH1 held off, CH1N is OC1REF, inverted by CC1NP
+//like the other high sides.
+static void setPhase3(DriveImage& image, uint32_t mode, uint32_t ccer) {
+    image.tim1Ccmr1 = (image.tim1Ccmr1 & ~TIM_CCMR1_OC1M) | mode;
+    image.tim1Ccer = CCER_PHASE2 | ccer;
+}
+
+//CCR preload on every channel, every gate switched off
+DriveImage bridgeOffImage() {
+    DriveImage image;
+    image.tim1Ccmr1 = TIM_CCMR1_OC1PE | TIM_CCMR1_OC2PE;
+    image.tim1Ccmr2 = TIM_CCMR2_OC3PE;
+    image.tim16Ccmr1 = TIM_CCMR1_OC1PE;
+    image.tim17Ccmr1 = TIM_CCMR1_OC1PE;
+    for (int g = 0; g < 4; g++) {
+        setMode(image, gates[g], gates[g].off);
+    }
+    setPhase3(image, OC_FORCE_INACTIVE, CCER_PHASE3_HIGH);
+    return image;
+}
+
+//Period registers for pwmHz, with the prescaler that keeps it inside the 16 bit
+//counters. All of them are preloaded once the timers run.
+static void setPeriod(int pwmHz) {
+    uint32_t psc = (SystemCoreClock/pwmHz)/65536;
+    uint32_t period = SystemCoreClock/pwmHz/(psc + 1);
+    //TIM1 counts up and down, so ARR is half the period
+    TIM1->PSC = psc;
+    TIM1->ARR = period/2;
+    TIM16->PSC = psc;
+    TIM16->ARR = period - 1;
+    TIM17->PSC = psc;
+    TIM17->ARR = period - 1;
+}
+
+void bridgeInit(int pwmHz, int deadTimeNs) {
+    //Center-aligned mode can only be set while the counter is stopped
+    TIM1->CR1 = 0;
+    TIM16->CR1 = 0;
+    TIM17->CR1 = 0;
+    TIM1->CR2 = 0;
+    TIM16->CR2 = 0;
+    TIM17->CR2 = 0;
+
+    uint64_t ticks = (uint64_t)deadTimeNs*SystemCoreClock/1000000000;
+    deadTicks = (ticks > DEAD_TICKS_MAX) ? DEAD_TICKS_MAX : (uint32_t)ticks;
+    setPeriod(pwmHz);
+    TIM1->BDTR = TIM_BDTR_MOE | TIM_BDTR_OSSR | deadTicks;
+    TIM16->BDTR = TIM_BDTR_MOE | deadTicks;
+    TIM17->BDTR = TIM_BDTR_MOE | deadTicks;
+
+    DriveImage off = bridgeOffImage();
+    TIM1->CCMR1 = off.tim1Ccmr1;
+    TIM1->CCMR2 = off.tim1Ccmr2;
+    TIM16->CCMR1 = off.tim16Ccmr1;
+    TIM17->CCMR1 = off.tim17Ccmr1;
+    TIM1->CCR1 = 0;
+    TIM1->CCR2 = 0;
+    TIM1->CCR3 = 0;
+    TIM16->CCR1 = 0;
+    TIM17->CCR1 = 0;
+
+    //Both outputs of each channel on so the dead time generator runs, see bridge.h
+    TIM1->CCER = off.tim1Ccer;
+    TIM16->CCER = TIM_CCER_CC1E | TIM_CCER_CC1NE | TIM_CCER_CC1NP;
+    TIM17->CCER = TIM_CCER_CC1E | TIM_CCER_CC1NE;
+
+    TIM1->CR2 = TIM_CR2_CCPC;
+    TIM16->CR2 = TIM_CR2_CCPC;
+    TIM17->CR2 = TIM_CR2_CCPC;
+
+    //An odd repetition count loaded with the counter at 0 skips the overflow, so every
+    //TIM1 update event from here on is an underflow
+    TIM1->RCR = 1;
+    TIM16->RCR = 0;
+    TIM17->RCR = 0;
+
+    //Load the prescalers and zero the counters, then start them within a few clocks
+    //of each other: TIM1 underflows as TIM16/17 overflow
+    TIM1->EGR = TIM_EGR_UG;
+    TIM16->EGR = TIM_EGR_UG;
+    TIM17->EGR = TIM_EGR_UG;
+    TIM1->CR1 = TIM_CR1_CMS_0 | TIM_CR1_ARPE | TIM_CR1_CEN;
+    TIM16->CR1 = TIM_CR1_ARPE | TIM_CR1_CEN;
+    TIM17->CR1 = TIM_CR1_ARPE | TIM_CR1_CEN;
+}
+
+void bridgeImages(const int8_t* driveTable, DriveImage* images, int n) {
+    DriveImage off = bridgeOffImage();
+    for (int s = 0; s < n; s++) {
+        images[s] = off;
+        for (int g = 0; g < 4; g++) {
+            bool on = driveTable[s] & (1 << g);
+            uint32_t mode;
+            if (gates[g].high) {
+                mode = on ? gates[g].on : gates[g].pwm;
+            }
+            else {
+                mode = on ? gates[g].pwm : gates[g].off;
+            }
+            setMode(images[s], gates[g], mode);
+        }
+        if (driveTable[s] & PHASE3_LOW) {
+            //low side on for the duty, the high side the rest of the period
+            setPhase3(images[s], OC_PWM1, CCER_PHASE3_PAIR);
+        }
+        else if (driveTable[s] & PHASE3_HIGH) {
+            //OC1REF low, so CH1N holds the high side on
+            setPhase3(images[s], OC_FORCE_INACTIVE, CCER_PHASE3_PAIR);
+        }
+        else {
+            //high side off for the duty, as the other phases' high sides
+            setPhase3(images[s], OC_PWM2, CCER_PHASE3_HIGH);
+        }
+    }
+}
+
+DriveImage bridgePwmImage() {
+    DriveImage image = bridgeOffImage();
+    for (int g = 0; g < 4; g++) {
+        setMode(image, gates[g], gates[g].pwm);
+    }
+    setPhase3(image, OC_PWM1, CCER_PHASE3_PAIR);
+    return image;
+}
+
+//Compare value for a duty over counts; a full duty has to stay past ARR
+static uint32_t compare(float delta, uint32_t counts) {
+    if (delta <= 0.0f) return 0;
+    if (delta >= 1.0f) return counts + 1;
+    return (uint32_t)(delta*counts);
+}
+
+void bridgeDuty(float delta) {
+    //Center-aligned: OCxREF is high for 2*CCR of the 2*ARR count period
+    uint32_t arr = TIM1->ARR;
+    uint32_t d = compare(delta, arr);
+    TIM1->CCR1 = d;
+    TIM1->CCR2 = d;
+    TIM1->CCR3 = d;
+    TIM16->CCR1 = compare(delta, TIM16->ARR + 1);
+    TIM17->CCR1 = compare(delta, TIM17->ARR + 1);
+}
+
+//PWM gates are set to the low side on-time, 1 - the high side duty
+static uint32_t phaseCompare(int32_t duty, uint32_t counts) {
+    if (duty <= 0) return counts + 1;
+    if (duty >= 32768) return 0;
+    return ((32768 - duty)*counts) >> 15;
+}
+
+void bridgePhases(const int32_t duty[3]) {
+    uint32_t arr = TIM1->ARR;
+    uint32_t c = phaseCompare(duty[0], TIM16->ARR + 1);
+    TIM16->CCR1 = c;
+    TIM17->CCR1 = c;
+    c = phaseCompare(duty[1], arr);
+    TIM1->CCR2 = c;
+    TIM1->CCR3 = c;
+    c = phaseCompare(duty[2], arr);
+    TIM1->CCR1 = c;
+}
+
+//Update events every periods PWM periods on all three timers, so they keep loading
+//their preloaded registers together
+static void setRepetition(int periods) {
+    //TIM1 is center-aligned, so it counts an overflow and an underflow per period
+    TIM1->RCR = 2*periods - 1;
+    TIM16->RCR = periods - 1;
+    TIM17->RCR = periods - 1;
+}
+
+void bridgeAttach(void (*isr)(), int periods) {
+    setRepetition(periods);
+    TIM1->SR = ~TIM_SR_UIF;
+    NVIC_SetVector(TIM1_UP_TIM16_IRQn, (uintptr_t)isr);
+    NVIC_EnableIRQ(TIM1_UP_TIM16_IRQn);
+    TIM1->DIER |= TIM_DIER_UIE;
+}
+
+void bridgeDetach() {
+    TIM1->DIER &= ~TIM_DIER_UIE;
+}
+
+void bridgeTrigger(int periods) {
+    if (periods <= 0) {
+        TIM1->CR2 &= ~TIM_CR2_MMS;
+        return;
+    }
+    setRepetition(periods);
+    TIM1->CR2 = (TIM1->CR2 & ~TIM_CR2_MMS) | TIM_CR2_MMS_1;
+}
+
+//A compare value for from counts moved to to counts; a full duty stays past the top
+static uint32_t rescale(uint32_t ccr, uint32_t from, uint32_t to) {
+    if (ccr > from) return to + 1;
+    return (uint32_t)((uint64_t)ccr*to/from);
+}
+
+void bridgeFrequency(int pwmHz) {
+    core_util_critical_section_enter();
+    uint32_t arr = TIM1->ARR;
+    uint32_t counts = TIM16->ARR + 1;
+    setPeriod(pwmHz);
+    uint32_t newArr = TIM1->ARR;
+    uint32_t newCounts = TIM16->ARR + 1;
+    TIM1->CCR1 = rescale(TIM1->CCR1, arr, newArr);
+    TIM1->CCR2 = rescale(TIM1->CCR2, arr, newArr);
+    TIM1->CCR3 = rescale(TIM1->CCR3, arr, newArr);
+    TIM16->CCR1 = rescale(TIM16->CCR1, counts, newCounts);
+    TIM17->CCR1 = rescale(TIM17->CCR1, counts, newCounts);
+    core_util_critical_section_exit();
+}
@@ -0,0 +1,104 @@
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include "mbed.h"
+
+//Three phase PWM on the timers behind the six gate drives, so commutation is a
+//handful of register writes and every phase switches off one clock.
+//
+//On the F303K8 the gate pins are spread over three timers:
+//
+//  L1L D4  TIM17_CH1N      L2L D3  TIM1_CH2N       L3L D9  TIM1_CH1
+//  L1H D5  TIM16_CH1N      L2H D6  TIM1_CH3N       L3H D10 TIM1_CH1N
+//
+//mbed's PWM map has D10 (PA_11) as TIM1_CH4 only, so main.cpp muxes it to TIM1_CH1N
+//(AF6) itself with pin_function() before bridgeInit(). L2L moves to D2 (PA_12) when
+//the halls take D3 (hallcapture.h); the map only has PA_12 as TIM16_CH1, which would
+//make it follow phase 1, so that is muxed to TIM1_CH2N (AF6) the same way.
+//
+//TIM1 runs center-aligned. TIM16/17 can only count up, so they run edge-aligned over
+//the same period and are started with their update on TIM1's underflow. TIM1's
+//repetition counter is always odd, so its update events stay on the underflow, and
+//TIM16/17's count whole periods to match, so all three load their preloaded PSC, ARR
+//and compare values at the same update events.
+//
+//Phase 3 is a CH1/CH1N pair, a half bridge with the dead time inserted by the timer
+//between its two gates. Phases 1 and 2 have their gates on separate channels, so the
+//hardware dead time is used on one output at a time: with both CCxE and CCxNE set the
+//generator delays the turn-on edge of the pin we use, and the partner output goes
+//nowhere because its pin isn't muxed to the timer. The PMOS high sides get inverted
+//polarity so their turn-on is the delayed edge too.
+//
+//Each phase has one duty (bridgeDuty()); a drive state only picks the output
+//compare mode of each gate: PWM, or held off (on for a high side in the H state).
+//That is the OCxM fields of four CCMR registers, and TIM1's CCER, as phase 3's gates
+//share OC1M and a floating phase 3 leaves CH1 off. With CR2.CCPC set the new modes
+//and enables sit in preload until EGR.COMG, so each timer switches its phases in one
+//step.
+//
+//The PwmOut objects for the gate pins still do the clock and pin setup and must be
+//created first. Don't write them afterwards: pwmout_write() reprograms the channel.
+
+struct DriveImage {
+    uint32_t tim1Ccmr1;
+    uint32_t tim1Ccmr2;
+    uint32_t tim16Ccmr1;
+    uint32_t tim17Ccmr1;
+    uint32_t tim1Ccer;
+};
+
+//Take over the gate timers at the given PWM frequency and dead time. All gates
+//come up held off.
+void bridgeInit(int pwmHz, int deadTimeNs);
+
+//Fill images[] with one entry per drive state of driveTable (see sixstep.h for the
+//bit layout)
+void bridgeImages(const int8_t* driveTable, DriveImage* images, int n);
+
+//Every gate in PWM, each phase a complementary half bridge, for bridgePhases()
+DriveImage bridgePwmImage();
+
+//Every gate held off, high sides included, so the bridge floats. Drive state 7 still
+//switches the high sides against the duty.
+DriveImage bridgeOffImage();
+
+//Duty for every phase, 0-1: the share of the period a PWM low side is on, or a PWM
+//high side off, less the dead time. Takes effect at the next update event.
+void bridgeDuty(float delta);
+
+//Sinusoidal drive: high side duty of each phase, Q15 (32768 = always on), with the
+//bridgePwmImage() drive state. Takes effect at the next update event.
+void bridgePhases(const int32_t duty[3]);
+
+//Call isr from the TIM1 update interrupt every periods PWM periods. isr must call
+//bridgeUpdateClear().
+void bridgeAttach(void (*isr)(), int periods);
+void bridgeDetach();
+
+//Put TIM1's update event on TRGO every periods PWM periods, for the ADC trigger, or
+//take it off with 0. Shares the repetition counter with bridgeAttach().
+void bridgeTrigger(int periods);
+
+//Change the PWM frequency while running. PSC, ARR and the compare values, rescaled to
+//keep the duties, are all preloaded, so the timers finish the period they are in and
+//start the next one at the new frequency; nothing is stopped or reinitialised as
+//pwmout_period_us() would. Frequencies down to SystemCoreClock/2^32 Hz.
+void bridgeFrequency(int pwmHz);
+
+inline void bridgeUpdateClear() {
+    TIM1->SR = ~TIM_SR_UIF;
+}
+
+//Switch to a drive state. Safe to call from an ISR.
+inline void bridgeWrite(const DriveImage& image) {
+    TIM1->CCMR1 = image.tim1Ccmr1;
+    TIM1->CCMR2 = image.tim1Ccmr2;
+    TIM16->CCMR1 = image.tim16Ccmr1;
+    TIM17->CCMR1 = image.tim17Ccmr1;
+    TIM1->CCER = image.tim1Ccer;
+    TIM1->EGR = TIM_EGR_COMG;
+    TIM16->EGR = TIM_EGR_COMG;
+    TIM17->EGR = TIM_EGR_COMG;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#include "calibration.h"
+
+#include <stddef.h>
+#include <string.h>
+
+//"CALB"
+#define CALIBRATION_MAGIC 0x424C4143
+
+struct CalibrationRecord {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;              //of the Calibration, as a check on the version
+    uint32_t sequence;          //one on from the other page's when it was saved
+    Calibration data;
+    uint32_t checksum;          //FNV-1a of everything before it
+};
+
+static uint32_t checksum(const CalibrationRecord& r) {
+    const uint8_t* p = (const uint8_t*)&r;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < offsetof(CalibrationRecord, checksum); i++) {
+        h = (h ^ p[i])*16777619u;
+    }
+    return h;
+}
+
+//End of the image in flash: the code, then the initial data the startup copies out
+//of it. mbed_app.json keeps it below the calibration pages, and the store erases and
+//programs nothing under it in case a build without that setting has grown into them.
+#if defined(__CC_ARM)
+extern "C" char Load$$LR$$LR_IROM1$$Limit[];
+static uintptr_t imageEnd() {
+    return (uintptr_t)Load$$LR$$LR_IROM1$$Limit;
+}
+#else
+//weak only so that the simulator's absolute definitions link into a position
+//independent host build (through the GOT); the GCC_ARM linker script defines all three
+extern "C" char __etext[] __attribute__((weak));
+extern "C" char __data_start__[] __attribute__((weak));
+extern "C" char __data_end__[] __attribute__((weak));
+static uintptr_t imageEnd() {
+    return (uintptr_t)__etext + (uintptr_t)(__data_end__ - __data_start__);
+}
+#endif
+
+static bool flashErase(uintptr_t page) {
+    if (page < imageEnd()) {
+        return false;
+    }
+    FLASH_EraseInitTypeDef erase;
+    erase.TypeErase = FLASH_TYPEERASE_PAGES;
+    erase.PageAddress = (uint32_t)page;
+    erase.NbPages = 1;
+    uint32_t pageError;
+    HAL_FLASH_Unlock();
+    bool ok = HAL_FLASHEx_Erase(&erase, &pageError) == HAL_OK;
+    HAL_FLASH_Lock();
+    return ok;
+}
+
+static bool flashProgram(uintptr_t address, uint16_t halfword) {
+    if (address < imageEnd()) {
+        return false;
+    }
+    HAL_FLASH_Unlock();
+    bool ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, (uint32_t)address, halfword) == HAL_OK;
+    HAL_FLASH_Lock();
+    return ok;
+}
+
+CalibrationStorage calibrationFlash(uintptr_t pageA, uintptr_t pageB) {
+    CalibrationStorage s;
+    s.pages[0] = pageA;
+    s.pages[1] = pageB;
+    s.pageSize = FLASH_PAGE_SIZE;
+    s.erase = flashErase;
+    s.program = flashProgram;
+    return s;
+}
+
+CalibrationStore::CalibrationStore(const CalibrationStorage& storage) : _storage(storage) {}
+
+static const CalibrationRecord* goodRecord(uintptr_t page) {
+    const CalibrationRecord* r = (const CalibrationRecord*)page;
+    if (r->magic != CALIBRATION_MAGIC || r->version != CALIBRATION_VERSION || r->size != sizeof(Calibration) ||
+        r->checksum != checksum(*r)) {
+        return 0;
+    }
+    return r;
+}
+
+int CalibrationStore::newest() const {
+    const CalibrationRecord* a = goodRecord(_storage.pages[0]);
+    const CalibrationRecord* b = goodRecord(_storage.pages[1]);
+    if (a && b) {
+        return ((int32_t)(b->sequence - a->sequence) > 0) ? 1 : 0;
+    }
+    return a ? 0 : b ? 1 : -1;
+}
+
+bool CalibrationStore::load(Calibration& c) const {
+    int page = newest();
+    if (page < 0) {
+        return false;
+    }
+    memcpy(&c, &((const CalibrationRecord*)_storage.pages[page])->data, sizeof(c));
+    return true;
+}
+
+uint32_t CalibrationStore::sequence() const {
+    int page = newest();
+    return (page < 0) ? 0 : ((const CalibrationRecord*)_storage.pages[page])->sequence;
+}
+
+bool CalibrationStore::save(const Calibration& c) {
+    int page = newest();
+    CalibrationRecord r;
+    memset(&r, 0, sizeof(r));
+    r.magic = CALIBRATION_MAGIC;
+    r.version = CALIBRATION_VERSION;
+    r.size = sizeof(Calibration);
+    r.sequence = ((page < 0) ? 0 : ((const CalibrationRecord*)_storage.pages[page])->sequence) + 1;
+    r.data = c;
+    r.checksum = checksum(r);
+
+    //over the older page, or the first if there is none
+    uintptr_t to = _storage.pages[(page == 0) ? 1 : 0];
+    if (sizeof(r) > _storage.pageSize || !_storage.erase(to)) {
+        return false;
+    }
+    //in halfwords, copied out rather than read through a uint16_t pointer, which may
+    //not alias the record; the checksum last
+    const uint8_t* p = (const uint8_t*)&r;
+    for (size_t i = 0; i < sizeof(r); i += 2) {
+        uint16_t h;
+        memcpy(&h, p + i, 2);
+        if (!_storage.program(to + i, h)) {
+            return false;
+        }
+    }
+    return memcmp((const void*)to, &r, sizeof(r)) == 0;
+}
@@ -0,0 +1,67 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include "mbed.h"
+#include "advance.h"
+
+//What the motor has found out about itself, kept across resets: the rotor state
+//motorHome() reads, the velocity loop gains and inertia from the auto-tuner and the
+//phase advance table.
+//
+//The record is the struct itself, read in place from flash: a load checks two
+//headers and two checksums and copies it, with nothing to parse. The header's version
+//has to match, so a record from firmware with another layout is ignored and the
+//defaults stand until the next save. Change CALIBRATION_VERSION with Calibration or
+//the advance table's size.
+//
+//Saves alternate between two flash pages, each with a sequence number, and the
+//checksum is written last, after the page has been erased and the rest written. A
+//save cut short by a reset leaves a page that doesn't check out, and the load takes
+//the other one, so the store holds either the old record or the new one.
+//
+//Erasing a page stalls the CPU for tens of ms, so save with the motor stopped.
+
+#define CALIBRATION_VERSION 3
+
+struct Calibration {
+    int8_t orState;             //rotor state at the motorHome() position, 6 for not known
+    uint8_t reserved[3];
+    float kp, ki, kff;          //velocity loop, kp 0 for the defaults
+    float inertia;              //kg.m^2 as auto-tuned, 0 for none
+    float advance[ADVANCE_SPEEDS*ADVANCE_DUTIES];   //sectors, see AdvanceTable
+};
+
+//The two pages the store uses: flash on the board (calibrationFlash()), or anything
+//else that reads in place, erases a page to 0xFF and programs a halfword at a time
+struct CalibrationStorage {
+    uintptr_t pages[2];
+    uint32_t pageSize;
+    bool (*erase)(uintptr_t page);
+    bool (*program)(uintptr_t address, uint16_t halfword);
+};
+
+//The flash pages at pageA and pageB, which the image has to leave free: set
+//target.mbed_app_size in mbed_app.json to end it below them. Pages it reaches into
+//anyway are never erased, and saves to them fail.
+CalibrationStorage calibrationFlash(uintptr_t pageA, uintptr_t pageB);
+
+class CalibrationStore {
+public:
+    CalibrationStore(const CalibrationStorage& storage);
+
+    //The newest good record, false if neither page has one
+    bool load(Calibration& c) const;
+
+    //Write c over the older record
+    bool save(const Calibration& c);
+
+    //Of the newest good record, 0 for none
+    uint32_t sequence() const;
+
+private:
+    int newest() const;
+
+    CalibrationStorage _storage;
+};
+
+#endif
@@ -0,0 +1,243 @@
+#include "command.h"
+
+//Semitones above C of the notes A to G
+static const uint8_t notePitch[] = {9, 11, 0, 2, 4, 5, 7};
+
+static char upper(char c) {
+    return (c >= 'a' && c <= 'z') ? (char)(c - 'a' + 'A') : c;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c = upper(c);
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+CommandParser::CommandParser() {
+    reset();
+}
+
+void CommandParser::reset() {
+    _phase = START;
+    _cmd.option = -1;
+    _cmd.notes = 0;
+    _cmd.rotations = 0;
+    _cmd.angle = 0;
+    _cmd.velocity = 0;
+    _cmd.key = 0;
+}
+
+ParseResult CommandParser::feed(char c, Command& out) {
+    if (c == ' ' || c == '\r' || c == '\n' || c == '\t') {
+        if (_phase == START) {
+            return PARSE_MORE;
+        }
+        bool ok = (_phase != SKIP) && finish();
+        if (ok) {
+            out = _cmd;
+        }
+        reset();
+        return ok ? PARSE_COMMAND : PARSE_ERROR;
+    }
+    switch (_phase) {
+        case START:
+            begin(c);
+            break;
+        case NUMBER:
+            //an R or D number can be followed by a V one
+            if (!digit(c)) {
+                if ((_field == 'R' || _field == 'D') && upper(c) == 'V' && finishNumber()) {
+                    _field = 'V';
+                    _negative = _point = false;
+                    _intDigits = _fracDigits = 0;
+                    _mantissa = 0;
+                    if (_cmd.type == COMMAND_ROTATE) {
+                        _cmd.type = COMMAND_ROTATE_VELOCITY;
+                    }
+                }
+                else {
+                    _phase = SKIP;
+                }
+            }
+            break;
+        case NOTES:
+            if (!note(c)) {
+                _phase = SKIP;
+            }
+            break;
+        case KEY: {
+            int v = hexValue(c);
+            if (v < 0 || _keyDigits == COMMAND_KEY_DIGITS) {
+                _phase = SKIP;
+            }
+            else {
+                _cmd.key = (_cmd.key << 4) | (uint64_t)v;
+                _keyDigits++;
+            }
+            break;
+        }
+        case OPTION:
+            if (c >= '0' && c <= ((_cmd.type == COMMAND_DRIVE) ? '2' : '1')) {
+                _cmd.option = (int8_t)(c - '0');
+                _phase = END;
+            }
+            else {
+                _phase = SKIP;
+            }
+            break;
+        case END:
+            _phase = SKIP;
+            break;
+        default:
+            break;
+    }
+    return PARSE_MORE;
+}
+
+//First letter of a word
+void CommandParser::begin(char c) {
+    switch (upper(c)) {
+        case 'R': case 'V': case 'D':
+            _phase = NUMBER;
+            _field = upper(c);
+            _cmd.type = (_field == 'R') ? COMMAND_ROTATE : (_field == 'D') ? COMMAND_HOLD : COMMAND_VELOCITY;
+            _negative = _point = false;
+            _intDigits = _fracDigits = 0;
+            _mantissa = 0;
+            break;
+        case 'T':
+            _phase = NOTES;
+            _cmd.type = COMMAND_TUNE;
+            _noteStage = 0;
+            break;
+        case 'K':
+            _phase = KEY;
+            _cmd.type = COMMAND_KEY;
+            _keyDigits = 0;
+            break;
+        case 'M':
+            _phase = OPTION;
+            _cmd.type = COMMAND_DRIVE;
+            break;
+        case 'P':
+            _phase = OPTION;
+            _cmd.type = COMMAND_PROFILE;
+            break;
+        case 'L':
+            _phase = OPTION;
+            _cmd.type = COMMAND_ADVANCE;
+            break;
+        case 'A':
+            _phase = END;
+            _cmd.type = COMMAND_AUTOTUNE;
+            break;
+        case 'H':
+            _phase = END;
+            _cmd.type = COMMAND_HISTOGRAM;
+            break;
+        case 'F':
+            _phase = END;
+            _cmd.type = COMMAND_FAULT;
+            break;
+        default:
+            _phase = SKIP;
+    }
+}
+
+//Next character of a number, false if it can't be one
+bool CommandParser::digit(char c) {
+    if (c == '-') {
+        if (_negative || _point || _intDigits) {
+            return false;
+        }
+        _negative = true;
+    }
+    else if (c == '.') {
+        if (_point || !_intDigits) {
+            return false;
+        }
+        _point = true;
+    }
+    else if (c >= '0' && c <= '9') {
+        if (_point ? _fracDigits == COMMAND_FRAC_DIGITS : _intDigits == COMMAND_INT_DIGITS) {
+            return false;
+        }
+        _mantissa = _mantissa*10 + (uint32_t)(c - '0');
+        if (_point) {
+            _fracDigits++;
+        }
+        else {
+            _intDigits++;
+        }
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+//Store the number in its field, false if it has no digits
+bool CommandParser::finishNumber() {
+    if (!_intDigits) {
+        return false;
+    }
+    static const float scale[COMMAND_FRAC_DIGITS + 1] = {1.0f, 10.0f, 100.0f, 1000.0f};
+    float v = (float)_mantissa/scale[_fracDigits];
+    if (_negative) {
+        v = -v;
+    }
+    if (_field == 'R') {
+        _cmd.rotations = v;
+    }
+    else if (_field == 'D') {
+        _cmd.angle = v;
+    }
+    else {
+        _cmd.velocity = v;
+    }
+    return true;
+}
+
+//Next character of a tune, false if it can't be one
+bool CommandParser::note(char c) {
+    if (_noteStage == 0) {
+        char u = upper(c);
+        if (u < 'A' || u > 'G' || _cmd.notes == COMMAND_TUNE_NOTES) {
+            return false;
+        }
+        _cmd.tune[_cmd.notes].pitch = notePitch[u - 'A'];
+        _noteStage = 1;
+        return true;
+    }
+    Note& n = _cmd.tune[_cmd.notes];
+    if (_noteStage == 1 && (c == '#' || c == '^')) {
+        n.pitch = (uint8_t)((n.pitch + ((c == '#') ? 1 : 11)) % 12);
+        _noteStage = 2;
+        return true;
+    }
+    if (c < '1' || c > '8') {
+        return false;
+    }
+    n.length = (uint8_t)(c - '0');
+    _cmd.notes++;
+    _noteStage = 0;
+    return true;
+}
+
+//End of the word: is it a whole command?
+bool CommandParser::finish() {
+    switch (_phase) {
+        case NUMBER:
+            return finishNumber();
+        case NOTES:
+            return _noteStage == 0 && _cmd.notes > 0;
+        case KEY:
+            return _keyDigits == COMMAND_KEY_DIGITS;
+        case OPTION:
+        case END:
+            return true;
+        default:
+            return false;
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stdint.h>
+
+//Serial command grammar, one command per whitespace separated word, letters in
+//either case:
+//
+//  R-?[0-9]{1,4}(.[0-9]{0,3})?          rotate this many turns, sign for direction
+//  V-?[0-9]{1,4}(.[0-9]{0,3})?          spin at rev/s
+//  R...V...                             rotate, at up to the velocity
+//  D-?[0-9]{1,4}(.[0-9]{0,3})?          hold the rotor at an angle, degrees
+//  D...V...                             move to it at the velocity, degrees/s
+//  T([A-G][#^]?[1-8]){1,16}             tune: notes, sharp or flat, length in 1/8 s
+//  K[0-9A-F]{16}                        64 bit key
+//  M[0-2], P[0-1]                       drive scheme, motion profile
+//  L[0-1]                               phase advance learning off or on, or the table
+//  A, H, F                              auto-tune, control loop histogram dump, fault report
+//
+//CommandParser takes one character at a time and keeps no text, only the state of
+//the word so far, so it never blocks, allocates or overruns a buffer.
+
+#define COMMAND_TUNE_NOTES 16
+#define COMMAND_INT_DIGITS 4
+#define COMMAND_FRAC_DIGITS 3
+#define COMMAND_KEY_DIGITS 16
+
+enum CommandType {
+    COMMAND_ROTATE,
+    COMMAND_VELOCITY,
+    COMMAND_ROTATE_VELOCITY,
+    COMMAND_HOLD,
+    COMMAND_TUNE,
+    COMMAND_KEY,
+    COMMAND_DRIVE,
+    COMMAND_PROFILE,
+    COMMAND_AUTOTUNE,
+    COMMAND_HISTOGRAM,
+    COMMAND_FAULT,
+    COMMAND_ADVANCE
+};
+
+struct Note {
+    uint8_t pitch;              //semitones above C, 0-11
+    uint8_t length;             //eighths of a second, 1-8
+};
+
+struct Command {
+    uint8_t type;               //CommandType
+    int8_t option;              //M, P and L digit, -1 if none
+    uint8_t notes;              //T: notes in tune
+    float rotations;            //R
+    float angle;                //D
+    float velocity;             //V
+    uint64_t key;               //K
+    Note tune[COMMAND_TUNE_NOTES];
+};
+
+enum ParseResult {
+    PARSE_MORE,                 //nothing finished yet
+    PARSE_COMMAND,              //a command is ready
+    PARSE_ERROR                 //a word that isn't a command ended
+};
+
+class CommandParser {
+public:
+    CommandParser();
+
+    //Next character. On PARSE_COMMAND the command is copied to out.
+    ParseResult feed(char c, Command& out);
+
+    //Forget the word in progress
+    void reset();
+
+private:
+    enum Phase { START, NUMBER, NOTES, KEY, OPTION, END, SKIP };
+
+    void begin(char c);
+    bool digit(char c);
+    bool note(char c);
+    bool finishNumber();
+    bool finish();
+
+    uint8_t _phase;
+    Command _cmd;
+
+    //Number in progress: R, D or V, and its digits so far
+    char _field;
+    bool _negative;
+    bool _point;
+    uint8_t _intDigits, _fracDigits;
+    uint32_t _mantissa;
+
+    //Note in progress: 0 wants a letter, 1 an accidental or length, 2 a length
+    uint8_t _noteStage;
+    uint8_t _keyDigits;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "controlloop.h"
+
+static void histogramAdd(LoopHistogram& h, uint32_t us) {
+    int bin = 0;
+    while (us >> bin && bin < LOOP_HIST_BINS - 1) {
+        bin++;
+    }
+    h.bins[bin]++;
+    if (us > h.max) {
+        h.max = us;
+    }
+}
+
+ControlLoop::ControlLoop(int rateHz) : _running(false) {
+    _rate = rateHz;
+    _period = 1000000/rateHz;
+    reset();
+}
+
+void ControlLoop::start(Callback<void()> task) {
+    _task = task;
+    _running = true;
+    _clear = true;
+    _next = us_ticker_read() + _period;
+    _ticker.attach_us(this, &ControlLoop::tick, _period);
+}
+
+void ControlLoop::stop() {
+    _ticker.detach();
+    _running = false;
+}
+
+void ControlLoop::setRate(int rateHz) {
+    _rate = rateHz;
+    _period = 1000000/rateHz;
+    if (_running) {
+        _ticker.detach();
+        start(_task);
+    }
+}
+
+void ControlLoop::reset() {
+    for (int i = 0; i < LOOP_HIST_BINS; i++) {
+        _exec.bins[i] = 0;
+        _jitter.bins[i] = 0;
+    }
+    _exec.max = 0;
+    _jitter.max = 0;
+    _iterations = 0;
+    _overruns = 0;
+    _clear = false;
+}
+
+void ControlLoop::tick() {
+    uint32_t start = us_ticker_read();
+    if (_clear) {
+        reset();
+    }
+    //Ticker re-arms from the previous event time, so the ideal start times never drift
+    int32_t late = (int32_t)(start - _next);
+    _next += _period;
+
+    _task();
+
+    uint32_t exec = us_ticker_read() - start;
+    histogramAdd(_exec, exec);
+    histogramAdd(_jitter, (late < 0) ? -late : late);
+    _iterations++;
+    if (exec > _period || late >= (int32_t)_period) {
+        _overruns++;
+    }
+}
+
+void ControlLoop::print(RawSerial& out) {
+    out.printf("Control loop %d Hz: %lu iterations, %lu overruns\n\r", _rate,
+               (unsigned long)_iterations, (unsigned long)_overruns);
+    out.printf("      us       exec     jitter\n\r");
+    for (int i = 0; i < LOOP_HIST_BINS; i++) {
+        uint32_t exec = _exec.bins[i];
+        uint32_t jitter = _jitter.bins[i];
+        if (!exec && !jitter) {
+            continue;
+        }
+        if (i == 0) {
+            out.printf("      <1");
+        }
+        else if (i == LOOP_HIST_BINS - 1) {
+            out.printf(" %6lu+", 1UL << (i - 1));
+        }
+        else {
+            out.printf(" %7lu", 1UL << (i - 1));
+        }
+        out.printf(" %10lu %10lu\n\r", (unsigned long)exec, (unsigned long)jitter);
+    }
+    out.printf("max exec %lu us, max jitter %lu us\n\r", (unsigned long)_exec.max, (unsigned long)_jitter.max);
+    clear();
+}
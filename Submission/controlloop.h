@@ -0,0 +1,61 @@
+#ifndef CONTROLLOOP_H
+#define CONTROLLOOP_H
+
+#include "mbed.h"
+
+//Histogram bins: bin 0 is < 1 us, bin k covers [2^(k-1), 2^k) us, the last bin
+//takes everything longer
+#define LOOP_HIST_BINS 16
+
+struct LoopHistogram {
+    volatile uint32_t bins[LOOP_HIST_BINS];
+    volatile uint32_t max;          //us
+};
+
+//Hard-periodic control task driven by a Ticker (us_ticker, TIM2).
+//
+//The task runs in the ticker interrupt, so it must not block or print. Each
+//iteration records how late it started against its ideal time (jitter) and how long
+//the task took. Only the interrupt writes the histograms; print() reads them without
+//locking and asks the interrupt to clear them, so a dump taken while the loop is
+//running can be off by the iteration in progress.
+class ControlLoop {
+public:
+    ControlLoop(int rateHz);
+
+    void start(Callback<void()> task);
+    void stop();
+
+    //Change the rate, restarting the loop if it is running
+    void setRate(int rateHz);
+    int rate() { return _rate; }
+    float period() { return _period/1000000.0f; }  //seconds
+
+    uint32_t iterations() { return _iterations; }
+    uint32_t overruns() { return _overruns; }
+    const LoopHistogram& execTime() { return _exec; }
+    const LoopHistogram& jitter() { return _jitter; }
+
+    //Dump the histograms and start new ones
+    void print(RawSerial& out);
+    void clear() { _clear = true; }
+
+private:
+    void tick();
+    void reset();
+
+    Ticker _ticker;
+    Callback<void()> _task;
+    int _rate;
+    uint32_t _period;               //us
+    uint32_t _next;                 //us_ticker time the next iteration should start
+    bool _running;
+
+    volatile bool _clear;
+    volatile uint32_t _iterations;
+    volatile uint32_t _overruns;    //iterations that ran longer than, or started a whole period late
+    LoopHistogram _exec;
+    LoopHistogram _jitter;
+};
+
+#endif
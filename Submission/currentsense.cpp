@@ -0,0 +1,58 @@
+#include "currentsense.h"
+
+//ADC1/2 external trigger 9 is TIM1_TRGO
+#define EXTSEL_TIM1_TRGO 9
+
+//Sample time codes for 7.5 ADC clocks: 20 clocks a conversion, 0.56 us for the pair;
+//and 19.5 for the bus divider, 0.5 us more after them
+#define SAMPLE_TIME 3
+#define BUS_SAMPLE_TIME 4
+
+volatile uint16_t currentSamples[3] = {32768, 32768, 0};
+
+void currentSenseInit() {
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN | RCC_AHBENR_ADC12EN;
+
+    //Synchronous ADC clock, HCLK/1, so the sample point is a fixed delay from TRGO
+    ADC12_COMMON->CCR = ADC12_CCR_CKMODE_0;
+
+    if (ADC1->CR & ADC_CR_ADEN) {
+        ADC1->CR |= ADC_CR_ADDIS;
+        while (ADC1->CR & ADC_CR_ADEN) {}
+    }
+    //Regulator on, through the intermediate state, then calibrate single-ended
+    ADC1->CR = 0;
+    ADC1->CR = ADC_CR_ADVREGEN_0;
+    wait_us(10);
+    ADC1->CR |= ADC_CR_ADCAL;
+    while (ADC1->CR & ADC_CR_ADCAL) {}
+
+    //Rising edge of TIM1_TRGO converts IN1, IN2 then IN4, left-aligned, each to the DMA
+    ADC1->CFGR = ADC_CFGR_DMAEN | ADC_CFGR_DMACFG | ADC_CFGR_ALIGN |
+                 (EXTSEL_TIM1_TRGO*ADC_CFGR_EXTSEL_0) | ADC_CFGR_EXTEN_0;
+    ADC1->SMPR1 = (SAMPLE_TIME << ADC_SMPR1_SMP1_Pos) | (SAMPLE_TIME << ADC_SMPR1_SMP2_Pos) |
+                  (BUS_SAMPLE_TIME << ADC_SMPR1_SMP4_Pos);
+    ADC1->SQR1 = (2 << ADC_SQR1_L_Pos) | (1 << ADC_SQR1_SQ1_Pos) | (2 << ADC_SQR1_SQ2_Pos) |
+                 (4 << ADC_SQR1_SQ3_Pos);
+
+    DMA1_Channel1->CCR = 0;
+    DMA1_Channel1->CPAR = (uintptr_t)&ADC1->DR;
+    DMA1_Channel1->CMAR = (uintptr_t)currentSamples;
+    DMA1_Channel1->CNDTR = 3;
+    DMA1_Channel1->CCR = DMA_CCR_PL_1 | DMA_CCR_MSIZE_0 | DMA_CCR_PSIZE_0 | DMA_CCR_MINC |
+                         DMA_CCR_CIRC | DMA_CCR_TCIE | DMA_CCR_EN;
+
+    ADC1->CR |= ADC_CR_ADEN;
+    while (!(ADC1->ISR & ADC_ISR_ADRDY)) {}
+    ADC1->CR |= ADC_CR_ADSTART;
+}
+
+void currentSenseAttach(void (*isr)()) {
+    DMA1->IFCR = DMA_IFCR_CGIF1;
+    NVIC_SetVector(DMA1_Channel1_IRQn, (uintptr_t)isr);
+    NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+}
+
+void currentSenseDetach() {
+    NVIC_DisableIRQ(DMA1_Channel1_IRQn);
+}
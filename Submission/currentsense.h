@@ -0,0 +1,59 @@
+#ifndef CURRENTSENSE_H
+#define CURRENTSENSE_H
+
+#include "mbed.h"
+
+//Phase 1 and 2 currents and the DC bus voltage sampled by ADC1 at every PWM period,
+//without the CPU.
+//
+//TIM1's update event, which bridgeTrigger() puts on TRGO at the counter underflow,
+//starts a three-channel ADC1 sequence; DMA1 channel 1 moves each result into
+//currentSamples[] in circular mode, and its transfer complete interrupt hands the
+//set to the attached ISR. The currents come first, so the bus conversion only delays
+//the interrupt. The underflow is the middle of the low side on-time of
+//phases 2 and 3 and the start of it for phase 1 (TIM16/17 are edge-aligned), away
+//from the switching edges.
+//
+//The current sense amplifiers are taken to sit at mid-rail with CURRENT_SENSE_V_PER_A,
+//positive into the winding, on:
+//
+//  IA  A0  PA_0  ADC1_IN1          IB  A1  PA_1  ADC1_IN2
+//
+//and the bus divided down by BUS_SENSE_DIVIDER, with a capacitor across the bottom
+//resistor for the sampling to charge from, on:
+//
+//  VBUS  A2  PA_3  ADC1_IN4
+//
+//The AnalogIn objects for those pins do the clock and pin setup and must be created
+//first. Don't read them afterwards: analogin_read() reprograms the ADC.
+
+#define CURRENT_SENSE_V_PER_A 0.25f
+#define CURRENT_FULL_SCALE_A (1.65f/CURRENT_SENSE_V_PER_A)
+#define BUS_SENSE_DIVIDER 6.0f
+#define BUS_FULL_SCALE_V (3.3f*BUS_SENSE_DIVIDER)
+
+//Left-aligned ADC results for phase 1 and 2 and the bus, written by the DMA
+extern volatile uint16_t currentSamples[3];
+
+//Set up ADC1 and the DMA channel, waiting for triggers
+void currentSenseInit();
+
+//Call isr after each pair of samples. isr must call currentSenseClear().
+void currentSenseAttach(void (*isr)());
+void currentSenseDetach();
+
+inline void currentSenseClear() {
+    DMA1->IFCR = DMA_IFCR_CGIF1;
+}
+
+//Phase current, Q15 of CURRENT_FULL_SCALE_A
+inline int32_t phaseCurrent(int phase) {
+    return (int32_t)currentSamples[phase] - 32768;
+}
+
+//Bus voltage as last sampled, V. Sampled with the currents, so only while TRGO is on.
+inline float busVoltage() {
+    return currentSamples[2]*(BUS_FULL_SCALE_V/65536);
+}
+
+#endif
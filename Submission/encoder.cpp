@@ -0,0 +1,94 @@
+#include "encoder.h"
+
+//Below this speed (no edge for 100 ms, ~0.02 rev/s) the motor counts as stopped
+#define ENCODER_STALL_US 100000
+
+//Count change for each (previous AB, new AB) pair. AB runs 00 -> 10 -> 11 -> 01 going
+//forwards; pairs where both channels changed are missed edges and count 0.
+const int8_t quadratureTable[16] = {
+     0, -1, +1,  0,
+    +1,  0,  0, -1,
+    -1,  0,  0, +1,
+     0, +1, -1,  0
+};
+
+Encoder::Encoder(PinName a, PinName b, int countsPerRev)
+    : _a(a), _b(b), _countsPerRev(countsPerRev) {
+    _errors = 0;
+    _ab = (_a.read() << 1) | _b.read();
+    reset();
+    _a.rise(this, &Encoder::edge);
+    _a.fall(this, &Encoder::edge);
+    _b.rise(this, &Encoder::edge);
+    _b.fall(this, &Encoder::edge);
+}
+
+void Encoder::reset() {
+    core_util_critical_section_enter();
+    _count = 0;
+    _edgeTime = us_ticker_read();
+    core_util_critical_section_exit();
+    _lastCount = 0;
+    _lastEdgeTime = _edgeTime;
+    _countRate = 0;
+    _position = 0;
+    _velocity = 0;
+}
+
+void Encoder::edge() {
+    uint8_t ab = (_a.read() << 1) | _b.read();
+    if (ab == _ab) {
+        return;
+    }
+    if ((_ab ^ ab) == 0x3) {
+        _errors++;
+    }
+    _count += quadratureTable[(_ab << 2) | ab];
+    _ab = ab;
+    _edgeTime = us_ticker_read();
+}
+
+void Encoder::update() {
+    core_util_critical_section_enter();
+    int32_t count = _count;
+    uint32_t edgeTime = _edgeTime;
+    core_util_critical_section_exit();
+
+    int32_t counts = count - _lastCount;
+    if (counts != 0) {
+        //Edge-to-edge time for the counts seen since the last update
+        uint32_t dt = edgeTime - _lastEdgeTime;
+        if (dt > 0) {
+            _countRate = counts*1000000.0f/dt;
+        }
+        _lastCount = count;
+        _lastEdgeTime = edgeTime;
+    }
+    else {
+        //No new edge: the speed is at most one count over the time since the last one
+        uint32_t since = us_ticker_read() - _lastEdgeTime;
+        if (since > ENCODER_STALL_US) {
+            _countRate = 0;
+        }
+        else if (since > 0) {
+            float bound = 1000000.0f/since;
+            if (_countRate > bound) {
+                _countRate = bound;
+            }
+            else if (_countRate < -bound) {
+                _countRate = -bound;
+            }
+        }
+    }
+
+    _position = (float)count/_countsPerRev;
+    _velocity = _countRate/_countsPerRev;
+}
+
+float Encoder::position() {
+    return _position;
+}
+
+float Encoder::velocity() {
+    return _velocity;
+}
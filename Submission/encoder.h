@@ -0,0 +1,55 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include "mbed.h"
+
+//Incremental encoder: 117 lines per channel, 4 counts per line when both edges of
+//CHA and CHB are decoded
+#define ENCODER_LINES   117
+#define ENCODER_COUNTS  (4*ENCODER_LINES)
+
+//Quadrature decoder and position/velocity estimator.
+//
+//The CHA/CHB ISRs only count edges and timestamp the last one. update() is called at
+//the control rate and turns that into a velocity: when edges arrived since the last
+//update the speed is counts over the time between the first and last of them (so it
+//doesn't depend on where the update falls between edges), otherwise the time since
+//the last edge gives an upper bound that lets the estimate fall to zero when stopped.
+class Encoder {
+public:
+    Encoder(PinName a, PinName b, int countsPerRev = ENCODER_COUNTS);
+
+    //Zero the position, e.g. after motorHome()
+    void reset();
+
+    //Sample the ISR counters. Call at a fixed rate from the control thread.
+    void update();
+
+    int32_t count() { return _count; }
+    uint32_t errors() { return _errors; }   //transitions where both channels changed
+
+    float position();       //revolutions since reset(), at the last update()
+    float velocity();       //rev/s, at the last update()
+
+private:
+    void edge();
+
+    InterruptIn _a;
+    InterruptIn _b;
+    int _countsPerRev;
+
+    //Written by the ISRs
+    volatile int32_t _count;
+    volatile uint32_t _edgeTime;    //us_ticker time of the last edge
+    volatile uint32_t _errors;
+    volatile uint8_t _ab;           //last channel levels, A in bit 1, B in bit 0
+
+    //Estimator state, control thread only
+    int32_t _lastCount;
+    uint32_t _lastEdgeTime;
+    float _countRate;               //counts per second
+    float _position;
+    float _velocity;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#include "fault.h"
+
+FaultMonitor::FaultMonitor(void (*cut)(), float (*demand)(), uint32_t stallUs, uint32_t stallSectors,
+                           float stallDemand, uint32_t minEdgeUs)
+    : _cut(cut), _demand(demand), _stallUs(stallUs), _stallSectors(stallSectors), _stallDemand(stallDemand),
+      _minEdgeUs(minEdgeUs),
+      _armed(false), _timing(false), _forward(true), _lastEdge(0), _deadline(0), _fault(FAULT_NONE), _detected(0), _cutDone(0) {
+}
+
+void FaultMonitor::arm() {
+    core_util_critical_section_enter();
+    _armed = true;
+    _timing = false;
+    restartStall(_stallUs);
+    core_util_critical_section_exit();
+}
+
+void FaultMonitor::disarm() {
+    _armed = false;
+    _stall.detach();
+}
+
+void FaultMonitor::hallEdge(bool forward, uint32_t time) {
+    if (!_armed) {
+        return;
+    }
+    //the first edge after arm() may be any time after the one before
+    uint32_t stallUs = _stallUs;
+    if (_timing && forward == _forward) {
+        uint32_t interval = time - _lastEdge;
+        if (interval < _minEdgeUs) {
+            latch(FAULT_OVERSPEED, time);
+            return;
+        }
+        if (interval < _stallUs/_stallSectors) {
+            stallUs = interval*_stallSectors;
+        }
+    }
+    _lastEdge = time;
+    _forward = forward;
+    _timing = true;
+    restartStall(stallUs);
+}
+
+void FaultMonitor::restartStall(uint32_t us) {
+    _deadline = us_ticker_read() + us;
+    _stall.attach_us(this, &FaultMonitor::stallCheck, us);
+}
+
+void FaultMonitor::trip(FaultCode code) {
+    latch(code, us_ticker_read());
+}
+
+void FaultMonitor::clear() {
+    _fault = FAULT_NONE;
+}
+
+const char* FaultMonitor::name(FaultCode code) {
+    switch (code) {
+        case FAULT_NONE: return "none";
+        case FAULT_STALL: return "stall";
+        case FAULT_OVERSPEED: return "overspeed";
+        case FAULT_HALL_ENCODER: return "hall/encoder disagree";
+        case FAULT_OVERCURRENT: return "overcurrent";
+        case FAULT_BEMF: return "back-EMF lost";
+        default: return "unknown";
+    }
+}
+
+//Timeout: the stall time has gone by since the last edge
+void FaultMonitor::stallCheck() {
+    if (!_armed) {
+        return;
+    }
+    if (_demand() >= _stallDemand) {
+        latch(FAULT_STALL, _deadline);
+        return;
+    }
+    //not pushing, so stopped is fine: look again later
+    restartStall(_stallUs);
+}
+
+void FaultMonitor::latch(FaultCode code, uint32_t detected) {
+    core_util_critical_section_enter();
+    if (_fault == FAULT_NONE) {
+        _cut();
+        _cutDone = us_ticker_read();
+        _detected = detected;
+        _fault = (uint8_t)code;
+    }
+    _armed = false;
+    core_util_critical_section_exit();
+    _stall.detach();
+}
@@ -0,0 +1,79 @@
+#ifndef FAULT_H
+#define FAULT_H
+
+#include "mbed.h"
+
+enum FaultCode {
+    FAULT_NONE,
+    FAULT_STALL,                //no hall edge in time while driving hard
+    FAULT_OVERSPEED,            //hall edges closer together than the overspeed interval
+    FAULT_HALL_ENCODER,         //a hall edge where the encoder says the rotor isn't
+    FAULT_OVERCURRENT,          //phase current over the limit, where it is sampled
+    FAULT_BEMF                  //sensorless commutation lost, with the halls no good
+};
+
+//Cuts the drive from whichever interrupt sees a fault, and latches the first one.
+//
+//The checks sit in the ISRs that have the evidence: the hall ISR calls hallEdge(),
+//which trips on an edge that came too soon after the last one the same way (back
+//and forth across one edge is not speed), and the current and encoder checks are
+//the caller's, through trip(). A Timeout restarted by every hall edge catches a
+//rotor that has stopped while demand() is at least stallDemand: it runs for
+//stallSectors times the interval between the last two edges the same way, so a fast
+//rotor is caught within a few of its own sector times, and for stallUs when that is
+//longer or there is no such interval, from rest or after a reversal. So
+//the time from the evidence to the gates going off is one call to cut, which has to
+//be safe from any interrupt.
+//
+//Only the first trip is kept; later ones, which the cut itself tends to cause, are
+//ignored until clear().
+class FaultMonitor {
+public:
+    FaultMonitor(void (*cut)(), float (*demand)(), uint32_t stallUs, uint32_t stallSectors, float stallDemand,
+                 uint32_t minEdgeUs);
+
+    //Start watching, e.g. once the motor is handed to the ISRs, and stop
+    void arm();
+    void disarm();
+
+    //From the hall ISR, on each edge that moves the rotor state on, with its direction
+    //and its us_ticker_read() time if the hardware has it
+    void hallEdge(bool forward) { hallEdge(forward, us_ticker_read()); }
+    void hallEdge(bool forward, uint32_t time);
+
+    //Cut the drive and latch code, from any context
+    void trip(FaultCode code);
+
+    FaultCode fault() { return (FaultCode)_fault; }
+    uint32_t detected() { return _detected; }   //us_ticker_read() when the fault was found
+    uint32_t cut() { return _cutDone; }         //and once the drive was off
+
+    //Forget the fault, before the next arm()
+    void clear();
+
+    static const char* name(FaultCode code);
+
+private:
+    void restartStall(uint32_t us);
+    void stallCheck();
+    void latch(FaultCode code, uint32_t detected);
+
+    void (*_cut)();
+    float (*_demand)();
+    uint32_t _stallUs;
+    uint32_t _stallSectors;
+    float _stallDemand;
+    uint32_t _minEdgeUs;
+
+    Timeout _stall;
+    volatile bool _armed;
+    volatile bool _timing;              //_lastEdge is an edge since arm()
+    volatile bool _forward;             //and its direction
+    volatile uint32_t _lastEdge;        //us_ticker time
+    volatile uint32_t _deadline;        //of the stall Timeout
+    volatile uint8_t _fault;
+    volatile uint32_t _detected;
+    volatile uint32_t _cutDone;
+};
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef FOC_H
+#define FOC_H
+
+#include <stdint.h>
+
+#include "pid.h"
+#include "svpwm.h"
+
+//Field-oriented current control, all Q15 fixed point.
+//
+//Each PWM period the two sampled phase currents go through the Clarke transform
+//(three phases to alpha/beta, alpha along phase 0) and the Park transform (alpha/beta
+//to d/q, rotating with the rotor's d axis). A PI loop on each axis turns the current
+//errors into a voltage, which the inverse Park transform takes back to alpha/beta for
+//svpwmVector(). Holding id at 0 and setting iq gives torque proportional to iq.
+//
+//Currents are per unit of the current sense full scale, voltages per unit of
+//Vdc/sqrt(3), the largest the modulator makes without clipping. Angles are electrical,
+//65536 to the turn, as in svpwm.h.
+
+#define FOC_SIN_SIZE 1024               //sine table entries, 0.35 degrees apart
+
+/////////////////////////////////TRANSFORMS//////////////////////////////////////////////////
+
+constexpr int16_t focRound(double v) {
+    return (int16_t)((v >= 0) ? v*32767 + 0.5 : v*32767 - 0.5);
+}
+struct FocSinEntry {
+    static constexpr int16_t entry(int i) { return focRound(svSin(2*svPi()*i/FOC_SIN_SIZE)); }
+};
+
+typedef SvTable<FocSinEntry, SvMakeSeq<FOC_SIN_SIZE>::type> FocSinTable;
+
+static_assert(FocSinEntry::entry(FOC_SIN_SIZE/4) == 32767, "foc table: sin(90 deg) is full scale");
+
+//Interpolated between entries, 64 angle steps apart
+inline int32_t focSin(uint16_t angle) {
+    const int16_t* t = FocSinTable::values;
+    uint32_t i = angle >> 6;
+    int32_t a = t[i];
+    int32_t b = t[(i + 1) & (FOC_SIN_SIZE - 1)];
+    return a + (((b - a)*(int32_t)(angle & 63)) >> 6);
+}
+inline int32_t focCos(uint16_t angle) { return focSin(angle + ANGLE_90); }
+
+inline int32_t focSaturate(int32_t x) {
+    return (x > 32767) ? 32767 : ((x < -32768) ? -32768 : x);
+}
+
+//Phase currents a and b (c = -a - b) to alpha/beta
+inline void clarke(int32_t a, int32_t b, int32_t& alpha, int32_t& beta) {
+    alpha = a;
+    beta = focSaturate(((a + 2*b)*SVPWM_INV_SQRT3) >> 15);
+}
+
+//alpha/beta to d/q, for a d axis with the given sine and cosine
+inline void park(int32_t alpha, int32_t beta, int32_t s, int32_t c, int32_t& d, int32_t& q) {
+    d = focSaturate((alpha*c + beta*s) >> 15);
+    q = focSaturate((beta*c - alpha*s) >> 15);
+}
+
+inline void inversePark(int32_t d, int32_t q, int32_t s, int32_t c, int32_t& alpha, int32_t& beta) {
+    alpha = focSaturate((d*c - q*s) >> 15);
+    beta = focSaturate((d*s + q*c) >> 15);
+}
+
+/////////////////////////////////CONTROLLER//////////////////////////////////////////////////
+
+class Foc {
+public:
+    //current: PI gains for both axes, per unit volts per per unit amp, run at the
+    //PWM rate, with the output limits the voltage may use
+    Foc(const PidConfig& current) : _d(current), _q(current), _idRef(0), _iqRef(0), _id(0), _iq(0) {}
+
+    void reset() {
+        _d.reset();
+        _q.reset();
+        _id = 0;
+        _iq = 0;
+    }
+
+    //Current references, safe to set from another context
+    void setCurrent(q15_t iq, q15_t id = 0) {
+        _iqRef = iq;
+        _idRef = id;
+    }
+
+    //One control step: phase a and b currents, the rotor's d axis angle, and the
+    //resulting high side duties for bridgePhases()
+    void update(int32_t ia, int32_t ib, uint16_t angle, int32_t duty[3]) {
+        int32_t s = focSin(angle);
+        int32_t c = focCos(angle);
+        int32_t alpha, beta;
+        clarke(ia, ib, alpha, beta);
+        int32_t id, iq;
+        park(alpha, beta, s, c, id, iq);
+        _id = (q15_t)id;
+        _iq = (q15_t)iq;
+        int32_t vd = _d.update(_idRef, (q15_t)id);
+        int32_t vq = _q.update(_iqRef, (q15_t)iq);
+        inversePark(vd, vq, s, c, alpha, beta);
+        svpwmVector(alpha, beta, duty);
+    }
+
+    //Measured currents at the last update
+    q15_t id() const { return _id; }
+    q15_t iq() const { return _iq; }
+
+private:
+    Pid<q15_t> _d, _q;
+    volatile q15_t _idRef, _iqRef;
+    q15_t _id, _iq;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+
+//Framing for binary streams. The payload gets a CRC-16/CCITT (polynomial 0x1021,
+//initial 0xFFFF) appended low byte first, then the whole is COBS encoded so the only
+//zero byte is the one that ends the frame. A receiver that joins mid-stream or loses
+//bytes picks up again at the next zero, and the CRC throws out damaged frames.
+//
+//Header only, shared with the host decoder in sim/tools/.
+
+//Largest encoded frame, delimiter included, for n payload bytes
+#define FRAME_SIZE(n) ((n) + 2 + ((n) + 2)/254 + 2)
+
+inline uint16_t crc16(const uint8_t* data, int length, uint16_t crc = 0xFFFF) {
+    //a nibble at a time, 16 entries instead of 256
+    static const uint16_t table[16] = {
+        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+        0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+    };
+    for (int i = 0; i < length; i++) {
+        crc = (uint16_t)((crc << 4) ^ table[(crc >> 12) ^ (data[i] >> 4)]);
+        crc = (uint16_t)((crc << 4) ^ table[(crc >> 12) ^ (data[i] & 0x0F)]);
+    }
+    return crc;
+}
+
+//COBS: every run of up to 254 non-zero bytes is preceded by its length plus one,
+//which also stands for the zero that followed it. Returns the encoded length.
+inline int cobsEncode(const uint8_t* in, int length, uint8_t* out) {
+    int code = 0;               //where the current run's length goes
+    int n = 1;
+    uint8_t run = 1;
+    for (int i = 0; i < length; i++) {
+        if (in[i]) {
+            out[n++] = in[i];
+            run++;
+        }
+        if (!in[i] || run == 0xFF) {
+            out[code] = run;
+            code = n++;
+            run = 1;
+        }
+    }
+    out[code] = run;
+    return n;
+}
+
+//Returns the decoded length, or -1 if in isn't valid COBS
+inline int cobsDecode(const uint8_t* in, int length, uint8_t* out) {
+    int n = 0;
+    int i = 0;
+    while (i < length) {
+        uint8_t run = in[i++];
+        if (run == 0 || i + run - 1 > length) {
+            return -1;
+        }
+        for (int k = 1; k < run; k++) {
+            if (!in[i]) {
+                return -1;
+            }
+            out[n++] = in[i++];
+        }
+        if (run != 0xFF && i < length) {
+            out[n++] = 0;
+        }
+    }
+    return n;
+}
+
+//payload needs 2 spare bytes past length for the CRC. Returns the bytes written to
+//out, at most FRAME_SIZE(length), ending in the zero delimiter.
+inline int frameEncode(uint8_t* payload, int length, uint8_t* out) {
+    uint16_t crc = crc16(payload, length);
+    payload[length] = (uint8_t)crc;
+    payload[length + 1] = (uint8_t)(crc >> 8);
+    int n = cobsEncode(payload, length + 2, out);
+    out[n++] = 0;
+    return n;
+}
+
+//One frame without its delimiter. Returns the payload length, or -1 if it is
+//malformed or fails the CRC.
+inline int frameDecode(const uint8_t* in, int length, uint8_t* payload) {
+    int n = cobsDecode(in, length, payload);
+    if (n < 2) {
+        return -1;
+    }
+    uint16_t crc = (uint16_t)(payload[n - 2] | (payload[n - 1] << 8));
+    return (crc16(payload, n - 2) == crc) ? n - 2 : -1;
+}
+
+#endif
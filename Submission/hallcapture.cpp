@@ -0,0 +1,95 @@
+#include "hallcapture.h"
+#include "pinmap.h"
+
+//Input filter settings IC1F 4-15: the fDTS divider, and how many samples in a row
+//the level has to hold for
+static const uint8_t filterDivider[12] = {2, 2, 4, 4, 8, 8, 16, 16, 16, 32, 32, 32};
+static const uint8_t filterSamples[12] = {6, 8, 6, 8, 6, 8, 5, 6, 8, 5, 6, 8};
+
+static const PinName inputs[3] = {PB_4, PB_5, PB_0};
+
+static void (*onEdge)();
+static void (*onCompare)();
+
+//TIM3 capture, a filtered edge of one of the three, or the compare after one. A
+//compare that matched just before the edge still runs, first.
+static void edgeCaptured() {
+    uint32_t sr = TIM3->SR & TIM3->DIER;
+    if (sr & TIM_SR_CC2IF) {
+        TIM3->SR = ~TIM_SR_CC2IF;
+        TIM3->DIER &= ~TIM_DIER_CC2IE;
+        onCompare();
+    }
+    if (sr & TIM_SR_CC1IF) {
+        TIM3->SR = ~TIM_SR_CC1IF;
+        TIM3->DIER &= ~TIM_DIER_CC2IE;
+        if (onEdge) {
+            onEdge();
+        }
+    }
+}
+
+void hallCaptureInit(float filterUs) {
+    //The shortest filter of at least filterUs, with tDTS 1, 2 or 4 clocks (CR1.CKD)
+    float clocks = filterUs*1e-6f*SystemCoreClock;
+    uint32_t ckd = 2;
+    uint32_t icf = 15;
+    uint32_t best = 0xFFFFFFFF;
+    for (int k = 0; k < 3; k++) {
+        for (int f = 0; f < 12; f++) {
+            uint32_t n = (uint32_t)filterDivider[f]*filterSamples[f] << k;
+            if (n >= clocks && n < best) {
+                best = n;
+                ckd = k;
+                icf = f + 4;
+            }
+        }
+    }
+
+    for (int k = 0; k < 3; k++) {
+        pin_function(inputs[k], STM_PIN_DATA(STM_MODE_AF_PP, GPIO_NOPULL, GPIO_AF2_TIM3));
+    }
+
+    RCC->APB1ENR |= RCC_APB1ENR_TIM3EN;
+    TIM3->CR1 = 0;
+    TIM3->PSC = SystemCoreClock/HALL_TICK_HZ - 1;
+    TIM3->ARR = 0xFFFF;
+    //CH1-3 XORed onto TI1, and CC1 captures on TRC, which is TI1F_ED: both edges of
+    //the filtered TI1
+    TIM3->CR2 = TIM_CR2_TI1S;
+    TIM3->CCMR1 = TIM_CCMR1_CC1S_1 | TIM_CCMR1_CC1S_0 | icf*TIM_CCMR1_IC1F_0;
+    TIM3->CCER = TIM_CCER_CC1E;
+    //and TI1F_ED resets the counter
+    TIM3->SMCR = TIM_SMCR_TS_2 | TIM_SMCR_SMS_2;
+    TIM3->EGR = TIM_EGR_UG;
+    TIM3->SR = 0;
+    TIM3->DIER = 0;
+    NVIC_SetVector(TIM3_IRQn, (uintptr_t)edgeCaptured);
+    NVIC_EnableIRQ(TIM3_IRQn);
+    TIM3->CR1 = ckd*TIM_CR1_CKD_0 | TIM_CR1_URS | TIM_CR1_CEN;
+}
+
+void hallCaptureAttach(void (*isr)()) {
+    onEdge = isr;
+    TIM3->DIER = TIM_DIER_CC1IE;
+}
+
+void hallCaptureDetach() {
+    TIM3->DIER = 0;
+}
+
+void hallCaptureSchedule(uint32_t ticks, void (*fn)()) {
+    onCompare = fn;
+    TIM3->CCR2 = ticks;
+    TIM3->SR = ~TIM_SR_CC2IF;
+    if (TIM3->CNT >= ticks) {
+        TIM3->DIER &= ~TIM_DIER_CC2IE;
+        fn();
+        return;
+    }
+    TIM3->DIER |= TIM_DIER_CC2IE;
+}
+
+uint32_t hallEdgeTime() {
+    return us_ticker_read() - TIM3->CNT*(1000000/HALL_TICK_HZ);
+}
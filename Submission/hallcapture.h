@@ -0,0 +1,54 @@
+#ifndef HALLCAPTURE_H
+#define HALLCAPTURE_H
+
+#include "mbed.h"
+
+//Photointerrupter edges from TIM3's hall sensor interface instead of EXTI.
+//
+//CR2.TI1S XORs the three inputs onto TI1, so an edge of any of them is an edge of
+//TI1. That goes through the input filter, which only passes a level once it has held
+//for the filter time, so chatter on a slow photointerrupter edge never gets as far as
+//an interrupt. The filtered edge is the slave mode trigger: it captures the count in
+//CCR1 and resets the counter, so the count is the time since the edge in
+//HALL_TICK_HZ ticks however late the interrupt runs.
+//
+//The capture interrupt comes straight off the vector table rather than through
+//gpio_irq_api.c's shared EXTI handlers, and calls the edge handler, which reads the
+//pins as it did from InterruptIn: they have been steady for the filter time by then.
+//
+//TIM3's inputs are on
+//
+//  CH1  PB_4 (D12)       CH2  PB_5 (D11)       CH3  PB_0 (D3)
+//
+//so I1 moves from D2 to D3, which is the L2L gate. L2L goes to D2 (PA_12), which is
+//TIM1_CH2N as well. See HALL_CAPTURE in main.cpp.
+//
+//The edge can't commutate in hardware as well: TRGO into TIM1's COM event would
+//switch phases 2 and 3, but phase 1 is on TIM16/17, which have no trigger input. The
+//edge handler writes the drive state before anything else instead. To commutate at
+//some other time, hallCaptureSchedule() puts CC2 a given count after the edge, which
+//the counter reset makes a compare against the time since it.
+//
+//The DigitalIn objects for the pins must be created first, as gpio_init_in() takes the
+//pins back from the timer. They still read the pins once the timer has them.
+
+#define HALL_TICK_HZ 1000000
+
+//Mux the pins to TIM3 and start it, with an input filter of at least filterUs, up to
+//14 us
+void hallCaptureInit(float filterUs);
+
+//Call isr from the capture interrupt at each filtered edge, or stop. An edge while
+//detached is still pending, and calls isr as soon as it is attached.
+void hallCaptureAttach(void (*isr)());
+void hallCaptureDetach();
+
+//us_ticker_read() time of the edge, from the edge handler
+uint32_t hallEdgeTime();
+
+//Call fn from the same interrupt once ticks have passed since the last edge, or
+//straight away if they already have. The next edge cancels it, before its handler
+//runs, and so does hallCaptureDetach().
+void hallCaptureSchedule(uint32_t ticks, void (*fn)());
+
+#endif
@@ -1,8 +1,42 @@
 #include "mbed.h"
 #include "rtos.h"
+#include "pinmap.h"
+#include "encoder.h"
+#include "sixstep.h"
+#include "controlloop.h"
+#include "pid.h"
+#include "bridge.h"
+#include "svpwm.h"
+#include "currentsense.h"
+#include "foc.h"
+#include "profile.h"
+#include "autotune.h"
+#include "ringbuffer.h"
+#include "seqlock.h"
+#include "command.h"
+#include "telemetry.h"
+#include "melody.h"
+#include "fault.h"
+#include "bemf.h"
+#include "hallcapture.h"
+#include "advance.h"
+#include "supply.h"
+#include "calibration.h"
+
+//Photointerrupter edges from TIM3's hall sensor interface (hallcapture.h) rather
+//than EXTI. That needs I1 on D3 and the L2L gate on D2, so it's off for the board as
+//built: swap the two wires and set hall-capture to 1 in mbed_app.json to turn it on.
+#define HALL_CAPTURE MBED_CONF_APP_HALL_CAPTURE
+
+//Sensorless six-step when a photointerrupter fails: SENSORLESS_FALLBACK, set from
+//mbed_app.json as it needs a board with the comparator inputs (see bemf.h)
 
 //Photointerrupter input pins
+#if HALL_CAPTURE
+#define I1pin D3
+#else
 #define I1pin D2
+#endif
 #define I2pin D11
 #define I3pin D12
 
@@ -13,29 +47,25 @@
 //Motor Drive output pins   //Mask in output byte
 #define L1Lpin D4           //0x01
 #define L1Hpin D5           //0x02
+#if HALL_CAPTURE
+#define L2Lpin D2           //0x04
+#else
 #define L2Lpin D3           //0x04
+#endif
 #define L2Hpin D6           //0x08
 #define L3Lpin D9           //0x10
 #define L3Hpin D10          //0x20
 
-//Mapping from sequential drive states to motor phase outputs
-/*
-State   L1  L2  L3
-0       H   -   L
-1       -   H   L
-2       L   H   -
-3       L   -   H
-4       -   L   H
-5       H   L   -
-6       -   -   -
-7       -   -   -
-*/
-//Drive state to output table
-const int8_t driveTable[] = {0x12,0x18,0x09,0x21,0x24,0x06,0x00,0x00};
-
-//Mapping from interrupter inputs to sequential rotor states. 0x00 and 0x07 are not valid
-const int8_t stateMap[] = {0x07,0x05,0x03,0x04,0x01,0x00,0x02,0x07};  
-//const int8_t stateMap[] = {0x07,0x01,0x03,0x02,0x05,0x00,0x04,0x07}; //Alternative if phase order of input or drive is reversed
+//Phase current sense inputs, for FOC, and the bus voltage divider
+#define IApin A0
+#define IBpin A1
+#define VBUSpin A2
+
+//Telemetry UART (USART1), binary frames at TELEMETRY_BAUD for a USB serial adapter
+#define TELEMETRY_TX D1
+#define TELEMETRY_RX D0
+
+//Drive and rotor state tables: driveTable[] and stateMap[] in sixstep.h
 
 //Phase lead to make motor spin
 volatile int8_t lead = -2;  //2 for forwards, -2 for backwards
@@ -48,9 +78,8 @@ DigitalIn I1(I1pin);
 DigitalIn I2(I2pin);
 DigitalIn I3(I3pin);
 
-//encoder input pins
-DigitalIn IncA(CHA);
-DigitalIn IncB(CHB);
+//Incremental encoder, counted in its own ISRs
+Encoder encoder(CHA, CHB);
 
 //Motor Drive outputs
 PwmOut L1L(L1Lpin);
@@ -60,46 +89,22 @@ PwmOut L2H(L2Hpin);
 PwmOut L3L(L3Lpin);
 PwmOut L3H(L3Hpin);
 
-//Set a given drive state
-void motorOut(int8_t driveState, double delta=1) {
-    
-    //Lookup the output byte from the drive state.
-    int8_t driveOut = driveTable[driveState & 0x07];
-    
-    /*
-    //Turn off first
-    if (~driveOut & 0x01) L1L = 0;
-    if (~driveOut & 0x02) L1H = 1;
-    if (~driveOut & 0x04) L2L = 0;
-    if (~driveOut & 0x08) L2H = 1;
-    if (~driveOut & 0x10) L3L = 0;
-    if (~driveOut & 0x20) L3H = 1;
-    
-    //Then turn on
-    if (driveOut & 0x01) L1L = 1;
-    if (driveOut & 0x02) L1H = 0;
-    if (driveOut & 0x04) L2L = 1;
-    if (driveOut & 0x08) L2H = 0;
-    if (driveOut & 0x10) L3L = 1;
-    if (driveOut & 0x20) L3H = 0;
-    */
+//Phase current and bus voltage sense, sampled by the ADC and DMA (see currentsense.h)
+AnalogIn IA(IApin);
+AnalogIn IB(IBpin);
+AnalogIn VBUS(VBUSpin);
 
-    
-    //Turn off first
-    if (~driveOut & 0x01) L1L = 0;
-    if (~driveOut & 0x02) L1H = delta;
-    if (~driveOut & 0x04) L2L = 0;
-    if (~driveOut & 0x08) L2H = delta;
-    if (~driveOut & 0x10) L3L = 0;
-    if (~driveOut & 0x20) L3H = delta;
-    
-    //Then turn on
-    if (driveOut & 0x01) L1L = delta;
-    if (driveOut & 0x02) L1H = 0;
-    if (driveOut & 0x04) L2L = delta;
-    if (driveOut & 0x08) L2H = 0;
-    if (driveOut & 0x10) L3L = delta;
-    if (driveOut & 0x20) L3H = 0;
+//Timer register images for each drive state, and for each rotor state once the
+//motor is homed (see startMotor()): driving in the direction of lead, and braking
+//against it
+DriveImage driveImages[8];
+DriveImage rotorImages[8];
+DriveImage brakeImages[8];
+
+//Set a given drive state
+void motorOut(int8_t driveState, float delta=1) {
+    bridgeDuty(delta);
+    bridgeWrite(driveImages[driveState & 0x07]);
     }
     
     //Convert photointerrupter inputs to a rotor state
@@ -107,383 +112,964 @@ inline int8_t readRotorState(){
     return stateMap[I1 + 2*I2 + 4*I3];
     }
 
+//Homing waits as homeSettle() in sixstep.h. Without the halls the open loop start
+//needs the rotor really there, so it waits up to HOME_BLIND_TIMEOUT_MS.
+#define HOME_BLIND_TIMEOUT_MS 6000
+
 //Basic synchronisation routine    
-int8_t motorHome() {
+int8_t motorHome(int timeoutMs = HOME_TIMEOUT_MS) {
     //Put the motor in drive state 0 and wait for it to stabilise
     motorOut(0);
-    wait(2.0);
+    homeSettle(encoder, timeoutMs);
     
     //Get the rotor state
     return readRotorState();
 }
 
 /////////////////////////////////COMMAND LINE INTERACE//////////////////////////////////////////
+//The UART RX interrupt puts characters in rxBuffer and wakes threadReadInput(), which
+//runs them through a CommandParser (see command.h) and posts each whole command to
+//the commands queue. main() takes them off the queue and runs them, so a new command
+//takes over from whatever the motor was doing.
 
-struct State {
-    int rotate;     //1 if R
-    int velocity;   //1 if V
-    int state;      //different states of DFA (1 = R, 2 = V, 3 = RV)
-    float rotVal;
-    float velVal;
-};
-
-typedef struct State* State_h;
-
-void stateInit(State_h s) {
-    s->rotate = 0;
-    s->velocity = 0;
-    s->state = 0;
-    s->rotVal = 0;
-    s->velVal = 0;
-}
-
-int parseDigit(char c) {
-    return (
-            c == '0' || c == '1' || c == '2' || c == '3' || c == '4'
-             || c == '5' || c == '6' || c == '7' || c == '8' || c == '9'
-            );
-}
+#define RX_BUFFER_SIZE 64
+#define COMMAND_QUEUE_SIZE 4
+#define SIGNAL_RX 0x1
 
-//should only be called if parseDigit is successful
-int readDigit(char c) {
-    char* digitArray = "0123456789";
-    for (int i=0; i < 10; i++) {
-        if (digitArray[i] == c) {
-            return i;
-        }
-    }
-    return -1;
-}
-
-int parseChar(char c, char input) {
-    return (input==c);
-}
-
-///returns the index of the last digit of the number and sets result
-int parseNumber(char* s, int start, float* result) {
-    int foundDecimal = 0;
-    int foundMinus = 0;
-    int i = start;
-    while (i < 16 && (parseDigit(s[i]) || parseChar('.', s[i]) || parseChar('-', s[i]))) {
-        if (parseChar('.', s[i]) && (i == start || foundDecimal)) {
-            i = 0;
-            break;
-        }
-        else if (parseChar('.', s[i])){
-            foundDecimal = 1;
-        }
-        else if (parseChar('-', s[i]) && (i != start || foundMinus)) {
-            i = 0;
-            break;
-        }
-        else if (parseChar('-', s[i])){
-            foundMinus = 1;
-        }
-        i++;
-    }
-    //if we managed to parse one of more digits
-    if (i > start) {
-        //take the characters between and including start and i
-        char num[17] = "0000000000000000";
-        for (int j = start; j < i+1; j++) {
-            num[j-start] = s[j];
-        }
-        *result = atof(num);
-        return i;
-    }
-    else {
-        //falied to parse any number
-        return -1;
-    }
-}
+RingBuffer<char, RX_BUFFER_SIZE> rxBuffer;
+Mail<Command, COMMAND_QUEUE_SIZE> commands;
+Thread thrInput(osPriorityAboveNormal);
 
 void threadReadInput();
+void runCommand(const Command& cmd);
 
 ///////////////////////////////COMMAND LINE INTERACE END////////////////////////////////////////
 
 /////////////////////////////////GLOBAL VARIABLES/////////////////////////////////////////////
-volatile double delta = 1.0;
-Timer t_calcVel;
+//Written by threads and the ISRs alike, so floats: one store each
+volatile float delta = 1.0f;
 volatile int8_t intState = 0;
-volatile int8_t intStateOld = 0;
-volatile double currentTime = 0;
-volatile double currentVelocity = 0;
-volatile double targetVelocity = 15;
-volatile double maxVelocity = 0;
-volatile double currentNumOfRotationsLeft = 0.0;    //not used now
-volatile double currentNumOfRotations = 0.0;
-volatile double numOfRotations = 10.0;
-volatile double oldError = 0;
-Serial pc(SERIAL_TX, SERIAL_RX);
+volatile float currentVelocity = 0;
+volatile float targetVelocity = 15;
+volatile float maxVelocity = 0;
+volatile float currentNumOfRotationsLeft = 0.0f;
+volatile float currentNumOfRotations = 0.0f;
+volatile float numOfRotations = 10.0f;
+
+//What the control tick last did, published once per tick for the threads, which
+//take a snapshot of all of it at once (see seqlock.h) instead of reading the globals
+//above one at a time while the tick changes them
+struct MotorState {
+    uint32_t time;              //us_ticker_read() at the tick
+    int8_t mode;
+    float position;             //revolutions since homing
+    float velocity;             //rev/s in the direction of lead
+    float targetVelocity;
+    float delta;
+    float rotations;            //R: turns so far and to go
+    float rotationsLeft;
+    float angle;                //D: degrees, and the setpoint
+    float setpoint;
+};
+SeqLock<MotorState> motorState;
+RawSerial pc(SERIAL_TX, SERIAL_RX);
+Telemetry telemetry(TELEMETRY_TX, TELEMETRY_RX);
+#if !HALL_CAPTURE
 //Run starter code with threading and interrupts
 InterruptIn sI1In(I1pin);
 InterruptIn sI2In(I2pin);
 InterruptIn sI3In(I3pin);
-InterruptIn chAIn(I2pin);
-InterruptIn chBIn(I3pin);
-
-Timer t_recordMaxVel;
+#endif
 
 
 /////////////////////////////////FUNCTION DECLARATIONS//////////////////////////////////////////
 
-//Task Starter
-void threadStarter();
+//Commutation
+void motorInit();
+void startMotor(int mode);
+void alignImages();
 void interruptUpdateMotor();
+inline uint16_t rotorAngle();
+void controlTick();
+void publishState(int mode);
+void threadReport();
 
 //Task velocity
-//void recordMaxVelocity();
-//void calculateMaxVelocity();
 void setVelocity();
-void calculateVelocity();
-Thread thrSetVelocity;
+void calculateVelocity(float velocity, float dt);
+void applyTuning();
+void gateSupplyFeedForward(float inertia);
+Thread thrReport(osPriorityBelowNormal);
 void calculateNumRotationsVelocity();
 
+//Task angle hold
+void setHold(float angle, float rate);
+void calculateHold(float velocity);
+float holdAngle();
+
 //Task position
-void calculateNumRotationsLeft();
+void planRotation();
 void setRotation();
 void setRotationVelocity();
-void pushMotor();
 
 
 
 //orState is subtracted from future rotor state inputs to align rotor and motor states
 int8_t orState = 0;
-
-/**********************************************************************************************
-***********************************************************************************************
-**********************************************************************************************/
-
-
+//orState only depends on how the hall sensors sit on the motor, so it is found once
+//and kept until something suggests the rotor and the ISRs disagree (see startMotor())
+volatile bool homed = false;
+uint32_t homeErrors = 0;                //encoder.errors() when last homed
+//Whether the photointerrupters can be trusted to commutate, see HALL_GOOD_EDGES
+volatile bool hallsGood = true;
+volatile int hallRun = 0;               //good edges since the last bad state
+volatile bool homedBlind = false;       //homed while they weren't, so orState is a guess
 
 //Main
 int main() {
-#if 0
-    
-    //Initialise the serial port
-    //Serial pc(SERIAL_TX, SERIAL_RX);
-    //int8_t intState = 0;
-    //int8_t intStateOld = 0;
-    pc.printf("Hello\n\r");
-    
-    
-    //Run the motor synchronisation
-    orState = motorHome();
-    pc.printf("Rotor origin: %x\n\r",orState);
-    //orState is subtracted from future rotor state inputs to align rotor and motor states
-    
-    //Poll the rotor state and set the motor outputs accordingly to spin the motor
+    motorInit();
+    thrInput.start(threadReadInput);
     while (1) {
-        intState = readRotorState();
-        if (intState != intStateOld) {
-            intStateOld = intState;
-            motorOut((intState-orState+lead+6)%6); //+6 to make sure the remainder is positive
-            //pc.printf("new rotor state = %d\n\r", intState);
+        osEvent evt = commands.get();
+        if (evt.status == osEventMail) {
+            Command* cmd = (Command*)evt.value.p;
+            runCommand(*cmd);
+            commands.free(cmd);
         }
     }
-#else
-    //thrSetVelocity.start(setVelocity);
-    //Thread thrReadInput;
-    //thrReadInput.start(threadReadInput);
-    //recordMaxVelocity();
-    //setVelocity();
-    //setRotation();
-    //setRotationVelocity();
-    L1L.period_us(100);
-    L1H.period_us(100);
-    L2L.period_us(100);
-    L2H.period_us(100);
-    L3L.period_us(100);
-    L3H.period_us(100);
-    threadReadInput();
-    while (1) {
-        Thread::wait(10000);
+}
+
+
+/////////////////////////////////COMMUTATION////////////////////////////////////////////////
+//The photointerrupter ISRs do the commutation: each edge looks up the new rotor state
+//and writes the drive state. Velocity and position control run in controlTick() from
+//the encoder estimates, at a fixed rate set by controlLoop. Nothing in either prints:
+//thrReport does that.
+
+#define MODE_IDLE               0
+#define MODE_VELOCITY           1
+#define MODE_ROTATION           2
+#define MODE_ROTATION_VELOCITY  3
+#define MODE_HOLD               4
+
+//Control loop rate, 1-10 kHz. Type H to dump its timing histograms.
+#define CONTROL_RATE_HZ 1000
+
+//Gate PWM, above the audible range. The dead time keeps each gate from turning on
+//until the other side of its phase is off.
+#define PWM_RATE_HZ 25000
+#define PWM_DEAD_TIME_NS 500
+
+//Drive schemes, picked with M0/M1/M2 and applied at the next R or V command
+#define DRIVE_SIX_STEP  0
+#define DRIVE_SVPWM     1
+#define DRIVE_FOC       2
+
+//SVPWM updates from the TIM1 update interrupt every MODULATION_PERIODS PWM periods
+#define MODULATION_PERIODS 2
+
+//FOC current loops, every PWM period, ~1 kHz bandwidth from the winding's R and L.
+//Per unit, kp = w*L*Ibase/Vbase and ki = w*R*Ibase/Vbase with Ibase the current
+//sense full scale and Vbase = supply/sqrt(3). delta = 1 asks for FOC_CURRENT_MAX.
+#define MOTOR_R 2.2f
+#define MOTOR_L 0.5e-3f
+#define SUPPLY_V 12.0f
+#define CURRENT_BANDWIDTH (2.0f*3.14159265f*1000.0f)
+#define CURRENT_PER_UNIT (CURRENT_FULL_SCALE_A*1.7320508f/SUPPLY_V)
+#define FOC_CURRENT_MAX 0.5f
+
+//R motion profiles, picked with P0 (trapezoidal) or P1 (S-curve): limits in rev/s^2
+//and rev/s^3, and the top speed in rev/s, for an R on its own and the most an RV
+//command can ask for
+#define PROFILE_TRAPEZOIDAL 0
+#define PROFILE_S_CURVE     1
+#define PROFILE_ACCEL 1.5f
+#define PROFILE_DECEL 6.0f
+#define PROFILE_JERK 10.0f
+#define ROTATION_MAX_VELOCITY 30.0
+
+//R commands can brake: a velocity loop output below zero drives against the rotation
+//(six-step a state behind instead of ahead, SVPWM the vector reversed) at up to
+//BRAKE_MAX_DUTY, rather than only shorting the windings at delta 0. That is what lets
+//the profile stop at PROFILE_DECEL rather than PROFILE_ACCEL.
+#define BRAKE_MAX_DUTY 0.3f
+//What BRAKE_MAX_DUTY stops the rotor at, rev/s^2, erring low. Once the rotor is no
+//further from the target than it takes to stop at that, R brakes at full duty.
+#define BRAKE_DECEL 12.0f
+
+//Profile tracking: rev/s per rotation of position error, and how close to the target
+//the motor has to be to brake, in rotations
+#define POSITION_KP 4.0f
+#define STOP_TOLERANCE 0.02
+
+//Velocity loop feed-forward, delta per rev/s (the plant gives ~64 rev/s at delta 1),
+//and the plant's time constant in s, for the profile acceleration
+#define VELOCITY_FEED_FORWARD (1.0f/64)
+#define VELOCITY_TIME_CONSTANT 0.9f
+
+//Velocity loop auto-tune, A while running a V command: delta steps TUNE_AMPLITUDE
+//either side of where it was every TUNE_PERIOD/2 s for TUNE_TIME s, sampled at
+//CONTROL_RATE_HZ/TUNE_DECIMATE, then new gains for a TUNE_LAMBDA s closed loop
+#define TUNE_AMPLITUDE 0.05f
+#define TUNE_PERIOD 2.0f
+#define TUNE_TIME 16.0f
+#define TUNE_DECIMATE 10
+#define TUNE_LAMBDA 0.3f
+
+//Back EMF constant in V per rad/s. Six-step has two phases in series, so the motor's
+//electrical damping is about (2*kE)^2/(2*R), which gives the inertia from the time
+//constant the tuner finds.
+#define MOTOR_KE 0.016f
+#define MOTOR_DAMPING ((2*MOTOR_KE)*(2*MOTOR_KE)/(2*MOTOR_R))
+
+//Electrical turns per revolution, and electrical angle per encoder count in Q16
+#define POLE_PAIRS 1
+#define ANGLE_PER_COUNT ((int32_t)(65536.0*65536.0*POLE_PAIRS/ENCODER_COUNTS))
+
+//Angle hold, D: a PI position loop in degrees feeds a proportional velocity loop in
+//degrees/s that gives a signed delta, so the rotor can be pushed either way. The
+//position integral carries the holding torque. The setpoint moves to a new target at
+//HOLD_RATE degrees/s, or the rate given with V. Six-step can only put the field at
+//six angles, so holding drives SVPWM (or FOC if M2 picked it).
+#define HOLD_RATE 90.0f
+#define HOLD_MAX_RATE 360.0f
+#define HOLD_KP 20.0f
+#define HOLD_KI 10.0f
+#define HOLD_VELOCITY_KP 0.002f
+#define HOLD_MAX_DELTA 0.3f
+//Half an encoder count: a resting setpoint always has one count within this. Inside
+//it the position loop sees no error, so its integral and the drive stay put instead
+//of hunting between two counts against friction.
+#define HOLD_DEADBAND (0.5f*360.0f/ENCODER_COUNTS)
+//The first hall edge after homing lines the encoder count up with it, as the rest
+//position depends on friction. Later edges only put the count right when it has
+//slipped by more than this, well above the error in where the edges sit.
+#define HALL_SLIP_COUNTS 6
+//With HALL_CAPTURE, how long a photointerrupter level has to hold to count as an edge
+#define HALL_FILTER_US 2.0f
+
+//Six-step phase advance (advance.h), with HALL_CAPTURE: the commutation moved from
+//the hall edge by a share of the last hall period, from a table over speeds up to
+//ADVANCE_MAX_VELOCITY, within ADVANCE_LIMIT sectors either way. L1 has it learnt
+//ADVANCE_STEP at a time while V holds the speed within ADVANCE_STEADY of the target.
+//It is kept with the calibration once it has changed.
+#define ADVANCE_MAX_VELOCITY 80.0f
+#define ADVANCE_LIMIT 0.5f
+#define ADVANCE_STEP 0.0625f
+#define ADVANCE_STEADY 0.02f
+
+//Calibration (calibration.h): orState, the auto-tuned velocity gains and inertia and
+//the phase advance table, loaded at reset so the first command needn't home and
+//written at the next motion command once any of them has changed. It alternates
+//between the last two flash pages, which the image has to leave free.
+#define CALIBRATION_PAGE_A (FLASH_BASE + 0xF000)
+#define CALIBRATION_PAGE_B (FLASH_BASE + 0xF800)
+
+//Supply feed-forward (supply.h): six-step and SVPWM duties scaled by SUPPLY_NOMINAL,
+//the voltage the gains were tuned at, over the bus voltage filtered over
+//SUPPLY_FILTER_MS, and by no more than down to SUPPLY_MIN. FOC needs none, as its
+//current loop gives the torque asked for whatever the bus. It only pays with more
+//inertia than the gains were tuned on: at 2e-4 kg.m^2 and 9 V the supply scenario
+//stops 0.014 rotations short with it against 0.002 without, and at 4e-4 and 7.5 V
+//0.03 past rather than 0.52. So it is on once the inertia in the calibration or from the last
+//tune is over SUPPLY_FEED_FORWARD_INERTIA, kg.m^2, and off while it isn't known.
+#define SUPPLY_FEED_FORWARD_INERTIA 3e-4f
+#define SUPPLY_NOMINAL 12.0f
+#define SUPPLY_MIN 6.0f
+#define SUPPLY_FILTER_MS 5.0f
+
+//Faults (fault.h), which cut the drive until the next motion command: no hall edge
+//for FAULT_STALL_SECTORS times the last interval between edges, or FAULT_STALL_MS
+//if that is longer or not known, while |delta| is at least FAULT_STALL_DELTA (a
+//reversal takes under 4 intervals from the last edge one way to the first the other,
+//with constant braking), hall edges closer
+//than at FAULT_MAX_VELOCITY, a hall edge over FAULT_SLIP_COUNTS (30 degrees
+//electrical) from where the encoder puts it, and a phase over FAULT_MAX_CURRENT_A,
+//which only FOC samples
+#define FAULT_STALL_MS 100
+#define FAULT_STALL_SECTORS 6
+#define FAULT_STALL_DELTA 0.5f
+#define FAULT_MAX_VELOCITY 100.0f
+#define FAULT_MIN_EDGE_US ((uint32_t)(1000000.0f/(FAULT_MAX_VELOCITY*6*POLE_PAIRS)))
+#define FAULT_SLIP_COUNTS (ENCODER_COUNTS/POLE_PAIRS/12)
+#define FAULT_MAX_CURRENT_A 5.0f
+#define FAULT_MAX_CURRENT ((int32_t)(FAULT_MAX_CURRENT_A/CURRENT_FULL_SCALE_A*32768))
+
+//Sensorless six-step (bemf.h) once the photointerrupters go bad, which is a state
+//that isn't one, and until HALL_GOOD_EDGES good edges in a row. Spinning at
+//BEMF_MIN_VELOCITY or more, the back-EMF takes over from the state the encoder angle
+//gives; from rest, a V command ramps the speed up open loop. BEMF_RAMP_DUTY is low
+//enough that the rotor lags the steps and its crossings show, and under
+//FAULT_STALL_DELTA, as the first steps are further apart than FAULT_STALL_MS.
+//Commutation is BEMF_DELAY of a sector after each crossing (30 degrees; the halls sit
+//30 degrees early). Braking needs the halls, so without them the drive stays at
+//BEMF_MIN_DUTY or more, enough on-time for the crossings to show.
+#define HALL_GOOD_EDGES 12
+#define BEMF_MIN_VELOCITY 3.0f
+#define BEMF_DELAY 0.5f
+#define BEMF_RAMP_FROM 1.0f
+#define BEMF_RAMP_TO 10.0f
+#define BEMF_RAMP_ACCEL 10.0f
+#define BEMF_RAMP_DUTY 0.3f
+#define BEMF_MIN_DUTY 0.05f
+
+//Braking to a stop before homing: the rotor counts as stopped when the encoder moves
+//at most one count in STOP_POLL_MS
+#define STOP_POLL_MS 50
+#define STOP_TIMEOUT_MS 10000
+
+//Status printout period, a line takes ~15 ms at 9600 baud
+#define REPORT_PERIOD_MS 200
+
+volatile int controlMode = MODE_IDLE;
+volatile bool commutate = false;        //cleared to stop the ISRs driving the motor
+volatile bool braking = false;          //six-step commutates from brakeImages
+volatile bool stopping = false;         //R is braking to the target at BRAKE_MAX_DUTY
+volatile int requestedDrive = DRIVE_SIX_STEP;
+volatile int driveMode = DRIVE_SIX_STEP;
+volatile int profileShape = PROFILE_S_CURVE;
+MotionProfile profile;                  //R command setpoints, see planRotation()
+volatile float profileTime = 0;         //seconds into the move
+
+//Rotor electrical angle for SVPWM, 0 at the motorHome() position: the angle of the
+//last hall edge plus the encoder counts since
+volatile uint16_t hallAngle = 0;
+volatile int32_t hallCount = 0;
+volatile int32_t countOffset = 0;       //added to the encoder count by hall edges, see holdAngle()
+volatile bool countAligned = false;     //by a hall edge since homing
+
+//D command: the angle asked for, in degrees from the motorHome() position, and the
+//setpoint moving towards it
+volatile bool holdRequested = false;    //set by setHold(), taken up by the control tick
+volatile float holdRequest = 0;
+volatile float holdRate = HOLD_RATE;
+volatile float holdTarget = 0;
+volatile float holdSetpoint = 0;
+volatile int32_t amplitude = 0;         //SVPWM voltage, Q15, from delta
+DriveImage pwmImage;
+ControlLoop controlLoop(CONTROL_RATE_HZ);
+//Tunes from the T command, played on the PWM carrier from the events thread
+EventQueue events;
+Thread thrEvents(osPriorityNormal);
+MelodyPlayer melody(events, PWM_RATE_HZ);
+//Fault monitor's cut, from any interrupt: every gate held off. The drive ISRs see
+//commutate clear and leave them so, and the next command homes again.
+DriveImage offImage;
+void cutDrive() {
+    commutate = false;
+    controlMode = MODE_IDLE;
+    bemfStop();
+    bridgeWrite(offImage);
+    homed = false;
+}
+float driveDemand() {
+    return commutate ? fabsf(delta) : 0.0f;
+}
+FaultMonitor faultMonitor(cutDrive, driveDemand, FAULT_STALL_MS*1000, FAULT_STALL_SECTORS, FAULT_STALL_DELTA,
+                          FAULT_MIN_EDGE_US);
+volatile bool faultReported = true;     //for threadReport()
+//Sensorless commutation's callbacks: its crossings stand in for hall edges, with the
+//fault monitor and for the rotor angle, and once it has lost the back-EMF the halls
+//take over again if they can
+void bemfCrossed(int state, bool forward) {
+    faultMonitor.hallEdge(forward);
+    hallAngle = state*ANGLE_60 + (forward ? -ANGLE_90 : ANGLE_90);
+    hallCount = encoder.count();
+}
+void bemfLost() {
+    int8_t state = readRotorState();
+    if (hallsGood && orState < 6 && state < 6) {
+        intState = state;
+        bridgeWrite(rotorImages[state]);
     }
+    else {
+        faultMonitor.trip(FAULT_BEMF);
+    }
+}
+Foc foc(pidConfig(CURRENT_BANDWIDTH*MOTOR_L*CURRENT_PER_UNIT, CURRENT_BANDWIDTH*MOTOR_R*CURRENT_PER_UNIT,
+                  0.0f, 1.0f/PWM_RATE_HZ, -1.0f, 1.0f));
+
+//Velocity loop, delta from rev/s: the plant is roughly 64 rev/s per unit delta with a
+//~1.2 s time constant. velocityGains is what startMotor() sets it up with, until the
+//auto-tuner replaces them. Position loop for R with V, rev/s from rotations.
+PidConfig defaultVelocityGains() {
+    PidConfig c = pidConfig(0.06f, 0.05f, 0.0f, 1.0f/CONTROL_RATE_HZ, 0.0f, 1.0f);
+    c.kff = VELOCITY_FEED_FORWARD;
+    return c;
+}
+PidConfig velocityGains = defaultVelocityGains();
+Pid<float> velocityPid(velocityGains);
+Pid<float> positionPid(pidConfig(0.5f, 0.0f, 0.0f, 1.0f/CONTROL_RATE_HZ, -5.0f, 5.0f));
+Pid<float> holdPositionPid(pidConfig(HOLD_KP, HOLD_KI, 0.0f, 1.0f/CONTROL_RATE_HZ, -HOLD_MAX_RATE, HOLD_MAX_RATE));
+Pid<float> holdVelocityPid(pidConfig(HOLD_VELOCITY_KP, 0.0f, 0.0f, 1.0f/CONTROL_RATE_HZ, -HOLD_MAX_DELTA, HOLD_MAX_DELTA));
+Autotuner autotuner;
+volatile bool tuneRequested = false;    //set by A, started from the control tick
+volatile bool tuneFinished = false;     //for threadReport() to print the result
+AdvanceTable advanceTable(ADVANCE_MAX_VELOCITY, ADVANCE_LIMIT, ADVANCE_STEP, 1.0f/CONTROL_RATE_HZ);
+volatile bool advanceLearning = false;  //L1
+volatile float phaseAdvance = 0.0f;     //sectors, for the next hall edges
+SupplySense supply(SUPPLY_NOMINAL, SUPPLY_MIN, SUPPLY_FILTER_MS*1e-3f, 1.0f/CONTROL_RATE_HZ);
+volatile bool supplyFeedForward = false;
+CalibrationStore calibrationStore(calibrationFlash(CALIBRATION_PAGE_A, CALIBRATION_PAGE_B));
+Calibration calibration;                //as last loaded or saved
+volatile bool calibrationDirty = false; //orState, gains or inertia changed since
+bool originLoaded = false;              //orState from it, the rotor not yet picked up
+
+//us_ticker_read() time of the hall edge being handled
+inline uint32_t hallTime() {
+#if HALL_CAPTURE
+    return hallEdgeTime();
+#else
+    return us_ticker_read();
 #endif
 }
 
-/**********************************************************************************************
-***********************************************************************************************
-**********************************************************************************************/
-/*
-void recordMaxVelocity() {
-    //Initialise the serial port
-    //Serial pc(SERIAL_TX, SERIAL_RX);
-    //int8_t intState = 0;
-    //int8_t intStateOld = 0;
-    pc.printf("Hello: measuring max speed:\n\r");
-    
-    //Run the motor synchronisation
-    orState = motorHome();
-    pc.printf("Rotor origin: %x\n\r",orState);
-    //orState is subtracted from future rotor state inputs to align rotor and motor states
-    maxVelocity = 0;
-    t_calcVel.start();
-    t_recordMaxVel.start();
-    //Poll the rotor state and set the motor outputs accordingly to spin the motor
-    while (1) {
-        intState = readRotorState();
-        if (intState != intStateOld) {
-            intStateOld = intState;
-            motorOut((intState-orState+lead+6)%6); //+6 to make sure the remainder is positive
-            //pc.printf("new rotor state = %d\n\r", intState);
-            calculateMaxVelocity();
-        }
-        double timePassed = t_recordMaxVel.read();
-        if (timePassed > 10.0) {
-            t_recordMaxVel.stop();
-            t_recordMaxVel.reset();
-            break;
+//Counts from where the encoder puts the rotor to angle, within an electrical turn
+int32_t hallSlip(uint16_t angle, int32_t count) {
+    const int32_t turn = ENCODER_COUNTS/POLE_PAIRS;
+    int32_t slip = ((int32_t)(((uint32_t)angle*turn) >> 16) - (count + countOffset)) % turn;
+    if (slip >= turn/2) slip -= turn;
+    else if (slip < -turn/2) slip += turn;
+    return slip;
+}
+
+//The last good hall edge, for the period, and the drive state the advance compare
+//writes and has written
+uint32_t lastEdgeTime;
+volatile int8_t lastEdgeStep = 0;
+volatile int8_t advanceState;
+volatile int8_t advancedState = -1;
+
+void advanceCompare() {
+    if (commutate && !braking) {
+        bridgeWrite(rotorImages[advanceState]);
+        advancedState = advanceState;
+    }
+}
+
+//Six-step commutation phaseAdvance sectors ahead of the hall edges, from a compare a
+//share of the last hall period after this edge: the next state's drive early, or this
+//one's late for less than 0. False to commutate at the edge as usual, without two
+//edges the same way in a row to time it from.
+bool advanceEdge(int8_t newState, int8_t step) {
+#if HALL_CAPTURE
+    float a = phaseAdvance;
+    if (a == 0.0f || (step != 1 && step != 5) || step != lastEdgeStep) {
+        return false;
+    }
+    uint32_t period = hallTime() - lastEdgeTime;
+    if (period > 0xFFFF) {
+        return false;
+    }
+    if (a > 0) {
+        if (advancedState != newState) {
+            bridgeWrite(rotorImages[newState]);
         }
+        advanceState = (newState + ((step == 1) ? 1 : 5)) % 6;
+        advancedState = -1;
+        hallCaptureSchedule((uint32_t)((1.0f - a)*period), advanceCompare);
     }
-    if (maxVelocity <= 0) {
-        recordMaxVelocity();
-        return;
+    else {
+        advanceState = newState;
+        advancedState = -1;
+        hallCaptureSchedule((uint32_t)(-a*period), advanceCompare);
     }
-    pc.printf("\n\rDone: max velocity = %f", maxVelocity);
-}
-void calculateMaxVelocity() {
-    //states go from 0-6 and wrap around
-    //t_calcVel should be started beforehand
-    intState = readRotorState();
-    if (intState == 0) {
-        t_calcVel.stop();
-        double time_ = t_calcVel.read();
-        if (currentTime != time_) {
-            currentVelocity = 1.0/time_;
-            if (currentVelocity > maxVelocity) {
-                maxVelocity = currentVelocity;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void interruptUpdateMotor(){
+    int8_t newState = readRotorState();
+    //The rotor rests in the middle of a state, so its edges are 30 degrees either side
+    int8_t step = (newState - intState + 6) % 6;
+    //the back-EMF commutates instead once the halls have gone bad (see sensorlessTick())
+    bool sensorless = bemfState() != BEMF_OFF;
+    if (commutate && driveMode == DRIVE_SIX_STEP && !sensorless && newState < 6 &&
+        (braking || !advanceEdge(newState, step))) {
+        bridgeWrite(braking ? brakeImages[newState] : rotorImages[newState]);
+    }
+    lastEdgeStep = 0;
+    if (newState >= 6 || (step != 0 && step != 1 && step != 5)) {
+        homed = false;      //a bad or skipped state: home again next time
+        hallRun = 0;
+        //only a sensor stuck dark or lit gives a bad state; a skip is for the slip check
+        if (newState >= 6) hallsGood = false;
+        //at the next edge, or here when the capture saw pins jumping together as one
+        //edge: the encoder should still put the rotor in the new state
+        else if (intState < 6 && hallsGood && countAligned && !sensorless) {
+            uint16_t centre = ((newState - orState + 6) % 6)*ANGLE_60;
+            int32_t slip = hallSlip(centre, encoder.count());
+            if (slip > 2*FAULT_SLIP_COUNTS || slip < -2*FAULT_SLIP_COUNTS) {
+                faultMonitor.trip(FAULT_HALL_ENCODER);
             }
-            //pc.printf("currentVelocity = %f, targetVelocity = %f, delta = %F\n\r",currentVelocity, targetVelocity, delta);
-            pc.printf(" %f ",currentVelocity);
-            currentTime = time_;
         }
-        t_calcVel.reset();
-        t_calcVel.start();
     }
+    else if (intState < 6 && step != 0 && !hallsGood && ++hallRun >= HALL_GOOD_EDGES) {
+        if (homedBlind) {
+            //where the encoder puts this edge gives the state homing should have read
+            uint16_t angle = rotorAngle() + ((step == 1) ? ANGLE_60 : 0);
+            orState = (newState - angle/ANGLE_60 + 6) % 6;
+            alignImages();
+            homedBlind = false;
+        }
+        hallsGood = true;
+    }
+    if (newState < 6 && intState < 6 && (step == 1 || step == 5) && hallsGood && !sensorless) {
+        uint32_t time = hallTime();
+        faultMonitor.hallEdge(step == 1, time);
+        lastEdgeTime = time;
+        lastEdgeStep = step;
+        uint16_t centre = ((newState - orState + 6) % 6)*ANGLE_60;
+        hallAngle = (step == 1) ? centre - ANGLE_30 : centre + ANGLE_30;
+        int32_t count = encoder.count();
+        hallCount = count;
+        //Where the count should be at this edge
+        int32_t slip = hallSlip(hallAngle, count);
+        if (countAligned && (slip > FAULT_SLIP_COUNTS || slip < -FAULT_SLIP_COUNTS)) {
+            faultMonitor.trip(FAULT_HALL_ENCODER);
+        }
+        if (!countAligned || slip > HALL_SLIP_COUNTS || slip < -HALL_SLIP_COUNTS) {
+            countOffset += slip;
+            countAligned = true;
+        }
+    }
+    intState = newState;
 }
-*/
 
-void threadStarter() {
-    //Run the motor synchronisation
-    pc.printf("Starting thread...\n\r");
-    orState = motorHome();
- 
-    //Attach ISR to interrupt pins
+//Hall edges to interruptUpdateMotor(), or not
+void hallEdgesOn() {
+#if HALL_CAPTURE
+    hallCaptureAttach(interruptUpdateMotor);
+#else
     sI1In.rise(&interruptUpdateMotor);
     sI1In.fall(&interruptUpdateMotor);
     sI2In.rise(&interruptUpdateMotor);
     sI2In.fall(&interruptUpdateMotor);
     sI3In.rise(&interruptUpdateMotor);
     sI3In.fall(&interruptUpdateMotor);
-    
-    while (1) {
-        //wait for interrupts
+    sI1In.enable_irq();
+    sI2In.enable_irq();
+    sI3In.enable_irq();
+#endif
+}
+void hallEdgesOff() {
+#if HALL_CAPTURE
+    hallCaptureDetach();
+#else
+    sI1In.disable_irq();
+    sI2In.disable_irq();
+    sI3In.disable_irq();
+#endif
+}
+
+inline uint16_t rotorAngle() {
+    int32_t counts = encoder.count() - hallCount;
+    return hallAngle + (uint16_t)(((int64_t)counts*ANGLE_PER_COUNT) >> 16);
+}
+
+//SVPWM, from the TIM1 update interrupt: the voltage vector 90 degrees ahead of the
+//rotor in the direction of lead. Drive state 0, which the rotor is homed to, is at
+//30 degrees in the phase frame of the sine table.
+void interruptModulate() {
+    bridgeUpdateClear();
+    if (!commutate) {
+        return;
     }
+    uint16_t vector = rotorAngle() + ANGLE_120 + ((lead > 0) ? ANGLE_90 : -ANGLE_90);
+    int32_t duty[3];
+    svpwm(vector, amplitude, duty);
+    bridgePhases(duty);
 }
 
-void interruptUpdateMotor(){
-    int8_t intState = readRotorState();
-    motorOut((intState-orState+lead+6)%6); //+6 to make sure the remainder is positive
-}
-
-//////////////////////////////////////////////////////////////////////////////////////////
-/*
-void setVelocity (){
-    int dutyCycle = 1;
-    orState = motorHome();
-    int currentState;
-    while (1){
-        currentState = readRotorState ();
-        motorOut (0x7);
-        wait ( (1 - dutyCycle) * 0.01);
-        motorOut(currentState - orState +2); 
-        wait ( (dutyCycle) * 0.01); 
+//FOC, from the DMA interrupt once both currents are in. The d axis is 30 degrees
+//on from the rotor angle, at drive state 0's vector when homed.
+void interruptCurrent() {
+    currentSenseClear();
+    if (!commutate) {
+        return;
     }
-    
- }
- */
- ////////////////////////////////////////////////////////////////////////////////////////
- 
+    int32_t ia = phaseCurrent(0);
+    int32_t ib = phaseCurrent(1);
+    int32_t ic = -ia - ib;
+    if (abs(ia) > FAULT_MAX_CURRENT || abs(ib) > FAULT_MAX_CURRENT || abs(ic) > FAULT_MAX_CURRENT) {
+        faultMonitor.trip(FAULT_OVERCURRENT);
+        return;
+    }
+    int32_t duty[3];
+    foc.update(ia, ib, rotorAngle() + ANGLE_30, duty);
+    bridgePhases(duty);
+}
+
+//What the last calibration found, or the defaults if there is none. With orState the
+//first command picks the rotor up where it is instead of homing.
+void loadCalibration() {
+    memset(&calibration, 0, sizeof(calibration));
+    calibration.orState = 6;
+    if (!calibrationStore.load(calibration)) {
+        pc.printf("Calibration: none\n\r");
+        return;
+    }
+    if (calibration.orState < 6) {
+        orState = calibration.orState;
+        homed = true;
+        homeErrors = encoder.errors();
+        originLoaded = true;
+    }
+    if (calibration.kp > 0) {
+        velocityGains.kp = calibration.kp;
+        velocityGains.ki = calibration.ki;
+        velocityGains.kff = calibration.kff;
+    }
+    advanceTable.set(calibration.advance);
+    gateSupplyFeedForward(calibration.inertia);
+    if (calibration.inertia > 0) {
+        pc.printf("Calibration: loaded, inertia ~ %g kg.m^2\n\r", calibration.inertia);
+    } else {
+        pc.printf("Calibration: loaded\n\r");
+    }
+}
+
+//Write the calibration back if anything in it has changed. The flash erase stalls the
+//CPU, so only with the rotor stopped and the windings shorted.
+void saveCalibration() {
+    if (!calibrationDirty && !advanceTable.changed()) {
+        return;
+    }
+    calibrationDirty = false;
+    if (!homedBlind && orState < 6) {
+        calibration.orState = orState;
+    }
+    advanceTable.get(calibration.advance);
+    bool saved = calibrationStore.save(calibration);
+    if (saved) {
+        advanceTable.saved();
+    }
+    pc.printf(saved ? "Calibration: saved\n\r" : "Calibration: not saved\n\r");
+}
+
+//Gate timers and the control loop. Runs once.
+void motorInit() {
+    if (thrReport.get_state() != Thread::Inactive) {
+        return;
+    }
+    //PwmOut muxes D10 (PA_11) to TIM1_CH4, the only entry the PWM map has for it: move
+    //it to TIM1_CH1N, L3L's partner (see bridge.h)
+    pin_function(L3Hpin, STM_PIN_DATA(STM_MODE_AF_PP, GPIO_NOPULL, GPIO_AF6_TIM1));
+#if HALL_CAPTURE
+    //PwmOut muxes D2 (PA_12) to TIM16_CH1, phase 1's timer, the only entry the PWM map
+    //has for it: move it to TIM1_CH2N
+    pin_function(L2Lpin, STM_PIN_DATA(STM_MODE_AF_PP, GPIO_NOPULL, GPIO_AF6_TIM1));
+#endif
+    bridgeInit(PWM_RATE_HZ, PWM_DEAD_TIME_NS);
+    bridgeImages(driveTable, driveImages, 8);
+    pwmImage = bridgePwmImage();
+    offImage = bridgeOffImage();
+#if SENSORLESS_FALLBACK
+    bemfInit(driveTable, driveImages, PWM_RATE_HZ, BEMF_DELAY, bemfCrossed, bemfLost);
+#endif
+#if HALL_CAPTURE
+    hallCaptureInit(HALL_FILTER_US);
+#endif
+    loadCalibration();
+    currentSenseInit();
+    bridgeTrigger(1);
+    controlLoop.start(controlTick);
+    thrReport.start(threadReport);
+    telemetry.start();
+    thrEvents.start(callback(&events, &EventQueue::dispatch_forever));
+}
+
+//FOC torque current for delta, signed for lead
+q15_t focCurrent(float d) {
+    q15_t iq = Pid<q15_t>::fromFloat(d*FOC_CURRENT_MAX);
+    return (lead > 0) ? iq : -iq;
+}
+
+//orState is subtracted from future rotor state inputs to align rotor and motor states
+void alignImages() {
+    for (int s = 0; s < 8; s++) {
+        rotorImages[s] = driveImages[(s-orState+lead+6)%6]; //+6 to make sure the remainder is positive
+        brakeImages[s] = driveImages[(s-orState-lead+6)%6];
+    }
+}
+
+//Stop the rotor, home it if need be and hand it over to the ISRs in the given control mode
+void startMotor(int mode) {
+    motorInit();
+    if (requestedDrive != DRIVE_SIX_STEP || mode == MODE_HOLD) {
+        melody.stop();
+    }
+    controlMode = MODE_IDLE;
+    commutate = false;
+    faultMonitor.disarm();
+    faultMonitor.clear();
+    faultReported = false;
+    bemfStop();
+    bridgeDetach();
+    bridgeTrigger(1);       //the bus voltage is sampled whatever the drive
+    currentSenseDetach();
+    hallEdgesOff();
+
+    //A new command can come in while the motor turns: short the windings (delta = 0
+    //turns all the high sides on) until the encoder stops, or homing would catch the
+    //rotor swinging through state 0
+    motorOut(0, 0);
+    bool stopped = false;
+    for (int t = 0; t < STOP_TIMEOUT_MS && !stopped; t += STOP_POLL_MS) {
+        int32_t count = encoder.count();
+        Thread::wait(STOP_POLL_MS);
+        stopped = abs(encoder.count() - count) <= 1;
+    }
+
+    //Before homing, which starts the encoder count again: the ISRs wait out the flash
+    //erase, and any edges they miss would otherwise show up as encoder errors
+    saveCalibration();
+
+    //Run the motor synchronisation, unless the rotor can be picked up where it is: the
+    //encoder has followed it since the last homing, so the hall angle is still good
+    int8_t state = readRotorState();
+    if (!homed || !stopped || state >= 6 || !hallsGood || encoder.errors() != homeErrors) {
+#if SENSORLESS_FALLBACK
+        orState = motorHome(hallsGood ? HOME_TIMEOUT_MS : HOME_BLIND_TIMEOUT_MS);
+#else
+        orState = motorHome();
+#endif
+        pc.printf("Rotor origin: %x\n\r",orState);
+        if (orState >= 6) {
+            hallsGood = false;
+            hallRun = 0;
+        }
+        homedBlind = !hallsGood;
+        homed = true;
+        homeErrors = encoder.errors();
+        intState = orState;
+        encoder.reset();
+        hallAngle = 0;
+        hallCount = 0;
+        countOffset = 0;
+        countAligned = false;
+        originLoaded = false;
+        if (orState < 6 && hallsGood && orState != calibration.orState) {
+            calibrationDirty = true;
+        }
+    }
+    else if (originLoaded) {
+        //orState from the calibration: the rotor is somewhere in the state, taken as
+        //its middle until the first edge puts the count right
+        originLoaded = false;
+        encoder.reset();
+        hallAngle = ((state - orState + 6) % 6)*ANGLE_60;
+        hallCount = 0;
+        countOffset = (int32_t)(((uint32_t)hallAngle*(ENCODER_COUNTS/POLE_PAIRS)) >> 16);
+        intState = state;
+    }
+    else {
+        //R counts from zero; move the count into the offsets so the angles carry on
+        core_util_critical_section_enter();
+        int32_t count = encoder.count();
+        encoder.reset();
+        hallCount -= count;
+        countOffset += count;
+        core_util_critical_section_exit();
+        intState = state;
+    }
+    alignImages();
+    braking = false;
+    stopping = false;
+    holdTarget = holdSetpoint = 0;
+    driveMode = (mode == MODE_HOLD && requestedDrive == DRIVE_SIX_STEP) ? DRIVE_SVPWM : requestedDrive;
+    //FOC can brake by reversing the current, so the velocity loop may ask for that.
+    //Its output is torque rather than voltage, so the velocity feed-forward doesn't apply.
+    PidConfig velocity = velocityGains;
+    if (driveMode == DRIVE_FOC) {
+        velocity.outMin = -1.0f;
+        velocity.kff = 0.0f;
+    }
+    else if (mode == MODE_ROTATION || mode == MODE_ROTATION_VELOCITY) {
+        velocity.outMin = -BRAKE_MAX_DUTY;
+    }
+    tuneRequested = false;
+    autotuner.stop();
+    velocityPid.configure(velocity);
+    velocityPid.reset();
+    positionPid.reset();
+    holdPositionPid.reset();
+    holdVelocityPid.reset();
+    foc.reset();
+    foc.setCurrent(focCurrent(delta));
+    controlMode = mode;
+    commutate = true;
+
+    //Attach ISR to interrupt pins
+    hallEdgesOn();
+    faultMonitor.arm();
+
+    if (driveMode == DRIVE_SVPWM) {
+        amplitude = (int32_t)(delta*SVPWM_ONE);
+        bridgeWrite(pwmImage);
+        bridgeAttach(interruptModulate, MODULATION_PERIODS);
+    }
+    else if (driveMode == DRIVE_FOC) {
+        const int32_t zero[3] = {SVPWM_ONE/2, SVPWM_ONE/2, SVPWM_ONE/2};
+        bridgePhases(zero);
+        bridgeWrite(pwmImage);
+        currentSenseAttach(interruptCurrent);
+    }
+#if SENSORLESS_FALLBACK
+    else if (!hallsGood && mode == MODE_VELOCITY) {
+        //Nothing to start on: homing left the rotor at drive state 0, so ramp up from
+        //there open loop until the back-EMF can be seen
+        bridgeDuty(BEMF_RAMP_DUTY);
+        bemfRamp((lead+6)%6, lead, BEMF_RAMP_FROM*6*POLE_PAIRS, BEMF_RAMP_TO*6*POLE_PAIRS,
+                 BEMF_RAMP_ACCEL*6*POLE_PAIRS);
+    }
+#endif
+    else {
+        //The rotor is sitting still, so give it the first push
+        motorOut((intState-orState+lead+6)%6, delta);
+    }
+}
+
+void interruptSerial() {
+    while (pc.readable()) {
+        rxBuffer.push((char)pc.getc());
+    }
+    thrInput.signal_set(SIGNAL_RX);
+}
+
 void threadReadInput() {
-    
+    CommandParser parser;
+    Command cmd;
+    pc.attach(&interruptSerial);
+    pc.printf("Please type a command:\n\r");
     while (1) {
-        pc.printf("Please type some input (note: input does not show and reset is required after each command):\n\r");
-        char input[16];
-        State_h s = (struct State*)malloc(sizeof(struct State));
-        stateInit(s);
-        //scan input
-        pc.scanf("%s", &input);
-        //pcprintf("input = %s\n", input);
-        //parse input
-        int i = 0;
-        while (s->state < 2 && input[i] != '\0') {
-            switch (input[i]) {
-                case 'R': case 'r':
-                    if (s->state == 0) {
-                        float val = 0.0;
-                        int newPos = parseNumber(input, i+1, &val);
-                        if (newPos != -1) {
-                            //printf("rotVal = %f\n", val);
-                            s->state = 1;
-                            s->rotate = 1;
-                            s->rotVal = val;
-                            i = newPos-1;
-                        }
-                    }
-                    break;
-                case 'V': case 'v':
-                    if (s->state == 0 || s->state == 1) {
-                        float val = 0.0;
-                        int newPos = parseNumber(input, i+1, &val);
-                        if (newPos != -1) {
-                            //printf("velVal = %f\n", val);
-                            s->state = 2;
-                            s->velocity = 1;
-                            s->velVal = val;
-                            i = newPos-1;
-                        }
-                    }
+        Thread::signal_wait(SIGNAL_RX);
+        char c;
+        while (rxBuffer.pop(c)) {
+            ParseResult result = parser.feed(c, cmd);
+            if (result == PARSE_ERROR) {
+                pc.printf("Unrecognised command\n\r");
             }
+            else if (result == PARSE_COMMAND) {
+                Command* queued = commands.alloc();
+                if (queued) {
+                    *queued = cmd;
+                    commands.put(queued);
+                }
+                else {
+                    pc.printf("Busy, command dropped\n\r");
+                }
+            }
+        }
+    }
+}
 
-            i++;
+//L: the phase advance table in electrical degrees, a row per speed step, a column
+//per duty step
+void printAdvance() {
+    pc.printf("Phase advance, degrees, by rev/s and duty %%:\n\r      ");
+    for (int d = 0; d < ADVANCE_DUTIES; d++) {
+        pc.printf(" %5d", d*100/ADVANCE_DUTIES);
+    }
+    pc.printf("\n\r");
+    for (int v = 0; v < ADVANCE_SPEEDS; v++) {
+        pc.printf("%5d ", (int)(v*ADVANCE_MAX_VELOCITY/ADVANCE_SPEEDS));
+        for (int d = 0; d < ADVANCE_DUTIES; d++) {
+            pc.printf(" %5.1f", advanceTable.at(v, d)*60.0f);
         }
-        //call threads here
-        if (s->rotate && s->velocity) {
-            pc.printf("Calling rotate and velocity function with R=%f, V=%f...\n\r", s->rotVal, s->velVal);
-            //insert here
-            maxVelocity = s->velVal;
-            if (maxVelocity > 5) {
-                maxVelocity = 5;
+        pc.printf("\n\r");
+    }
+}
+
+//Runs in main(), which the motion commands block while homing
+void runCommand(const Command& cmd) {
+    switch (cmd.type) {
+        case COMMAND_HISTOGRAM:
+            controlLoop.print(pc);
+            break;
+        case COMMAND_FAULT: {
+            FaultCode f = faultMonitor.fault();
+            if (f == FAULT_NONE) {
+                pc.printf("Fault: none\n\r");
             }
-            else if (maxVelocity < 0) {
-                maxVelocity = -maxVelocity;
+            else {
+                pc.printf("Fault: %s, drive cut %d us after it was found\n\r", FaultMonitor::name(f),
+                          (int)(faultMonitor.cut() - faultMonitor.detected()));
             }
-            numOfRotations = s->rotVal;
-            setRotationVelocity();
-            
+            break;
         }
-        else if (s->rotate) {
-            pc.printf("Calling just rotate function with R=%f...\n\r", s->rotVal);
-            maxVelocity = 5.0;
-            numOfRotations = s->rotVal;
-            setRotationVelocity();
+        case COMMAND_DRIVE: {
+            const char* names[] = {"six-step", "SVPWM", "FOC"};
+            requestedDrive = (cmd.option == 1) ? DRIVE_SVPWM : (cmd.option == 2) ? DRIVE_FOC : DRIVE_SIX_STEP;
+            pc.printf("Drive: %s from the next command\n\r", names[requestedDrive]);
+            break;
         }
-        else if (s->velocity) {
-            pc.printf("Calling just velocity function with V=%f...\n\r", s->velVal);
-            targetVelocity = s->velVal;
+        case COMMAND_PROFILE:
+            profileShape = (cmd.option == 0) ? PROFILE_TRAPEZOIDAL : PROFILE_S_CURVE;
+            pc.printf("Profile: %s from the next command\n\r", (profileShape == PROFILE_S_CURVE) ? "S-curve" : "trapezoidal");
+            break;
+        case COMMAND_ADVANCE:
+            if (cmd.option >= 0) {
+                advanceLearning = (cmd.option == 1);
+                pc.printf("Phase advance: %s\n\r", advanceLearning ? "learning while V holds its speed" : "from the table");
+            }
+            else {
+                printAdvance();
+            }
+            break;
+        case COMMAND_AUTOTUNE:
+            if (controlMode != MODE_VELOCITY || driveMode == DRIVE_FOC) {
+                pc.printf("Auto-tune needs a V command running six-step or SVPWM\n\r");
+            }
+            else {
+                pc.printf("Auto-tuning for %d s\n\r", (int)TUNE_TIME);
+                tuneRequested = true;
+            }
+            break;
+        case COMMAND_TUNE:
+            if (driveMode != DRIVE_SIX_STEP) {
+                pc.printf("Tunes need six-step drive (M0)\n\r");
+            }
+            else {
+                pc.printf("Tune: %d notes\n\r", cmd.notes);
+                melody.play(cmd.tune, cmd.notes);
+            }
+            break;
+        case COMMAND_KEY:
+            //parsed and echoed: there is nothing on the board to use it yet
+            pc.printf("Key: %08lx%08lx\n\r", (unsigned long)(cmd.key >> 32), (unsigned long)(cmd.key & 0xFFFFFFFF));
+            break;
+        case COMMAND_ROTATE_VELOCITY:
+            pc.printf("Calling rotate and velocity function with R=%f, V=%f...\n\r", cmd.rotations, cmd.velocity);
+            maxVelocity = fabs(cmd.velocity);
+            if (maxVelocity > ROTATION_MAX_VELOCITY) {
+                maxVelocity = ROTATION_MAX_VELOCITY;
+            }
+            numOfRotations = cmd.rotations;
+            setRotationVelocity();
+            break;
+        case COMMAND_ROTATE:
+            pc.printf("Calling just rotate function with R=%f...\n\r", cmd.rotations);
+            maxVelocity = ROTATION_MAX_VELOCITY;
+            numOfRotations = cmd.rotations;
+            setRotationVelocity();
+            break;
+        case COMMAND_VELOCITY:
+            pc.printf("Calling just velocity function with V=%f...\n\r", cmd.velocity);
+            targetVelocity = cmd.velocity;
             setVelocity();
-        }
-        free(s);
-        Thread::wait(5000);
+            break;
+        case COMMAND_HOLD:
+            pc.printf("Holding at %f degrees\n\r", cmd.angle);
+            setHold(cmd.angle, (cmd.velocity != 0) ? fabs(cmd.velocity) : HOLD_RATE);
+            break;
     }
 }
 
 
-volatile bool velDecreasing = false;
-Timer t_motorPeriod;
-volatile double velErrorDeltaSum = 0;
-volatile double posError = -1;
+volatile float velocityFeedForward = 0; //rev/s, from the profile for the velocity loop
 
 
 void setVelocity() {
@@ -497,246 +1083,349 @@ void setVelocity() {
     }
     
     delta = 1;
-    t_calcVel.start();
-    t_motorPeriod.start();
-    
-    pc.printf("Hello\n\r");
-    
-    //Run the motor synchronisation
-    orState = motorHome();
-    pc.printf("Rotor origin: %x\n\r",orState);
-    //orState is subtracted from future rotor state inputs to align rotor and motor states
-    
-    //Poll the rotor state and set the motor outputs accordingly to spin the motor
-    while (1) {
-        intState = readRotorState();
-        //delta = 1.0;
-        if (intState != intStateOld) {
-            intStateOld = intState;       
-            motorOut((intState-orState+lead+6)%6, delta); //+6 to make sure the remainder is positive
-            calculateVelocity();
-        }
-        else {
-            currentVelocity = 0.0;
-        }
-        //Thread::wait(1);
-    }
+    velocityFeedForward = 0;
+    startMotor(MODE_VELOCITY);
 }                                                            
 
-void calculateVelocity() {
-    //states go from 0-6 and wrap around
-    //t_calcVel should be started beforehand
-    intState = readRotorState();
-    if (intState == orState) {
-        t_calcVel.stop();
-        double time_ = t_calcVel.read();
-        if (currentTime != time_) {
-            currentVelocity = 1.0/time_;
-            //measure period
-            
-            //pc.printf("currentVelocity = %f, targetVelocity = %f, delta = %F\n\r",currentVelocity, targetVelocity, delta);
-            //pc.printf(" %f ",currentVelocity);
-            currentTime = time_;
-            //set delta using PID
-            double error = targetVelocity - currentVelocity;
-            //double k_p = 0.01;
-            double k_p = 0.5;
-            double k_i = 0;
-            double k_d = 1.2;
-            double errorDelta = (k_p*error)/10.0;
-            //delta += errorDelta;
-            double errorDeltaChange = (k_d*((error - oldError))/time_)/10.0;
-            velErrorDeltaSum += error/10.0;
-            delta += errorDelta + (k_i*velErrorDeltaSum) + errorDeltaChange;
-            
-            //delta += errorDelta;
-            //delta = 0.0001;
-            /*
-             if (error < 0) {
-                if (!velDecreasing) {
-                    t_motorPeriod.stop();
-                    pc.printf("\n\rperiod = %f\n\r", t_motorPeriod.read());
-                    t_motorPeriod.reset();
-                    t_motorPeriod.start();
-                    velDecreasing = true;
-                }
-            }
-            else {
-                velDecreasing = false;
-            }
-            */
-            //delta = delta + errorDelta;
-            delta = (delta > 1.0) ? 1.0 : delta;
-            delta = (delta < 0.0) ? 0.0 : delta;
-            pc.printf(" %f \n\r",currentVelocity);
+//velocity in rev/s in the direction of lead, dt seconds since the last call
+void calculateVelocity(float velocity, float dt) {
+    currentVelocity = velocity;
+    if (tuneRequested) {
+        tuneRequested = false;
+        autotuner.start((float)delta, TUNE_AMPLITUDE, TUNE_PERIOD, TUNE_TIME, 1.0f/CONTROL_RATE_HZ, TUNE_DECIMATE);
+    }
+    //the tuner drives while it identifies the plant, then hands over its gains
+    if (autotuner.running()) {
+        delta = autotuner.update((float)velocity);
+        if (!autotuner.running()) {
+            applyTuning();
         }
-        t_calcVel.reset();
-        t_calcVel.start();
+        return;
     }
+    //set delta using PI
+    delta = velocityPid.update((float)targetVelocity, (float)velocity, velocityFeedForward);
 }
 
-bool rotatedHalf = false;
-
-void calculateNumRotationsLeft() {
-    //read currentState
-    //if intState == orState
-    //then one rotation has been made
-    if (intState >= 3 && !rotatedHalf) {
-        rotatedHalf = true;
-    }
-    else if(intState == 0 && rotatedHalf) {
-        rotatedHalf = 0;
-        currentNumOfRotationsLeft -= 1.0;
-        if (currentNumOfRotationsLeft < 100) {
-            if (currentNumOfRotationsLeft > 43)
-            {
-                delta = 0.9216;
-            }
-            else {
-                double maxCount = (numOfRotations > 43) ? 43 : numOfRotations;
-                //delta = (currentNumOfRotationsLeft*currentNumOfRotationsLeft)/(numOfRotations*numOfRotations);
-                delta = (currentNumOfRotationsLeft*currentNumOfRotationsLeft)/(maxCount*maxCount);
-                delta = (delta > 1.0) ? 1.0 : delta;
-                delta = (delta < 0.0) ? 0.0 : delta;
-            }
-        }
-        else {
-            delta = 1;
-        }
-        pc.printf("currentNumOfRotationsleft = %f, delta = %f\n\r", currentNumOfRotationsLeft, delta);
+//Swap the tuner's gains into the running velocity loop, with the integral carrying
+//on from the drive it left so delta doesn't jump. Kept for later commands.
+void applyTuning() {
+    if (autotuner.estimate().valid) {
+        velocityGains = autotuner.gains(TUNE_LAMBDA, 1.0f/CONTROL_RATE_HZ, 0.0f, 1.0f);
+        velocityPid.configure(velocityGains);
+        velocityPid.reset(autotuner.operatingPoint() - velocityGains.kff*velocityFeedForward);
+        calibration.kp = velocityGains.kp;
+        calibration.ki = velocityGains.ki;
+        calibration.kff = velocityGains.kff;
+        calibration.inertia = autotuner.inertia(MOTOR_DAMPING);
+        gateSupplyFeedForward(calibration.inertia);
+        calibrationDirty = true;
     }
+    tuneFinished = true;
 }
 
+//Supply feed-forward on for a flywheel of this inertia, kg.m^2, 0 for not known
+void gateSupplyFeedForward(float inertia) {
+    supplyFeedForward = inertia > SUPPLY_FEED_FORWARD_INERTIA;
+}
 
- // Only works with full batteries
 void setRotation() {
-    delta = 1;
-    rotatedHalf = false;
     numOfRotations = 20.0;
-    lead = 2;
-    if (numOfRotations < 0) {
-        numOfRotations = -numOfRotations;
-        lead = -2;
+    maxVelocity = ROTATION_MAX_VELOCITY;
+    planRotation();
+    startMotor(MODE_ROTATION);
+}
+
+
+//The phase advance for the next hall edges, from the table at this speed and duty, or
+//the optimiser's while L1 has it learning and V holds the speed. velocity is in the
+//direction of lead.
+void advanceTick(float velocity) {
+    float duty = delta;
+    bool steady = controlMode == MODE_VELOCITY && !autotuner.running() && bemfState() == BEMF_OFF &&
+                  duty > 0 && fabsf(velocity - targetVelocity) <= ADVANCE_STEADY*targetVelocity;
+    if (advanceLearning && steady) {
+        phaseAdvance = advanceTable.optimise(velocity, duty);
+        return;
     }
-    currentNumOfRotationsLeft = numOfRotations;
-    //posError = floor(numOfRotations*177);
-    pc.printf("Hello\n\r");
-    
-    //Run the motor synchronisation
-    orState = motorHome();
-    pc.printf("Rotor origin: %x\n\r",orState);
-    while (currentNumOfRotationsLeft > 0) {
-        intState = readRotorState();
-        if (intState != intStateOld) {
-            intStateOld = intState;          
-            motorOut((intState-orState+lead+6)%6, delta); //+6 to make sure the remainder is positive
-            calculateNumRotationsLeft();
-        }
+    advanceTable.pause();
+    phaseAdvance = (duty > 0 && velocity > 0) ? advanceTable.lookup(velocity, duty) : 0.0f;
+}
+
+#if SENSORLESS_FALLBACK
+//Six-step commutation from the halls or the back-EMF, from the control tick, and the
+//drive the back-EMF needs. velocity is in the direction of lead.
+void sensorlessTick(float velocity) {
+    BemfState s = bemfState();
+    if (s == BEMF_OFF && !hallsGood && velocity >= BEMF_MIN_VELOCITY) {
+        //the state the halls would give, from the encoder angle since the last good edge
+        int8_t rotor = (int8_t)((((uint32_t)rotorAngle() + ANGLE_30)/ANGLE_60) % 6);
+        braking = false;
+        bemfStart((rotor+lead+6)%6, lead, 1e6f/(velocity*6*POLE_PAIRS));
     }
-    while (1) {
-        intState = readRotorState();
-        if (intState != intStateOld) {
-            intStateOld = intState;    
-            calculateNumRotationsLeft();
+    else if (s != BEMF_OFF && hallsGood && orState < 6) {
+        core_util_critical_section_enter();
+        bemfStop();
+        int8_t state = readRotorState();
+        if (state < 6) {
+            intState = state;
+            bridgeWrite(rotorImages[state]);
         }
+        core_util_critical_section_exit();
+        return;
+    }
+    s = bemfState();
+    if (s == BEMF_RAMP) {
+        delta = BEMF_RAMP_DUTY;
+        velocityPid.reset(BEMF_RAMP_DUTY);
+    }
+    else if (s == BEMF_RUN && delta < BEMF_MIN_DUTY) {
+        delta = BEMF_MIN_DUTY;
     }
 }
+#endif
 
-
-void threadSetVelocity() {
-    //set target velocity
-    thrSetVelocity.set_priority(osPriorityHigh);
-    targetVelocity = 0.0;
-    delta = 1;
-    t_calcVel.start();
-    t_motorPeriod.start();
-    
-    pc.printf("Hello\n\r");
-    
-    //Run the motor synchronisation
-    orState = motorHome();
-    pc.printf("Rotor origin: %x\n\r",orState);
-    //orState is subtracted from future rotor state inputs to align rotor and motor states
-    
-    //Poll the rotor state and set the motor outputs accordingly to spin the motor
-    while (1) {
-        intState = readRotorState();
-        //delta = 1.0;
-        if (intState != intStateOld) {
-            intStateOld = intState;
-            motorOut((intState-orState+lead+6)%6, delta); //+6 to make sure the remainder is positive
-            calculateVelocity();
-            calculateNumRotationsVelocity();
+//Runs in the ticker interrupt every 1/CONTROL_RATE_HZ
+void controlTick() {
+    supply.update(busVoltage());
+    int mode = controlMode;
+    if (mode == MODE_IDLE) {
+        return;
+    }
+    encoder.update();
+    if (mode == MODE_ROTATION || mode == MODE_ROTATION_VELOCITY) {
+        calculateNumRotationsVelocity();
+        if (controlMode == MODE_IDLE) {
+            publishState(mode);
+            return;
         }
-        else {
-            currentVelocity = 0.0;
+    }
+    float velocity = encoder.velocity();
+    if (mode == MODE_HOLD) {
+        calculateHold(velocity);
+    }
+    else {
+        calculateVelocity((lead > 0) ? velocity : -velocity, controlLoop.period());
+        if (stopping) {
+            delta = -BRAKE_MAX_DUTY;
         }
-        Thread::wait(1);
+        if (driveMode == DRIVE_SIX_STEP) {
+#if SENSORLESS_FALLBACK
+            sensorlessTick((lead > 0) ? velocity : -velocity);
+#endif
+            advanceTick((lead > 0) ? velocity : -velocity);
+        }
+    }
+    //the loops work in duty at SUPPLY_NOMINAL
+    float scale = supplyFeedForward ? supply.scale() : 1.0f;
+    if (driveMode == DRIVE_SVPWM) {
+        float m = delta*scale;
+        m = (m > 1.0f) ? 1.0f : (m < -1.0f) ? -1.0f : m;
+        amplitude = (int32_t)(m*SVPWM_ONE);
+    }
+    else if (driveMode == DRIVE_FOC) {
+        foc.setCurrent(focCurrent(delta));
+    }
+    else {
+        float duty = delta*scale;
+        duty = (duty > 1.0f) ? 1.0f : (duty < -1.0f) ? -1.0f : duty;
+        if ((duty < 0) != braking) {
+            core_util_critical_section_enter();
+            braking = (duty < 0);
+            bridgeWrite(braking ? brakeImages[intState] : rotorImages[intState]);
+            core_util_critical_section_exit();
+        }
+        if (braking) {
+            duty = -duty;
+        }
+        bridgeDuty(duty);
     }
+    publishState(mode);
 }
 
-volatile double velErrorVelocitySum = 0;
-Ticker tick_push;
+//The tick's results to motorState and the telemetry stream
+void publishState(int mode) {
+    MotorState state;
+    state.time = us_ticker_read();
+    state.mode = (int8_t)mode;
+    state.position = encoder.position();
+    state.velocity = currentVelocity;
+    state.targetVelocity = targetVelocity;
+    state.delta = delta;
+    state.rotations = currentNumOfRotations;
+    state.rotationsLeft = currentNumOfRotationsLeft;
+    state.angle = holdAngle();
+    state.setpoint = holdSetpoint;
+    motorState.write(state);
 
-void calculateNumRotationsVelocity() {
-    if (intState >= 3 && !rotatedHalf) {
-        rotatedHalf = true;
-    }
-    else if(intState == 0 && rotatedHalf) {
-        rotatedHalf = false;
-        //if (lead > 0) {
-            currentNumOfRotations += 1.0;
-        //}
-        //else {
-        //    currentNumOfRotations -= 1.0;
-        //}
-        double error = numOfRotations - currentNumOfRotations;
-        double k_p = 2;
-        double k_i = 0;
-        double k_d = 0;
-        double errorVelocity = (k_p*error)/4.0;
-        //double errorVelocityChange = (k_d*((error - oldError))/time_)/10.0;
-        velErrorVelocitySum += error;
-        targetVelocity = errorVelocity;
-        //targetVelocity += errorVelocity + (k_i*velErrorVelocitySum) + errorVelocityChange;
-        targetVelocity = (targetVelocity > maxVelocity) ? maxVelocity : targetVelocity;
-        targetVelocity = (targetVelocity < -maxVelocity) ? -maxVelocity : targetVelocity;
-        printf(" num so far = %f, target velocity = %f \n\r", currentNumOfRotations, targetVelocity);
-        tick_push.detach();
-        tick_push.attach(&pushMotor, 10.0);
+    TelemetrySample sample;
+    sample.time = state.time;
+    sample.position = state.position;
+    sample.velocity = state.velocity;
+    sample.delta = state.delta;
+    sample.error = state.targetVelocity - state.velocity;
+    telemetry.record(sample);
+}
+
+//Serial status output, kept out of the control loop
+void threadReport() {
+    int printedRevolution = -1;
+    BemfState commutation = BEMF_OFF;
+    while (1) {
+        Thread::wait(REPORT_PERIOD_MS);
+        MotorState s = motorState.read();
+        //nothing to show until the first tick in the current mode
+        int mode = (s.mode == controlMode) ? s.mode : MODE_IDLE;
+        if (!faultReported && faultMonitor.fault() != FAULT_NONE) {
+            faultReported = true;
+            pc.printf("Fault: %s, drive cut\n\r", FaultMonitor::name(faultMonitor.fault()));
+        }
+        if (bemfState() != commutation) {
+            static const char* const sources[] = {"halls", "open loop ramp", "back-EMF"};
+            commutation = bemfState();
+            pc.printf("Commutation: %s\n\r", sources[commutation]);
+        }
+        if (tuneFinished) {
+            tuneFinished = false;
+            PlantEstimate e = autotuner.estimate();
+            if (e.valid) {
+                pc.printf("Tuned: K = %f rev/s, tau = %f s, friction = %f, inertia ~ %g kg.m^2, kp = %f, ki = %f\n\r",
+                          e.gain, e.tau, e.friction, autotuner.inertia(MOTOR_DAMPING), velocityGains.kp, velocityGains.ki);
+            }
+            else {
+                pc.printf("Auto-tune failed, gains unchanged\n\r");
+            }
+        }
+        if (mode == MODE_VELOCITY) {
+            pc.printf(" %f \n\r", s.velocity);
+        }
+        else if (mode == MODE_ROTATION && (int)s.rotations != printedRevolution) {
+            printedRevolution = (int)s.rotations;
+            pc.printf("currentNumOfRotationsleft = %f, delta = %f\n\r", s.rotationsLeft, s.delta);
+        }
+        else if (mode == MODE_ROTATION_VELOCITY && (int)s.rotations != printedRevolution) {
+            printedRevolution = (int)s.rotations;
+            pc.printf(" num so far = %f, target velocity = %f \n\r", s.rotations, s.targetVelocity);
+        }
+        else if (mode == MODE_HOLD && (int)floorf(s.angle) != printedRevolution) {
+            printedRevolution = (int)floorf(s.angle);
+            pc.printf(" angle = %f, setpoint = %f, delta = %f\n\r", s.angle, s.setpoint, s.delta);
+        }
+        else if (mode == MODE_IDLE) {
+            printedRevolution = -1;
+        }
     }
 }
 
-void setRotationVelocity() {
-    //maxVelocity = 5.0;
-    rotatedHalf = false;
-    tick_push.attach(&pushMotor, 10.0);
-    //numOfRotations = 100.0;
+/////////////////////////////////MOTION PROFILE/////////////////////////////////////////////
+//R commands follow a MotionProfile from rest to rest. Each control tick samples the
+//setpoint; the velocity loop gets the profile velocity as its feed-forward plus the
+//position loop's correction for the tracking error. Once the profile is over and the
+//rotor is within STOP_TOLERANCE of the target it brakes.
+
+//Plan numOfRotations (sign picks lead) at up to maxVelocity
+void planRotation() {
     lead = 2;
     if (numOfRotations < 0) {
         numOfRotations = -numOfRotations;
         lead = -2;
     }
     currentNumOfRotations = 0;
-    pc.printf("Hello\n\r");
-    
-    //Run the motor synchronisation
-    orState = motorHome();
-    pc.printf("Rotor origin: %x\n\r",orState);
-    thrSetVelocity.start(threadSetVelocity);
-    while (1) {
-        //printf("running this");
-        Thread::wait(100);
-        if (targetVelocity < 0) {
-            thrSetVelocity.terminate();
-            break;
-        }
+    currentNumOfRotationsLeft = numOfRotations;
+    profileTime = 0;
+    profile.plan((float)numOfRotations, (float)maxVelocity, PROFILE_ACCEL,
+                 (profileShape == PROFILE_S_CURVE) ? PROFILE_JERK : 0.0f, PROFILE_DECEL);
+    targetVelocity = 0.0;
+    velocityFeedForward = 0;
+    delta = 1;
+    positionPid.configure(pidConfig(POSITION_KP, 0.0f, 0.0f, 1.0f/CONTROL_RATE_HZ, -maxVelocity, maxVelocity));
+}
+
+void calculateNumRotationsVelocity() {
+    currentNumOfRotations = fabs(encoder.position());
+    currentNumOfRotationsLeft = numOfRotations - currentNumOfRotations;
+    float t = profileTime + controlLoop.period();
+    profileTime = t;
+    if (t >= profile.duration() && currentNumOfRotationsLeft <= STOP_TOLERANCE) {
+        //stop commutating and brake: delta = 0 turns all the high sides on
+        commutate = false;
+        bemfStop();
+        stopping = false;
+        controlMode = MODE_IDLE;
+        delta = 0;
+        velocityFeedForward = 0;
+        motorOut((intState-orState+lead+6)%6, delta);
+        return;
     }
+    //the velocity loop can trail the profile's stop, so brake hard once it is that or
+    //overshoot
+    float velocity = (lead > 0) ? encoder.velocity() : -encoder.velocity();
+    stopping = velocity > 0 && currentNumOfRotationsLeft <= velocity*velocity/(2*BRAKE_DECEL);
+    ProfilePoint ref = profile.sample(t);
+    //the plant is first order, so holding the profile's acceleration takes delta for
+    //the velocity it will have VELOCITY_TIME_CONSTANT later
+    velocityFeedForward = ref.velocity + VELOCITY_TIME_CONSTANT*ref.acceleration;
+    targetVelocity = ref.velocity + positionPid.update(ref.position, (float)currentNumOfRotations);
 }
 
-void pushMotor() {
-    numOfRotations = currentNumOfRotations;
-    currentNumOfRotations = 0;
-    tick_push.detach();
-    tick_push.attach(&pushMotor, 10.0);
+void setRotationVelocity() {
+    planRotation();
+    startMotor(MODE_ROTATION_VELOCITY);
+}
+
+/////////////////////////////////ANGLE HOLD/////////////////////////////////////////////////
+//D commands hold the rotor at an angle from the motorHome() position, which the hall
+//states pin down, so the angle is absolute. The encoder gives it to a count (0.77
+//degrees) and the hall edges put the count right if it slips. Each control tick moves
+//the setpoint towards the target, the position loop turns the setpoint error into a
+//velocity on top of the setpoint's own, and the velocity loop gives the drive.
+
+//Degrees from the motorHome() position, any number of turns
+float holdAngle() {
+    return (encoder.count() + countOffset)*(360.0f/ENCODER_COUNTS);
+}
+
+//Hold at angle (any number of turns apart is the same angle), moving there at rate
+//degrees/s the short way round. Homes first unless already holding.
+void setHold(float angle, float rate) {
+    core_util_critical_section_enter();
+    holdRequest = angle;
+    holdRate = (rate > HOLD_MAX_RATE) ? HOLD_MAX_RATE : rate;
+    holdRequested = true;
+    core_util_critical_section_exit();
+    if (controlMode != MODE_HOLD) {
+        lead = 2;
+        delta = 0;
+        startMotor(MODE_HOLD);
+    }
+}
+
+void calculateHold(float velocity) {
+    float angle = holdAngle();
+    if (holdRequested) {
+        holdRequested = false;
+        holdTarget = angle + remainderf(holdRequest - angle, 360.0f);
+        holdSetpoint = angle;
+    }
+    float step = holdRate*controlLoop.period();
+    float error = holdTarget - holdSetpoint;
+    float rate = 0;
+    if (fabsf(error) <= step) {
+        holdSetpoint = holdTarget;
+    }
+    else {
+        rate = (error > 0) ? holdRate : -holdRate;
+        holdSetpoint = holdSetpoint + rate*controlLoop.period();
+    }
+    //At rest inside the deadband neither loop sees an error, so the drive is the
+    //position integral alone. The velocity estimate isn't used there: rocking across
+    //one encoder edge reads as tens of degrees/s and would keep the rocking going.
+    float measured = angle;
+    float speed = velocity*360.0f;
+    if (rate == 0 && fabsf(holdSetpoint - angle) <= HOLD_DEADBAND) {
+        measured = holdSetpoint;
+        speed = 0;
+    }
+    currentVelocity = velocity;
+    float demand = holdPositionPid.update(holdSetpoint, measured) + rate;
+    delta = holdVelocityPid.update(demand, speed);
 }
@@ -12,6 +12,9 @@
 #define MBED_CONF_PLATFORM_DEFAULT_SERIAL_BAUD_RATE 9600 // set by library:platform
 #define MBED_CONF_PLATFORM_STDIO_FLUSH_AT_EXIT      1    // set by library:platform
 #define MBED_CONF_PLATFORM_STDIO_CONVERT_NEWLINES   0    // set by library:platform
+#define MBED_CONF_APP_HALL_CAPTURE                  0    // set by application
+#define MBED_CONF_APP_SENSORLESS_FALLBACK           0    // set by application
+#define MBED_CONF_APP_BEMF_V3_PIN                   PB_11 // set by application
 // Macros
 #define UNITY_INCLUDE_CONFIG_H                           // defined by library:utest
 
@@ -0,0 +1,58 @@
+#include "melody.h"
+#include "bridge.h"
+
+//Carrier in Hz for each semitone above C, octave 5
+static const int noteHz[12] = {523, 554, 587, 622, 659, 698, 740, 784, 831, 880, 932, 988};
+
+MelodyPlayer::MelodyPlayer(EventQueue& queue, int restHz)
+    : _queue(queue), _restHz(restHz), _pendingCount(0), _count(0), _index(0), _event(0), _playing(false) {}
+
+void MelodyPlayer::play(const Note* notes, int count) {
+    if (count > COMMAND_TUNE_NOTES) {
+        count = COMMAND_TUNE_NOTES;
+    }
+    core_util_critical_section_enter();
+    memcpy(_pending, notes, count*sizeof(Note));
+    _pendingCount = count;
+    core_util_critical_section_exit();
+    _queue.call(this, &MelodyPlayer::begin);
+}
+
+void MelodyPlayer::stop() {
+    _queue.call(this, &MelodyPlayer::halt);
+}
+
+//The rest run in the queue's thread
+void MelodyPlayer::begin() {
+    if (_event) {
+        _queue.cancel(_event);
+    }
+    core_util_critical_section_enter();
+    memcpy(_notes, _pending, _pendingCount*sizeof(Note));
+    _count = _pendingCount;
+    core_util_critical_section_exit();
+    _index = 0;
+    _playing = _count > 0;
+    _event = 0;
+    if (_playing) {
+        next();
+    }
+}
+
+void MelodyPlayer::next() {
+    const Note& n = _notes[_index];
+    bridgeFrequency(noteHz[n.pitch % 12]);
+    _index = (_index + 1) % _count;
+    _event = _queue.call_in(n.length*MELODY_NOTE_MS, this, &MelodyPlayer::next);
+}
+
+void MelodyPlayer::halt() {
+    if (_event) {
+        _queue.cancel(_event);
+        _event = 0;
+    }
+    if (_playing) {
+        bridgeFrequency(_restHz);
+        _playing = false;
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef MELODY_H
+#define MELODY_H
+
+#include "mbed.h"
+#include "mbed_events.h"
+#include "command.h"
+
+//Plays a tune on the motor windings by moving the gate PWM carrier to each note's
+//pitch: the current ripple at the carrier frequency makes the motor sing while it
+//keeps turning. The note changes run as events on an EventQueue, each one scheduling
+//the next with call_in(), so nothing waits in a thread and the control loop carries on
+//at its own rate. The tune repeats until stop() or another play().
+//
+//Only six-step drive can play: its duty is the same at any carrier, where SVPWM and FOC
+//update from the PWM timer's own interrupts.
+
+#define MELODY_NOTE_MS 125              //a length of 1, an eighth of a second
+
+class MelodyPlayer {
+public:
+    //restHz is the carrier to go back to when the tune stops
+    MelodyPlayer(EventQueue& queue, int restHz);
+
+    //From any thread. Replaces whatever is playing.
+    void play(const Note* notes, int count);
+    void stop();
+
+    bool playing() const { return _playing; }
+
+private:
+    void begin();
+    void next();
+    void halt();
+
+    EventQueue& _queue;
+    int _restHz;
+    Note _pending[COMMAND_TUNE_NOTES];
+    int _pendingCount;
+    Note _notes[COMMAND_TUNE_NOTES];
+    int _count;
+    int _index;
+    int _event;                         //the next note's event, 0 if none
+    volatile bool _playing;
+};
+
+#endif
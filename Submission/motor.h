@@ -0,0 +1,159 @@
+#ifndef MOTOR_H
+#define MOTOR_H
+
+#include "mbed.h"
+#include "encoder.h"
+#include "pid.h"
+#include "sixstep.h"
+
+//One motor with its own pins, hall and encoder ISRs and velocity loop, so a firmware
+//image can run several. The drive and state tables and the homing wait are the ones
+//main.cpp uses, from sixstep.h. Pins is a type holding the pin map as static
+//members, which fixes each instance's wiring at compile time:
+//
+//  struct LeftPins {
+//      static const PinName I1 = D2, I2 = D11, I3 = D12;       //photointerrupters
+//      static const PinName CHA = D7, CHB = D8;                //encoder
+//      static const PinName L1L = D4, L1H = D5, L2L = D3, L2H = D6, L3L = D9, L3H = D10;
+//  };
+//  Motor<LeftPins> left(gains);
+//
+//The drive is six-step through PwmOut, as main.cpp did before the TIM1 bridge
+//(bridge.h), which there is only one of: any PWM capable pins will do, for six
+//PwmOut::write() calls per commutation. The high side gates are active low, so
+//delta = 0 turns them all on and brakes.
+//
+//tick() is the control task. Give the motors' ticks to a MotorScheduler
+//(scheduler.h), which staggers them over the control period.
+//
+//main.cpp doesn't use either: its one motor runs on the bridge with SVPWM, FOC, the
+//profiles and the fault checks, which this doesn't have.
+template <typename Pins>
+class Motor {
+public:
+    //velocityGains: delta from rev/s, with dt the scheduler's period
+    Motor(const PidConfig& velocityGains)
+        : _i1(Pins::I1), _i2(Pins::I2), _i3(Pins::I3), _encoder(Pins::CHA, Pins::CHB),
+          _l1l(Pins::L1L), _l1h(Pins::L1H), _l2l(Pins::L2L), _l2h(Pins::L2H), _l3l(Pins::L3L), _l3h(Pins::L3H),
+          _velocityPid(velocityGains), _orState(0), _state(0), _lead(2), _homed(false), _running(false),
+          _target(0), _velocity(0), _delta(0) {
+        out(7, 1);
+    }
+
+    //Find orState, as motorHome() in main.cpp. Blocks for up to HOME_TIMEOUT_MS plus
+    //HOME_SWING_MS, so from a thread.
+    void home() {
+        out(0, 1);
+        homeSettle(_encoder);
+        _orState = rotorState();
+        _homed = true;
+    }
+
+    //Spin at velocity rev/s, the sign giving the direction. Homes first if need be.
+    void start(float velocity) {
+        if (!_homed) {
+            home();
+        }
+        _lead = (velocity < 0) ? -2 : 2;
+        _target = fabsf(velocity);
+        _velocityPid.reset();
+        _delta = 1;
+        _state = rotorState();
+        _encoder.reset();
+        _running = true;
+        _i1.rise(this, &Motor::hallEdge);
+        _i1.fall(this, &Motor::hallEdge);
+        _i2.rise(this, &Motor::hallEdge);
+        _i2.fall(this, &Motor::hallEdge);
+        _i3.rise(this, &Motor::hallEdge);
+        _i3.fall(this, &Motor::hallEdge);
+        _i1.enable_irq();
+        _i2.enable_irq();
+        _i3.enable_irq();
+        //The rotor is sitting still, so give it the first push
+        out((_state - _orState + _lead + 6) % 6, _delta);
+    }
+
+    //Stop commutating and brake
+    void stop() {
+        _running = false;
+        _i1.disable_irq();
+        _i2.disable_irq();
+        _i3.disable_irq();
+        _delta = 0;
+        out(_state, 0);
+    }
+
+    //New speed in the same direction, from any context
+    void setVelocity(float velocity) { _target = fabsf(velocity); }
+
+    //Control task, at the rate velocityGains was set up for
+    void tick() {
+        if (!_running) {
+            return;
+        }
+        _encoder.update();
+        float v = _encoder.velocity();
+        _velocity = (_lead > 0) ? v : -v;
+        _delta = _velocityPid.update(_target, _velocity, _target);
+    }
+
+    bool running() { return _running; }
+    int8_t origin() { return _orState; }
+    float velocity() { return _velocity; }      //rev/s in the direction of travel
+    float delta() { return _delta; }
+    Encoder& encoder() { return _encoder; }
+
+private:
+    int8_t rotorState() {
+        return stateMap[_i1 + 2*_i2 + 4*_i3];
+    }
+
+    //Set a drive state, turning phases off before others on
+    void out(int8_t driveState, float delta) {
+        int8_t driveOut = driveTable[driveState & 0x07];
+        if (~driveOut & 0x01) _l1l = 0;
+        if (~driveOut & 0x02) _l1h = delta;
+        if (~driveOut & 0x04) _l2l = 0;
+        if (~driveOut & 0x08) _l2h = delta;
+        if (~driveOut & 0x10) _l3l = 0;
+        if (~driveOut & 0x20) _l3h = delta;
+        if (driveOut & 0x01) _l1l = delta;
+        if (driveOut & 0x02) _l1h = 0;
+        if (driveOut & 0x04) _l2l = delta;
+        if (driveOut & 0x08) _l2h = 0;
+        if (driveOut & 0x10) _l3l = delta;
+        if (driveOut & 0x20) _l3h = 0;
+    }
+
+    void hallEdge() {
+        int8_t state = rotorState();
+        _state = state;
+        if (_running) {
+            out((state - _orState + _lead + 6) % 6, _delta);
+        }
+    }
+
+    InterruptIn _i1;
+    InterruptIn _i2;
+    InterruptIn _i3;
+    Encoder _encoder;
+    PwmOut _l1l;
+    PwmOut _l1h;
+    PwmOut _l2l;
+    PwmOut _l2h;
+    PwmOut _l3l;
+    PwmOut _l3h;
+    Pid<float> _velocityPid;
+
+    int8_t _orState;
+    volatile int8_t _state;
+    volatile int8_t _lead;
+    bool _homed;
+    volatile bool _running;
+    volatile float _target;
+    volatile float _velocity;
+    volatile float _delta;
+};
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef PID_H
+#define PID_H
+
+#include <stdint.h>
+#include <math.h>
+
+//PID controller with anti-windup, a filtered derivative, feed-forward and an output
+//clamp, for float and Q15/Q31 fixed point.
+//
+//  Pid<float>  - any units, single precision (the F303's FPU has no doubles)
+//  Pid<q31_t>  - per-unit values in [-1, 1), 64-bit accumulator
+//  Pid<q15_t>  - per-unit values in [-1, 1), 64-bit accumulator, 16-bit multiplies
+//
+//output = kp*e + ki*sum(e*dt) + D + kff*feedForward, clamped to [outMin, outMax],
+//with e = setpoint - measurement. The derivative acts on the measurement so setpoint
+//steps don't kick it: D = -kd*d(measurement)/dt through a first-order low-pass with
+//time constant derivativeTau. The integral only moves while the output is inside
+//its limits (or the error would bring it back inside), so it can't wind up.
+//
+//For the fixed point versions every PidConfig value is per unit: kp = 2 means a full
+//scale error gives twice the full scale output.
+
+typedef int16_t q15_t;
+typedef int32_t q31_t;
+
+struct PidConfig {
+    float kp;
+    float ki;               //per second
+    float kd;               //seconds
+    float kff;
+    float dt;               //update period, seconds
+    float derivativeTau;    //seconds, 0 for no filter
+    float outMin;
+    float outMax;
+};
+
+inline PidConfig pidConfig(float kp, float ki, float kd, float dt, float outMin, float outMax) {
+    PidConfig c;
+    c.kp = kp;
+    c.ki = ki;
+    c.kd = kd;
+    c.kff = 0;
+    c.dt = dt;
+    c.derivativeTau = 0;
+    c.outMin = outMin;
+    c.outMax = outMax;
+    return c;
+}
+
+//Fixed point formats: VALUE_BITS fractional bits in T, ACC_BITS in the accumulator.
+//The accumulator keeps 8 (Q31) or 33 (Q15) bits of headroom above full scale so the
+//terms can be summed before clamping.
+template <typename T> struct PidTraits;
+template <> struct PidTraits<q15_t> { enum { VALUE_BITS = 15, ACC_BITS = 30 }; };
+template <> struct PidTraits<q31_t> { enum { VALUE_BITS = 31, ACC_BITS = 54 }; };
+
+//Gain as a mantissa using all bits of T, and the right shift that takes its product
+//with a value to the accumulator format
+struct PidGain {
+    int32_t m;
+    int shift;
+};
+
+template <typename T>
+class Pid {
+public:
+    typedef int64_t Acc;
+
+    Pid(const PidConfig& config) { configure(config); reset(); }
+
+    //Gains can be changed while running, the integral is kept
+    void configure(const PidConfig& config) {
+        _kp = gain(config.kp);
+        _ki = gain(config.ki*config.dt);
+        _kff = gain(config.kff);
+        _kd = gain(config.kd/config.dt);
+        _alpha = gain(config.dt/(config.dt + config.derivativeTau));
+        _min = toAcc(config.outMin);
+        _max = toAcc(config.outMax);
+    }
+
+    void reset(T integral = 0) {
+        _integral = (Acc)integral << (ACC_BITS - VALUE_BITS);
+        _derivative = 0;
+        _last = 0;
+        _first = true;
+    }
+
+    T update(T setpoint, T measurement, T feedForward = 0) {
+        int32_t e = saturate((int64_t)setpoint - measurement);
+
+        Acc p = mul(_kp, e);
+        Acc ff = mul(_kff, feedForward);
+
+        if (_first) {
+            _last = measurement;
+            _first = false;
+        }
+        int32_t change = saturate((int64_t)measurement - _last);
+        _last = measurement;
+        Acc raw = -mul(_kd, change);
+        _derivative += mul(_alpha, saturate((raw - _derivative) >> (ACC_BITS - VALUE_BITS)));
+
+        Acc integral = _integral + mul(_ki, e);
+        if (integral > _max) integral = _max;
+        else if (integral < _min) integral = _min;
+
+        Acc out = p + integral + _derivative + ff;
+        if (out > _max) {
+            out = _max;
+            if (integral < _integral) _integral = integral;
+        }
+        else if (out < _min) {
+            out = _min;
+            if (integral > _integral) _integral = integral;
+        }
+        else {
+            _integral = integral;
+        }
+        return (T)saturate((out + ROUND) >> (ACC_BITS - VALUE_BITS));
+    }
+
+    T integral() const { return (T)saturate(_integral >> (ACC_BITS - VALUE_BITS)); }
+
+    static T fromFloat(float x) {
+        float s = x*(float)(1LL << VALUE_BITS);
+        if (s >= (float)MAX_VALUE) return (T)MAX_VALUE;
+        if (s <= (float)MIN_VALUE) return (T)MIN_VALUE;
+        return (T)lrintf(s);
+    }
+    static float toFloat(T x) { return (float)x/(float)(1LL << VALUE_BITS); }
+
+private:
+    enum {
+        VALUE_BITS = PidTraits<T>::VALUE_BITS,
+        ACC_BITS = PidTraits<T>::ACC_BITS
+    };
+    static const int64_t MAX_VALUE = (1LL << VALUE_BITS) - 1;
+    static const int64_t MIN_VALUE = -(1LL << VALUE_BITS);
+    static const Acc ROUND = (Acc)1 << (ACC_BITS - VALUE_BITS - 1);
+
+    static int32_t saturate(int64_t x) {
+        if (x > MAX_VALUE) return (int32_t)MAX_VALUE;
+        if (x < MIN_VALUE) return (int32_t)MIN_VALUE;
+        return (int32_t)x;
+    }
+
+    static PidGain gain(float g) {
+        PidGain k;
+        k.m = 0;
+        k.shift = 0;
+        if (g == 0) {
+            return k;
+        }
+        int exponent;
+        frexpf(g, &exponent);
+        int frac = VALUE_BITS - exponent;
+        //products can be shifted right by up to 63 bits, smaller gains are just zero
+        if (frac > ACC_BITS + VALUE_BITS) {
+            return k;
+        }
+        int64_t m = llrintf(ldexpf(g, frac));
+        if (m > MAX_VALUE || m < MIN_VALUE) {
+            m /= 2;
+            frac--;
+        }
+        k.m = (int32_t)m;
+        k.shift = VALUE_BITS + frac - ACC_BITS;
+        return k;
+    }
+
+    static Acc toAcc(float x) { return (Acc)llrintf(ldexpf(x, ACC_BITS)); }
+
+    //gain * x, x with VALUE_BITS fractional bits, result in the accumulator format
+    static Acc mul(const PidGain& k, int32_t x) {
+        Acc p = (Acc)k.m*x;
+        if (k.shift > 0) return (p + ((Acc)1 << (k.shift - 1))) >> k.shift;
+        return p << -k.shift;
+    }
+
+    PidGain _kp, _ki, _kd, _kff, _alpha;
+    Acc _min, _max;
+    Acc _integral;
+    Acc _derivative;
+    T _last;
+    bool _first;
+};
+
+//Single precision version, same behaviour in whatever units the caller uses
+template <>
+class Pid<float> {
+public:
+    Pid(const PidConfig& config) { configure(config); reset(); }
+
+    void configure(const PidConfig& config) {
+        _kp = config.kp;
+        _ki = config.ki*config.dt;
+        _kff = config.kff;
+        _kd = config.kd/config.dt;
+        _alpha = config.dt/(config.dt + config.derivativeTau);
+        _min = config.outMin;
+        _max = config.outMax;
+    }
+
+    void reset(float integral = 0) {
+        _integral = integral;
+        _derivative = 0;
+        _last = 0;
+        _first = true;
+    }
+
+    float update(float setpoint, float measurement, float feedForward = 0) {
+        float e = setpoint - measurement;
+        if (_first) {
+            _last = measurement;
+            _first = false;
+        }
+        float raw = -_kd*(measurement - _last);
+        _last = measurement;
+        _derivative += _alpha*(raw - _derivative);
+
+        float integral = _integral + _ki*e;
+        if (integral > _max) integral = _max;
+        else if (integral < _min) integral = _min;
+
+        float out = _kp*e + integral + _derivative + _kff*feedForward;
+        if (out > _max) {
+            out = _max;
+            if (integral < _integral) _integral = integral;
+        }
+        else if (out < _min) {
+            out = _min;
+            if (integral > _integral) _integral = integral;
+        }
+        else {
+            _integral = integral;
+        }
+        return out;
+    }
+
+    float integral() const { return _integral; }
+
+private:
+    float _kp, _ki, _kd, _kff, _alpha;
+    float _min, _max;
+    float _integral;
+    float _derivative;
+    float _last;
+    bool _first;
+};
+
+#endif
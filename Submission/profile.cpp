@@ -0,0 +1,115 @@
+#include "profile.h"
+
+#include <math.h>
+
+MotionProfile::MotionProfile() : _count(0), _current(0), _duration(0), _distance(0), _peak(0) {}
+
+//Append a segment of constant jerk, starting from where the last one ends but at the
+//given acceleration (a trapezoid steps it)
+void MotionProfile::add(float duration, float acceleration, float jerk) {
+    if (duration <= 0.0f || _count == MAX_SEGMENTS) {
+        return;
+    }
+    Segment s;
+    s.start = _duration;
+    s.a = acceleration;
+    s.j = jerk;
+    if (_count == 0) {
+        s.p = s.v = 0.0f;
+    }
+    else {
+        const Segment& l = _segments[_count - 1];
+        float d = s.start - l.start;
+        s.p = l.p + d*(l.v + d*(l.a/2 + d*l.j/6));
+        s.v = l.v + d*(l.a + d*l.j/2);
+    }
+    _segments[_count++] = s;
+    _duration += duration;
+}
+
+//Getting from rest to v, or from v to rest, within an acceleration and jerk limit:
+//how long it takes, with the acceleration it peaks at in peak. It covers v*time/2.
+static float ramp(float v, float acceleration, float jerk, float& peak) {
+    peak = acceleration;
+    if (jerk <= 0.0f) {
+        return v/acceleration;
+    }
+    if (v*jerk < acceleration*acceleration) {
+        peak = sqrtf(v*jerk);           //v is reached before the acceleration limit
+    }
+    return v/peak + peak/jerk;
+}
+
+void MotionProfile::plan(float distance, float velocity, float acceleration, float jerk, float deceleration) {
+    _count = 0;
+    _current = 0;
+    _duration = 0;
+    _distance = (distance > 0.0f) ? distance : 0.0f;
+    _peak = 0;
+    if (deceleration <= 0.0f) {
+        deceleration = acceleration;
+    }
+    if (_distance == 0.0f || velocity <= 0.0f || acceleration <= 0.0f) {
+        return;
+    }
+    float v = velocity;
+    float a, d;
+    float ta = ramp(v, acceleration, jerk, a);
+    float td = ramp(v, deceleration, jerk, d);
+    if (v*(ta + td)/2 > _distance) {
+        //Too short to reach v. The ramps cover more the higher the peak, so bisect for
+        //the one that covers the distance, erring low: the rest is cruise.
+        float low = 0, high = v;
+        for (int i = 0; i < 24; i++) {
+            v = (low + high)/2;
+            ta = ramp(v, acceleration, jerk, a);
+            td = ramp(v, deceleration, jerk, d);
+            if (v*(ta + td)/2 > _distance) high = v;
+            else low = v;
+        }
+        v = low;
+        ta = ramp(v, acceleration, jerk, a);
+        td = ramp(v, deceleration, jerk, d);
+    }
+    float cruise = (_distance - v*(ta + td)/2)/v;
+    _peak = v;
+
+    //A trapezoid is the same with the jerk ramps 0: only the constant segments are left
+    if (jerk <= 0.0f) {
+        jerk = 0;
+    }
+    float tja = jerk ? a/jerk : 0;
+    float tjd = jerk ? d/jerk : 0;
+    add(tja, 0, jerk);
+    add(ta - 2*tja, a, 0);
+    add(tja, a, -jerk);
+    add(cruise, 0, 0);
+    add(tjd, 0, -jerk);
+    add(td - 2*tjd, -d, 0);
+    add(tjd, -d, jerk);
+}
+
+ProfilePoint MotionProfile::sample(float t) {
+    ProfilePoint p;
+    if (_count == 0 || t <= 0.0f) {
+        p.position = p.velocity = p.acceleration = 0;
+        return p;
+    }
+    if (t >= _duration) {
+        p.position = _distance;
+        p.velocity = p.acceleration = 0;
+        return p;
+    }
+    if (t < _segments[_current].start) {
+        _current = 0;
+    }
+    while (_current + 1 < _count && t >= _segments[_current + 1].start) {
+        _current++;
+    }
+    const Segment& s = _segments[_current];
+    float d = t - s.start;
+    p.position = s.p + d*(s.v + d*(s.a/2 + d*s.j/6));
+    p.velocity = s.v + d*(s.a + d*s.j/2);
+    p.acceleration = s.a + d*s.j;
+    return p;
+}
@@ -0,0 +1,60 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+//Point to point motion profile from rest to rest, trapezoidal or jerk-limited
+//S-curve, planned once and then sampled at the control rate.
+//
+//plan() works out every segment boundary up front: for an S-curve up to seven
+//segments of constant jerk (+J, 0, -J while accelerating, a cruise, and -J, 0, +J
+//while decelerating), for a trapezoid the three constant acceleration ones. The
+//deceleration limit may be higher than the acceleration one, for a drive that can
+//brake harder than it can push. Moves too short to reach the velocity limit, or the
+//acceleration limit, get a lower peak instead. sample() then only has to evaluate
+//one cubic: it keeps the segment it was last in, so with time moving forward each
+//call is O(1).
+//
+//Units are whatever the caller uses, e.g. rotations, rev/s, rev/s^2 and rev/s^3.
+//Floats: the F303's FPU is single precision.
+
+struct ProfilePoint {
+    float position;
+    float velocity;
+    float acceleration;
+};
+
+class MotionProfile {
+public:
+    MotionProfile();
+
+    //A move of distance (>= 0) within the velocity, acceleration and jerk limits,
+    //stopping at deceleration if that is given. jerk 0 gives a trapezoidal profile.
+    void plan(float distance, float velocity, float acceleration, float jerk, float deceleration = 0);
+
+    //The setpoint t seconds into the move: the start before 0, the end after
+    //duration(). Call with t rising for O(1); going back costs a rescan.
+    ProfilePoint sample(float t);
+
+    float duration() const { return _duration; }
+    float distance() const { return _distance; }
+    float peakVelocity() const { return _peak; }
+
+private:
+    enum { MAX_SEGMENTS = 7 };
+
+    struct Segment {
+        float start;            //time
+        float p, v, a;          //state at start
+        float j;                //jerk throughout
+    };
+
+    void add(float duration, float acceleration, float jerk);
+
+    Segment _segments[MAX_SEGMENTS];
+    int _count;
+    int _current;               //segment of the last sample()
+    float _duration;
+    float _distance;
+    float _peak;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stdint.h>
+
+//Fixed size queue between one producer and one consumer, e.g. an interrupt and a
+//thread, without locking. Each side only writes its own index, and the element is
+//stored before the index that publishes it (single core, so program order is enough
+//as long as the compiler keeps it: the indices are volatile). N must be a power of 2;
+//one slot is left empty to tell full from empty.
+template <typename T, uint32_t N>
+class RingBuffer {
+public:
+    RingBuffer() : _head(0), _tail(0), _dropped(0) {}
+
+    //Producer side. False, and the item is counted as dropped, when full.
+    bool push(const T& item) {
+        uint32_t head = _head;
+        uint32_t next = (head + 1) & (N - 1);
+        if (next == _tail) {
+            _dropped++;
+            return false;
+        }
+        _items[head] = item;
+        _head = next;
+        return true;
+    }
+
+    //Consumer side. False when empty.
+    bool pop(T& item) {
+        uint32_t tail = _tail;
+        if (tail == _head) {
+            return false;
+        }
+        item = _items[tail];
+        _tail = (tail + 1) & (N - 1);
+        return true;
+    }
+
+    bool empty() const { return _head == _tail; }
+    uint32_t size() const { return (_head - _tail) & (N - 1); }
+    uint32_t dropped() const { return _dropped; }
+
+private:
+    static_assert((N & (N - 1)) == 0, "RingBuffer size must be a power of 2");
+
+    T _items[N];
+    volatile uint32_t _head;        //next slot to write, producer only
+    volatile uint32_t _tail;        //next slot to read, consumer only
+    volatile uint32_t _dropped;
+};
+
+#endif
@@ -0,0 +1,31 @@
+#include "scheduler.h"
+
+MotorScheduler::MotorScheduler(int rateHz)
+    : _loop(rateHz), _rate(rateHz), _count(0), _next(0) {
+}
+
+int MotorScheduler::add(Callback<void()> task) {
+    if (_count == SCHEDULER_MAX_TASKS) {
+        return -1;
+    }
+    _tasks[_count] = task;
+    return _count++;
+}
+
+void MotorScheduler::start() {
+    if (!_count) {
+        return;
+    }
+    _next = 0;
+    _loop.setRate(_rate*_count);
+    _loop.start(callback(this, &MotorScheduler::slot));
+}
+
+void MotorScheduler::stop() {
+    _loop.stop();
+}
+
+void MotorScheduler::slot() {
+    _tasks[_next]();
+    _next = (_next + 1 == _count) ? 0 : _next + 1;
+}
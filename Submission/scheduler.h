@@ -0,0 +1,41 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "mbed.h"
+#include "controlloop.h"
+
+#define SCHEDULER_MAX_TASKS 8
+
+//Control tasks for several motors at one rate, staggered across the period. The
+//ControlLoop underneath runs at rate times the number of tasks and each iteration
+//runs the next task in turn, so with N motors each tick starts period/N after the
+//one before instead of all N back to back in one interrupt. The longest the hall
+//ISRs can be held off is then one motor's tick, whatever N is.
+//
+//Add every task before start(). The loop's histograms (loop()) are per slot.
+class MotorScheduler {
+public:
+    MotorScheduler(int rateHz);
+
+    //Returns the task's slot, or -1 if there are SCHEDULER_MAX_TASKS already
+    int add(Callback<void()> task);
+
+    void start();
+    void stop();
+
+    int tasks() { return _count; }
+    int rate() { return _rate; }
+    float period() { return 1.0f/_rate; }   //seconds, between ticks of one task
+    ControlLoop& loop() { return _loop; }
+
+private:
+    void slot();
+
+    ControlLoop _loop;
+    Callback<void()> _tasks[SCHEDULER_MAX_TASKS];
+    int _rate;
+    int _count;
+    int _next;                      //slot to run, ticker interrupt only
+};
+
+#endif
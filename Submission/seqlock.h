@@ -0,0 +1,53 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdint.h>
+
+#include "mbed.h"
+
+//A value that one context writes and others take snapshots of, without locking
+//either side. The writer makes the sequence odd, copies the value in and makes it
+//even again; a reader copies the value out between two reads of the sequence and
+//tries again if a write was in progress or happened meanwhile. So every field of a
+//snapshot comes from the same write, where separate volatile globals can be caught
+//half updated (a double is two stores on the Cortex-M4).
+//
+//The writer never waits, so it can be an interrupt. Readers have to be preemptible
+//by it (threads, or lower priority interrupts): a reader that interrupted a write
+//would retry forever.
+template <typename T>
+class SeqLock {
+public:
+    SeqLock() : _sequence(0) {}
+
+    //One writer only
+    void write(const T& value) {
+        core_util_atomic_incr_u32((uint32_t*)&_sequence, 1);
+        __DMB();
+        _value = value;
+        __DMB();
+        core_util_atomic_incr_u32((uint32_t*)&_sequence, 1);
+    }
+
+    T read() const {
+        T value;
+        uint32_t before, after;
+        do {
+            before = _sequence;
+            __DMB();
+            value = _value;
+            __DMB();
+            after = _sequence;
+        } while ((before & 1) || before != after);
+        return value;
+    }
+
+    //Writes so far, to tell whether a snapshot is new
+    uint32_t writes() const { return _sequence >> 1; }
+
+private:
+    volatile uint32_t _sequence;
+    T _value;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#include "rtos.h"
+#include "sixstep.h"
+
+const int8_t driveTable[8] = {0x12,0x18,0x09,0x21,0x24,0x06,0x00,0x00};
+
+const int8_t stateMap[8] = {0x07,0x05,0x03,0x04,0x01,0x00,0x02,0x07};
+//const int8_t stateMap[8] = {0x07,0x01,0x03,0x02,0x05,0x00,0x04,0x07}; //Alternative if phase order of input or drive is reversed
+
+void homeSettle(Encoder& encoder, int timeoutMs) {
+    int32_t count = encoder.count();
+    int still = 0;
+    int dir = 0;
+    int32_t turns[2] = {count, count};  //the last two counts it turned back at
+    for (int t = 0; t < timeoutMs && still < HOME_SETTLE_MS; t += HOME_POLL_MS) {
+        Thread::wait(HOME_POLL_MS);
+        int32_t now = encoder.count();
+        still = (now == count) ? still + HOME_POLL_MS : 0;
+        int d = (now > count) - (now < count);
+        if (d != 0 && d != dir) {
+            turns[0] = turns[1];
+            turns[1] = count;
+            dir = d;
+        }
+        count = now;
+    }
+    if (still < HOME_SETTLE_MS) {
+        int32_t middle = (turns[0] + turns[1])/2;
+        for (int t = 0; t < HOME_SWING_MS; t += HOME_POLL_MS) {
+            Thread::wait(HOME_POLL_MS);
+            int32_t now = encoder.count();
+            bool passed = (count - middle)*(now - middle) <= 0;
+            count = now;
+            if (passed) break;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef SIXSTEP_H
+#define SIXSTEP_H
+
+#include "mbed.h"
+#include "encoder.h"
+
+//Six-step commutation tables and homing, shared by the motor in main.cpp and
+//Motor<Pins> (motor.h)
+
+//Mapping from sequential drive states to motor phase outputs
+/*
+State   L1  L2  L3
+0       H   -   L
+1       -   H   L
+2       L   H   -
+3       L   -   H
+4       -   L   H
+5       H   L   -
+6       -   -   -
+7       -   -   -
+*/
+//Drive state to output table
+extern const int8_t driveTable[8];
+
+//Mapping from interrupter inputs to sequential rotor states. 0x00 and 0x07 are not valid
+extern const int8_t stateMap[8];
+
+//Homing holds drive state 0 until the encoder has not moved for HOME_SETTLE_MS, at
+//most HOME_TIMEOUT_MS (the old fixed wait). Full duty: with less the rotor stops
+//further from the drive vector against friction, and the hall frame is off by that.
+//A rotor still swinging about the drive vector at the timeout is read as it passes
+//the middle of its swing, within HOME_SWING_MS: at the ends it can be a state either
+//side.
+#define HOME_POLL_MS 2
+#define HOME_SETTLE_MS 40
+#define HOME_TIMEOUT_MS 2000
+#define HOME_SWING_MS 500
+
+//With drive state 0 already on, wait until the rotor is at it as above, so the
+//photointerrupters can be read for orState. Blocks, so from a thread.
+void homeSettle(Encoder& encoder, int timeoutMs = HOME_TIMEOUT_MS);
+
+#endif
@@ -0,0 +1,21 @@
+#include "supply.h"
+
+#include <math.h>
+
+//A sample below this is taken to be no sample at all: nothing has triggered the ADC
+//yet, or the divider is missing
+#define SUPPLY_NO_SAMPLE 1.0f
+
+SupplySense::SupplySense(float nominal, float minimum, float tau, float dt)
+    : _nominal(nominal), _minimum(minimum), _alpha(1.0f - expf(-dt/tau)),
+      _voltage(0), _scale(1) {}
+
+void SupplySense::update(float volts) {
+    if (volts < SUPPLY_NO_SAMPLE) {
+        return;
+    }
+    //the first sample starts the filter off where the bus is
+    float v = (_voltage > 0) ? _voltage + _alpha*(volts - _voltage) : volts;
+    _voltage = v;
+    _scale = _nominal/((v > _minimum) ? v : _minimum);
+}
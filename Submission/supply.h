@@ -0,0 +1,38 @@
+#ifndef SUPPLY_H
+#define SUPPLY_H
+
+#include "mbed.h"
+
+//Supply voltage feed-forward, so the loops tuned on a full battery behave the same on
+//a flat one.
+//
+//A duty gives the windings that share of the bus voltage, so the velocity loop's
+//gain, the braking and the profile's feed-forward all shrink with the battery, and
+//sag with the current drawn. scale() is what to multiply a duty tuned at the nominal
+//voltage by to give the same winding voltage at the bus voltage there is.
+//
+//The bus is sampled with the phase currents (currentsense.h), by the DMA at every TIM1
+//trigger, and update() low-pass filters the latest sample at the control tick: fast
+//enough to follow the sag as the load changes, slow enough not to feed the PWM ripple
+//and noise into the duty.
+class SupplySense {
+public:
+    //Tuned at nominal V, filtered with time constant tau s, updated every dt s. Below
+    //minimum V the scale stops growing, as the duty would only saturate.
+    SupplySense(float nominal, float minimum, float tau, float dt);
+
+    //From the control tick, with the last bus sample in V
+    void update(float volts);
+
+    //Filtered bus voltage, V, or 0 before the first sample
+    float voltage() const { return _voltage; }
+
+    //nominal/voltage, 1 before the first sample
+    float scale() const { return _scale; }
+
+private:
+    float _nominal, _minimum, _alpha;
+    float _voltage, _scale;
+};
+
+#endif
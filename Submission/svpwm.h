@@ -0,0 +1,127 @@
+#ifndef SVPWM_H
+#define SVPWM_H
+
+#include <stdint.h>
+
+//Space vector PWM from a table built by the compiler.
+//
+//Angles are electrical, 65536 to the turn so uint16_t arithmetic wraps for free.
+//The high side duty of phase k is
+//
+//  1/2 + m*(sin(angle - k*120deg) + z)/sqrt(3),   z = -(max + min)/2 over the phases
+//
+//The common mode z turns the three sines into the space vector sequence, and m = 1
+//is the largest undistorted voltage, Vdc/sqrt(3) per phase. The table holds one turn
+//of (sin + z)/sqrt(3) for phase 0 in Q15, with 3*256 entries so the other phases are
+//a whole number of entries away, and is interpolated linearly between entries.
+
+#define SVPWM_TABLE_SIZE 768
+#define SVPWM_ONE 32768                 //Q15 duty of 1, and amplitude 1
+
+//Electrical angles
+#define ANGLE_30  ((uint16_t)5461)
+#define ANGLE_60  ((uint16_t)10923)
+#define ANGLE_90  ((uint16_t)16384)
+#define ANGLE_120 ((uint16_t)21845)
+
+/////////////////////////////////TABLE GENERATION////////////////////////////////////////////
+//C++11 constexpr: single expressions, so loops are recursion and the table is a
+//parameter pack expansion.
+
+constexpr double svPi() { return 3.14159265358979323846; }
+
+//Taylor series, accurate to 1e-12 on [-pi, pi]
+constexpr double svSinSeries(double x2, double term, int k) {
+    return (k > 12) ? term : term + svSinSeries(x2, -term*x2/((2*k + 2)*(2*k + 3)), k + 1);
+}
+constexpr double svSin(double x) {
+    return (x > svPi()) ? svSin(x - 2*svPi()) :
+           (x < -svPi()) ? svSin(x + 2*svPi()) : svSinSeries(x*x, x, 0);
+}
+
+constexpr double svMax(double a, double b, double c) { return (a > b) ? ((a > c) ? a : c) : ((b > c) ? b : c); }
+constexpr double svMin(double a, double b, double c) { return (a < b) ? ((a < c) ? a : c) : ((b < c) ? b : c); }
+
+constexpr double svPhase(double a, double b, double c) {
+    return (a - (svMax(a, b, c) + svMin(a, b, c))/2)/1.7320508075688772;
+}
+constexpr double svValue(double x) {
+    return svPhase(svSin(x), svSin(x - 2*svPi()/3), svSin(x + 2*svPi()/3));
+}
+constexpr int16_t svRound(double v) {
+    return (int16_t)((v >= 0) ? v*SVPWM_ONE + 0.5 : v*SVPWM_ONE - 0.5);
+}
+constexpr int16_t svpwmEntry(int i) {
+    return svRound(svValue(2*svPi()*i/SVPWM_TABLE_SIZE));
+}
+struct SvpwmEntry { static constexpr int16_t entry(int i) { return svpwmEntry(i); } };
+
+template <int... I> struct SvSeq {};
+
+template <typename A, typename B> struct SvConcat;
+template <int... A, int... B> struct SvConcat<SvSeq<A...>, SvSeq<B...> > {
+    typedef SvSeq<A..., (int)sizeof...(A) + B...> type;
+};
+
+//0 to N-1, split in halves so template depth is log2(N)
+template <int N> struct SvMakeSeq {
+    typedef typename SvConcat<typename SvMakeSeq<N/2>::type, typename SvMakeSeq<N - N/2>::type>::type type;
+};
+template <> struct SvMakeSeq<0> { typedef SvSeq<> type; };
+template <> struct SvMakeSeq<1> { typedef SvSeq<0> type; };
+
+//E::entry(i) for each i in S
+template <typename E, typename S> struct SvTable;
+template <typename E, int... I> struct SvTable<E, SvSeq<I...> > {
+    static const int16_t values[sizeof...(I)];
+};
+template <typename E, int... I> const int16_t SvTable<E, SvSeq<I...> >::values[sizeof...(I)] = {E::entry(I)...};
+
+typedef SvTable<SvpwmEntry, SvMakeSeq<SVPWM_TABLE_SIZE>::type> SvpwmTable;
+
+static_assert(svpwmEntry(0) == 0, "svpwm table: phase 0 crosses zero at 0 deg");
+static_assert(svpwmEntry(192) == 14189, "svpwm table: 3/(4*sqrt(3)) at 90 deg");
+
+/////////////////////////////////MODULATOR///////////////////////////////////////////////////
+
+//Table value at entry i plus frac/256 of the way to the next one
+inline int32_t svpwmLookup(uint32_t i, uint32_t frac) {
+    const int16_t* t = SvpwmTable::values;
+    int32_t a = t[i];
+    int32_t b = t[(i == SVPWM_TABLE_SIZE - 1) ? 0 : i + 1];
+    return a + (((b - a)*(int32_t)frac) >> 8);
+}
+
+//High side duty of each phase, Q15 with SVPWM_ONE always on, for a voltage vector
+//at angle with amplitude m (Q15, 0 to SVPWM_ONE)
+inline void svpwm(uint16_t angle, int32_t m, int32_t duty[3]) {
+    uint32_t x = (uint32_t)angle*3;
+    uint32_t i = x >> 8;
+    uint32_t frac = x & 0xFF;
+    duty[0] = SVPWM_ONE/2 + ((m*svpwmLookup(i, frac)) >> 15);
+    duty[1] = SVPWM_ONE/2 + ((m*svpwmLookup((i >= 256) ? i - 256 : i + 512, frac)) >> 15);
+    duty[2] = SVPWM_ONE/2 + ((m*svpwmLookup((i < 512) ? i + 256 : i - 512, frac)) >> 15);
+}
+
+//The same from the vector's components, Q15 with SVPWM_ONE for amplitude 1, alpha
+//along phase 0: svpwm(angle, m) is svpwmVector(m*sin(angle), -m*cos(angle)). Past
+//amplitude 1 the duties clip.
+#define SVPWM_SQRT3     56756           //sqrt(3) in Q15
+#define SVPWM_INV_SQRT3 18919           //1/sqrt(3) in Q15
+
+inline void svpwmVector(int32_t alpha, int32_t beta, int32_t duty[3]) {
+    int32_t b = (beta*SVPWM_SQRT3) >> 15;
+    int32_t v[3] = {alpha, (b - alpha) >> 1, (-b - alpha) >> 1};
+    int32_t mx = v[0], mn = v[0];
+    for (int k = 1; k < 3; k++) {
+        if (v[k] > mx) mx = v[k];
+        if (v[k] < mn) mn = v[k];
+    }
+    int32_t z = -((mx + mn) >> 1);
+    for (int k = 0; k < 3; k++) {
+        int32_t d = SVPWM_ONE/2 + (((v[k] + z)*SVPWM_INV_SQRT3) >> 15);
+        duty[k] = (d < 0) ? 0 : ((d > SVPWM_ONE) ? SVPWM_ONE : d);
+    }
+}
+
+#endif
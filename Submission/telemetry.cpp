@@ -0,0 +1,90 @@
+#include "telemetry.h"
+
+#define SIGNAL_TX_DONE 0x1
+
+//The one whose frame DMA1 channel 4 is sending
+static Telemetry* sending;
+
+static uint8_t* putU32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+    return p + 4;
+}
+
+static uint8_t* putFloat(uint8_t* p, float v) {
+    uint32_t u;
+    memcpy(&u, &v, sizeof(u));
+    return putU32(p, u);
+}
+
+Telemetry::Telemetry(PinName tx, PinName rx, int baud)
+    : _serial(tx, rx, baud), _thread(osPriorityLow), _sequence(0), _frames(0) {}
+
+void Telemetry::start() {
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+    DMA1_Channel4->CCR = 0;
+    DMA1_Channel4->CPAR = (uintptr_t)&USART1->TDR;
+    USART1->CR3 |= USART_CR3_DMAT;
+    sending = this;
+    DMA1->IFCR = DMA_IFCR_CGIF4;
+    NVIC_SetVector(DMA1_Channel4_IRQn, (uintptr_t)&Telemetry::sent);
+    NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+    _thread.start(callback(this, &Telemetry::run));
+}
+
+//length bytes of _frame, a byte to TDR each time it empties
+void Telemetry::send(int length) {
+    DMA1_Channel4->CMAR = (uintptr_t)_frame;
+    DMA1_Channel4->CNDTR = length;
+    DMA1_Channel4->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_TCIE | DMA_CCR_EN;
+}
+
+//The last byte is in TDR, from the DMA interrupt: the UART finishes it on its own,
+//and the next frame's first byte waits for TXE
+void Telemetry::sent() {
+    DMA1->IFCR = DMA_IFCR_CGIF4;
+    DMA1_Channel4->CCR = 0;
+    sending->_thread.signal_set(SIGNAL_TX_DONE);
+}
+
+//Up to a batch of samples into _payload, returns its length or 0 if there were none
+int Telemetry::pack() {
+    uint8_t* p = _payload + TELEMETRY_HEADER_BYTES;
+    int count = 0;
+    TelemetrySample s;
+    while (count < TELEMETRY_BATCH && _ring.pop(s)) {
+        p = putU32(p, s.time);
+        p = putFloat(p, s.position);
+        p = putFloat(p, s.velocity);
+        p = putFloat(p, s.delta);
+        p = putFloat(p, s.error);
+        count++;
+    }
+    if (!count) {
+        return 0;
+    }
+    uint16_t dropped = (uint16_t)_ring.dropped();
+    _payload[0] = TELEMETRY_FRAME_SAMPLES;
+    _payload[1] = _sequence++;
+    _payload[2] = (uint8_t)dropped;
+    _payload[3] = (uint8_t)(dropped >> 8);
+    _payload[4] = (uint8_t)count;
+    return (int)(p - _payload);
+}
+
+void Telemetry::run() {
+    while (1) {
+        if (_ring.size() < TELEMETRY_BATCH) {
+            Thread::wait(TELEMETRY_PERIOD_MS);
+        }
+        int length = pack();
+        if (length <= 0) {
+            continue;
+        }
+        send(frameEncode(_payload, length, _frame));
+        Thread::signal_wait(SIGNAL_TX_DONE);
+        _frames++;
+    }
+}
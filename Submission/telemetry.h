@@ -0,0 +1,75 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "mbed.h"
+#include "rtos.h"
+#include "ringbuffer.h"
+#include "frame.h"
+
+//Binary telemetry on its own UART, so the control loop never waits for a character.
+//
+//record() is called from the control tick and only copies the sample into a ring
+//buffer; when the ring is full the sample is dropped and counted. A low priority
+//thread takes up to TELEMETRY_BATCH samples at a time, packs them into a frame (see
+//frame.h) and has DMA1 channel 4, USART1_TX's request, feed it to the UART in the
+//background; the thread sleeps until the channel's transfer complete interrupt. The
+//F303K8 has no serial_tx_asynch() (DEVICE_SERIAL_ASYNCH) to do that instead.
+//
+//So the port has to be USART1: TX on D1 (PA_9) or PB_6. The RawSerial still does the
+//clock, pin and baud setup.
+//
+//Frame payload, little endian:
+//
+//  0  uint8   TELEMETRY_FRAME_SAMPLES
+//  1  uint8   sequence number, to spot lost frames
+//  2  uint16  samples dropped so far, wrapping
+//  4  uint8   sample count
+//  5  count x {uint32 time us, float position rev, float velocity rev/s,
+//              float delta, float velocity error rev/s}
+//
+//sim/tools/telemetry2csv.cpp turns a capture of the stream into CSV.
+
+#define TELEMETRY_BAUD 921600
+#define TELEMETRY_RING 64               //samples, 64 ms at the control rate
+#define TELEMETRY_BATCH 8
+#define TELEMETRY_PERIOD_MS 5           //wait for a batch to build up
+#define TELEMETRY_FRAME_SAMPLES 1
+#define TELEMETRY_HEADER_BYTES 5
+#define TELEMETRY_SAMPLE_BYTES 20
+
+struct TelemetrySample {
+    uint32_t time;                      //us_ticker_read()
+    float position;
+    float velocity;
+    float delta;
+    float error;
+};
+
+class Telemetry {
+public:
+    Telemetry(PinName tx, PinName rx, int baud = TELEMETRY_BAUD);
+
+    void start();
+
+    //From the control tick. Never waits.
+    void record(const TelemetrySample& sample) { _ring.push(sample); }
+
+    uint32_t dropped() const { return _ring.dropped(); }
+    uint32_t frames() const { return _frames; }
+
+private:
+    void run();
+    void send(int length);
+    static void sent();
+    int pack();
+
+    RawSerial _serial;
+    Thread _thread;
+    RingBuffer<TelemetrySample, TELEMETRY_RING> _ring;
+    uint8_t _sequence;
+    uint32_t _frames;
+    uint8_t _payload[TELEMETRY_HEADER_BYTES + TELEMETRY_BATCH*TELEMETRY_SAMPLE_BYTES + 2];
+    uint8_t _frame[FRAME_SIZE(TELEMETRY_HEADER_BYTES + TELEMETRY_BATCH*TELEMETRY_SAMPLE_BYTES)];
+};
+
+#endif
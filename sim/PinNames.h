@@ -0,0 +1,20 @@
+//NUCLEO_F303K8 pin names: the target's own list, so a pin the package doesn't have
+//fails to build here as it does for the board.
+
+#ifndef SIM_PINNAMES_H
+#define SIM_PINNAMES_H
+
+#include "../mbed-os/targets/TARGET_STM/TARGET_STM32F3/TARGET_NUCLEO_F303K8/PinNames.h"
+
+namespace sim {
+
+//Port pins the K8 package doesn't bring out, which the comparator models still take
+//their inputs from. They aren't PinNames, so firmware can only reach one through a
+//board setting (see firmware.cpp).
+const int PIN_PB_2 = 0x12;
+const int PIN_PB_11 = 0x1B;
+const int PIN_PB_15 = 0x1F;
+
+}
+
+#endif
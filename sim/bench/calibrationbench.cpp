@@ -0,0 +1,213 @@
+//Host test and benchmark for Submission/calibration.h, against two pages of RAM that
+//behave like the F303's flash: erase to 0xFF, program a halfword at a time, and no
+//more than that once the power is cut.
+//
+//  g++ -std=c++11 -O2 -Isim -ISubmission -o calibrationbench sim/bench/calibrationbench.cpp Submission/calibration.cpp sim/sim.cpp sim/mbed.cpp sim/stm32f3xx.cpp
+//
+//Each save in a run of them is cut short after every number of erase and program
+//operations it takes, with an erase cut halfway through the page, and a fresh store
+//then loads from what is left: it has to come back with the record from before the
+//save or the one from it, never anything else, and the new one once its checksum is
+//written. Records with a bit flipped or another version have to be passed over for
+//the other page, and a save to flash pages under the end of the image has to fail
+//without touching them. The benchmark is host nanoseconds per load().
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "calibration.h"
+
+namespace {
+
+const uint32_t PAGE_SIZE = 2048;
+
+uint8_t pages[2][PAGE_SIZE];
+long budget = -1;           //operations before the power is cut, -1 for never
+long operations = 0;
+
+bool ramErase(uintptr_t page) {
+    operations++;
+    if (budget == 0) {
+        //cut partway: the erase gets through half the page
+        memset((void*)page, 0xFF, PAGE_SIZE/2);
+        return false;
+    }
+    if (budget > 0) budget--;
+    memset((void*)page, 0xFF, PAGE_SIZE);
+    return true;
+}
+
+bool ramProgram(uintptr_t address, uint16_t halfword) {
+    operations++;
+    if (budget == 0) return false;
+    if (budget > 0) budget--;
+    uint16_t old;
+    memcpy(&old, (void*)address, 2);
+    old &= halfword;        //programming only clears bits
+    memcpy((void*)address, &old, 2);
+    return true;
+}
+
+CalibrationStorage ramStorage() {
+    CalibrationStorage s;
+    s.pages[0] = (uintptr_t)pages[0];
+    s.pages[1] = (uintptr_t)pages[1];
+    s.pageSize = PAGE_SIZE;
+    s.erase = ramErase;
+    s.program = ramProgram;
+    return s;
+}
+
+//A record that differs from the last in every field
+Calibration record(int n) {
+    Calibration c;
+    memset(&c, 0, sizeof(c));
+    c.orState = (int8_t)(n % 6);
+    c.kp = 0.05f + n*1e-3f;
+    c.ki = 0.06f + n*1e-3f;
+    c.kff = 1.0f/64 + n*1e-4f;
+    c.inertia = 2e-4f*(1 + n*0.01f);
+    for (int i = 0; i < ADVANCE_SPEEDS*ADVANCE_DUTIES; i++) {
+        c.advance[i] = 0.0625f*((n + i) % 9 - 4);
+    }
+    return c;
+}
+
+bool same(const Calibration& a, const Calibration& b) {
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+//What a store made after a reset loads: -1 for nothing, the record number, or -2 for
+//something that is neither of the two it could be
+int loadAfterReset(int before, int after) {
+    CalibrationStore store(ramStorage());
+    Calibration c;
+    if (!store.load(c)) return -1;
+    if (before >= 0 && same(c, record(before))) return before;
+    if (same(c, record(after))) return after;
+    return -2;
+}
+
+//Where the fields are in a page, by the record layout in calibration.cpp:
+//magic, version, size and sequence, then the Calibration, then the checksum
+const size_t VERSION_OFFSET = 4;
+const size_t CHECKSUM_OFFSET = 12 + sizeof(Calibration);
+
+uint32_t fnv(const uint8_t* p, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) h = (h ^ p[i])*16777619u;
+    return h;
+}
+
+double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+}
+
+int main() {
+    memset(pages, 0xFF, sizeof(pages));
+    int wrong = 0;
+
+    {
+        CalibrationStore store(ramStorage());
+        Calibration c;
+        if (store.load(c) || store.sequence() != 0) {
+            printf("  erased pages load a record\n");
+            wrong++;
+        }
+    }
+
+    //Power cuts through each save
+    const int saves = 12;
+    long cuts = 0, keptOld = 0, tookNew = 0;
+    uint8_t snapshot[2][PAGE_SIZE];
+    for (int n = 0; n < saves; n++) {
+        memcpy(snapshot, pages, sizeof(pages));
+        budget = -1;
+        operations = 0;
+        {
+            CalibrationStore store(ramStorage());
+            if (!store.save(record(n))) {
+                printf("  save %d failed\n", n);
+                wrong++;
+            }
+        }
+        //up to a cut just after the checksum, the last write, which has to load the new one
+        long total = operations;
+        for (long cut = 0; cut <= total; cut++) {
+            memcpy(pages, snapshot, sizeof(pages));
+            budget = cut;
+            CalibrationStore store(ramStorage());
+            store.save(record(n));
+            budget = -1;
+            int got = loadAfterReset(n - 1, n);
+            cuts++;
+            if (got == n) tookNew++;
+            else if (got == n - 1 && cut < total) keptOld++;
+            else if (wrong++ < 5) printf("  save %d cut after %ld operations loads %d\n", n, cut, got);
+        }
+        //and once it gets to the end
+        memcpy(pages, snapshot, sizeof(pages));
+        CalibrationStore store(ramStorage());
+        store.save(record(n));
+        if (loadAfterReset(n - 1, n) != n || store.sequence() != (uint32_t)n + 1) {
+            printf("  save %d not loaded\n", n);
+            wrong++;
+        }
+    }
+
+    //The newest record spoilt: a flipped bit, or another version with a good checksum
+    CalibrationStore store(ramStorage());
+    int newest = (store.sequence() % 2) ? 0 : 1;
+    int flips = 0, flipsLoaded = 0;
+    memcpy(snapshot, pages, sizeof(pages));
+    for (size_t bit = 0; bit < (CHECKSUM_OFFSET + 4)*8; bit++) {
+        memcpy(pages, snapshot, sizeof(pages));
+        pages[newest][bit/8] ^= (uint8_t)(1 << (bit % 8));
+        flips++;
+        if (loadAfterReset(saves - 2, saves - 1) != saves - 2) {
+            if (flipsLoaded++ < 5) printf("  bit %u flipped doesn't load the older record\n", (unsigned)bit);
+            wrong++;
+        }
+    }
+    memcpy(pages, snapshot, sizeof(pages));
+    uint16_t version = CALIBRATION_VERSION + 1;
+    memcpy(pages[newest] + VERSION_OFFSET, &version, 2);
+    uint32_t checksum = fnv(pages[newest], CHECKSUM_OFFSET);
+    memcpy(pages[newest] + CHECKSUM_OFFSET, &checksum, 4);
+    bool versionSkipped = loadAfterReset(saves - 2, saves - 1) == saves - 2;
+    if (!versionSkipped) wrong++;
+    memcpy(pages, snapshot, sizeof(pages));
+
+    //Flash pages the image reaches into, which a save mustn't erase
+    memset(sim::flash(), 0, 2*FLASH_PAGE_SIZE);
+    CalibrationStore imageStore(calibrationFlash(FLASH_BASE, FLASH_BASE + FLASH_PAGE_SIZE));
+    bool imageSpared = !imageStore.save(record(0)) && sim::flash()[0] == 0 && sim::flash()[FLASH_PAGE_SIZE] == 0;
+    if (!imageSpared) wrong++;
+
+    //Load time
+    const int rounds = 200000;
+    Calibration c;
+    volatile float sink = 0;
+    double start = now();
+    for (int i = 0; i < rounds; i++) {
+        store.load(c);
+        sink = sink + c.kp;
+    }
+    double ns = (now() - start)*1e9/rounds;
+
+    printf("Calibration store, %u byte record in %u byte pages\n\n", (unsigned)(CHECKSUM_OFFSET + 4),
+           (unsigned)PAGE_SIZE);
+    printf("power cuts:  %ld over %d saves, %ld kept the old record, %ld took the new one\n", cuts, saves,
+           keptOld, tookNew);
+    printf("bit flips:   %d in the newest record, %d not passed over\n", flips, flipsLoaded);
+    printf("version:     %s\n", versionSkipped ? "another passed over" : "another loaded");
+    printf("image:       %s\n", imageSpared ? "save under it refused" : "save under it erased or written");
+    printf("load:        %.1f ns\n", ns);
+    printf("%d wrong\n", wrong);
+    return wrong ? 1 : 0;
+}
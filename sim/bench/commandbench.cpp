@@ -0,0 +1,254 @@
+//Host fuzz test and benchmark for Submission/command.h.
+//
+//  g++ -std=c++11 -O2 -ISubmission -o commandbench sim/bench/commandbench.cpp Submission/command.cpp
+//
+//The fuzz part feeds the parser random words, some well formed, some mutated, some
+//noise, and checks each against the grammar written as std::regex: a word must give
+//PARSE_COMMAND exactly when it matches, and well formed words must come back with
+//the values they were made from. The benchmark is host nanoseconds per character
+//over a stream of valid commands; at 9600 baud a character arrives every ~1 ms.
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "command.h"
+
+namespace {
+
+uint32_t rngState = 12345;
+
+uint32_t rng() {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+int rngRange(int n) { return (int)(rng() % (uint32_t)n); }
+
+const std::regex grammar(
+    "[Rr]-?[0-9]{1,4}(\\.[0-9]{0,3})?([Vv]-?[0-9]{1,4}(\\.[0-9]{0,3})?)?"
+    "|[Dd]-?[0-9]{1,4}(\\.[0-9]{0,3})?([Vv]-?[0-9]{1,4}(\\.[0-9]{0,3})?)?"
+    "|[Vv]-?[0-9]{1,4}(\\.[0-9]{0,3})?"
+    "|[Tt]([A-Ga-g][#^]?[1-8]){1,16}"
+    "|[Kk][0-9A-Fa-f]{16}"
+    "|[Mm][0-2]?|[Pp][01]?|[Ll][01]?|[Aa]|[Hh]|[Ff]");
+
+//A number in the grammar, and its value
+std::string number(float& value) {
+    int intDigits = 1 + rngRange(4);
+    int fracDigits = rngRange(5) - 1;       //-1 for no point
+    std::string s = rngRange(3) ? "" : "-";
+    long mantissa = 0;
+    for (int i = 0; i < intDigits; i++) {
+        int d = rngRange(10);
+        s += (char)('0' + d);
+        mantissa = mantissa*10 + d;
+    }
+    double scale = 1;
+    if (fracDigits >= 0) {
+        s += '.';
+        for (int i = 0; i < fracDigits; i++) {
+            int d = rngRange(10);
+            s += (char)('0' + d);
+            mantissa = mantissa*10 + d;
+            scale *= 10;
+        }
+    }
+    value = (float)(mantissa/scale);
+    if (s[0] == '-') value = -value;
+    return s;
+}
+
+//A well formed command and what it should parse to
+std::string validWord(Command& expect) {
+    expect.option = -1;
+    expect.notes = 0;
+    expect.rotations = expect.angle = expect.velocity = 0;
+    expect.key = 0;
+    std::string s;
+    switch (rngRange(10)) {
+        case 0:
+            expect.type = COMMAND_ROTATE;
+            s = "R" + number(expect.rotations);
+            break;
+        case 1:
+            expect.type = COMMAND_VELOCITY;
+            s = "v" + number(expect.velocity);
+            break;
+        case 2:
+            expect.type = COMMAND_ROTATE_VELOCITY;
+            s = "r" + number(expect.rotations);
+            s += "V" + number(expect.velocity);
+            break;
+        case 3: {
+            expect.type = COMMAND_TUNE;
+            static const char letters[] = "ABCDEFG";
+            static const int pitch[] = {9, 11, 0, 2, 4, 5, 7};
+            expect.notes = (uint8_t)(1 + rngRange(COMMAND_TUNE_NOTES));
+            s = "T";
+            for (int i = 0; i < expect.notes; i++) {
+                int l = rngRange(7);
+                int p = pitch[l];
+                s += letters[l];
+                int acc = rngRange(3);
+                if (acc == 1) { s += '#'; p = (p + 1) % 12; }
+                if (acc == 2) { s += '^'; p = (p + 11) % 12; }
+                int length = 1 + rngRange(8);
+                s += (char)('0' + length);
+                expect.tune[i].pitch = (uint8_t)p;
+                expect.tune[i].length = (uint8_t)length;
+            }
+            break;
+        }
+        case 4: {
+            expect.type = COMMAND_KEY;
+            static const char hex[] = "0123456789abcdefABCDEF";
+            s = "K";
+            for (int i = 0; i < COMMAND_KEY_DIGITS; i++) {
+                char c = hex[rngRange(22)];
+                s += c;
+                int v = (c <= '9') ? c - '0' : ((c | 0x20) - 'a' + 10);
+                expect.key = (expect.key << 4) | (uint64_t)v;
+            }
+            break;
+        }
+        case 5:
+            expect.type = COMMAND_DRIVE;
+            expect.option = (int8_t)rngRange(3);
+            s = "M" + std::string(1, (char)('0' + expect.option));
+            break;
+        case 6:
+            expect.type = COMMAND_PROFILE;
+            expect.option = (int8_t)rngRange(2);
+            s = "p" + std::string(1, (char)('0' + expect.option));
+            break;
+        case 7:
+            expect.type = COMMAND_HOLD;
+            s = "D" + number(expect.angle);
+            if (rngRange(2)) s += "v" + number(expect.velocity);
+            break;
+        case 8:
+            expect.type = COMMAND_ADVANCE;
+            expect.option = (int8_t)rngRange(2);
+            s = "l" + std::string(1, (char)('0' + expect.option));
+            break;
+        default: {
+            static const uint8_t types[] = {COMMAND_AUTOTUNE, COMMAND_HISTOGRAM, COMMAND_FAULT};
+            static const char* words[] = {"A", "h", "f"};
+            int k = rngRange(3);
+            expect.type = types[k];
+            s = words[k];
+        }
+    }
+    return s;
+}
+
+//A valid word with a few characters changed, or noise
+std::string fuzzWord() {
+    static const char alphabet[] = "RVDTKMPLAHrvdtkmplahABCDEFGabcdefg0123456789.-#^xyz!\x01\xff";
+    Command ignore;
+    std::string s;
+    if (rngRange(4)) {
+        s = validWord(ignore);
+        int edits = 1 + rngRange(3);
+        for (int e = 0; e < edits; e++) {
+            size_t at = (size_t)rngRange((int)s.size() + 1);
+            char c = alphabet[rngRange((int)sizeof(alphabet) - 1)];
+            switch (rngRange(3)) {
+                case 0: s.insert(at, 1, c); break;
+                case 1: if (at < s.size()) s.erase(at, 1); break;
+                default: if (at < s.size()) s[at] = c;
+            }
+        }
+    }
+    else {
+        int n = 1 + rngRange(24);
+        for (int i = 0; i < n; i++) s += alphabet[rngRange((int)sizeof(alphabet) - 1)];
+    }
+    return s;
+}
+
+ParseResult parseWord(CommandParser& parser, const std::string& word, Command& out) {
+    for (size_t i = 0; i < word.size(); i++) {
+        if (parser.feed(word[i], out) != PARSE_MORE) return PARSE_ERROR;  //no word ends early
+    }
+    return parser.feed(rngRange(2) ? ' ' : '\r', out);
+}
+
+bool same(const Command& a, const Command& b) {
+    if (a.type != b.type || a.option != b.option || a.notes != b.notes || a.key != b.key) return false;
+    if (fabsf(a.rotations - b.rotations) > 1e-3f*fmaxf(1.0f, fabsf(b.rotations))) return false;
+    if (fabsf(a.angle - b.angle) > 1e-3f*fmaxf(1.0f, fabsf(b.angle))) return false;
+    if (fabsf(a.velocity - b.velocity) > 1e-3f*fmaxf(1.0f, fabsf(b.velocity))) return false;
+    for (int i = 0; i < a.notes; i++) {
+        if (a.tune[i].pitch != b.tune[i].pitch || a.tune[i].length != b.tune[i].length) return false;
+    }
+    return true;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+}
+
+int main() {
+    CommandParser parser;
+    Command out;
+
+    //Round trip
+    const int validRuns = 200000;
+    int wrong = 0;
+    for (int i = 0; i < validRuns; i++) {
+        Command expect;
+        std::string w = validWord(expect);
+        if (parseWord(parser, w, out) != PARSE_COMMAND || !same(out, expect)) {
+            if (wrong++ < 5) printf("  round trip failed: %s\n", w.c_str());
+        }
+    }
+
+    //Differential against the regex
+    const int fuzzRuns = 200000;
+    int disagree = 0, accepted = 0;
+    for (int i = 0; i < fuzzRuns; i++) {
+        std::string w = fuzzWord();
+        if (w.find_first_of(" \r\n\t") != std::string::npos) continue;
+        bool match = std::regex_match(w, grammar);
+        ParseResult r = parseWord(parser, w, out);
+        accepted += (r == PARSE_COMMAND);
+        if (match != (r == PARSE_COMMAND)) {
+            if (disagree++ < 5) printf("  disagrees with grammar: %s\n", w.c_str());
+        }
+    }
+
+    //Throughput over a stream of valid commands
+    std::string stream;
+    Command ignore;
+    while (stream.size() < (1 << 20)) {
+        stream += validWord(ignore);
+        stream += "\r\n";
+    }
+    const int rounds = 20;
+    volatile uint32_t commands = 0;
+    double start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < stream.size(); i++) {
+            if (parser.feed(stream[i], out) == PARSE_COMMAND) commands = commands + 1;
+        }
+    }
+    double ns = (now() - start)*1e9/(rounds*(double)stream.size());
+
+    printf("Command parser, %u byte state, no buffer\n\n", (unsigned)sizeof(CommandParser));
+    printf("round trip:  %d words, %d wrong\n", validRuns, wrong);
+    printf("fuzz:        %d words, %d accepted, %d disagree with the grammar\n", fuzzRuns, accepted, disagree);
+    printf("throughput:  %.1f ns/char, %.0f Mchar/s (%u commands)\n", ns, 1e3/ns, (unsigned)commands/rounds);
+    return (wrong || disagree) ? 1 : 0;
+}
@@ -0,0 +1,157 @@
+//Host benchmark for Submission/foc.h: cost and accuracy of one FOC step (Clarke,
+//Park, two PI current loops, inverse Park, SVPWM duties) in Q15 against the same
+//step in float, and the transforms against double.
+//
+//  g++ -std=c++11 -O2 -ISubmission -o focbench sim/bench/focbench.cpp
+//
+//Speed is host nanoseconds per step, only meaningful relative to the other rows.
+//The step has to fit in a 40 us PWM period at 25 kHz, 2880 cycles of the F303; the
+//Q15 version is integer multiplies and two table loads, the float one needs
+//sinf()/cosf() on top, each a software routine of a few hundred cycles there.
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include <vector>
+
+#include "foc.h"
+
+namespace {
+
+const double SQRT3 = 1.7320508075688772;
+const double TWO_PI = 6.283185307179586;
+
+//One step's inputs: phase a/b currents and the d axis angle
+struct Input {
+    int32_t ia, ib;
+    uint16_t angle;
+};
+
+struct Output {
+    int32_t duty[3];
+};
+
+const PidConfig current = pidConfig(3.0f, 13000.0f, 0.0f, 1.0f/25000, -1.0f, 1.0f);
+
+//Float current loop with the same structure as Foc
+class FloatFoc {
+public:
+    FloatFoc() : _d(current), _q(current), _iqRef(0.2f) {}
+
+    Output update(const Input& in) {
+        float a = in.ia/32768.0f;
+        float b = in.ib/32768.0f;
+        float th = in.angle*(float)(TWO_PI/65536);
+        float s = sinf(th), c = cosf(th);
+        float alpha = a;
+        float beta = (a + 2*b)/(float)SQRT3;
+        float id = alpha*c + beta*s;
+        float iq = beta*c - alpha*s;
+        float vd = _d.update(0.0f, id);
+        float vq = _q.update(_iqRef, iq);
+        float va = vd*c - vq*s;
+        float vb = vd*s + vq*c;
+        float v[3] = {va, -0.5f*va + 0.5f*(float)SQRT3*vb, -0.5f*va - 0.5f*(float)SQRT3*vb};
+        float z = -0.5f*(fmaxf(v[0], fmaxf(v[1], v[2])) + fminf(v[0], fminf(v[1], v[2])));
+        Output o;
+        for (int k = 0; k < 3; k++) {
+            float d = 0.5f + (v[k] + z)/(float)SQRT3;
+            d = d < 0 ? 0 : (d > 1 ? 1 : d);
+            o.duty[k] = (int32_t)(d*SVPWM_ONE);
+        }
+        return o;
+    }
+
+private:
+    Pid<float> _d, _q;
+    float _iqRef;
+};
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+template <typename F>
+double timePerStep(const std::vector<Input>& inputs, F f) {
+    volatile int32_t sink = 0;
+    const int rounds = 200;
+    double start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            Output o = f(inputs[i]);
+            sink = sink + o.duty[0] + o.duty[1] + o.duty[2];
+        }
+    }
+    (void)sink;
+    return (now() - start)*1e9/(rounds*inputs.size());
+}
+
+//Largest d/q current error of clarke() and park() against double, in Q15 counts
+double transformError(const std::vector<Input>& inputs) {
+    double worst = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const Input& in = inputs[i];
+        int32_t alpha, beta, d, q;
+        clarke(in.ia, in.ib, alpha, beta);
+        park(alpha, beta, focSin(in.angle), focCos(in.angle), d, q);
+        double th = in.angle*TWO_PI/65536;
+        double ea = in.ia, eb = (in.ia + 2.0*in.ib)/SQRT3;
+        double ed = ea*cos(th) + eb*sin(th);
+        double eq = eb*cos(th) - ea*sin(th);
+        worst = fmax(worst, fmax(fabs(d - ed), fabs(q - eq)));
+    }
+    return worst;
+}
+
+//Largest duty difference between svpwmVector() and svpwm() for the same vector
+double modulatorMismatch() {
+    double worst = 0;
+    for (int a = 0; a < 65536; a += 7) {
+        int32_t m = 30000;
+        int32_t d0[3], d1[3];
+        svpwm((uint16_t)a, m, d0);
+        double th = a*TWO_PI/65536;
+        svpwmVector((int32_t)lrint(m*sin(th)), (int32_t)lrint(-m*cos(th)), d1);
+        for (int k = 0; k < 3; k++) worst = fmax(worst, fabs((double)d0[k] - d1[k]));
+    }
+    return worst;
+}
+
+}
+
+int main() {
+    //Balanced currents at a range of amplitudes and load angles, all rotor angles
+    std::vector<Input> inputs;
+    for (int amp = 1; amp <= 8; amp++) {
+        for (int a = 0; a < 65536; a += 97) {
+            double th = a*TWO_PI/65536 + 0.3*amp;
+            double i = amp*0.1*32767;
+            Input in;
+            in.ia = (int32_t)lrint(i*cos(th));
+            in.ib = (int32_t)lrint(i*cos(th - TWO_PI/3));
+            in.angle = (uint16_t)a;
+            inputs.push_back(in);
+        }
+    }
+
+    Foc foc(current);
+    foc.setCurrent(Pid<q15_t>::fromFloat(0.2f));
+    FloatFoc ffoc;
+    double nsFixed = timePerStep(inputs, [&](const Input& in) {
+        Output o;
+        foc.update(in.ia, in.ib, in.angle, o.duty);
+        return o;
+    });
+    double nsFloat = timePerStep(inputs, [&](const Input& in) { return ffoc.update(in); });
+
+    printf("FOC step, %d entry sine table (%.2f deg)\n\n", FOC_SIN_SIZE, 360.0/FOC_SIN_SIZE);
+    printf("%-8s %8s %8s\n", "version", "ns/step", "speedup");
+    printf("%-8s %8.1f %7.2fx\n", "float", nsFloat, 1.0);
+    printf("%-8s %8.1f %7.2fx\n", "q15", nsFixed, nsFloat/nsFixed);
+    printf("\nclarke+park max error: %.1f counts of 32768\n", transformError(inputs));
+    printf("svpwmVector vs svpwm max duty difference: %.1f counts of 32768\n", modulatorMismatch());
+    return 0;
+}
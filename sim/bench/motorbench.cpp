@@ -0,0 +1,237 @@
+//Host benchmark for Submission/motor.h and scheduler.h: how many motors fit on one
+//F303K8.
+//
+//  g++ -std=c++11 -O2 -Isim -ISubmission -o motorbench sim/bench/motorbench.cpp sim/sim.cpp sim/mbed.cpp sim/plant.cpp sim/stm32f3xx.cpp Submission/encoder.cpp Submission/sixstep.cpp Submission/controlloop.cpp Submission/scheduler.cpp
+//  ./motorbench [--target V] [--time S]
+//
+//Runs 1 to SCHEDULER_MAX_TASKS Motor<Pins> instances against as many plants in the
+//simulator, each at --target rev/s, with their 1 kHz ticks staggered by a
+//MotorScheduler and, for comparison, all in one ControlLoop interrupt. CPU load is
+//what a lowest priority thread doesn't get over the last second, so it counts the
+//modelled costs only (sim::Costs, see README.md): a lower bound, good for scaling.
+//The estimate at the end is how many motors would fit in BUDGET of the CPU at the
+//load per motor measured with all of them running.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "sim.h"
+#include "plant.h"
+#include "mbed.h"
+#include "rtos.h"
+#include "motor.h"
+#include "scheduler.h"
+
+namespace {
+
+const double BUDGET = 0.7;          //of the CPU, leaving the rest for threads and UARTs
+const int CONTROL_RATE_HZ = 1000;
+
+double target = 15.0;
+double simTime = 0;                 //per run, 0 for long enough to home and settle
+
+//Pins of bench motor K, off the real pin map so any number fit
+template <int K>
+struct BenchPins {
+    static const PinName I1 = (PinName)(0x100 + 0x10*K);
+    static const PinName I2 = (PinName)(0x101 + 0x10*K);
+    static const PinName I3 = (PinName)(0x102 + 0x10*K);
+    static const PinName CHA = (PinName)(0x103 + 0x10*K);
+    static const PinName CHB = (PinName)(0x104 + 0x10*K);
+    static const PinName L1L = (PinName)(0x105 + 0x10*K);
+    static const PinName L1H = (PinName)(0x106 + 0x10*K);
+    static const PinName L2L = (PinName)(0x107 + 0x10*K);
+    static const PinName L2H = (PinName)(0x108 + 0x10*K);
+    static const PinName L3L = (PinName)(0x109 + 0x10*K);
+    static const PinName L3H = (PinName)(0x10A + 0x10*K);
+};
+
+sim::MotorPins plantPins(int k) {
+    sim::MotorPins p;
+    int base = 0x100 + 0x10*k;
+    p.I1 = base;
+    p.I2 = base + 1;
+    p.I3 = base + 2;
+    p.CHA = base + 3;
+    p.CHB = base + 4;
+    p.L1L = base + 5;
+    p.L1H = base + 6;
+    p.L2L = base + 7;
+    p.L2H = base + 8;
+    p.L3L = base + 9;
+    p.L3H = base + 10;
+    p.IA = base + 11;
+    p.IB = base + 12;
+    p.V1 = p.V2 = p.V3 = p.VN = -1;
+    p.VBUS = -1;
+    return p;
+}
+
+//The bench handles motors of different Pins types through this
+struct AnyMotor {
+    virtual void home() = 0;
+    virtual void start(float velocity) = 0;
+    virtual void tick() = 0;
+    virtual float velocity() = 0;
+    virtual ~AnyMotor() {}
+};
+
+PidConfig velocityGains() {
+    PidConfig c = pidConfig(0.06f, 0.05f, 0.0f, 1.0f/CONTROL_RATE_HZ, 0.0f, 1.0f);
+    c.kff = 1.0f/64;
+    return c;
+}
+
+template <int K>
+struct BenchMotor : AnyMotor {
+    BenchMotor() : motor(velocityGains()) {}
+    void home() { motor.home(); }
+    void start(float velocity) { motor.start(velocity); }
+    void tick() { motor.tick(); }
+    float velocity() { return motor.velocity(); }
+    Motor<BenchPins<K> > motor;
+};
+
+template <int K>
+AnyMotor* makeMotor(int k) {
+    return (k == K) ? new BenchMotor<K>() : makeMotor<K + 1>(k);
+}
+template <>
+AnyMotor* makeMotor<SCHEDULER_MAX_TASKS>(int) {
+    return 0;
+}
+
+struct Result {
+    double load;            //of the CPU, last second
+    double latencyP99;      //hall edge to commutation, s, worst motor
+    long missed;
+    uint32_t jitterMax;     //us, control interrupt start
+    uint32_t overruns;
+    double speedError;      //worst |velocity - target| over the last second, rev/s
+};
+
+//One run's firmware side, built fresh in each forked child
+int motors;
+bool staggered;
+double runTime;
+std::vector<AnyMotor*> bench;
+MotorScheduler* scheduler;
+ControlLoop* together;
+volatile sim::Time idle;
+volatile bool measuring;
+Result result;
+
+void tickAll() {
+    for (int k = 0; k < motors; k++) bench[k]->tick();
+}
+
+void idleThread() {
+    while (1) {
+        sim::advance(sim::US);
+        if (measuring) idle = idle + sim::US;
+    }
+}
+
+void entry() {
+    for (int k = 0; k < motors; k++) bench[k]->home();
+    for (int k = 0; k < motors; k++) bench[k]->start((float)target);
+    if (staggered) scheduler->start();
+    else together->start(tickAll);
+
+    Thread idler(osPriorityIdle);
+    idler.start(idleThread);
+    sim::Time end = sim::fromSeconds(runTime);
+    Thread::wait((uint32_t)((end - sim::now())/sim::MS) - 1000);
+    ControlLoop& loop = staggered ? scheduler->loop() : *together;
+    loop.clear();
+    measuring = true;
+    sim::Time start = sim::now();
+    result.speedError = 0;
+    for (int i = 0; i < 100; i++) {
+        Thread::wait(10);
+        for (int k = 0; k < motors; k++) {
+            result.speedError = std::max(result.speedError, fabs(bench[k]->velocity() - target));
+        }
+    }
+    measuring = false;
+    result.load = 1.0 - (double)idle/(sim::now() - start);
+    result.jitterMax = loop.jitter().max;
+    result.overruns = loop.overruns();
+}
+
+Result runBench(int n, bool stagger, double time) {
+    Result r;
+    memset(&r, 0, sizeof(r));
+    sim::isolated<Result>([n, stagger, time](Result& out) {
+        motors = n;
+        runTime = time;
+        staggered = stagger;
+        std::vector<sim::Plant*> plants;
+        for (int k = 0; k < n; k++) {
+            plants.push_back(new sim::Plant(sim::defaultParams(), plantPins(k)));
+            plants.back()->start();
+            bench.push_back(makeMotor<0>(k));
+        }
+        scheduler = new MotorScheduler(CONTROL_RATE_HZ);
+        together = new ControlLoop(CONTROL_RATE_HZ);
+        for (int k = 0; k < n; k++) scheduler->add(callback(bench[k], &AnyMotor::tick));
+        memset(&result, 0, sizeof(result));
+        result.load = -1;
+        sim::run(sim::fromSeconds(time), entry);
+        for (int k = 0; k < n; k++) {
+            std::vector<float> lat = plants[k]->latencies();
+            if (!lat.empty()) {
+                std::sort(lat.begin(), lat.end());
+                result.latencyP99 = std::max(result.latencyP99, (double)lat[(size_t)(0.99*(lat.size() - 1))]);
+            }
+            result.missed += plants[k]->stats().missed;
+        }
+        out = result;
+    }, r);
+    return r;
+}
+
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--target" && i + 1 < argc) target = atof(argv[++i]);
+        else if (a == "--time" && i + 1 < argc) simTime = atof(argv[++i]);
+        else {
+            printf("usage: motorbench [--target V] [--time S]\n");
+            return 1;
+        }
+    }
+
+    printf("Motors at %g rev/s, %d Hz control, six-step through PwmOut\n\n", target, CONTROL_RATE_HZ);
+    printf("%6s %10s %7s %9s %7s %9s %8s %9s\n",
+           "motors", "ticks", "load", "lat_p99", "missed", "jitter", "overrun", "speed_err");
+    double perMotor = 0;
+    for (int n = 1; n <= SCHEDULER_MAX_TASKS; n++) {
+        //the motors home one after the other, then spin up
+        double time = (simTime > 0) ? simTime : 0.8*n + 4.0;
+        for (int s = 1; s >= 0; s--) {
+            Result r = runBench(n, s == 1, time);
+            if (r.load < 0) {
+                printf("%6d %10s crashed\n", n, s ? "staggered" : "together");
+                continue;
+            }
+            printf("%6d %10s %6.2f%% %8.1fu %7ld %8uu %8u %9.3f\n", n, s ? "staggered" : "together",
+                   100*r.load, r.latencyP99*1e6, r.missed, (unsigned)r.jitterMax, (unsigned)r.overruns,
+                   r.speedError);
+            if (s && n == SCHEDULER_MAX_TASKS) perMotor = r.load/n;
+        }
+    }
+    if (perMotor > 0) {
+        printf("\n%.2f%% of the CPU per motor: %d motors in %.0f%%\n", 100*perMotor, (int)(BUDGET/perMotor),
+               100*BUDGET);
+    }
+    return 0;
+}
@@ -0,0 +1,234 @@
+//Host benchmark for Submission/pid.h: speed and accuracy of Pid<float>, Pid<q31_t> and
+//Pid<q15_t> against the same controller in double, which is what calculateVelocity()
+//used to do.
+//
+//  g++ -std=c++11 -O2 -ISubmission -o pidbench sim/bench/pidbench.cpp
+//
+//Accuracy comes from running each controller in closed loop on the velocity plant the
+//simulator uses (about 64 rev/s per unit duty, 1.2 s time constant) through a
+//sequence of setpoint steps and a load step. Speed is host nanoseconds per update,
+//only meaningful relative to the double row: on the F303 double is soft-float and
+//float is one instruction per operation, so the gap there is much wider. The
+//ControlLoop exec histogram (H) gives the real numbers on the board.
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include <vector>
+
+#include "pid.h"
+
+namespace {
+
+const double FULL_SCALE = 64.0;         //rev/s per unit
+const double PLANT_GAIN = 64.0;
+const double PLANT_TAU = 1.2;
+const float DT = 0.001f;
+const int STEPS = 12000;
+
+//Same algorithm as Pid<float>, in double
+class DoublePid {
+public:
+    DoublePid(const PidConfig& c) : _integral(0), _derivative(0), _last(0), _first(true) {
+        _kp = c.kp;
+        _ki = (double)c.ki*c.dt;
+        _kff = c.kff;
+        _kd = (double)c.kd/c.dt;
+        _alpha = (double)c.dt/((double)c.dt + c.derivativeTau);
+        _min = c.outMin;
+        _max = c.outMax;
+    }
+    double update(double setpoint, double measurement, double feedForward) {
+        double e = setpoint - measurement;
+        if (_first) {
+            _last = measurement;
+            _first = false;
+        }
+        double raw = -_kd*(measurement - _last);
+        _last = measurement;
+        _derivative += _alpha*(raw - _derivative);
+        double integral = _integral + _ki*e;
+        if (integral > _max) integral = _max;
+        else if (integral < _min) integral = _min;
+        double out = _kp*e + integral + _derivative + _kff*feedForward;
+        if (out > _max) {
+            out = _max;
+            if (integral < _integral) _integral = integral;
+        }
+        else if (out < _min) {
+            out = _min;
+            if (integral > _integral) _integral = integral;
+        }
+        else {
+            _integral = integral;
+        }
+        return out;
+    }
+private:
+    double _kp, _ki, _kd, _kff, _alpha, _min, _max;
+    double _integral, _derivative, _last;
+    bool _first;
+};
+
+//Per-unit velocity loop: error in units of FULL_SCALE, output is the duty
+PidConfig velocityConfig() {
+    PidConfig c = pidConfig(0.06f*FULL_SCALE, 0.05f*FULL_SCALE, 0.0005f*FULL_SCALE, DT, 0.0f, 0.98f);
+    c.kff = 0.9f;
+    c.derivativeTau = 0.01f;
+    return c;
+}
+
+double setpointAt(int k) {
+    if (k < 3000) return 15.0;
+    if (k < 6000) return 45.0;
+    if (k < 9000) return 5.0;
+    return 30.0;
+}
+
+double loadAt(int k) {
+    return k >= 10500 ? 8.0 : 0.0;      //rev/s of speed lost to a load step
+}
+
+double plantStep(double v, double u, int k) {
+    double target = PLANT_GAIN*u - loadAt(k);
+    return v + (target - v)*(DT/PLANT_TAU);
+}
+
+struct Trace {
+    std::vector<double> out;
+    std::vector<double> velocity;
+};
+
+template <typename C, typename F>
+Trace closedLoop(C& pid, F update) {
+    Trace t;
+    double v = 0;
+    for (int k = 0; k < STEPS; k++) {
+        double u = update(pid, setpointAt(k), v);
+        v = plantStep(v, u, k);
+        t.out.push_back(u);
+        t.velocity.push_back(v);
+    }
+    return t;
+}
+
+struct Accuracy {
+    double outMax, outRms, velMax;
+};
+
+Accuracy compare(const Trace& a, const Trace& ref) {
+    Accuracy r = {0, 0, 0};
+    for (size_t i = 0; i < a.out.size(); i++) {
+        double e = fabs(a.out[i] - ref.out[i]);
+        r.outMax = e > r.outMax ? e : r.outMax;
+        r.outRms += e*e;
+        double ev = fabs(a.velocity[i] - ref.velocity[i]);
+        r.velMax = ev > r.velMax ? ev : r.velMax;
+    }
+    r.outRms = sqrt(r.outRms/a.out.size());
+    return r;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+//Inputs for the timing runs, precomputed so only update() is timed
+std::vector<double> measurements;
+
+template <typename C, typename V>
+double timePerUpdate(C& pid, const std::vector<V>& sp, const std::vector<V>& meas) {
+    volatile V sink = 0;
+    const int rounds = 200;
+    double start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < meas.size(); i++) {
+            sink = pid.update(sp[i], meas[i], sp[i]);
+        }
+    }
+    (void)sink;
+    return (now() - start)*1e9/(rounds*meas.size());
+}
+
+template <typename T>
+std::vector<T> convert(const std::vector<double>& x) {
+    std::vector<T> r;
+    for (size_t i = 0; i < x.size(); i++) r.push_back(Pid<T>::fromFloat((float)(x[i]/FULL_SCALE)));
+    return r;
+}
+
+std::vector<float> toFloat(const std::vector<double>& x) {
+    return std::vector<float>(x.begin(), x.end());
+}
+
+void row(const char* name, double ns, double ref, const Accuracy* a) {
+    if (a) {
+        printf("%-8s %8.1f %7.2fx %12.2e %12.2e %12.2e\n", name, ns, ref/ns, a->outMax, a->outRms, a->velMax);
+    }
+    else {
+        printf("%-8s %8.1f %7.2fx %12s %12s %12s\n", name, ns, 1.0, "-", "-", "-");
+    }
+}
+
+}
+
+int main() {
+    PidConfig c = velocityConfig();
+
+    DoublePid ref(c);
+    Trace refTrace = closedLoop(ref, [](DoublePid& p, double sp, double v) {
+        return p.update(sp/FULL_SCALE, v/FULL_SCALE, sp/FULL_SCALE);
+    });
+
+    Pid<float> pf(c);
+    Trace floatTrace = closedLoop(pf, [](Pid<float>& p, double sp, double v) {
+        return (double)p.update((float)(sp/FULL_SCALE), (float)(v/FULL_SCALE), (float)(sp/FULL_SCALE));
+    });
+
+    Pid<q31_t> p31(c);
+    Trace q31Trace = closedLoop(p31, [](Pid<q31_t>& p, double sp, double v) {
+        q31_t s = Pid<q31_t>::fromFloat((float)(sp/FULL_SCALE));
+        return (double)Pid<q31_t>::toFloat(p.update(s, Pid<q31_t>::fromFloat((float)(v/FULL_SCALE)), s));
+    });
+
+    Pid<q15_t> p15(c);
+    Trace q15Trace = closedLoop(p15, [](Pid<q15_t>& p, double sp, double v) {
+        q15_t s = Pid<q15_t>::fromFloat((float)(sp/FULL_SCALE));
+        return (double)Pid<q15_t>::toFloat(p.update(s, Pid<q15_t>::fromFloat((float)(v/FULL_SCALE)), s));
+    });
+
+    Accuracy aFloat = compare(floatTrace, refTrace);
+    Accuracy aQ31 = compare(q31Trace, refTrace);
+    Accuracy aQ15 = compare(q15Trace, refTrace);
+
+    //Timing inputs: the reference run's setpoints and measurements
+    std::vector<double> sp, meas;
+    for (int k = 0; k < STEPS; k++) {
+        sp.push_back(setpointAt(k));
+        meas.push_back(refTrace.velocity[k]);
+    }
+    std::vector<double> spPu, measPu;
+    for (int k = 0; k < STEPS; k++) {
+        spPu.push_back(sp[k]/FULL_SCALE);
+        measPu.push_back(meas[k]/FULL_SCALE);
+    }
+    DoublePid td(c);
+    Pid<float> tf(c);
+    Pid<q31_t> t31(c);
+    Pid<q15_t> t15(c);
+    double nsDouble = timePerUpdate(td, spPu, measPu);
+    double nsFloat = timePerUpdate(tf, toFloat(spPu), toFloat(measPu));
+    double nsQ31 = timePerUpdate(t31, convert<q31_t>(sp), convert<q31_t>(meas));
+    double nsQ15 = timePerUpdate(t15, convert<q15_t>(sp), convert<q15_t>(meas));
+
+    printf("velocity loop, %d steps at %.0f Hz, errors against double in duty and rev/s\n\n", STEPS, 1/DT);
+    printf("%-8s %8s %8s %12s %12s %12s\n", "type", "ns/upd", "speedup", "out_max", "out_rms", "vel_max");
+    row("double", nsDouble, nsDouble, 0);
+    row("float", nsFloat, nsDouble, &aFloat);
+    row("q31", nsQ31, nsDouble, &aQ31);
+    row("q15", nsQ15, nsDouble, &aQ15);
+    return 0;
+}
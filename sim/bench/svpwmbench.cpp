@@ -0,0 +1,150 @@
+//Host benchmark for Submission/svpwm.h: cost and accuracy of the SVPWM interrupt's
+//work (rotor angle from the hall edge and encoder count, table lookup, compare
+//values) against the same modulation done with sinf() and against double.
+//
+//  g++ -std=c++11 -O2 -ISubmission -o svpwmbench sim/bench/svpwmbench.cpp
+//
+//Speed is host nanoseconds per interrupt, only meaningful relative to the other
+//rows: on the F303 sinf() is a software routine of a few hundred cycles per call and
+//the table version is a dozen loads and multiplies, so the gap there is wider. The
+//register writes and interrupt entry the simulator charges come on top.
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include <vector>
+
+#include "svpwm.h"
+
+namespace {
+
+const int ENCODER_COUNTS = 468;
+const int32_t ANGLE_PER_COUNT = (int32_t)(65536.0*65536.0/ENCODER_COUNTS);
+const uint32_t ARR = 1440;              //TIM1 at 25kHz center-aligned
+const double SQRT3 = 1.7320508075688772;
+const double TWO_PI = 6.283185307179586;
+
+//One interrupt's inputs
+struct Input {
+    uint16_t hallAngle;
+    int32_t counts;                     //encoder counts since the hall edge
+    int32_t amplitude;                  //Q15
+};
+
+//Low side compare values, as bridgePhases() writes them
+struct Output {
+    uint32_t ccr[3];
+};
+
+uint32_t compare(int32_t duty) {
+    if (duty <= 0) return ARR + 1;
+    if (duty >= SVPWM_ONE) return 0;
+    return ((SVPWM_ONE - duty)*ARR) >> 15;
+}
+
+//What interruptModulate() does between reading the encoder and writing the timer
+inline Output table(const Input& in) {
+    uint16_t rotor = in.hallAngle + (uint16_t)(((int64_t)in.counts*ANGLE_PER_COUNT) >> 16);
+    uint16_t vector = rotor + ANGLE_120 + ANGLE_90;
+    int32_t duty[3];
+    svpwm(vector, in.amplitude, duty);
+    Output o;
+    for (int k = 0; k < 3; k++) o.ccr[k] = compare(duty[k]);
+    return o;
+}
+
+//The same with the sines computed in float
+inline Output sine(const Input& in) {
+    float rotor = in.hallAngle*(float)(TWO_PI/65536) + in.counts*(float)(TWO_PI/ENCODER_COUNTS);
+    float vector = rotor + (float)(TWO_PI*210/360);
+    float s[3];
+    for (int k = 0; k < 3; k++) s[k] = sinf(vector - k*(float)(TWO_PI/3));
+    float mx = fmaxf(s[0], fmaxf(s[1], s[2]));
+    float mn = fminf(s[0], fminf(s[1], s[2]));
+    float m = in.amplitude/(float)SVPWM_ONE;
+    Output o;
+    for (int k = 0; k < 3; k++) {
+        float d = 0.5f + m*(s[k] - 0.5f*(mx + mn))/(float)SQRT3;
+        o.ccr[k] = (uint32_t)((1.0f - d)*ARR);
+    }
+    return o;
+}
+
+//Exact low side duty for comparison
+void exact(const Input& in, double duty[3]) {
+    double rotor = in.hallAngle*TWO_PI/65536 + in.counts*TWO_PI/ENCODER_COUNTS;
+    double vector = rotor + TWO_PI*210/360;
+    double s[3];
+    for (int k = 0; k < 3; k++) s[k] = sin(vector - k*TWO_PI/3);
+    double mx = fmax(s[0], fmax(s[1], s[2]));
+    double mn = fmin(s[0], fmin(s[1], s[2]));
+    double m = (double)in.amplitude/SVPWM_ONE;
+    for (int k = 0; k < 3; k++) duty[k] = 1.0 - (0.5 + m*(s[k] - 0.5*(mx + mn))/SQRT3);
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+template <typename F>
+double timePerCall(const std::vector<Input>& inputs, F f) {
+    volatile uint32_t sink = 0;
+    const int rounds = 200;
+    double start = now();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            Output o = f(inputs[i]);
+            sink = sink + o.ccr[0] + o.ccr[1] + o.ccr[2];
+        }
+    }
+    (void)sink;
+    return (now() - start)*1e9/(rounds*inputs.size());
+}
+
+//Largest compare value error against exact, in degrees of vector angle and in counts
+template <typename F>
+double maxError(const std::vector<Input>& inputs, F f) {
+    double worst = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        Output o = f(inputs[i]);
+        double d[3];
+        exact(inputs[i], d);
+        for (int k = 0; k < 3; k++) {
+            double e = fabs(o.ccr[k] - d[k]*ARR);
+            worst = e > worst ? e : worst;
+        }
+    }
+    return worst;
+}
+
+}
+
+int main() {
+    //A rotor turning through every hall sector at a range of amplitudes
+    std::vector<Input> inputs;
+    for (int a = 1; a <= 8; a++) {
+        for (int c = 0; c < 6*ENCODER_COUNTS; c++) {
+            Input in;
+            int sector = (c*6/ENCODER_COUNTS) % 6;
+            in.hallAngle = (uint16_t)(sector*ANGLE_60 - ANGLE_30);
+            in.counts = c % (ENCODER_COUNTS/6);
+            in.amplitude = a*SVPWM_ONE/8;
+            inputs.push_back(in);
+        }
+    }
+
+    double nsTable = timePerCall(inputs, table);
+    double nsSine = timePerCall(inputs, sine);
+    double errTable = maxError(inputs, table);
+    double errSine = maxError(inputs, sine);
+
+    printf("SVPWM interrupt body, %u count period, %d table entries (%.2f deg)\n\n",
+           (unsigned)ARR, SVPWM_TABLE_SIZE, 360.0/SVPWM_TABLE_SIZE);
+    printf("%-8s %8s %8s %14s\n", "version", "ns/irq", "speedup", "max_err_counts");
+    printf("%-8s %8.1f %7.2fx %14.2f\n", "sinf", nsSine, 1.0, errSine);
+    printf("%-8s %8.1f %7.2fx %14.2f\n", "table", nsTable, nsSine/nsTable, errTable);
+    return 0;
+}
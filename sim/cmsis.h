@@ -0,0 +1,9 @@
+//Host stand-in for cmsis.h, which the target's PinNames.h includes: the device
+//registers are the models in stm32f3xx.h.
+
+#ifndef SIM_CMSIS_H
+#define SIM_CMSIS_H
+
+#include "stm32f3xx.h"
+
+#endif
@@ -0,0 +1,36 @@
+//Builds the firmware in Submission/ against the host mbed shim. It lives in its own
+//namespace so that its printf() goes to the simulated UART (see mbed.cpp) and its
+//main() doesn't clash with the simulator's.
+
+#include "mbed.h"
+#include "rtos.h"
+#include "mbed_events.h"
+#include "firmware.h"
+
+//mbed_app.json's settings for the simulated board. Its plant is wired for the hall
+//capture, I1 on D3 and L2L on D2 (plant.cpp), and has the comparator inputs, PB_11
+//included, so the "sensorless" scenario can take over from a failed photointerrupter.
+//It doesn't model PB_0 also being I1.
+#define MBED_CONF_APP_HALL_CAPTURE 1
+#define MBED_CONF_APP_SENSORLESS_FALLBACK 1
+#define MBED_CONF_APP_BEMF_V3_PIN ((PinName)sim::PIN_PB_11)
+
+namespace firmware {
+#include "../Submission/encoder.cpp"
+#include "../Submission/sixstep.cpp"
+#include "../Submission/controlloop.cpp"
+#include "../Submission/bridge.cpp"
+#include "../Submission/currentsense.cpp"
+#include "../Submission/profile.cpp"
+#include "../Submission/autotune.cpp"
+#include "../Submission/command.cpp"
+#include "../Submission/telemetry.cpp"
+#include "../Submission/melody.cpp"
+#include "../Submission/fault.cpp"
+#include "../Submission/bemf.cpp"
+#include "../Submission/hallcapture.cpp"
+#include "../Submission/advance.cpp"
+#include "../Submission/supply.cpp"
+#include "../Submission/calibration.cpp"
+#include "../Submission/main.cpp"
+}
@@ -0,0 +1,40 @@
+//Firmware entry points and globals that the simulator scenarios drive directly.
+//Keep in step with Submission/main.cpp.
+
+#ifndef SIM_FIRMWARE_H
+#define SIM_FIRMWARE_H
+
+#include <stdint.h>
+
+#include "mbed.h"
+
+namespace firmware {
+
+//stdio printf() from the firmware goes out of the simulated UART
+int printf(const char* format, ...);
+
+extern volatile float delta;
+extern volatile float targetVelocity;
+extern volatile float maxVelocity;
+extern volatile float numOfRotations;
+extern volatile int8_t lead;
+extern volatile bool commutate;         //set once the motor is homed and handed to the ISRs
+extern int8_t orState;                  //rotor state motorHome() found
+extern volatile int requestedDrive;     //0 six-step, 1 SVPWM, 2 FOC
+extern volatile int profileShape;       //0 trapezoidal, 1 S-curve
+extern volatile bool supplyFeedForward;
+
+#include "../Submission/fault.h"
+extern FaultMonitor faultMonitor;
+#include "../Submission/calibration.h"
+extern Calibration calibration;         //as loaded at reset or last saved
+
+int main();
+void setVelocity();
+void setRotation();
+void setRotationVelocity();
+void gateSupplyFeedForward(float inertia);
+
+}
+
+#endif
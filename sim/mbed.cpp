@@ -0,0 +1,28 @@
+#include "mbed.h"
+#include "rtos.h"
+
+//wait_us() from platform/mbed_wait_api_rtos.cpp: sleep whole milliseconds in the
+//RTOS, busy-wait the rest
+void wait_us(int us) {
+    sim::Time start = sim::now();
+    int ms = us/1000;
+    if (ms > 0 && core_util_are_interrupts_enabled() && !sim::inIsr() && sim::currentTask()) {
+        Thread::wait(ms);
+    }
+    sim::Time end = start + (sim::Time)us*sim::US;
+    if (sim::now() < end) sim::advance(end - sim::now());
+}
+
+namespace firmware {
+
+int printf(const char* format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    for (int i = 0; i < n && i < (int)sizeof(buf) - 1; i++) sim::uartPutc(buf[i]);
+    return n;
+}
+
+}
@@ -0,0 +1,474 @@
+//Host stand-in for mbed.h, just enough of the mbed OS 5 API for Submission/ to build
+//against the simulation kernel. Pins, timers and the UART are backed by sim/sim.h;
+//their CPU cost comes from sim::costs().
+
+#ifndef SIM_MBED_H
+#define SIM_MBED_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <cstdio>
+#include <functional>
+
+#include "sim.h"
+
+#define MBED_CONF_RTOS_PRESENT                      1
+#define MBED_CONF_PLATFORM_STDIO_BAUD_RATE          9600
+#define MBED_CONF_PLATFORM_DEFAULT_SERIAL_BAUD_RATE 9600
+
+#define MBED_ASSERT(expr) do { if (!(expr)) { fprintf(stderr, "MBED_ASSERT: %s\n", #expr); abort(); } } while (0)
+
+#include "PinNames.h"
+#include "stm32f3xx.h"
+
+//pin_function() from pinmap.h, with the pin data from the target's PinNames.h. The
+//mode and alternate function connect timer inputs in the sim (see stm32f3xx.cpp).
+#define GPIO_NOPULL         (0)
+#define GPIO_PULLUP         (1)
+#define GPIO_PULLDOWN       (2)
+#define GPIO_AF2_TIM3       (2)
+#define GPIO_AF6_TIM1       (6)
+
+inline void pin_function(PinName pin, int data) {
+    int mode = STM_PIN_MODE(data);
+    bool af = mode == STM_MODE_AF_PP || mode == STM_MODE_AF_OD;
+    sim::pinFunction(pin, af ? STM_PIN_AFNUM(data) : -1);
+}
+
+typedef uint32_t timestamp_t;
+
+inline uint32_t us_ticker_read() {
+    sim::advance(sim::costs().timerRead);
+    return (uint32_t)(sim::now()/sim::US);
+}
+
+inline void __disable_irq() { sim::disableIrq(); }
+inline void __enable_irq() { sim::enableIrq(); }
+inline void core_util_critical_section_enter() { sim::disableIrq(); }
+inline void core_util_critical_section_exit() { sim::enableIrq(); }
+inline bool core_util_are_interrupts_enabled() { return sim::irqEnabled(); }
+
+//Interrupts only come in where the firmware is charged CPU time, never inside these,
+//so plain read-modify-writes are atomic here
+inline uint32_t core_util_atomic_incr_u32(uint32_t* valuePtr, uint32_t delta) { return *valuePtr += delta; }
+inline uint32_t core_util_atomic_decr_u32(uint32_t* valuePtr, uint32_t delta) { return *valuePtr -= delta; }
+inline bool core_util_atomic_cas_u32(uint32_t* ptr, uint32_t* expectedCurrentValue, uint32_t desiredValue) {
+    if (*ptr != *expectedCurrentValue) {
+        *expectedCurrentValue = *ptr;
+        return false;
+    }
+    *ptr = desiredValue;
+    return true;
+}
+inline void __DMB() { __asm__ __volatile__("" ::: "memory"); }
+
+void wait_us(int us);
+inline void wait_ms(int ms) { wait_us(ms*1000); }
+inline void wait(float s) { wait_us((int)(s*1000000.0f)); }
+
+namespace mbed {
+
+/////////////////////////////////CALLBACK////////////////////////////////////////////////////
+
+template <typename F>
+class Callback;
+
+template <typename R, typename... A>
+class Callback<R(A...)> {
+public:
+    Callback() {}
+    Callback(R (*func)(A...)) {
+        if (func) _f = func;
+    }
+    template <typename T>
+    Callback(T* obj, R (T::*method)(A...)) {
+        _f = [obj, method](A... a) { return (obj->*method)(a...); };
+    }
+    template <typename T>
+    Callback(R (*func)(T*, A...), T* arg) {
+        _f = [func, arg](A... a) { return func(arg, a...); };
+    }
+    R call(A... a) const { return _f(a...); }
+    R operator()(A... a) const { return _f(a...); }
+    operator bool() const { return (bool)_f; }
+private:
+    std::function<R(A...)> _f;
+};
+
+template <typename R, typename... A>
+Callback<R(A...)> callback(R (*func)(A...)) { return Callback<R(A...)>(func); }
+
+template <typename T, typename R, typename... A>
+Callback<R(A...)> callback(T* obj, R (T::*method)(A...)) { return Callback<R(A...)>(obj, method); }
+
+/////////////////////////////////DIGITAL/////////////////////////////////////////////////////
+
+class DigitalOut {
+public:
+    DigitalOut(PinName pin, int value = 0) : _pin(&sim::pin(pin)) { _pin->level = value; }
+    void write(int value) { _pin->level = value; }
+    int read() { return _pin->level; }
+    DigitalOut& operator=(int value) { write(value); return *this; }
+    operator int() { return read(); }
+private:
+    sim::Pin* _pin;
+};
+
+class DigitalIn {
+public:
+    DigitalIn(PinName pin) : _pin(&sim::pin(pin)) {}
+    DigitalIn(PinName pin, PinMode) : _pin(&sim::pin(pin)) {}
+    int read() {
+        sim::advance(sim::costs().gpioRead);
+        return _pin->level;
+    }
+    void mode(PinMode) {}
+    operator int() { return read(); }
+private:
+    sim::Pin* _pin;
+};
+
+//Behaves like the STM32 gpio_irq_api.c: the EXTI line belongs to the last InterruptIn
+//created on the pin, edges coalesce while the interrupt is pending, and the handler
+//picks rise() or fall() from the pin level when the ISR runs.
+class InterruptIn : public sim::InterruptSink {
+public:
+    InterruptIn(PinName pin) : _name(pin), _pin(&sim::pin(pin)), _riseOn(false), _fallOn(false),
+                               _pending(false), _latched(false), _enabled(true) {
+        _pin->irq = this;
+    }
+    virtual ~InterruptIn() { if (_pin->irq == this) _pin->irq = 0; }
+
+    int read() {
+        sim::advance(sim::costs().gpioRead);
+        return _pin->level;
+    }
+    operator int() { return read(); }
+    void mode(PinMode) {}
+
+    void rise(Callback<void()> func) { _rise = func; _riseOn = (bool)func; }
+    void fall(Callback<void()> func) { _fall = func; _fallOn = (bool)func; }
+    template <typename T, typename M> void rise(T* obj, M method) { rise(Callback<void()>(obj, method)); }
+    template <typename T, typename M> void fall(T* obj, M method) { fall(Callback<void()>(obj, method)); }
+
+    void enable_irq() {
+        _enabled = true;
+        if (_latched) {
+            _latched = false;
+            request();
+        }
+    }
+    void disable_irq() { _enabled = false; }
+
+    virtual void pinChanged(int) {
+        if (!(_pin->level ? _riseOn : _fallOn)) return;
+        if (!_enabled) {
+            _latched = true;
+            return;
+        }
+        request();
+    }
+
+private:
+    void request() {
+        if (_pending) return;
+        _pending = true;
+        sim::pendIsr([this]() {
+            _pending = false;
+            if (_pin->level) {
+                if (_rise) _rise();
+            }
+            else if (_fall) {
+                _fall();
+            }
+        });
+    }
+
+    PinName _name;
+    sim::Pin* _pin;
+    Callback<void()> _rise;
+    Callback<void()> _fall;
+    bool _riseOn, _fallOn;
+    bool _pending, _latched, _enabled;
+};
+
+/////////////////////////////////ANALOG//////////////////////////////////////////////////////
+
+//Reads the voltage the plant puts on the pin, 3.3V full scale. On the board the
+//constructor also enables the ADC clock and puts the pin in analog mode, which is
+//all firmware that programs the ADC registers itself needs from it.
+class AnalogIn {
+public:
+    AnalogIn(PinName pin) : _pin(&sim::pin(pin)) {}
+
+    float read() {
+        sim::advance(sim::costs().adcRead);
+        float v = _pin->voltage/3.3f;
+        return v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+    }
+    unsigned short read_u16() { return (unsigned short)(read()*65535.0f); }
+    operator float() { return read(); }
+
+private:
+    sim::Pin* _pin;
+};
+
+/////////////////////////////////PWM/////////////////////////////////////////////////////////
+
+//Pins on a modelled timer (sim/stm32f3xx.cpp) go through its registers the way
+//pwmout_api.c does, so firmware that also writes the timer directly sees the same
+//state; any other pin just gets its duty set.
+class PwmOut {
+public:
+    PwmOut(PinName pin) : _name(pin), _duty(0), _period_us(20000) {
+        sim::pin(pin);
+        _timer = sim::pwmoutInit(pin);
+        if (_timer) {
+            sim::pwmoutPeriod(pin, _period_us);
+            sim::pwmoutWrite(pin, 0);
+        }
+    }
+
+    void write(float value) {
+        if (value < 0.0f) value = 0.0f;
+        else if (value > 1.0f) value = 1.0f;
+        sim::advance(sim::costs().pwmWrite);
+        _duty = value;
+        if (_timer) sim::pwmoutWrite(_name, value);
+        else sim::writeDuty(_name, value);
+    }
+    float read() { return _duty; }
+
+    void period(float seconds) { period_us((int)(seconds*1000000.0f)); }
+    void period_ms(int ms) { period_us(ms*1000); }
+    void period_us(int us) {
+        sim::advance(sim::costs().pwmPeriod);
+        _period_us = us;
+        if (_timer) {
+            sim::pwmoutPeriod(_name, us);
+            sim::pwmoutWrite(_name, _duty);
+        }
+    }
+    void pulsewidth(float seconds) { pulsewidth_us((int)(seconds*1000000.0f)); }
+    void pulsewidth_ms(int ms) { pulsewidth_us(ms*1000); }
+    void pulsewidth_us(int us) { write((float)us/_period_us); }
+
+    PwmOut& operator=(float value) { write(value); return *this; }
+    PwmOut& operator=(PwmOut& rhs) { write(rhs.read()); return *this; }
+    operator float() { return read(); }
+
+private:
+    PinName _name;
+    float _duty;
+    int _period_us;
+    bool _timer;
+};
+
+/////////////////////////////////TIMERS//////////////////////////////////////////////////////
+
+class Timer {
+public:
+    Timer() : _running(false), _start(0), _elapsed(0) {}
+    void start() {
+        if (!_running) {
+            _start = sim::now();
+            _running = true;
+        }
+    }
+    void stop() {
+        _elapsed += slice();
+        _running = false;
+    }
+    void reset() {
+        _start = sim::now();
+        _elapsed = 0;
+    }
+    int read_us() {
+        sim::advance(sim::costs().timerRead);
+        return (int)((_elapsed + slice())/sim::US);
+    }
+    int read_ms() { return read_us()/1000; }
+    float read() { return (float)read_us()/1000000.0f; }
+    operator float() { return read(); }
+private:
+    sim::Time slice() { return _running ? sim::now() - _start : 0; }
+    bool _running;
+    sim::Time _start;
+    sim::Time _elapsed;
+};
+
+class Ticker {
+public:
+    Ticker() : _id(0), _delay(0), _next(0) {}
+    virtual ~Ticker() { detach(); }
+
+    void attach(Callback<void()> func, float t) { attach_us(func, (timestamp_t)(t*1000000.0f)); }
+    template <typename T, typename M> void attach(T* obj, M method, float t) { attach(Callback<void()>(obj, method), t); }
+    void attach_us(Callback<void()> func, timestamp_t t) {
+        detach();
+        _func = func;
+        _delay = (sim::Time)t*sim::US;
+        _next = sim::now() + _delay;
+        arm();
+    }
+    template <typename T, typename M> void attach_us(T* obj, M method, timestamp_t t) { attach_us(Callback<void()>(obj, method), t); }
+    void detach() {
+        sim::cancel(_id);
+        _id = 0;
+    }
+
+protected:
+    virtual void arm() {
+        _id = sim::at(_next, [this]() {
+            //Like Ticker::handler(): schedule the next event before calling out
+            _next += _delay;
+            arm();
+            _func();
+        }, true);
+    }
+    sim::EventId _id;
+    sim::Time _delay;
+    sim::Time _next;
+    Callback<void()> _func;
+};
+
+class Timeout : public Ticker {
+protected:
+    virtual void arm() {
+        _id = sim::at(_next, [this]() {
+            _id = 0;
+            _func();
+        }, true);
+    }
+};
+
+/////////////////////////////////SERIAL//////////////////////////////////////////////////////
+
+//Serial event flags, as serial_api.h
+#define SERIAL_EVENT_TX_SHIFT       (2)
+#define SERIAL_EVENT_TX_COMPLETE    (1 << (SERIAL_EVENT_TX_SHIFT + 0))
+#define SERIAL_EVENT_TX_ALL         (SERIAL_EVENT_TX_COMPLETE)
+
+typedef Callback<void(int)> event_callback_t;
+
+//What Serial and RawSerial share. RawSerial has no stdio stream or locking, so it is
+//the one that can be used from the RX interrupt. The port on USBTX is the console
+//(sim::uartPutc() and typeAt()); any other port only transmits, into sim::uartCapture(),
+//and has its USART registers set up for the firmware to drive (sim::serialInit()).
+//The F303K8 has no DEVICE_SERIAL_ASYNCH, so neither has this.
+class SerialBase {
+public:
+    enum IrqType { RxIrq = 0, TxIrq };
+
+    SerialBase(PinName tx, int baud) : _console(tx == USBTX), _tx(tx), _baud(baud), _txBusy(false) {
+        if (_console) sim::costs().baud = baud;
+        else sim::serialInit(tx, baud);
+    }
+
+    void baud(int baudrate) {
+        _baud = baudrate;
+        if (_console) sim::costs().baud = baudrate;
+        else sim::serialInit(_tx, baudrate);
+    }
+
+    int putc(int c) {
+        if (_console) {
+            sim::uartPutc(c);
+        }
+        else {
+            uint8_t b = (uint8_t)c;
+            sim::uartWriteAsync(&b, 1, _baud, []() {});
+        }
+        return c;
+    }
+    int puts(const char* s) {
+        while (*s) putc(*s++);
+        return 0;
+    }
+    int printf(const char* format, ...) {
+        char buf[256];
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(buf, sizeof(buf), format, args);
+        va_end(args);
+        for (int i = 0; i < n && i < (int)sizeof(buf) - 1; i++) putc(buf[i]);
+        return n;
+    }
+
+    int getc() { return sim::rxGet(); }
+    int readable() { return sim::rxReadable(); }
+    int writeable() { return 1; }
+
+    void attach(Callback<void()> func, IrqType type = RxIrq) {
+        if (type == RxIrq) sim::rxAttach([func]() { if (func) func(); });
+    }
+    template <typename T, typename M> void attach(T* obj, M method, IrqType type = RxIrq) {
+        attach(Callback<void()>(obj, method), type);
+    }
+
+#if DEVICE_SERIAL_ASYNCH
+    //Asynchronous transmit (serial_tx_asynch()): returns at once, -1 if a transfer is
+    //still going, and calls callback from an interrupt when the last byte is out
+    int write(const uint8_t* buffer, int length, const event_callback_t& callback,
+              int event = SERIAL_EVENT_TX_COMPLETE) {
+        if (_txBusy) return -1;
+        _txBusy = true;
+        sim::uartWriteAsync(buffer, length, _baud, [this, callback, event]() {
+            _txBusy = false;
+            if (callback && (event & SERIAL_EVENT_TX_COMPLETE)) callback(SERIAL_EVENT_TX_COMPLETE);
+        });
+        return 0;
+    }
+#endif
+
+private:
+    bool _console;
+    PinName _tx;
+    int _baud;
+    volatile bool _txBusy;
+};
+
+class Serial : public SerialBase {
+public:
+    Serial(PinName tx, PinName rx, const char* name = NULL, int baud = MBED_CONF_PLATFORM_DEFAULT_SERIAL_BAUD_RATE)
+        : SerialBase(tx, baud) {
+        (void)rx; (void)name;
+    }
+    Serial(PinName tx, PinName rx, int baud) : SerialBase(tx, baud) { (void)rx; }
+
+    //Only the "%s"-style token reads the firmware uses: collect one whitespace
+    //separated word, then hand it to vsscanf
+    int scanf(const char* format, ...) {
+        char buf[256];
+        int n = 0;
+        int c = getc();
+        while (c == ' ' || c == '\r' || c == '\n' || c == '\t') c = getc();
+        while (c != ' ' && c != '\r' && c != '\n' && c != '\t' && n < (int)sizeof(buf) - 1) {
+            buf[n++] = (char)c;
+            c = getc();
+        }
+        buf[n] = '\0';
+        va_list args;
+        va_start(args, format);
+        int r = vsscanf(buf, format, args);
+        va_end(args);
+        return r;
+    }
+};
+
+class RawSerial : public SerialBase {
+public:
+    RawSerial(PinName tx, PinName rx, int baud = MBED_CONF_PLATFORM_DEFAULT_SERIAL_BAUD_RATE) : SerialBase(tx, baud) {
+        (void)rx;
+    }
+};
+
+}
+
+using namespace mbed;
+
+#endif
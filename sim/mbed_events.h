@@ -0,0 +1,104 @@
+//Host stand-in for mbed_events.h: an EventQueue whose dispatch() runs on the
+//simulated clock. Only the calls the firmware uses: call(), call_in(), call_every(),
+//cancel() and dispatch().
+
+#ifndef SIM_MBED_EVENTS_H
+#define SIM_MBED_EVENTS_H
+
+#include <functional>
+#include <vector>
+
+#include "mbed.h"
+
+#define EVENTS_EVENT_SIZE 64
+#define EVENTS_QUEUE_SIZE (32*EVENTS_EVENT_SIZE)
+
+namespace events {
+
+class EventQueue {
+public:
+    EventQueue(unsigned size = EVENTS_QUEUE_SIZE, unsigned char* buffer = NULL) : _nextId(1), _break(false) {
+        (void)size; (void)buffer;
+    }
+
+    template <typename F, typename... A>
+    int call(F f, A... a) { return post(0, 0, std::bind(f, a...)); }
+    template <typename T, typename R, typename... B, typename... A>
+    int call(T* obj, R (T::*method)(B...), A... a) { return post(0, 0, std::bind(method, obj, a...)); }
+
+    template <typename F, typename... A>
+    int call_in(int ms, F f, A... a) { return post(ms, 0, std::bind(f, a...)); }
+    template <typename T, typename R, typename... B, typename... A>
+    int call_in(int ms, T* obj, R (T::*method)(B...), A... a) { return post(ms, 0, std::bind(method, obj, a...)); }
+
+    template <typename F, typename... A>
+    int call_every(int ms, F f, A... a) { return post(ms, ms, std::bind(f, a...)); }
+    template <typename T, typename R, typename... B, typename... A>
+    int call_every(int ms, T* obj, R (T::*method)(B...), A... a) { return post(ms, ms, std::bind(method, obj, a...)); }
+
+    void cancel(int id) {
+        for (size_t i = 0; i < _events.size(); i++) {
+            if (_events[i].id == id) {
+                _events.erase(_events.begin() + i);
+                return;
+            }
+        }
+    }
+
+    //Run events as they fall due, for ms milliseconds or forever with -1
+    void dispatch(int ms = -1) {
+        sim::Time end = (ms < 0) ? sim::FOREVER : sim::now() + (sim::Time)ms*sim::MS;
+        _break = false;
+        while (!_break) {
+            int next = -1;
+            for (size_t i = 0; i < _events.size(); i++) {
+                if (next < 0 || _events[i].due < _events[next].due) next = (int)i;
+            }
+            sim::Time t = sim::now();
+            if (next >= 0 && _events[next].due <= t) {
+                std::function<void()> fn = _events[next].fn;
+                if (_events[next].period) _events[next].due += (sim::Time)_events[next].period*sim::MS;
+                else _events.erase(_events.begin() + next);
+                fn();
+                continue;
+            }
+            if (t >= end) return;
+            sim::Time until = (next >= 0 && _events[next].due < end) ? _events[next].due : end;
+            sim::block(this, until == sim::FOREVER ? sim::FOREVER : until - t);
+        }
+    }
+    void dispatch_forever() { dispatch(-1); }
+    void break_dispatch() {
+        _break = true;
+        sim::wake(this);
+    }
+
+private:
+    struct Event {
+        int id;
+        sim::Time due;
+        int period;             //ms, 0 for once
+        std::function<void()> fn;
+    };
+
+    int post(int ms, int period, const std::function<void()>& fn) {
+        Event e;
+        e.id = _nextId++;
+        e.due = sim::now() + (sim::Time)(ms > 0 ? ms : 0)*sim::MS;
+        e.period = period;
+        e.fn = fn;
+        _events.push_back(e);
+        sim::wake(this);
+        return e.id;
+    }
+
+    std::vector<Event> _events;
+    int _nextId;
+    bool _break;
+};
+
+}
+
+using namespace events;
+
+#endif
@@ -0,0 +1,810 @@
+//Closed-loop simulator for the motor firmware.
+//
+//Each scenario runs the firmware in Submission/ against the plant model in a fresh
+//process and reports how the real (simulated) rotor behaved. See README.md.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "sim.h"
+#include "plant.h"
+#include "firmware.h"
+
+using namespace sim;
+
+namespace {
+
+struct Options {
+    double time;            //simulated seconds per scenario
+    double target;          //V scenarios: rev/s
+    double revs;            //R scenarios: rotations
+    double vmax;            //R scenarios: velocity limit
+    bool echo;              //copy firmware serial output to stdout
+    const char* trace;      //CSV of the rotor trace
+    const char* telemetry;  //raw bytes from the telemetry UART
+    PlantParams plant;
+};
+
+Options opt;
+Plant* activePlant;         //the running scenario's, for faults injected mid-run
+std::vector<Commutation> commutations;  //the last scenario's, as the plant saw them
+
+struct Report {
+    char name[32];
+    double simSeconds;
+    double wallSeconds;
+    double target;
+    double settle;          //s from the command, -1 if never settled
+    double overshoot;       //V: % of target, R: rotations past target
+    double finalError;      //V: rev/s, R: rotations
+    double ripple;          //rms velocity error after settling, rev/s
+    double finalVelocity;
+    double finalPosition;
+    double origin;          //plant position at the start, revolutions
+    double driveOrigin;     //and relative to that once homed, where R counts from
+    double latencyAvg;
+    double latencyP99;
+    PlantStats stats;
+};
+
+struct Sample {
+    float t, position, velocity, delta;
+};
+
+double wallClock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+//Run entry against a fresh plant, sampling the rotor every millisecond
+void simulate(Report& r, const char* name, double target, void (*entry)(), std::vector<Sample>& trace) {
+    memset(&r, 0, sizeof(r));
+    snprintf(r.name, sizeof(r.name), "%s", name);
+    r.target = target;
+    setEcho(opt.echo);
+
+    Plant plant(opt.plant);
+    plant.start();
+    activePlant = &plant;
+    double origin = plant.position();
+    r.origin = origin;
+    bool driving = false;
+    every(MS, [&]() {
+        if (!driving && firmware::commutate) {
+            driving = true;
+            r.driveOrigin = plant.position() - origin;
+        }
+        Sample s;
+        s.t = (float)toSeconds(now());
+        s.position = (float)(plant.position() - origin);
+        s.velocity = (float)plant.velocity();
+        s.delta = (float)firmware::delta;
+        trace.push_back(s);
+    });
+
+    double wall = wallClock();
+    run(fromSeconds(opt.time), entry);
+    r.wallSeconds = wallClock() - wall;
+    r.simSeconds = opt.time;
+
+    activePlant = 0;
+    commutations = plant.commutations();
+    r.stats = plant.stats();
+    r.finalVelocity = plant.velocity();
+    r.finalPosition = plant.position() - origin;
+    std::vector<float> lat = plant.latencies();
+    if (!lat.empty()) {
+        double sum = 0;
+        for (size_t i = 0; i < lat.size(); i++) sum += lat[i];
+        r.latencyAvg = sum/lat.size();
+        std::sort(lat.begin(), lat.end());
+        r.latencyP99 = lat[(size_t)(0.99*(lat.size() - 1))];
+    }
+
+    if (opt.trace) {
+        FILE* f = fopen(opt.trace, "w");
+        if (f) {
+            fprintf(f, "t,position,velocity,delta\n");
+            for (size_t i = 0; i < trace.size(); i++) {
+                fprintf(f, "%.3f,%.4f,%.3f,%.4f\n", trace[i].t, trace[i].position, trace[i].velocity, trace[i].delta);
+            }
+            fclose(f);
+        }
+    }
+    if (opt.telemetry) {
+        FILE* f = fopen(opt.telemetry, "wb");
+        if (f) {
+            fwrite(uartCapture().data(), 1, uartCapture().size(), f);
+            fclose(f);
+        }
+    }
+}
+
+//Time of the first sample after the last one outside the band, -1 unless the trace
+//stays inside for at least half a second
+double settleTime(const std::vector<Sample>& trace, long last) {
+    if (last + 1 >= (long)trace.size()) return -1;
+    if (trace.back().t - trace[last + 1].t < 0.5f) return -1;
+    return trace[last + 1].t;
+}
+
+//Settling into a +-5% band (at least 0.5 rev/s) around a velocity target
+void velocityMetrics(Report& r, const std::vector<Sample>& trace) {
+    double target = fabs(r.target);
+    double band = std::max(0.05*target, 0.5);
+    double peak = 0;
+    long last = -1;
+    for (size_t i = 0; i < trace.size(); i++) {
+        double v = fabs(trace[i].velocity);
+        peak = std::max(peak, v);
+        if (fabs(v - target) > band) last = (long)i;
+    }
+    r.settle = settleTime(trace, last);
+    r.overshoot = target > 0 ? std::max(0.0, 100.0*(peak - target)/target) : 0;
+    r.finalError = fabs(r.finalVelocity) - target;
+    double sum = 0;
+    long n = 0;
+    for (size_t i = last + 1; i < trace.size(); i++) {
+        double e = fabs(trace[i].velocity) - target;
+        sum += e*e;
+        n++;
+    }
+    r.ripple = n ? sqrt(sum/n) : -1;
+}
+
+//Settling to within 0.05 rotations of a position target, counted from where homing
+//left the rotor as the firmware does
+void rotationMetrics(Report& r, const std::vector<Sample>& trace) {
+    double target = fabs(r.target);
+    double peak = 0;
+    long last = -1;
+    for (size_t i = 0; i < trace.size(); i++) {
+        double p = fabs(trace[i].position - r.driveOrigin);
+        peak = std::max(peak, p);
+        if (fabs(p - target) > 0.05) last = (long)i;
+    }
+    r.settle = settleTime(trace, last);
+    r.overshoot = std::max(0.0, peak - target);
+    r.finalError = fabs(r.finalPosition - r.driveOrigin) - target;
+    r.ripple = -1;
+}
+
+/////////////////////////////////SCENARIOS///////////////////////////////////////////////////
+
+void runVelocity(Report& r) {
+    std::vector<Sample> trace;
+    firmware::targetVelocity = opt.target;
+    simulate(r, "velocity", opt.target, firmware::setVelocity, trace);
+    velocityMetrics(r, trace);
+}
+
+void runRotation(Report& r) {
+    std::vector<Sample> trace;
+    //setRotation() sets its own 20 rotation target
+    simulate(r, "rotation", 20.0, firmware::setRotation, trace);
+    rotationMetrics(r, trace);
+}
+
+void runRotationVelocity(Report& r) {
+    std::vector<Sample> trace;
+    firmware::numOfRotations = opt.revs;
+    firmware::maxVelocity = opt.vmax;
+    simulate(r, "rotvel", opt.revs, firmware::setRotationVelocity, trace);
+    rotationMetrics(r, trace);
+}
+
+//The whole firmware driven from the command line, with a histogram dump (H) at the
+//end while the status printout keeps the UART busy
+void runLoop(Report& r) {
+    std::vector<Sample> trace;
+    char command[32];
+    snprintf(command, sizeof(command), "V%g\r", opt.target);
+    typeAt(100*MS, command);
+    typeAt(fromSeconds(opt.time) - SEC, "H\r");
+    bool echo = opt.echo;
+    opt.echo = true;
+    simulate(r, "loop", opt.target, []() { firmware::main(); }, trace);
+    opt.echo = echo;
+    printf("\n");
+    velocityMetrics(r, trace);
+}
+
+//V--target, then auto-tune (A) once it has settled; the tuner's estimate and gains
+//come out of the firmware's serial, and the metrics cover the retuned loop at the end.
+//Runs at least 30 s so the 16 s identification has room.
+void runAutotune(Report& r) {
+    std::vector<Sample> trace;
+    char command[32];
+    snprintf(command, sizeof(command), "V%g\r", opt.target);
+    typeAt(100*MS, command);
+    typeAt(6*SEC, "A\r");
+    Options saved = opt;
+    opt.echo = true;
+    opt.time = std::max(opt.time, 30.0);
+    simulate(r, "autotune", opt.target, []() { firmware::main(); }, trace);
+    opt = saved;
+    printf("\n");
+    velocityMetrics(r, trace);
+}
+
+//V--target, then a tune (T) once it has settled. The carrier moves to each note, and
+//the metrics show whether the speed holds through the changes. Runs at least 16 s.
+void runMelody(Report& r) {
+    std::vector<Sample> trace;
+    char command[32];
+    snprintf(command, sizeof(command), "V%g\r", opt.target);
+    typeAt(100*MS, command);
+    typeAt(6*SEC, "TC4E4G4C#8G4E4C2D2E2F2G8\r");
+    Options saved = opt;
+    opt.echo = true;
+    opt.time = std::max(opt.time, 16.0);
+    simulate(r, "melody", opt.target, []() { firmware::main(); }, trace);
+    opt = saved;
+    printf("\n");
+    velocityMetrics(r, trace);
+}
+
+//Angle of a trace sample in the firmware's frame, degrees from where motorHome()
+//leaves the rotor: the middle of the hall sector it reads as orState
+double holdAngle(const Report& r, const Sample& s) {
+    int sector = ((firmware::orState - opt.plant.hallOffset) % 6 + 6) % 6;
+    double home = (sector + 0.5)*60.0/opt.plant.polePairs;
+    return (r.origin + s.position)*360.0 - home;
+}
+
+//Angle error (wrapped to +-180) and mean |delta| over [from, to)
+void holdWindow(const Report& r, const std::vector<Sample>& trace, double target, double from, double to,
+                double& error, double& maxError, double& duty) {
+    double sum = 0, sumDuty = 0;
+    long n = 0;
+    maxError = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        if (trace[i].t < from || trace[i].t >= to) continue;
+        double e = remainder(holdAngle(r, trace[i]) - target, 360.0);
+        sum += e;
+        maxError = std::max(maxError, fabs(e));
+        sumDuty += fabs(trace[i].delta);
+        n++;
+    }
+    error = n ? sum/n : 0;
+    duty = n ? sumDuty/n : 0;
+}
+
+//D90, then D95V1 at 8 s: a 90 degree move, a hold, a 1 degree/s creep over 5 degrees
+//and a second hold, against the real rotor angle. The report's figures are for the
+//final hold, in degrees: settle into +-1, overshoot, mean error and the rms error.
+void runHold(Report& r) {
+    std::vector<Sample> trace;
+    typeAt(100*MS, "D90\r");
+    typeAt(8*SEC, "D95V1\r");
+    Options saved = opt;
+    opt.echo = true;
+    opt.time = std::max(opt.time, 20.0);
+    simulate(r, "hold", 95.0, []() { firmware::main(); }, trace);
+    opt = saved;
+    printf("\n");
+
+    long last = -1;
+    double peak = 0, sum = 0;
+    long n = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        if (trace[i].t < 8.0) continue;
+        double a = holdAngle(r, trace[i]);
+        peak = std::max(peak, a);
+        if (fabs(a - 95.0) > 1.0) last = (long)i;
+        if (trace[i].t >= trace.back().t - 2.0) {
+            sum += (a - 95.0)*(a - 95.0);
+            n++;
+        }
+    }
+    r.settle = settleTime(trace, last);
+    r.overshoot = std::max(0.0, peak - 95.0);
+    r.ripple = n ? sqrt(sum/n) : -1;
+
+    double error, maxError, duty, creepError, creepMax, creepDuty;
+    holdWindow(r, trace, 90.0, 6.0, 8.0, error, maxError, duty);
+    printf("hold 90:   error %+.3f deg (max %.3f), holding duty %.4f\n", error, maxError, duty);
+    //the creep setpoint, 1 degree/s from 90 once the command is in
+    double sumCreep = 0;
+    long nCreep = 0;
+    creepMax = 0;
+    creepDuty = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        if (trace[i].t < 9.0 || trace[i].t >= 12.0) continue;
+        double e = remainder(holdAngle(r, trace[i]) - (90.0 + (trace[i].t - 8.0)), 360.0);
+        sumCreep += e;
+        creepMax = std::max(creepMax, fabs(e));
+        creepDuty += fabs(trace[i].delta);
+        nCreep++;
+    }
+    creepError = nCreep ? sumCreep/nCreep : 0;
+    creepDuty = nCreep ? creepDuty/nCreep : 0;
+    printf("creep:     error %+.3f deg (max %.3f) behind a 1 deg/s setpoint, duty %.4f\n", creepError, creepMax, creepDuty);
+    holdWindow(r, trace, 95.0, trace.back().t - 2.0, trace.back().t + 1.0, error, maxError, duty);
+    printf("hold 95:   error %+.3f deg (max %.3f), holding duty %.4f\n", error, maxError, duty);
+    r.finalError = error;
+}
+
+//V--target, a word that isn't a command, then V at -1/2 of the target while the
+//first is still running: the new command has to take over without a reset. The
+//metrics are against the second target.
+void runPreempt(Report& r) {
+    std::vector<Sample> trace;
+    char command[32];
+    snprintf(command, sizeof(command), "V%g\r", opt.target);
+    typeAt(100*MS, command);
+    typeAt(4*SEC, "X12 R1.2.3\r");
+    double setpoint = -opt.target/2;
+    snprintf(command, sizeof(command), "V%g\r", setpoint);
+    typeAt(6*SEC, command);
+    bool echo = opt.echo;
+    opt.echo = true;
+    double time = opt.time;
+    opt.time = std::max(opt.time, 16.0);
+    simulate(r, "preempt", opt.target/2, []() { firmware::main(); }, trace);
+    opt.echo = echo;
+    opt.time = time;
+    printf("\n");
+    velocityMetrics(r, trace);
+    //The first command's peak isn't overshoot: only the second's, past its setpoint
+    //in its direction, from when it was typed
+    double peak = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        double v = (setpoint < 0) ? -trace[i].velocity : trace[i].velocity;
+        if (trace[i].t >= 6) peak = std::max(peak, v);
+    }
+    r.overshoot = setpoint != 0 ? std::max(0.0, 100.0*(peak - fabs(setpoint))/fabs(setpoint)) : 0;
+}
+
+//One injected fault, and what the firmware made of it
+struct FaultRun {
+    const char* what;
+    double onset;           //s, when the fault was injected or the plant crossed into it
+    int code;               //FaultCode latched, 0 for none
+    double detected;        //s, as the firmware's fault monitor saw it
+    double cut;
+    double gatesOff;        //s, when the plant saw every gate off
+};
+
+const double OVERSPEED = 100.0;     //rev/s, FAULT_MAX_VELOCITY in Submission/main.cpp
+FaultRun faultRuns[4];
+int numFaultRuns;
+
+//Snapshot the fault monitor and the gates, just before the restart clears them
+void faultCheck(int k) {
+    FaultRun& f = faultRuns[k];
+    f.code = firmware::faultMonitor.fault();
+    f.detected = firmware::faultMonitor.detected()*1e-6;
+    f.cut = firmware::faultMonitor.cut()*1e-6;
+    f.gatesOff = toSeconds(activePlant->gatesOff());
+}
+
+//V--target, then faults injected into the plant one after the other, each followed by
+//an F to report it and V--target to restart: the rotor locked solid, the hall sensors
+//slipped a sector against the encoder, and a load that drives the rotor past the
+//overspeed limit until the drive is cut. With --foc, which samples the phase
+//currents, shorted turns (R and L down 100 times) as well. Each fault's line gives
+//its reaction time: from the fault to the gates off, and from the monitor's detection
+//to the gates off. The metrics cover the run after the last restart, from when it
+//has braked the rotor to a stop.
+void runFault(Report& r) {
+    std::vector<Sample> trace;
+    char command[32];
+    snprintf(command, sizeof(command), "V%g\r", opt.target);
+    Options saved = opt;
+    const double period = 8.0;          //long enough to brake, home and settle again
+    numFaultRuns = (firmware::requestedDrive == 2) ? 4 : 3;
+    faultRuns[0].what = "locked rotor";
+    faultRuns[1].what = "hall sector slip";
+    faultRuns[2].what = "overrunning load";
+    faultRuns[3].what = "shorted turns";
+    typeAt(100*MS, command);
+    for (int k = 0; k < numFaultRuns; k++) {
+        double t = 4.0 + k*period;
+        faultRuns[k].onset = t;
+        faultRuns[k].code = 0;
+        switch (k) {
+        case 0:
+            at(fromSeconds(t), []() { activePlant->params().coulombFriction = 1.0; }, false);
+            at(fromSeconds(t + 1.0), [saved]() { activePlant->params().coulombFriction = saved.plant.coulombFriction; }, false);
+            break;
+        case 1:
+            at(fromSeconds(t), []() { activePlant->params().hallOffset += 1; }, false);
+            at(fromSeconds(t + 1.0), [saved]() { activePlant->params().hallOffset = saved.plant.hallOffset; }, false);
+            break;
+        case 2:
+            at(fromSeconds(t), []() { activePlant->params().loadTorque = -0.2; }, false);
+            break;
+        case 3:
+            at(fromSeconds(t), []() {
+                activePlant->params().phaseResistance /= 100;
+                activePlant->params().phaseInductance /= 100;
+            }, false);
+            at(fromSeconds(t + 1.0), [saved]() {
+                activePlant->params().phaseResistance = saved.plant.phaseResistance;
+                activePlant->params().phaseInductance = saved.plant.phaseInductance;
+            }, false);
+            break;
+        }
+        at(fromSeconds(t + 1.4), [k]() { faultCheck(k); }, false);
+        typeAt(fromSeconds(t + 1.5), "F\r");
+        typeAt(fromSeconds(t + 2.0), command);
+    }
+    //the overrunning load lets go once the drive is cut, or the rotor would still be
+    //running away at the restart
+    every(MS, [saved]() {
+        if (activePlant && firmware::faultMonitor.fault() != firmware::FAULT_NONE) {
+            activePlant->params().loadTorque = saved.plant.loadTorque;
+        }
+    });
+    double restart = 4.0 + (numFaultRuns - 1)*period + 2.0;
+    opt.echo = true;
+    opt.time = std::max(opt.time, restart + 12.0);
+    simulate(r, "fault", opt.target, []() { firmware::main(); }, trace);
+    opt = saved;
+    printf("\n");
+
+    //the overspeed starts where the rotor passes the limit, if it did before the cut
+    for (size_t i = 0; i < trace.size(); i++) {
+        if (trace[i].t >= faultRuns[2].detected) break;
+        if (trace[i].t >= faultRuns[2].onset && fabs(trace[i].velocity) > OVERSPEED) {
+            faultRuns[2].onset = trace[i].t;
+            break;
+        }
+    }
+    for (int k = 0; k < numFaultRuns; k++) {
+        const FaultRun& f = faultRuns[k];
+        if (!f.code) {
+            printf("%-17s not detected\n", f.what);
+            continue;
+        }
+        printf("%-17s %-22s fault to gates off %8.3f ms, detection to gates off %6.1f us\n", f.what,
+               firmware::FaultMonitor::name((firmware::FaultCode)f.code), (f.gatesOff - f.onset)*1e3,
+               (f.gatesOff - f.detected)*1e6);
+    }
+
+    //from when the restart has braked the rotor to a stop
+    std::vector<Sample> last;
+    for (size_t i = 0; i < trace.size(); i++) {
+        if (trace[i].t >= restart && (!last.empty() || fabs(trace[i].velocity) < 0.5)) last.push_back(trace[i]);
+    }
+    velocityMetrics(r, last);
+}
+
+//Commutation angle (see Commutation in plant.h) over [from, to) seconds
+void commutationWindow(const char* what, double from, double to) {
+    double sum = 0, sum2 = 0;
+    long n = 0;
+    for (size_t i = 0; i < commutations.size(); i++) {
+        if (commutations[i].time < from || commutations[i].time >= to) continue;
+        sum += commutations[i].angle;
+        sum2 += commutations[i].angle*commutations[i].angle;
+        n++;
+    }
+    if (!n) {
+        printf("%-22s no commutations\n", what);
+        return;
+    }
+    double mean = sum/n;
+    printf("%-22s commutation angle %6.1f deg (sd %4.1f, textbook 120) over %ld\n", what, mean,
+           sqrt(std::max(0.0, sum2/n - mean*mean)), n);
+}
+
+//V--target, then photointerrupter I1 fails dark: the back-EMF takes over from the
+//halls while running. V--target again with it still failed has to start from rest on
+//the open loop ramp, and once I1 comes back the halls take over again. The angles
+//are where the bridge was switched against the real rotor, in each part of the run,
+//and the metrics cover the restart without the halls.
+void runSensorless(Report& r) {
+    std::vector<Sample> trace;
+    char command[32];
+    snprintf(command, sizeof(command), "V%g\r", opt.target);
+    typeAt(100*MS, command);
+    at(fromSeconds(5.0), []() { activePlant->params().hallFailed = 1; }, false);
+    typeAt(fromSeconds(10.0), command);
+    at(fromSeconds(26.0), []() { activePlant->params().hallFailed = 0; }, false);
+    Options saved = opt;
+    opt.echo = true;
+    opt.time = std::max(opt.time, 32.0);
+    simulate(r, "sensorless", opt.target, []() { firmware::main(); }, trace);
+    opt = saved;
+    printf("\n");
+
+    commutationWindow("halls", 3.0, 5.0);
+    commutationWindow("back-EMF, taken over", 6.0, 10.0);
+    commutationWindow("back-EMF, restarted", 22.0, 26.0);
+    commutationWindow("halls again", 28.0, 32.0);
+    std::vector<Sample> restart;
+    for (size_t i = 0; i < trace.size(); i++) {
+        if (trace[i].t >= 10.0 && trace[i].t < 26.0) restart.push_back(trace[i]);
+    }
+    velocityMetrics(r, restart);
+}
+
+//Mean duty and speed per duty over [from, to) seconds
+void dutyWindow(const char* what, const std::vector<Sample>& trace, double from, double to) {
+    double duty = 0, velocity = 0;
+    long n = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        if (trace[i].t < from || trace[i].t >= to) continue;
+        duty += fabs(trace[i].delta);
+        velocity += fabs(trace[i].velocity);
+        n++;
+    }
+    if (!n || duty <= 0) {
+        printf("%-22s no samples\n", what);
+        return;
+    }
+    printf("%-22s duty %.4f, %.2f rev/s per unit duty\n", what, duty/n, velocity/duty);
+}
+
+//The first boot of the advance and calibration scenarios, back from its own process
+//with the flash
+struct AdvanceBoot {
+    Report report;
+    uint8_t flash[FLASH_SIZE];
+};
+
+const double ADVANCE_LEARN = 60.0;  //s of L1 in the first boot
+
+//V--target and L1: the phase advance is learnt while the speed holds, then L0, the
+//table (L), and V--target again, which saves it to flash. A second boot from that
+//flash runs V--target on the loaded table. The angles and duties are before the
+//learning, at the end of it, and after the reset; the metrics are the second boot's.
+void runAdvance(Report& r) {
+    char command[32];
+    snprintf(command, sizeof(command), "V%g\r", opt.target);
+    const double restart = 4.0 + ADVANCE_LEARN;
+    Options saved = opt;
+    opt.echo = true;
+    AdvanceBoot first;
+    bool ok = isolated<AdvanceBoot>([&](AdvanceBoot& out) {
+        std::vector<Sample> trace;
+        typeAt(100*MS, command);
+        typeAt(4*SEC, "L1\r");
+        typeAt(fromSeconds(restart), "L0\r");
+        typeAt(fromSeconds(restart + 0.1), "L\r");
+        typeAt(fromSeconds(restart + 0.2), command);
+        opt.time = restart + 6.0;
+        simulate(out.report, "advance", opt.target, []() { firmware::main(); }, trace);
+        printf("\n");
+        commutationWindow("before", 2.0, 4.0);
+        dutyWindow("before", trace, 2.0, 4.0);
+        commutationWindow("learnt", restart - 2.0, restart);
+        dutyWindow("learnt", trace, restart - 2.0, restart);
+        memcpy(out.flash, sim::flash(), FLASH_SIZE);
+    }, first);
+    if (!ok) {
+        printf("advance: first boot crashed\n");
+        opt = saved;
+        return;
+    }
+    memcpy(sim::flash(), first.flash, FLASH_SIZE);
+
+    std::vector<Sample> trace;
+    typeAt(100*MS, command);
+    opt.time = std::max(opt.time, 6.0);
+    simulate(r, "advance", opt.target, []() { firmware::main(); }, trace);
+    opt = saved;
+    printf("\n");
+    commutationWindow("after reset", 2.0, 4.0);
+    dutyWindow("after reset", trace, 2.0, 4.0);
+    velocityMetrics(r, trace);
+}
+
+//V--target and A, then V--target again once the tune is done, which saves the rotor
+//origin and the tuned gains to flash. A second boot from that flash runs V--target
+//on what it loaded, without homing; the metrics are its.
+void runCalibration(Report& r) {
+    char command[32];
+    snprintf(command, sizeof(command), "V%g\r", opt.target);
+    Options saved = opt;
+    opt.echo = true;
+    AdvanceBoot first;
+    bool ok = isolated<AdvanceBoot>([&](AdvanceBoot& out) {
+        std::vector<Sample> trace;
+        typeAt(100*MS, command);
+        typeAt(6*SEC, "A\r");
+        typeAt(26*SEC, command);
+        opt.time = 32.0;
+        simulate(out.report, "calibration", opt.target, []() { firmware::main(); }, trace);
+        printf("\n");
+        memcpy(out.flash, sim::flash(), FLASH_SIZE);
+    }, first);
+    if (!ok) {
+        printf("calibration: first boot crashed\n");
+        opt = saved;
+        return;
+    }
+    memcpy(sim::flash(), first.flash, FLASH_SIZE);
+
+    std::vector<Sample> trace;
+    typeAt(100*MS, command);
+    opt.time = std::max(opt.time, 6.0);
+    simulate(r, "calibration", opt.target, []() { firmware::main(); }, trace);
+    opt = saved;
+    printf("\n");
+    const firmware::Calibration& c = firmware::calibration;
+    printf("calibration            origin %d, kp = %f, ki = %f, inertia ~ %g kg.m^2\n", c.orState, c.kp, c.ki,
+           c.inertia);
+    velocityMetrics(r, trace);
+}
+
+const double SUPPLY_SWEEP[] = {12.0, 10.5, 9.0, 7.5};
+const double SUPPLY_SAG = 0.5;     //ohm, the battery's internal resistance in the sweep
+
+//setRotation() from a full battery down to a flat one with SUPPLY_SAG ohm of internal
+//resistance, once without the supply feed-forward and once with it, with --inertia and
+//with twice that, where the gains have less margin: where each stops against the 20
+//rotation target, and which way the firmware's gate on the inertia picks, given the
+//plant's (the tuner's estimate is within 10% of it). The metrics are the flattest
+//battery's as gated, at --inertia.
+void runSupply(Report& r) {
+    const int n = sizeof(SUPPLY_SWEEP)/sizeof(SUPPLY_SWEEP[0]);
+    Options saved = opt;
+    opt.plant.supplyResistance = SUPPLY_SAG;
+    for (int heavy = 0; heavy < 2; heavy++) {
+        opt.plant.inertia = saved.plant.inertia*(heavy ? 2 : 1);
+        firmware::gateSupplyFeedForward((float)opt.plant.inertia);
+        bool gated = firmware::supplyFeedForward;
+        printf("inertia %.1e  gated feed-forward %s\n", opt.plant.inertia, gated ? "on" : "off");
+        for (int k = 0; k < n; k++) {
+            opt.plant.supplyVoltage = SUPPLY_SWEEP[k];
+            for (int on = 0; on < 2; on++) {
+                Report run;
+                bool ok = isolated<Report>([on](Report& out) {
+                    std::vector<Sample> trace;
+                    firmware::supplyFeedForward = on;
+                    simulate(out, "supply", 20.0, firmware::setRotation, trace);
+                    rotationMetrics(out, trace);
+                }, run);
+                printf("inertia %.1e  supply %4.1f V  feed-forward %-3s  ", opt.plant.inertia, SUPPLY_SWEEP[k],
+                       on ? "on" : "off");
+                if (!ok) {
+                    printf("crashed\n");
+                    continue;
+                }
+                printf("stop error %+.3f rev, overshoot %.3f, settled %.3f s\n", run.finalError, run.overshoot,
+                       run.settle);
+                if (!heavy && k == n - 1 && on == gated) r = run;
+            }
+        }
+    }
+    opt = saved;
+}
+
+struct Scenario {
+    const char* name;
+    void (*fn)(Report&);
+    const char* help;
+};
+
+const Scenario scenarios[] = {
+    {"velocity", runVelocity, "setVelocity() at --target rev/s"},
+    {"rotation", runRotation, "setRotation(), 20 rotations"},
+    {"rotvel", runRotationVelocity, "setRotationVelocity() for --revs at up to --vmax"},
+    {"loop", runLoop, "V--target from the command line, then dump the control loop timing"},
+    {"preempt", runPreempt, "V--target, then a bad command and V at -1/2 --target while running"},
+    {"autotune", runAutotune, "V--target from the command line, then auto-tune the velocity loop (A)"},
+    {"hold", runHold, "D90 then a 1 degree/s creep to 95 (D95V1), against the real rotor angle"},
+    {"melody", runMelody, "V--target from the command line, then play a tune on the PWM carrier (T)"},
+    {"sensorless", runSensorless, "V--target, then hall I1 fails: back-EMF commutation, a restart on the ramp, and back"},
+    {"supply", runSupply, "setRotation() on a battery from 12 V down to 7.5 V, without and with the supply feed-forward, at 1x and 2x --inertia"},
+    {"calibration", runCalibration, "V--target and A, save the origin and gains, and run on them after a reset without homing"},
+    {"advance", runAdvance, "V--target and L1: learn the phase advance, save it, and run on it after a reset"},
+    {"fault", runFault, "V--target, then a locked rotor, hall slip and overspeed (and short, --foc), each cut and reported (F)"},
+};
+const int numScenarios = sizeof(scenarios)/sizeof(scenarios[0]);
+
+void printHeader() {
+    printf("%-10s %8s %8s %9s %9s %9s %8s %9s %9s %6s %8s\n",
+           "scenario", "target", "settle", "overshoot", "final_err", "ripple",
+           "lat_avg", "lat_p99", "lat_max", "missed", "speedup");
+}
+
+void printReport(const Report& r) {
+    const PlantStats& s = r.stats;
+    printf("%-10s %8.2f %8.3f %9.3f %9.3f %9.3f %7.1fu %8.1fu %8.1fu %6ld %7.0fx\n",
+           r.name, r.target, r.settle, r.overshoot, r.finalError, r.ripple,
+           r.latencyAvg*1e6, r.latencyP99*1e6, s.latencyMax*1e6, s.missed,
+           r.wallSeconds > 0 ? r.simSeconds/r.wallSeconds : 0);
+}
+
+void usage() {
+    printf("usage: motorsim [scenario...] [options]\n\nscenarios (default: all):\n");
+    for (int i = 0; i < numScenarios; i++) printf("  %-10s %s\n", scenarios[i].name, scenarios[i].help);
+    printf("\noptions:\n"
+           "  --time S        simulated seconds per scenario (10)\n"
+           "  --target V      velocity target, rev/s (15)\n"
+           "  --revs N        rotation target (20)\n"
+           "  --vmax V        velocity limit for rotations, rev/s (5)\n"
+           "  --supply V      supply voltage (12)\n"
+           "  --sag R         supply internal resistance, ohm (0)\n"
+           "  --inertia J     rotor inertia, kg.m^2\n"
+           "  --friction B    viscous friction, N.m.s/rad\n"
+           "  --ke K          flux linkage, V.s/rad\n"
+           "  --load T        load torque, N.m\n"
+           "  --dt US         plant integration step, us (10)\n"
+           "  --svpwm         drive with space vector PWM instead of six-step\n"
+           "  --foc           drive with field-oriented current control\n"
+           "  --trapezoid     trapezoidal rotation profiles instead of S-curve\n"
+           "  --sinusoidal    sinusoidal back-EMF instead of trapezoidal\n"
+           "  --echo          show the firmware's serial output\n"
+           "  --trace FILE    write the rotor trace of the last scenario as CSV\n"
+           "  --telemetry FILE  write the last scenario's telemetry stream (see sim/tools/telemetry2csv)\n");
+}
+
+}
+
+int main(int argc, char** argv) {
+    opt.time = 10.0;
+    opt.target = 15.0;
+    opt.revs = 20.0;
+    opt.vmax = 5.0;
+    opt.echo = false;
+    opt.trace = 0;
+    opt.telemetry = 0;
+    opt.plant = defaultParams();
+
+    std::vector<const Scenario*> selected;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--help" || a == "-h") { usage(); return 0; }
+        else if (a == "--echo") opt.echo = true;
+        else if (a == "--time" && hasValue) opt.time = atof(argv[++i]);
+        else if (a == "--target" && hasValue) opt.target = atof(argv[++i]);
+        else if (a == "--revs" && hasValue) opt.revs = atof(argv[++i]);
+        else if (a == "--vmax" && hasValue) opt.vmax = atof(argv[++i]);
+        else if (a == "--supply" && hasValue) opt.plant.supplyVoltage = atof(argv[++i]);
+        else if (a == "--sag" && hasValue) opt.plant.supplyResistance = atof(argv[++i]);
+        else if (a == "--inertia" && hasValue) opt.plant.inertia = atof(argv[++i]);
+        else if (a == "--friction" && hasValue) opt.plant.viscousFriction = atof(argv[++i]);
+        else if (a == "--ke" && hasValue) opt.plant.fluxLinkage = atof(argv[++i]);
+        else if (a == "--load" && hasValue) opt.plant.loadTorque = atof(argv[++i]);
+        else if (a == "--dt" && hasValue) opt.plant.step = (Time)(atof(argv[++i])*US);
+        else if (a == "--trace" && hasValue) opt.trace = argv[++i];
+        else if (a == "--telemetry" && hasValue) opt.telemetry = argv[++i];
+        else if (a == "--svpwm") firmware::requestedDrive = 1;
+        else if (a == "--foc") firmware::requestedDrive = 2;
+        else if (a == "--trapezoid") firmware::profileShape = 0;
+        else if (a == "--sinusoidal") opt.plant.trapezoidal = false;
+        else {
+            const Scenario* s = 0;
+            for (int k = 0; k < numScenarios; k++) {
+                if (a == scenarios[k].name) s = &scenarios[k];
+            }
+            if (!s) {
+                usage();
+                return 1;
+            }
+            selected.push_back(s);
+        }
+    }
+    if (selected.empty()) {
+        for (int k = 0; k < numScenarios; k++) selected.push_back(&scenarios[k]);
+    }
+
+    printHeader();
+    int failed = 0;
+    for (size_t i = 0; i < selected.size(); i++) {
+        Report r;
+        void (*fn)(Report&) = selected[i]->fn;
+        if (isolated<Report>([fn](Report& out) { fn(out); }, r)) {
+            printReport(r);
+        }
+        else {
+            printf("%-10s crashed\n", selected[i]->name);
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
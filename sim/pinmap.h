@@ -0,0 +1,8 @@
+//Host stand-in for hal/pinmap.h: pin_function() lives in the mbed.h shim.
+
+#ifndef SIM_PINMAP_H
+#define SIM_PINMAP_H
+
+#include "mbed.h"
+
+#endif
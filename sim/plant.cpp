@@ -0,0 +1,348 @@
+#include "plant.h"
+
+#include <math.h>
+#include <algorithm>
+
+#include "PinNames.h"
+
+namespace sim {
+
+namespace {
+
+const double TWO_PI = 6.283185307179586;
+const double SECTOR = TWO_PI/6;
+const double SIN120 = 0.8660254037844386;
+
+//Photointerrupter inputs (I1 + 2*I2 + 4*I3) for each rotor state, the inverse of
+//stateMap[] in Submission/sixstep.cpp
+const int hallPattern[6] = {0x5, 0x4, 0x6, 0x2, 0x3, 0x1};
+
+//Drive state for (high phase, low phase), matching driveTable[]
+const int bridgeState[3][3] = {
+    {-1, 5, 0},
+    { 2, -1, 1},
+    { 3, 4, -1}
+};
+
+int wrap(long v, int n) {
+    long r = v % n;
+    return (int)(r < 0 ? r + n : r);
+}
+
+}
+
+MotorPins defaultPins() {
+    MotorPins p;
+    p.I1 = D3;                  //HALL_CAPTURE, on TIM3
+    p.I2 = D11;
+    p.I3 = D12;
+    p.CHA = D7;
+    p.CHB = D8;
+    p.IA = A0;
+    p.IB = A1;
+    p.L1L = D4;
+    p.L1H = D5;
+    p.L2L = D2;
+    p.L2H = D6;
+    p.L3L = D9;
+    p.L3H = D10;
+    //the comparator inputs, see Submission/bemf.h
+    p.V1 = PA_7;
+    p.V2 = PB_0;
+    p.V3 = PIN_PB_11;
+    p.VN = PA_4;
+    p.VBUS = A2;                //see Submission/currentsense.h
+    return p;
+}
+
+PlantParams defaultParams() {
+    PlantParams p;
+    p.supplyVoltage = 12.0;
+    p.supplyResistance = 0.0;
+    p.phaseResistance = 2.2;
+    p.phaseInductance = 0.5e-3;
+    p.fluxLinkage = 0.016;
+    p.inertia = 2.0e-4;
+    p.viscousFriction = 2.0e-6;
+    p.coulombFriction = 1.5e-3;
+    p.loadTorque = 0.0;
+    p.polePairs = 1;
+    p.encoderLines = 117;
+    p.hallOffset = 2;
+    p.hallFailed = 0;
+    p.trapezoidal = true;
+    p.senseGain = 0.25;
+    p.senseOffset = 1.65;
+    p.voltageGain = 0.2;
+    p.busGain = 1/6.0;
+    p.step = 10*US;
+    return p;
+}
+
+Plant::Plant(const PlantParams& params, const MotorPins& pins)
+    : _p(params), _pins(pins), _theta(0.7), _omega(0), _torque(0), _bus(params.supplyVoltage), _t(0),
+      _hallPins(0), _encPins(0), _bridge(-1), _lastHallEdge(0), _answered(true),
+      _gatesOff(false), _gatesOffAt(0) {
+    _i[0] = _i[1] = _i[2] = 0;
+    _stats.hallEdges = 0;
+    _stats.commutations = 0;
+    _stats.missed = 0;
+    _stats.latencySum = 0;
+    _stats.latencyMax = 0;
+    _stats.shootThrough = 0;
+    _stats.supplyEnergy = 0;
+}
+
+void Plant::start() {
+    const int gates[6] = {_pins.L1L, _pins.L1H, _pins.L2L, _pins.L2H, _pins.L3L, _pins.L3H};
+    for (int k = 0; k < 6; k++) pin(gates[k]).gate = this;
+
+    //Initial sensor levels, without edges
+    double e = _p.polePairs*_theta;
+    _hallPins = hallPattern[wrap((long)floor(e/SECTOR) + _p.hallOffset, 6)] & ~_p.hallFailed;
+    pin(_pins.I1).level = _hallPins & 1;
+    pin(_pins.I2).level = (_hallPins >> 1) & 1;
+    pin(_pins.I3).level = (_hallPins >> 2) & 1;
+    long count = (long)floor(_theta*4*_p.encoderLines/TWO_PI);
+    int q = wrap(count, 4);
+    _encPins = (q == 1 || q == 2) | ((q == 2 || q == 3) << 1);
+    pin(_pins.CHA).level = _encPins & 1;
+    pin(_pins.CHB).level = (_encPins >> 1) & 1;
+    pin(_pins.IA).voltage = (float)_p.senseOffset;
+    pin(_pins.IB).voltage = (float)_p.senseOffset;
+    _bus = _p.supplyVoltage;
+    if (_pins.VBUS >= 0) pin(_pins.VBUS).voltage = (float)(_p.busGain*_bus);
+
+    _t = now();
+    every(_p.step, [this]() { step(); });
+}
+
+double Plant::position() const { return _theta/TWO_PI; }
+double Plant::velocity() const { return _omega/TWO_PI; }
+double Plant::current(int phase) const { return _i[phase]; }
+double Plant::torque() const { return _torque; }
+double Plant::busVoltage() const { return _bus; }
+
+//Average switch state of one phase over a PWM period. Low side gates (LxL) are
+//active high; high side gates (LxH) drive PMOS and are active low. Both PwmOut
+//channels start their period high, so the on-times overlap by h + l - 1.
+void Plant::phaseDrive(int phase, double& high, double& low, double& overlap) const {
+    const int lowPin[3] = {_pins.L1L, _pins.L2L, _pins.L3L};
+    const int highPin[3] = {_pins.L1H, _pins.L2H, _pins.L3H};
+    double l = pin(lowPin[phase]).duty;
+    double h = 1.0 - pin(highPin[phase]).duty;
+    overlap = h + l - 1.0;
+    if (overlap < 0) overlap = 0;
+    high = h - overlap;
+    low = l - overlap;
+}
+
+void Plant::step() {
+    Time t0 = now();
+    double dt = toSeconds(_p.step);
+    double R = _p.phaseResistance;
+    double Vs = _bus;
+    double kE = _p.polePairs*_p.fluxLinkage;
+
+    //Back-EMF shape of each phase, phases at 0/120/240 degrees electrical
+    double e0 = _p.polePairs*_theta;
+    double sn = sin(e0), cs = cos(e0);
+    double shape[3] = {sn, -0.5*sn - SIN120*cs, -0.5*sn + SIN120*cs};
+    if (_p.trapezoidal) {
+        for (int k = 0; k < 3; k++) {
+            double s = 2.0*shape[k];
+            shape[k] = s > 1.0 ? 1.0 : (s < -1.0 ? -1.0 : s);
+        }
+    }
+
+    //Winding currents: each phase sees its averaged terminal voltage while its switches
+    //conduct and follows the star point plus back-EMF while floating
+    double drive[3], connected[3], highFrac[3], high[3], low[3];
+    double sumU = 0, sumC = 0, sumCE = 0, sumI = 0;
+    for (int k = 0; k < 3; k++) {
+        double h, l, o;
+        phaseDrive(k, h, l, o);
+        high[k] = h + o;
+        low[k] = l + o;
+        drive[k] = Vs*(h + 0.5*o);
+        connected[k] = h + l + o;
+        highFrac[k] = h + 0.5*o;
+        _stats.shootThrough += o*dt;
+        double emf = -kE*_omega*shape[k];
+        sumU += drive[k];
+        sumC += connected[k];
+        sumCE += connected[k]*emf;
+        sumI += _i[k];
+    }
+    double star = sumC > 1e-9 ? (sumU - sumCE - R*sumI)/sumC : 0;
+    double decay = exp(-R*dt/_p.phaseInductance);
+    double power = 0;
+    for (int k = 0; k < 3; k++) {
+        double emf = -kE*_omega*shape[k];
+        double v = drive[k] - connected[k]*(star + emf);
+        _i[k] = _i[k]*decay + (1.0 - decay)*v/R;
+        power += Vs*highFrac[k]*_i[k];
+    }
+
+    //Terminal voltages for the comparators in the middle of the low side on-time, where
+    //the firmware samples them: a phase is low there if its low side switches at all,
+    //high if its high side is on right through the low side pulses (which are centred
+    //on the same point), and otherwise floats on the star point
+    if (_pins.VN >= 0) {
+        double pulse = std::max(low[0], std::max(low[1], low[2]));
+        double terminal[3], onU = 0, onE = 0;
+        bool floating[3];
+        int on = 0;
+        for (int k = 0; k < 3; k++) {
+            floating[k] = low[k] <= 1e-9 && high[k] < 1.0 - pulse + 1e-9;
+            if (!floating[k]) {
+                terminal[k] = (low[k] > 1e-9) ? 0 : Vs;
+                onU += terminal[k];
+                onE += -kE*_omega*shape[k];
+                on++;
+            }
+        }
+        double starOn = on ? (onU - onE)/on : 0;
+        for (int k = 0; k < 3; k++) {
+            if (floating[k]) terminal[k] = starOn - kE*_omega*shape[k];
+        }
+        double g = _p.voltageGain;
+        pin(_pins.V1).voltage = (float)(g*terminal[0]);
+        pin(_pins.V2).voltage = (float)(g*terminal[1]);
+        pin(_pins.V3).voltage = (float)(g*terminal[2]);
+        pin(_pins.VN).voltage = (float)(g*(terminal[0] + terminal[1] + terminal[2])/3);
+    }
+    _stats.supplyEnergy += power*dt;
+    //the sag from this step's supply current, for the next step; current fed back
+    //while braking raises the bus instead
+    _bus = _p.supplyVoltage - _p.supplyResistance*power/Vs;
+    if (_pins.VBUS >= 0) pin(_pins.VBUS).voltage = (float)(_p.busGain*_bus);
+    pin(_pins.IA).voltage = (float)(_p.senseOffset + _p.senseGain*_i[0]);
+    pin(_pins.IB).voltage = (float)(_p.senseOffset + _p.senseGain*_i[1]);
+
+    //Rotor
+    _torque = -kE*(shape[0]*_i[0] + shape[1]*_i[1] + shape[2]*_i[2]);
+    double net = _torque - _p.loadTorque - _p.viscousFriction*_omega;
+    double omega = _omega;
+    if (omega == 0 && fabs(net) <= _p.coulombFriction) {
+        omega = 0;
+    }
+    else {
+        double dir = omega != 0 ? (omega > 0 ? 1.0 : -1.0) : (net > 0 ? 1.0 : -1.0);
+        omega += dt*(net - dir*_p.coulombFriction)/_p.inertia;
+        if (_omega != 0 && omega*_omega < 0) omega = 0;
+    }
+    double theta = _theta + 0.5*(_omega + omega)*dt;
+    double m0 = _theta;
+    _omega = omega;
+    _theta = theta;
+    _t = t0;
+
+    scheduleHall(_p.polePairs*m0, _p.polePairs*theta);
+    scheduleEncoder(m0, theta);
+}
+
+//Edge times are interpolated across the step so interrupts see exact timing
+void Plant::scheduleHall(double e0, double e1) {
+    long s0 = (long)floor(e0/SECTOR);
+    long s1 = (long)floor(e1/SECTOR);
+    if (s0 == s1) return;
+    Time dt = _p.step;
+    int dir = s1 > s0 ? 1 : -1;
+    for (long b = s0; b != s1; b += dir) {
+        long boundary = dir > 0 ? b + 1 : b;
+        long sector = dir > 0 ? b + 1 : b - 1;
+        Time t = _t + (Time)(dt*((boundary*SECTOR - e0)/(e1 - e0)));
+        int pins = hallPattern[wrap(sector + _p.hallOffset, 6)] & ~_p.hallFailed;
+        int changed = pins ^ _hallPins;
+        _hallPins = pins;
+        if (changed & 1) emit(t, _pins.I1, pins & 1);
+        if (changed & 2) emit(t, _pins.I2, (pins >> 1) & 1);
+        if (changed & 4) emit(t, _pins.I3, (pins >> 2) & 1);
+        at(t, [this]() { hallEdge(); }, false);
+    }
+}
+
+void Plant::scheduleEncoder(double m0, double m1) {
+    double scale = 4*_p.encoderLines/TWO_PI;
+    long c0 = (long)floor(m0*scale);
+    long c1 = (long)floor(m1*scale);
+    if (c0 == c1) return;
+    Time dt = _p.step;
+    int dir = c1 > c0 ? 1 : -1;
+    for (long c = c0; c != c1; c += dir) {
+        long boundary = dir > 0 ? c + 1 : c;
+        long count = dir > 0 ? c + 1 : c - 1;
+        Time t = _t + (Time)(dt*((boundary/scale - m0)/(m1 - m0)));
+        int q = wrap(count, 4);
+        int pins = (q == 1 || q == 2) | ((q == 2 || q == 3) << 1);
+        int changed = pins ^ _encPins;
+        _encPins = pins;
+        if (changed & 1) emit(t, _pins.CHA, pins & 1);
+        if (changed & 2) emit(t, _pins.CHB, (pins >> 1) & 1);
+    }
+}
+
+void Plant::emit(Time t, int name, int level) {
+    at(t, [name, level]() { setLevel(name, level); }, false);
+}
+
+void Plant::hallEdge() {
+    _stats.hallEdges++;
+    //Only count edges the firmware should have answered: not while braking or off
+    if (!_answered && decodeBridge() >= 0) _stats.missed++;
+    _answered = false;
+    _lastHallEdge = now();
+}
+
+//Decode which drive state the gates currently describe, -1 if none
+int Plant::decodeBridge() const {
+    int high = -1, low = -1;
+    for (int k = 0; k < 3; k++) {
+        double h, l, o;
+        phaseDrive(k, h, l, o);
+        if (l > 0.001 || o > 0.001) {
+            if (low >= 0) return -1;
+            low = k;
+        }
+        else if (h > 0.999) {
+            if (high >= 0) return -1;
+            high = k;
+        }
+    }
+    if (high < 0 || low < 0) return -1;
+    return bridgeState[high][low];
+}
+
+void Plant::gateWritten(int) {
+    bool off = true;
+    for (int k = 0; k < 3; k++) {
+        double h, l, o;
+        phaseDrive(k, h, l, o);
+        if (h > 0.001 || l > 0.001 || o > 0.001) off = false;
+    }
+    if (off && !_gatesOff) _gatesOffAt = now();
+    _gatesOff = off;
+    int state = decodeBridge();
+    if (state < 0 || state == _bridge) return;
+    _bridge = state;
+    _stats.commutations++;
+    //drive state k rests the rotor at 30 + 60k degrees electrical
+    if (_omega != 0) {
+        double rest = SECTOR*(state + 0.5);
+        double ahead = (_omega > 0) ? rest - _p.polePairs*_theta : _p.polePairs*_theta - rest;
+        Commutation c;
+        c.time = (float)toSeconds(now());
+        c.angle = (float)(360.0/TWO_PI*(ahead - TWO_PI*floor(ahead/TWO_PI)));
+        _commutations.push_back(c);
+    }
+    if (!_answered) {
+        double latency = toSeconds(now() - _lastHallEdge);
+        _latencies.push_back((float)latency);
+        _stats.latencySum += latency;
+        if (latency > _stats.latencyMax) _stats.latencyMax = latency;
+        _answered = true;
+    }
+}
+
+}
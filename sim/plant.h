@@ -0,0 +1,129 @@
+//BLDC motor plant model for the simulator.
+//
+//Reads the six gate duties the firmware writes through PwmOut, integrates a
+//duty-averaged three phase winding model (R, L, back-EMF, star point) and the rotor
+//mechanics (inertia, viscous and Coulomb friction, load), and drives the
+//photointerrupter (I1-I3) and encoder (CHA/CHB) pins with edges at their
+//interpolated times. Phase 1 and 2 currents appear as voltages on IA/IB, as from a
+//shunt amplifier, for the ADC model, the phase terminal voltages and their resistor
+//star on V1-V3 and VN, as from dividers, for the comparators, and the bus voltage,
+//which sags by the supply's internal resistance under load, on VBUS.
+
+#ifndef SIM_PLANT_H
+#define SIM_PLANT_H
+
+#include <vector>
+
+#include "sim.h"
+
+namespace sim {
+
+//Pin assignment of one motor; defaults to the pins in Submission/main.cpp
+struct MotorPins {
+    int I1, I2, I3;
+    int CHA, CHB;
+    int IA, IB;                 //current sense outputs, phases 1 and 2
+    int L1L, L1H, L2L, L2H, L3L, L3H;
+    int V1, V2, V3, VN;         //phase voltage sense outputs and their star, VN -1 for none
+    int VBUS;                   //bus voltage divider output, -1 for none
+};
+MotorPins defaultPins();
+
+struct PlantParams {
+    double supplyVoltage;       //V, open circuit
+    double supplyResistance;    //ohm, the battery's internal resistance
+    double phaseResistance;     //ohm
+    double phaseInductance;     //H
+    double fluxLinkage;         //peak phase flux linkage, V.s/rad (electrical)
+    double inertia;             //kg.m^2, rotor plus flywheel
+    double viscousFriction;     //N.m per rad/s
+    double coulombFriction;     //N.m
+    double loadTorque;          //N.m, opposing positive rotation
+    int polePairs;
+    int encoderLines;           //per channel per revolution, x4 edges when decoded
+    int hallOffset;             //photointerrupter sector of the drive state 0 rest position
+    int hallFailed;             //photointerrupters stuck dark (I1 = 1, I2 = 2, I3 = 4)
+    bool trapezoidal;           //trapezoidal (120 deg flat) instead of sinusoidal back-EMF
+    double senseGain;           //current sense V/A, positive into the winding
+    double senseOffset;         //current sense output at 0 A
+    double voltageGain;         //phase voltage sense V/V
+    double busGain;             //bus voltage sense V/V
+    Time step;                  //integration step
+};
+PlantParams defaultParams();
+
+//Commutation and drive statistics collected from the gate writes
+struct PlantStats {
+    long hallEdges;
+    long commutations;          //valid drive state changes seen on the gates
+    long missed;                //hall edges left unanswered while a drive state was applied
+    double latencySum;          //hall edge to completed commutation, seconds
+    double latencyMax;
+    double shootThrough;        //seconds of high and low switch overlap, all phases
+    double supplyEnergy;        //J drawn from the supply
+};
+
+//Electrical degrees from the rotor to the rest position of the drive state it is
+//switched into, in the direction of rotation: 120 is the textbook six-step point, with
+//the rotor 90 degrees behind the field in the middle of the state.
+struct Commutation {
+    float time;                 //s
+    float angle;
+};
+
+class Plant : public GateListener {
+public:
+    Plant(const PlantParams& params = defaultParams(), const MotorPins& pins = defaultPins());
+
+    //Attach to the pins and start stepping at the current simulation time
+    void start();
+
+    double position() const;    //revolutions
+    double velocity() const;    //rev/s
+    double current(int phase) const;
+    double torque() const;
+    double busVoltage() const;  //V, after the sag
+
+    PlantParams& params() { return _p; }
+    const PlantStats& stats() const { return _stats; }
+    const std::vector<float>& latencies() const { return _latencies; }
+    const std::vector<Commutation>& commutations() const { return _commutations; }
+    Time gatesOff() const { return _gatesOffAt; }   //last time every gate went off
+
+
+    virtual void gateWritten(int pin);
+
+private:
+    void step();
+    void phaseDrive(int phase, double& high, double& low, double& overlap) const;
+    int decodeBridge() const;
+    void scheduleHall(double e0, double e1);
+    void scheduleEncoder(double m0, double m1);
+    void emit(Time t, int pin, int level);
+    void hallEdge();
+
+    PlantParams _p;
+    MotorPins _pins;
+    double _theta;              //mechanical angle, rad
+    double _omega;              //rad/s
+    double _i[3];
+    double _torque;
+    double _bus;                //V at the bridge, from the last step's supply current
+    Time _t;
+
+    int _hallPins;              //levels as last scheduled
+    int _encPins;
+
+    int _bridge;
+    Time _lastHallEdge;
+    bool _answered;
+    bool _gatesOff;
+    Time _gatesOffAt;
+    std::vector<float> _latencies;
+    std::vector<Commutation> _commutations;
+    PlantStats _stats;
+};
+
+}
+
+#endif
@@ -0,0 +1,246 @@
+//Host stand-in for rtos.h (mbed OS 5 / RTX): threads, mutexes, semaphores and
+//queues on top of the cooperative scheduler in sim/sim.h.
+
+#ifndef SIM_RTOS_H
+#define SIM_RTOS_H
+
+#include <stdint.h>
+#include <deque>
+
+#include "mbed.h"
+
+typedef enum {
+    osPriorityIdle          = -3,
+    osPriorityLow           = -2,
+    osPriorityBelowNormal   = -1,
+    osPriorityNormal        =  0,
+    osPriorityAboveNormal   = +1,
+    osPriorityHigh          = +2,
+    osPriorityRealtime      = +3,
+    osPriorityError         = 0x84
+} osPriority;
+
+typedef enum {
+    osOK                    = 0,
+    osEventSignal           = 0x08,
+    osEventMessage          = 0x10,
+    osEventMail             = 0x20,
+    osEventTimeout          = 0x40,
+    osErrorParameter        = 0x80,
+    osErrorResource         = 0x81,
+    osErrorTimeoutResource  = 0xC1,
+    osErrorISR              = 0x82,
+    osErrorValue            = 0x86
+} osStatus;
+
+typedef void* osThreadId;
+
+typedef struct {
+    osStatus status;
+    union {
+        uint32_t v;
+        void* p;
+        int32_t signals;
+    } value;
+} osEvent;
+
+#define osWaitForever 0xFFFFFFFF
+#define DEFAULT_STACK_SIZE 2048
+
+namespace rtos {
+
+inline sim::Time simTimeout(uint32_t millisec) {
+    return millisec == osWaitForever ? sim::FOREVER : (sim::Time)millisec*sim::MS;
+}
+
+class Thread {
+public:
+    enum State { Inactive, Ready, Running, WaitingDelay, WaitingSemaphore, Deleted };
+
+    Thread(osPriority priority = osPriorityNormal, uint32_t stack_size = DEFAULT_STACK_SIZE,
+           unsigned char* stack_pointer = NULL) : _priority(priority), _task(0) {
+        (void)stack_size; (void)stack_pointer;
+    }
+
+    osStatus start(mbed::Callback<void()> task) {
+        if (_task) return osErrorParameter;
+        _task = sim::spawn([task]() { task(); }, _priority);
+        return osOK;
+    }
+    template <typename T, typename M>
+    osStatus start(T* obj, M method) { return start(mbed::Callback<void()>(obj, method)); }
+
+    osStatus join() {
+        while (sim::alive(_task)) sim::sleep(sim::MS);
+        return osOK;
+    }
+    osStatus terminate() {
+        sim::kill(_task);
+        return osOK;
+    }
+    osStatus set_priority(osPriority priority) {
+        _priority = priority;
+        if (_task) sim::setPriority(_task, priority);
+        return osOK;
+    }
+    osPriority get_priority() { return _priority; }
+
+    int32_t signal_set(int32_t signals) {
+        if (_task) sim::signalSet(_task, signals);
+        return signals;
+    }
+    State get_state() {
+        if (!_task) return Inactive;
+        return sim::alive(_task) ? Ready : Deleted;
+    }
+
+    static osEvent signal_wait(int32_t signals, uint32_t millisec = osWaitForever) {
+        osEvent evt;
+        evt.value.signals = sim::signalWait(signals, simTimeout(millisec));
+        evt.status = evt.value.signals ? osEventSignal : osEventTimeout;
+        return evt;
+    }
+
+    //RTX delays count kernel ticks (1 ms), so the first one is partial
+    static osStatus wait(uint32_t millisec) {
+        sim::Time wake = (sim::now()/sim::MS + millisec)*sim::MS;
+        sim::sleep(wake - sim::now());
+        return osEventTimeout;
+    }
+    static osStatus yield() {
+        sim::yield();
+        return osOK;
+    }
+    static osThreadId gettid() { return sim::currentTask(); }
+
+    virtual ~Thread() {}
+
+private:
+    osPriority _priority;
+    sim::Task* _task;
+};
+
+class Mutex {
+public:
+    Mutex() : _owner(0), _count(0) {}
+    osStatus lock(uint32_t millisec = osWaitForever) {
+        sim::Task* self = sim::currentTask();
+        while (_count && _owner != self) {
+            if (!sim::block(this, simTimeout(millisec))) return osErrorTimeoutResource;
+        }
+        _owner = self;
+        _count++;
+        return osOK;
+    }
+    bool trylock() { return lock(0) == osOK; }
+    osStatus unlock() {
+        if (_count && --_count == 0) {
+            _owner = 0;
+            sim::wake(this);
+        }
+        return osOK;
+    }
+private:
+    sim::Task* _owner;
+    int _count;
+};
+
+class Semaphore {
+public:
+    Semaphore(int32_t count = 0) : _count(count) {}
+    int32_t wait(uint32_t millisec = osWaitForever) {
+        while (_count == 0) {
+            if (!sim::block(this, simTimeout(millisec))) return 0;
+        }
+        return _count--;
+    }
+    osStatus release() {
+        _count++;
+        sim::wake(this);
+        return osOK;
+    }
+private:
+    int32_t _count;
+};
+
+template <typename T, uint32_t queue_sz>
+class Queue {
+public:
+    osStatus put(T* data, uint32_t millisec = 0) {
+        while (_items.size() >= queue_sz) {
+            if (millisec == 0 || sim::inIsr() || !sim::block(&_items, simTimeout(millisec))) return osErrorResource;
+        }
+        _items.push_back(data);
+        sim::wake(this);
+        return osOK;
+    }
+    osEvent get(uint32_t millisec = osWaitForever) {
+        osEvent evt;
+        while (_items.empty()) {
+            if (millisec == 0 || !sim::block(this, simTimeout(millisec))) {
+                evt.status = millisec == 0 ? osOK : osEventTimeout;
+                evt.value.p = 0;
+                return evt;
+            }
+        }
+        evt.status = osEventMessage;
+        evt.value.p = _items.front();
+        _items.pop_front();
+        sim::wake(&_items);
+        return evt;
+    }
+private:
+    std::deque<T*> _items;
+};
+
+template <typename T, uint32_t pool_sz>
+class MemoryPool {
+public:
+    MemoryPool() {
+        for (uint32_t i = 0; i < pool_sz; i++) _free[i] = true;
+    }
+    T* alloc() {
+        for (uint32_t i = 0; i < pool_sz; i++) {
+            if (_free[i]) {
+                _free[i] = false;
+                return &_items[i];
+            }
+        }
+        return NULL;
+    }
+    T* calloc() {
+        T* item = alloc();
+        if (item) memset(item, 0, sizeof(T));
+        return item;
+    }
+    osStatus free(T* item) {
+        _free[item - _items] = true;
+        return osOK;
+    }
+private:
+    T _items[pool_sz];
+    bool _free[pool_sz];
+};
+
+template <typename T, uint32_t queue_sz>
+class Mail {
+public:
+    T* alloc(uint32_t millisec = 0) { (void)millisec; return _pool.alloc(); }
+    T* calloc(uint32_t millisec = 0) { (void)millisec; return _pool.calloc(); }
+    osStatus put(T* mptr) { return _queue.put(mptr); }
+    osEvent get(uint32_t millisec = osWaitForever) {
+        osEvent evt = _queue.get(millisec);
+        if (evt.status == osEventMessage) evt.status = osEventMail;
+        return evt;
+    }
+    osStatus free(T* mptr) { return _pool.free(mptr); }
+private:
+    Queue<T, queue_sz> _queue;
+    MemoryPool<T, queue_sz> _pool;
+};
+
+}
+
+using namespace rtos;
+
+#endif
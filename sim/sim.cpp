@@ -0,0 +1,553 @@
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+
+#include <deque>
+#include <map>
+#include <queue>
+#include <unordered_set>
+
+namespace sim {
+
+namespace {
+
+const size_t STACK_SIZE = 512*1024;
+const Time ROUND_ROBIN = 5*MS;      //RTX time slice for threads of equal priority
+
+enum TaskState { READY, SLEEPING, BLOCKED, DEAD };
+
+struct Event {
+    Time t;
+    uint64_t seq;
+    EventId id;
+    bool isr;
+    std::function<void()> fn;
+};
+
+struct Later {
+    bool operator()(const Event* a, const Event* b) const {
+        return a->t != b->t ? a->t > b->t : a->seq > b->seq;
+    }
+};
+
+}
+
+struct Task {
+    ucontext_t ctx;
+    char* stack;
+    std::function<void()> fn;
+    int priority;
+    TaskState state;
+    const void* waitObj;
+    EventId timeout;
+    bool timedOut;
+    int32_t signals;
+    int32_t waitSignals;
+    uint64_t readySeq;
+    Time sliceStart;
+};
+
+namespace {
+
+struct Kernel {
+    Time now;
+    Time stop;
+    bool running;
+    int isrDepth;
+    int irqMask;
+
+    std::priority_queue<Event*, std::vector<Event*>, Later> events;
+    std::unordered_set<EventId> cancelled;
+    uint64_t seq;
+    EventId nextId;
+    std::deque<std::function<void()> > pendingIsr;
+
+    std::vector<Task*> tasks;
+    Task* current;
+    ucontext_t sched;
+    uint64_t readySeq;
+
+    std::map<int, Pin> pins;
+    Costs costs;
+
+    std::string console;
+    bool echo;
+    Time lineFree;
+    std::deque<int> rx;
+    std::function<void()> rxIrq;
+    std::string capture;
+    Time captureFree;
+
+    Kernel() : now(0), stop(0), running(false), isrDepth(0), irqMask(0), seq(0), nextId(1),
+               current(0), readySeq(0), echo(false), lineFree(0),
+               captureFree(0) {
+        costs.irqEntry = 1500;
+        costs.gpioRead = 100;
+        costs.pwmWrite = 3000;
+        costs.pwmPeriod = 20000;
+        costs.timerRead = 300;
+        costs.regWrite = 40;
+        costs.adcRead = 5000;
+        costs.baud = 9600;
+    }
+};
+
+Kernel& K() {
+    static Kernel k;
+    return k;
+}
+
+void runUntil(Time target);
+
+void makeReady(Task* t) {
+    Kernel& k = K();
+    if (t->timeout) {
+        k.cancelled.insert(t->timeout);
+        t->timeout = 0;
+    }
+    t->state = READY;
+    t->waitObj = 0;
+    t->readySeq = ++k.readySeq;
+}
+
+Task* pickReady() {
+    Task* best = 0;
+    for (size_t i = 0; i < K().tasks.size(); i++) {
+        Task* t = K().tasks[i];
+        if (t->state != READY) continue;
+        if (!best || t->priority > best->priority ||
+            (t->priority == best->priority && t->readySeq < best->readySeq)) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+//Give the CPU back to the scheduler. Returns when the task is picked again.
+void switchOut() {
+    Kernel& k = K();
+    Task* t = k.current;
+    swapcontext(&t->ctx, &k.sched);
+}
+
+void checkStop() {
+    Kernel& k = K();
+    if (k.now >= k.stop && k.current) {
+        k.current->state = DEAD;
+        switchOut();
+    }
+}
+
+void preemptCheck() {
+    Kernel& k = K();
+    Task* cur = k.current;
+    if (!cur || k.isrDepth) return;
+    if (cur->state != READY) {
+        switchOut();
+        return;
+    }
+    Task* best = pickReady();
+    if (best == cur || !best) return;
+    if (best->priority > cur->priority) {
+        switchOut();
+    }
+    else if (best->priority == cur->priority && k.now - cur->sliceStart >= ROUND_ROBIN) {
+        cur->readySeq = ++k.readySeq;
+        switchOut();
+    }
+}
+
+void runIsr() {
+    Kernel& k = K();
+    std::function<void()> fn = k.pendingIsr.front();
+    k.pendingIsr.pop_front();
+    k.isrDepth++;
+    advance(k.costs.irqEntry);
+    fn();
+    k.isrDepth--;
+}
+
+void runUntil(Time target) {
+    Kernel& k = K();
+    for (;;) {
+        if (!k.isrDepth && !k.irqMask && !k.pendingIsr.empty()) {
+            runIsr();
+            continue;
+        }
+        if (k.events.empty() || k.events.top()->t > target) break;
+        Event* e = k.events.top();
+        k.events.pop();
+        if (k.cancelled.erase(e->id)) {
+            delete e;
+            continue;
+        }
+        if (e->t > k.now) k.now = e->t;
+        if (e->isr) k.pendingIsr.push_back(e->fn);
+        else e->fn();
+        delete e;
+        checkStop();
+    }
+    if (k.now < target) k.now = target;
+    checkStop();
+    preemptCheck();
+}
+
+void taskMain() {
+    Kernel& k = K();
+    Task* t = k.current;
+    t->fn();
+    t->state = DEAD;
+    setcontext(&k.sched);
+}
+
+}
+
+Costs& costs() { return K().costs; }
+
+Time now() { return K().now; }
+
+bool running() { return K().running; }
+
+bool inIsr() { return K().isrDepth > 0; }
+
+void disableIrq() { K().irqMask++; }
+
+void enableIrq() {
+    Kernel& k = K();
+    if (k.irqMask && --k.irqMask == 0 && k.running && !k.pendingIsr.empty()) runUntil(k.now);
+}
+
+bool irqEnabled() { return K().irqMask == 0; }
+
+void advance(Time ns) {
+    Kernel& k = K();
+    if (!k.running) return;
+    Time target = k.now + ns;
+    if ((k.isrDepth || k.irqMask || k.pendingIsr.empty()) &&
+        (k.events.empty() || k.events.top()->t > target)) {
+        k.now = target;
+        if (target >= k.stop) checkStop();
+        return;
+    }
+    runUntil(target);
+}
+
+/////////////////////////////////THREADS/////////////////////////////////////////////////////
+
+Task* spawn(const std::function<void()>& fn, int priority) {
+    Kernel& k = K();
+    Task* t = new Task();
+    t->stack = (char*)malloc(STACK_SIZE);
+    t->fn = fn;
+    t->priority = priority;
+    t->waitObj = 0;
+    t->timeout = 0;
+    t->timedOut = false;
+    t->signals = 0;
+    t->waitSignals = 0;
+    getcontext(&t->ctx);
+    t->ctx.uc_stack.ss_sp = t->stack;
+    t->ctx.uc_stack.ss_size = STACK_SIZE;
+    t->ctx.uc_link = 0;
+    makecontext(&t->ctx, taskMain, 0);
+    makeReady(t);
+    k.tasks.push_back(t);
+    preemptCheck();
+    return t;
+}
+
+Task* currentTask() { return K().current; }
+
+void setPriority(Task* task, int priority) {
+    task->priority = priority;
+    preemptCheck();
+}
+
+int priority(Task* task) { return task->priority; }
+
+bool alive(Task* task) { return task && task->state != DEAD; }
+
+void kill(Task* task) {
+    Kernel& k = K();
+    if (!task || task->state == DEAD) return;
+    if (task->timeout) k.cancelled.insert(task->timeout);
+    task->timeout = 0;
+    task->state = DEAD;
+    if (task == k.current && !k.isrDepth) switchOut();
+}
+
+namespace {
+
+//Suspend the current task until made ready, or until timeout (FOREVER for none).
+bool suspend(TaskState state, const void* obj, Time timeout) {
+    Kernel& k = K();
+    Task* t = k.current;
+    if (!t || k.isrDepth) {
+        //Not a thread: nothing to switch to, so spin instead
+        if (timeout != FOREVER) advance(timeout);
+        return false;
+    }
+    t->state = state;
+    t->waitObj = obj;
+    t->timedOut = false;
+    if (timeout != FOREVER) {
+        t->timeout = at(k.now + timeout, [t]() {
+            t->timeout = 0;
+            if (t->state == SLEEPING || t->state == BLOCKED) {
+                t->timedOut = true;
+                makeReady(t);
+            }
+        }, false);
+    }
+    switchOut();
+    return !t->timedOut;
+}
+
+}
+
+void sleep(Time ns) {
+    suspend(SLEEPING, 0, ns);
+}
+
+bool block(const void* obj, Time timeout) {
+    return suspend(BLOCKED, obj, timeout);
+}
+
+void wake(const void* obj) {
+    Kernel& k = K();
+    for (size_t i = 0; i < k.tasks.size(); i++) {
+        Task* t = k.tasks[i];
+        if (t->state == BLOCKED && t->waitObj == obj) makeReady(t);
+    }
+    if (!k.isrDepth) preemptCheck();
+}
+
+void yield() {
+    Kernel& k = K();
+    if (!k.current || k.isrDepth) return;
+    k.current->readySeq = ++k.readySeq;
+    if (pickReady() != k.current) switchOut();
+}
+
+void signalSet(Task* task, int32_t signals) {
+    task->signals |= signals;
+    if (task->state == BLOCKED && task->waitObj == &task->signals) {
+        int32_t want = task->waitSignals;
+        if (want ? (task->signals & want) == want : task->signals != 0) {
+            makeReady(task);
+            if (!K().isrDepth) preemptCheck();
+        }
+    }
+}
+
+int32_t signalWait(int32_t signals, Time timeout) {
+    Task* t = K().current;
+    for (;;) {
+        int32_t got = signals ? (t->signals & signals) : t->signals;
+        if (signals ? got == signals : got != 0) {
+            t->signals &= ~got;
+            return got;
+        }
+        t->waitSignals = signals;
+        if (!block(&t->signals, timeout)) return 0;
+    }
+}
+
+/////////////////////////////////EVENTS//////////////////////////////////////////////////////
+
+EventId at(Time t, const std::function<void()>& fn, bool isr) {
+    Kernel& k = K();
+    Event* e = new Event();
+    e->t = t;
+    e->seq = ++k.seq;
+    e->id = k.nextId++;
+    e->isr = isr;
+    e->fn = fn;
+    k.events.push(e);
+    return e->id;
+}
+
+void cancel(EventId id) {
+    if (id) K().cancelled.insert(id);
+}
+
+void pendIsr(const std::function<void()>& fn) {
+    K().pendingIsr.push_back(fn);
+}
+
+void every(Time period, const std::function<void()>& fn) {
+    struct Periodic {
+        Time period;
+        std::function<void()> fn;
+        void arm(Time t) {
+            at(t, [this, t]() {
+                fn();
+                arm(t + period);
+            }, false);
+        }
+    };
+    Periodic* p = new Periodic();
+    p->period = period;
+    p->fn = fn;
+    p->arm(K().now + period);
+}
+
+/////////////////////////////////PINS////////////////////////////////////////////////////////
+
+Pin& pin(int name) {
+    std::map<int, Pin>::iterator it = K().pins.find(name);
+    if (it == K().pins.end()) {
+        Pin p;
+        p.level = 0;
+        p.duty = 0;
+        p.voltage = 0;
+        p.irq = 0;
+        p.timer = 0;
+        p.gate = 0;
+        it = K().pins.insert(std::make_pair(name, p)).first;
+    }
+    return it->second;
+}
+
+void setLevel(int name, int level) {
+    Pin& p = pin(name);
+    if (p.level == level) return;
+    p.level = level;
+    if (p.irq) p.irq->pinChanged(name);
+    if (p.timer) p.timer->pinChanged(name);
+}
+
+void writeDuty(int name, float duty) {
+    Pin& p = pin(name);
+    p.duty = duty;
+    if (p.gate) p.gate->gateWritten(name);
+}
+
+/////////////////////////////////SERIAL//////////////////////////////////////////////////////
+
+std::string& console() { return K().console; }
+
+void setEcho(bool echo) { K().echo = echo; }
+
+void consoleWrite(const char* s, int n) {
+    K().console.append(s, n);
+    if (K().echo) fwrite(s, 1, n, stdout);
+}
+
+void uartPutc(int c) {
+    Kernel& k = K();
+    Time charTime = 10*SEC/k.costs.baud;
+    //One character can sit in the data register while another is shifted out
+    if (k.running && k.lineFree > k.now + charTime) advance(k.lineFree - charTime - k.now);
+    k.lineFree = (k.lineFree > k.now ? k.lineFree : k.now) + charTime;
+    char ch = (char)c;
+    consoleWrite(&ch, 1);
+}
+
+void typeAt(Time t, const std::string& text) {
+    Time charTime = 10*SEC/K().costs.baud;
+    for (size_t i = 0; i < text.size(); i++) {
+        int c = (unsigned char)text[i];
+        at(t + i*charTime, [c]() {
+            Kernel& k = K();
+            k.rx.push_back(c);
+            if (k.rxIrq) pendIsr(k.rxIrq);
+            wake(&k.rx);
+        }, false);
+    }
+}
+
+bool rxReadable() { return !K().rx.empty(); }
+
+int rxGet() {
+    Kernel& k = K();
+    while (k.rx.empty()) block(&k.rx, FOREVER);
+    int c = k.rx.front();
+    k.rx.pop_front();
+    return c;
+}
+
+void rxAttach(const std::function<void()>& fn) { K().rxIrq = fn; }
+
+void uartWriteAsync(const uint8_t* data, int length, int baud, const std::function<void()>& done) {
+    Kernel& k = K();
+    advance(k.costs.regWrite*4);
+    k.capture.append((const char*)data, length);
+    k.captureFree = (k.captureFree > k.now ? k.captureFree : k.now) + (Time)length*10*SEC/baud;
+    std::function<void()> fn = done;
+    at(k.captureFree, [fn]() { fn(); }, true);
+}
+
+std::string& uartCapture() { return K().capture; }
+
+/////////////////////////////////RUN/////////////////////////////////////////////////////////
+
+void run(Time duration, const std::function<void()>& entry) {
+    Kernel& k = K();
+    k.running = true;
+    k.stop = k.now + duration;
+    spawn(entry, 0);
+    while (k.now < k.stop) {
+        Task* t = pickReady();
+        if (t) {
+            k.current = t;
+            t->sliceStart = k.now;
+            swapcontext(&k.sched, &t->ctx);
+            k.current = 0;
+            k.isrDepth = 0;
+            continue;
+        }
+        Time next = k.stop;
+        if (!k.events.empty() && k.events.top()->t < next) next = k.events.top()->t;
+        runUntil(next);
+    }
+    for (size_t i = 0; i < k.tasks.size(); i++) {
+        free(k.tasks[i]->stack);
+        delete k.tasks[i];
+    }
+    k.tasks.clear();
+    k.pendingIsr.clear();
+    k.running = false;
+}
+
+bool isolatedRaw(const std::function<void(void*)>& fn, void* result, size_t size) {
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        close(fds[0]);
+        fn(result);
+        fflush(stdout);
+        const char* p = (const char*)result;
+        size_t left = size;
+        while (left) {
+            ssize_t n = write(fds[1], p, left);
+            if (n <= 0) break;
+            p += n;
+            left -= n;
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    char* p = (char*)result;
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fds[0], p + got, size - got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return got == size && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+}
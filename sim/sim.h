@@ -0,0 +1,160 @@
+//Host-side simulation kernel for the motor firmware.
+//
+//Provides simulated time, cooperative RTOS-style threads, interrupts, timer events
+//and the pin registry that the mbed shim (sim/mbed.h) and the plant model
+//(sim/plant.h) talk to. Everything is single threaded and deterministic: time only
+//moves when the firmware consumes modelled CPU time or every thread is blocked.
+
+#ifndef SIM_SIM_H
+#define SIM_SIM_H
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+typedef uint64_t Time;              //nanoseconds since the start of the run
+
+const Time NS = 1;
+const Time US = 1000;
+const Time MS = 1000000;
+const Time SEC = 1000000000;
+const Time FOREVER = ~(Time)0;
+
+inline Time fromSeconds(double s) { return (Time)(s*1e9 + 0.5); }
+inline double toSeconds(Time t) { return t*1e-9; }
+
+//Modelled CPU cost of the mbed calls the firmware makes on the F303K8 at 72 MHz.
+//These are estimates from reading the HAL paths (pwmout_write() does float maths
+//plus HAL_TIM_PWM_ConfigChannel()/HAL_TIM_PWM_Start(), InterruptIn goes through
+//handle_interrupt_in() and the CThunk), not measurements on a board.
+struct Costs {
+    Time irqEntry;      //exception entry + mbed EXTI/ticker dispatch to the callback
+    Time gpioRead;      //DigitalIn read, including the polling loop around it
+    Time pwmWrite;      //PwmOut::write()
+    Time pwmPeriod;     //PwmOut::period_us(), re-initialises the timer
+    Time timerRead;     //Timer::read()/us_ticker_read()
+    Time regWrite;      //one peripheral register write (or read-modify-write)
+    Time adcRead;       //AnalogIn::read(), channel setup and one polled conversion
+    uint32_t baud;      //UART rate used to time printf/putc
+};
+Costs& costs();
+
+/////////////////////////////////TIME////////////////////////////////////////////////////////
+
+Time now();
+
+//Consume CPU time in the calling context (thread or ISR). Interrupts that become due
+//while a thread is busy are run before this returns.
+void advance(Time ns);
+
+bool running();
+bool inIsr();
+
+//__disable_irq()/__enable_irq(): interrupts stay pending while masked
+void disableIrq();
+void enableIrq();
+bool irqEnabled();
+
+/////////////////////////////////THREADS/////////////////////////////////////////////////////
+
+struct Task;
+
+Task* spawn(const std::function<void()>& fn, int priority);
+Task* currentTask();
+void setPriority(Task* task, int priority);
+int priority(Task* task);
+void kill(Task* task);
+bool alive(Task* task);
+
+//Block the calling thread. block() returns false if the timeout expired before
+//wake() was called on obj.
+void sleep(Time ns);
+bool block(const void* obj, Time timeout);
+void wake(const void* obj);
+void yield();
+
+//Thread signal flags (Thread::signal_set/signal_wait)
+void signalSet(Task* task, int32_t signals);
+int32_t signalWait(int32_t signals, Time timeout);
+
+/////////////////////////////////EVENTS//////////////////////////////////////////////////////
+
+typedef uint64_t EventId;
+
+//Run fn at time t. isr events go through the interrupt path (entry cost, no nesting);
+//others are kernel-internal and take no simulated time.
+EventId at(Time t, const std::function<void()>& fn, bool isr);
+void cancel(EventId id);
+
+//Request an interrupt now (e.g. a UART RX byte).
+void pendIsr(const std::function<void()>& fn);
+
+/////////////////////////////////PINS////////////////////////////////////////////////////////
+
+struct GateListener {
+    virtual void gateWritten(int pin) = 0;
+    virtual ~GateListener() {}
+};
+
+struct InterruptSink {
+    virtual void pinChanged(int pin) = 0;
+    virtual ~InterruptSink() {}
+};
+
+struct Pin {
+    int level;                  //input level driven by the plant
+    float duty;                 //output duty written by PwmOut
+    float voltage;              //analog input level driven by the plant, V
+    InterruptSink* irq;         //EXTI owner: the last InterruptIn created on the pin
+    InterruptSink* timer;       //timer input the pin is muxed to with pin_function()
+    GateListener* gate;
+};
+
+Pin& pin(int name);
+void setLevel(int name, int level);         //drive an input, raising its EXTI interrupt
+                                            //and telling its timer
+void writeDuty(int name, float duty);
+
+/////////////////////////////////SERIAL//////////////////////////////////////////////////////
+
+//Characters written by the firmware, and a script of characters to type at it.
+std::string& console();
+void setEcho(bool echo);
+void consoleWrite(const char* s, int n);
+
+//Blocking UART transmit: waits while the data register is full, as serial_putc() does
+void uartPutc(int c);
+void typeAt(Time t, const std::string& text);
+bool rxReadable();
+int rxGet();
+void rxAttach(const std::function<void()>& fn);
+
+//Transmit on a port other than the console, in the background: done runs as an
+//interrupt once the last byte has gone at baud. Bytes queue behind any still going.
+void uartWriteAsync(const uint8_t* data, int length, int baud, const std::function<void()>& done);
+std::string& uartCapture();             //everything sent that way
+
+/////////////////////////////////RUN/////////////////////////////////////////////////////////
+
+//Call fn every period (kernel-internal), e.g. to step a plant or record a trace.
+void every(Time period, const std::function<void()>& fn);
+
+//Run entry as the first firmware thread for the given simulated duration. Every
+//thread is abandoned when the time is up.
+void run(Time duration, const std::function<void()>& entry);
+
+//Run fn in a forked child so firmware globals start fresh; the child's result is
+//copied back through a pipe. T must be trivially copyable.
+bool isolatedRaw(const std::function<void(void*)>& fn, void* result, size_t size);
+
+template <typename T>
+bool isolated(const std::function<void(T&)>& fn, T& result) {
+    return isolatedRaw([&](void* p) { fn(*(T*)p); }, &result, sizeof(T));
+}
+
+}
+
+#endif
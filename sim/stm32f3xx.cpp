@@ -0,0 +1,1114 @@
+//Register-level models of the STM32F303K8 timers that drive the motor gates, of the
+//ADC and DMA channel that sample the phase currents, and of the comparators.
+//
+//Each output pin's duty is recomputed from the timer registers whenever one of them
+//is written, the same way the hardware derives OCxREF and the CHx/CHxN outputs:
+//
+//  OCxM force inactive/active  -> 0/1
+//  OCxM PWM mode 1/2           -> CCRx/(ARR+1), or CCRx/ARR center-aligned
+//  CCxE/CCxNE, CCxP/CCxNP      -> output enable and polarity; CHxN is the inverse of
+//                                 OCxREF when CHx is also enabled, OCxREF otherwise
+//  BDTR.DTG                    -> with both CHx and CHxN enabled, each pulse of either
+//                                 starts the dead time late (before polarity)
+//  BDTR.MOE                    -> outputs of TIM1/15/16/17 off when clear
+//
+//With DIER.UIE set and the NVIC line enabled, update events raise the timer's
+//interrupt every (PSC+1)*(ARR+1)*(RCR+1) clocks, or (PSC+1)*ARR*(RCR+1) when
+//center-aligned (an update at each overflow and underflow). With CR2.MMS = update
+//the same events pulse TRGO for the ADC external trigger.
+//
+//CNT reads give the count from the time since CEN was set (or EGR.UG), up and down
+//when center-aligned. With CC1 or CC2 an output and DIER.CCxIE set the count reaching
+//CCRx sets SR.CCxIF and raises the capture/compare interrupt; channels 3-4 don't
+//compare.
+//
+//Pins muxed to a timer input with pin_function() drive TI1, XORed with TI2 and TI3
+//when CR2.TI1S is set. A change of TI1 only reaches TI1F once it has held for the
+//IC1F filter's samples, so shorter glitches are lost. Each TI1F edge captures the
+//count in CCR1 with CC1 an input on TI1 (CCER.CC1P/CC1NP pick the edges) or on TRC
+//with SMCR.TS = TI1F_ED, and resets the counter in SMCR.SMS reset mode.
+//
+//With CR2.CCPC set, writes to CCMRx and CCER go to the preload registers and only
+//reach the outputs on EGR.COMG, as on the real advanced-control timers. CCRx and ARR
+//apply straight away rather than at the next update event: the plant works with
+//duties averaged over a PWM period, so that delay can't be seen.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <map>
+
+#include "sim.h"
+#include "PinNames.h"
+#include "stm32f3xx.h"
+
+uint32_t SystemCoreClock = 72000000;
+
+/////////////////////////////////NVIC////////////////////////////////////////////////////////
+
+namespace {
+
+struct Line {
+    uintptr_t vector;
+    bool enabled;
+};
+
+std::map<int, Line>& lines() {
+    static std::map<int, Line> l;
+    return l;
+}
+
+}
+
+namespace sim {
+void nvicChanged();
+}
+
+void NVIC_SetVector(IRQn_Type irq, uintptr_t vector) {
+    lines()[irq].vector = vector;
+    sim::nvicChanged();
+}
+
+uintptr_t NVIC_GetVector(IRQn_Type irq) { return lines()[irq].vector; }
+
+void NVIC_EnableIRQ(IRQn_Type irq) {
+    lines()[irq].enabled = true;
+    sim::nvicChanged();
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq) {
+    lines()[irq].enabled = false;
+    sim::nvicChanged();
+}
+
+void NVIC_SetPriority(IRQn_Type, uint32_t) {}
+
+namespace sim {
+
+bool irqEnabled(IRQn_Type irq) {
+    Line& l = lines()[irq];
+    return l.enabled && l.vector;
+}
+
+void raiseIrq(IRQn_Type irq) {
+    if (!irqEnabled(irq)) return;
+    pendIsr((void (*)())lines()[irq].vector);
+}
+
+void Reg::set(uint32_t x) {
+    v = x;
+    advance(costs().regWrite);
+    if (owner) owner->written(this);
+}
+
+uint32_t Reg::get() const {
+    if (owner) owner->read(const_cast<Reg*>(this));
+    return v;
+}
+
+namespace {
+
+//A timer channel pin: CHx, or CHxN if complementary, with the alternate function
+//that takes it there
+struct Output {
+    int timer;
+    int channel;
+    bool complementary;
+    int pin;
+    int af;
+    bool pwmMap;                    //the one PwmOut muxes the pin to
+};
+
+//Gate drive pins on the Nucleo-F303K8. PwmOut takes the entry in the PeripheralPins.c
+//PWM map; the others are only reached with pin_function().
+const Output outputs[] = {
+    {17, 1, true, PB_7, 1, true},           //D4  L1L
+    {16, 1, true, PB_6, 1, true},           //D5  L1H
+    {1, 2, true, PB_0, 6, true},            //D3  L2L
+    {16, 1, false, PA_12, 1, true},         //D2  TIM16_CH1, phase 1's timer
+    {1, 2, true, PA_12, 6, false},          //D2  L2L with the halls on TIM3
+    {1, 3, true, PB_1, 6, true},            //D6  L2H
+    {1, 1, false, PA_8, 6, true},           //D9  L3L
+    {1, 4, false, PA_11, 11, true},         //D10 TIM1_CH4
+    {1, 1, true, PA_11, 6, false},          //D10 L3H, L3L's partner
+};
+const int numOutputs = sizeof(outputs)/sizeof(outputs[0]);
+
+//Timer input pins, with the alternate function that takes them there
+struct Input {
+    int timer;
+    int channel;
+    int pin;
+    int af;
+};
+
+const Input inputs[] = {
+    {3, 1, PB_4, 2},                //D12
+    {3, 2, PB_5, 2},                //D11
+    {3, 3, PB_0, 2},                //D3
+};
+const int numInputs = sizeof(inputs)/sizeof(inputs[0]);
+
+//Output pins muxed to a timer channel, by a PwmOut or pin_function()
+std::map<int, const Output*>& pwmPins() {
+    static std::map<int, const Output*> pins;
+    return pins;
+}
+
+bool advanced(int n) { return n == 1 || n == 15 || n == 16 || n == 17; }
+
+IRQn_Type updateIrq(int n) {
+    switch (n) {
+        case 1: case 16: return TIM1_UP_TIM16_IRQn;
+        case 15: return TIM1_BRK_TIM15_IRQn;
+        case 17: return TIM1_TRG_COM_TIM17_IRQn;
+        case 3: return TIM3_IRQn;
+        default: return TIM2_IRQn;
+    }
+}
+
+IRQn_Type compareIrq(int n) {
+    return (n == 1) ? TIM1_CC_IRQn : updateIrq(n);
+}
+
+class TimerModel : public Peripheral, public InterruptSink {
+public:
+    TimerModel(int n)
+        : _n(n), _ccmr1(0), _ccmr2(0), _ccer(0), _sr(0), _dier(0), _update(0), _filter(0), _psc(0),
+          _running(false), _start(0), _ti1(0), _ti1f(0) {
+        Reg* r = &regs.CR1;
+        for (size_t i = 0; i < sizeof(TIM_TypeDef)/sizeof(Reg); i++) r[i].owner = this;
+        regs.ARR.v = 0xFFFF;
+        _compare[0] = _compare[1] = 0;
+    }
+
+    virtual void written(Reg* reg) {
+        if (reg == &regs.EGR) {
+            if ((reg->v & TIM_EGR_COMG) && (regs.CR2.v & TIM_CR2_CCPC)) {
+                _ccmr1 = regs.CCMR1.v;
+                _ccmr2 = regs.CCMR2.v;
+                _ccer = regs.CCER.v;
+            }
+            if (reg->v & TIM_EGR_UG) {
+                _psc = regs.PSC.v;
+                restart(0);
+            }
+            reg->v = 0;                 //EGR bits clear themselves
+        }
+        else if (reg == &regs.SR) {
+            reg->v &= _sr;              //flags are cleared by writing 0
+            _sr = reg->v;
+        }
+        else if (reg == &regs.CR1) {
+            //the count stops where it is and carries on from there
+            bool was = _running;
+            _running = reg->v & TIM_CR1_CEN;
+            if (_running && !was) restart(regs.CNT.v);
+            else if (!_running && was) regs.CNT.v = count(now());
+            schedule();
+        }
+        else if (reg == &regs.CR2 || reg == &regs.DIER) {
+            if (reg == &regs.CR2) inputsMuxed();
+            //a capture or compare already flagged interrupts once it is enabled
+            if (reg == &regs.DIER && (reg->v & ~_dier & _sr & (TIM_DIER_CC1IE | TIM_DIER_CC2IE))) {
+                raiseIrq(compareIrq(_n));
+            }
+            _dier = regs.DIER.v;
+            schedule();
+        }
+        else if (reg == &regs.PSC || reg == &regs.CNT) {
+            //the prescaler is taken straight away rather than at the next update event
+            uint32_t c = (reg == &regs.CNT) ? reg->v : count(now());
+            _psc = regs.PSC.v;
+            restart(c);
+        }
+        else if (reg == &regs.CCR1 || reg == &regs.CCR2 || reg == &regs.ARR) {
+            schedule();
+        }
+        else if (!(regs.CR2.v & TIM_CR2_CCPC)) {
+            _ccmr1 = regs.CCMR1.v;
+            _ccmr2 = regs.CCMR2.v;
+            _ccer = regs.CCER.v;
+        }
+        apply();
+    }
+
+    virtual void read(Reg* reg) {
+        if (reg == &regs.CNT && _running) reg->v = count(now());
+    }
+
+    //An input pin changed: TI1 goes through the filter to the edge detector
+    virtual void pinChanged(int) {
+        int ti1 = inputLevel();
+        if (ti1 == _ti1) return;
+        _ti1 = ti1;
+        cancel(_filter);
+        _filter = 0;
+        Time delay = filterDelay();
+        if (!delay) {
+            filtered();
+            return;
+        }
+        _filter = at(now() + delay, [this]() {
+            _filter = 0;
+            filtered();
+        }, false);
+    }
+
+    //The input filter starts out at the level the pins are at, without an edge, when
+    //they are muxed or CR2.TI1S changes
+    void inputsMuxed() {
+        _ti1 = _ti1f = inputLevel();
+    }
+
+    //Recompute every output of this timer, passing changes on to the pins
+    void apply() {
+        for (int i = 0; i < numOutputs; i++) {
+            std::map<int, const Output*>::iterator muxed = pwmPins().find(outputs[i].pin);
+            if (outputs[i].timer != _n || muxed == pwmPins().end() || muxed->second != &outputs[i]) continue;
+            float duty = output(outputs[i].channel, outputs[i].complementary);
+            if (pin(outputs[i].pin).duty != duty) writeDuty(outputs[i].pin, duty);
+        }
+    }
+
+    //Start or stop the update events to match CEN, and UIE and the NVIC or TRGO, and
+    //move the compare events to CCR1 and CCR2
+    void schedule() {
+        bool on = (regs.CR1.v & TIM_CR1_CEN) &&
+                  (((regs.DIER.v & TIM_DIER_UIE) && irqEnabled(updateIrq(_n))) || trgoOnUpdate());
+        if (!on) {
+            cancel(_update);
+            _update = 0;
+        }
+        else if (!_update) {
+            arm(now());
+        }
+        for (int c = 1; c <= 2; c++) {
+            cancel(_compare[c - 1]);
+            _compare[c - 1] = 0;
+            //CCxS is the bottom two bits of each half of CCMR1
+            if ((regs.CR1.v & TIM_CR1_CEN) && (regs.DIER.v & (TIM_DIER_CC1IE << (c - 1))) &&
+                !(regs.CCMR1.v & (TIM_CCMR1_CC1S << 8*(c - 1))) && irqEnabled(compareIrq(_n))) {
+                armCompare(c);
+            }
+        }
+    }
+
+    //Write a register without charging CPU time, for the HAL calls behind PwmOut
+    void quiet(Reg& reg, uint32_t value) {
+        reg.v = value;
+        written(&reg);
+    }
+
+    TIM_TypeDef regs;
+
+private:
+    bool trgoOnUpdate() { return (regs.CR2.v & TIM_CR2_MMS) == TIM_CR2_MMS_1; }
+
+    //Timer clocks per PWM period
+    double periodTicks() {
+        double counts = (regs.CR1.v & TIM_CR1_CMS) ? 2.0*regs.ARR.v : regs.ARR.v + 1.0;
+        return (regs.PSC.v + 1.0)*counts;
+    }
+
+    //BDTR.DTG in timer clocks, with CKD = 0
+    double deadTicks() {
+        uint32_t dtg = regs.BDTR.v & TIM_BDTR_DTG;
+        if ((dtg & 0x80) == 0) return dtg;
+        if ((dtg & 0xC0) == 0x80) return (64 + (dtg & 0x3F))*2;
+        if ((dtg & 0xE0) == 0xC0) return (32 + (dtg & 0x1F))*8;
+        return (32 + (dtg & 0x1F))*16;
+    }
+
+    //OCxREF duty from the active output compare mode
+    float reference(int channel) {
+        uint32_t ccmr = (channel <= 2) ? _ccmr1 : _ccmr2;
+        int shift = (channel & 1) ? 0 : 8;
+        uint32_t mode = ((ccmr >> (4 + shift)) & 7) | (((ccmr >> (16 + shift)) & 1) << 3);
+        const Reg* ccr[4] = {&regs.CCR1, &regs.CCR2, &regs.CCR3, &regs.CCR4};
+        double top = (regs.CR1.v & TIM_CR1_CMS) ? regs.ARR.v : regs.ARR.v + 1.0;
+        double pwm = top > 0 ? ccr[channel - 1]->v/top : 0;
+        if (pwm > 1) pwm = 1;
+        switch (mode) {
+            case 4: return 0;
+            case 5: return 1;
+            case 6: return (float)pwm;
+            case 7: return (float)(1 - pwm);
+            default: return 0;
+        }
+    }
+
+    float output(int channel, bool complementary) {
+        if (advanced(_n) && !(regs.BDTR.v & TIM_BDTR_MOE)) return 0;
+        int shift = 4*(channel - 1);
+        bool e = _ccer & (TIM_CCER_CC1E << shift);
+        bool ne = _ccer & (TIM_CCER_CC1NE << shift);
+        float ref = reference(channel);
+        float duty;
+        if (e && ne && ref > 0 && ref < 1) {
+            //one rising edge per period on each output, delayed by the dead time
+            float dead = periodTicks() > 0 ? (float)(deadTicks()/periodTicks()) : 0;
+            float on = complementary ? 1 - ref : ref;
+            duty = on > dead ? on - dead : 0;
+            if (_ccer & ((complementary ? TIM_CCER_CC1NP : TIM_CCER_CC1P) << shift)) duty = 1 - duty;
+            return duty;
+        }
+        if (complementary) {
+            if (!ne) return 0;
+            duty = e ? 1 - ref : ref;
+            if (_ccer & (TIM_CCER_CC1NP << shift)) duty = 1 - duty;
+        }
+        else {
+            if (!e) return 0;
+            duty = ref;
+            if (_ccer & (TIM_CCER_CC1P << shift)) duty = 1 - duty;
+        }
+        return duty;
+    }
+
+    void arm(Time from) {
+        double counts = (regs.CR1.v & TIM_CR1_CMS) ? regs.ARR.v : regs.ARR.v + 1.0;
+        double ticks = (regs.PSC.v + 1.0)*counts*(regs.RCR.v + 1.0);
+        Time t = from + (Time)(ticks*1e9/SystemCoreClock + 0.5);
+        _update = at(t, [this, t]() {
+            arm(t);
+            _sr |= TIM_SR_UIF;
+            regs.SR.v = _sr;
+            if (trgoOnUpdate()) timerTrgo(_n);
+            if (regs.DIER.v & TIM_DIER_UIE) raiseIrq(updateIrq(_n));
+        }, false);
+    }
+
+    //Counter clocks since _start, which is when the count was 0
+    double clocks(Time t) {
+        return toSeconds(t - _start)*SystemCoreClock/(_psc + 1.0);
+    }
+
+    uint32_t count(Time t) {
+        double c = clocks(t);
+        if (regs.CR1.v & TIM_CR1_CMS) {
+            double top = regs.ARR.v;
+            double p = top > 0 ? fmod(c, 2*top) : 0;
+            return (uint32_t)(p <= top ? p : 2*top - p);
+        }
+        return (uint32_t)fmod(c, regs.ARR.v + 1.0);
+    }
+
+    void restart(uint32_t from) {
+        _start = now() - (Time)(from*(_psc + 1.0)*1e9/SystemCoreClock);
+        schedule();
+    }
+
+    //The next time an up-counting CNT gets to CCR1 or CCR2
+    void armCompare(int channel) {
+        double top = regs.ARR.v + 1.0;
+        double c = clocks(now());
+        double ahead = ((channel == 1) ? regs.CCR1.v : regs.CCR2.v) - fmod(c, top);
+        if (ahead < 0.05) ahead += top;     //not the match just gone, to rounding
+        Time t = now() + (Time)(ahead*(_psc + 1.0)*1e9/SystemCoreClock + 0.5);
+        _compare[channel - 1] = at(t, [this, channel]() {
+            _compare[channel - 1] = 0;
+            _sr |= TIM_SR_CC1IF << (channel - 1);
+            regs.SR.v = _sr;
+            raiseIrq(compareIrq(_n));
+            schedule();
+        }, false);
+    }
+
+    //TI1, or TI1 ^ TI2 ^ TI3 with CR2.TI1S, from the pins muxed to this timer
+    int inputLevel() {
+        int level = 0;
+        for (int i = 0; i < numInputs; i++) {
+            const Input& in = inputs[i];
+            if (in.timer != _n || pin(in.pin).timer != this) continue;
+            if (in.channel == 1 || (regs.CR2.v & TIM_CR2_TI1S)) level ^= pin(in.pin).level;
+        }
+        return level;
+    }
+
+    //How long TI1 has to hold: IC1F samples at fCK_INT (1-3) or fDTS over a divider
+    //(4-15), with tDTS from CR1.CKD
+    Time filterDelay() {
+        static const int divider[16] = {0, 1, 1, 1, 2, 2, 4, 4, 8, 8, 16, 16, 16, 32, 32, 32};
+        static const int samples[16] = {0, 2, 4, 8, 6, 8, 6, 8, 6, 8, 5, 6, 8, 5, 6, 8};
+        int f = (regs.CCMR1.v & TIM_CCMR1_IC1F)/TIM_CCMR1_IC1F_0;
+        double clocks = divider[f]*samples[f];
+        if (f >= 4) clocks *= 1 << ((regs.CR1.v & TIM_CR1_CKD)/TIM_CR1_CKD_0);
+        return (Time)(clocks*1e9/SystemCoreClock + 0.5);
+    }
+
+    //An edge of TI1F: capture, and reset the counter
+    void filtered() {
+        if (_ti1 == _ti1f) return;
+        _ti1f = _ti1;
+        bool trc = (regs.SMCR.v & TIM_SMCR_TS) == TIM_SMCR_TS_2;
+        uint32_t ccs = regs.CCMR1.v & TIM_CCMR1_CC1S;
+        uint32_t polarity = regs.CCER.v & (TIM_CCER_CC1P | TIM_CCER_CC1NP);
+        bool capture = (ccs == TIM_CCMR1_CC1S) ? trc :
+                       (ccs == TIM_CCMR1_CC1S_0) ? (polarity == (TIM_CCER_CC1P | TIM_CCER_CC1NP) ||
+                                                    (polarity == 0 && _ti1f) || (polarity == TIM_CCER_CC1P && !_ti1f)) :
+                       false;
+        if (capture && (regs.CCER.v & TIM_CCER_CC1E)) {
+            regs.CCR1.v = _running ? count(now()) : regs.CNT.v;
+            _sr |= TIM_SR_CC1IF;
+            regs.SR.v = _sr;
+            if (regs.DIER.v & TIM_DIER_CC1IE) raiseIrq(compareIrq(_n));
+        }
+        if (trc && (regs.SMCR.v & TIM_SMCR_SMS) == TIM_SMCR_SMS_2 && _running) {
+            //the reset is an update event, which only sets UIF without CR1.URS
+            if (!(regs.CR1.v & TIM_CR1_URS)) {
+                _sr |= TIM_SR_UIF;
+                regs.SR.v = _sr;
+                if (regs.DIER.v & TIM_DIER_UIE) raiseIrq(updateIrq(_n));
+            }
+            cancel(_update);
+            _update = 0;
+            restart(0);
+        }
+    }
+
+    int _n;
+    uint32_t _ccmr1, _ccmr2, _ccer;     //active copies, behind the CCPC preload
+    uint32_t _sr;
+    uint32_t _dier;                     //as last written
+    EventId _update;
+    EventId _compare[2];                //CCR1 and CCR2 matches
+    EventId _filter;                    //TI1 getting through the filter
+    uint32_t _psc;                      //PSC the count runs at
+    bool _running;
+    Time _start;
+    int _ti1, _ti1f;                    //TI1 and TI1F levels
+};
+
+std::map<int, TimerModel*>& models();
+
+TimerModel& model(int n) {
+    std::map<int, TimerModel*>& timers = models();
+    std::map<int, TimerModel*>::iterator it = timers.find(n);
+    if (it == timers.end()) {
+        it = timers.insert(std::make_pair(n, new TimerModel(n))).first;
+    }
+    return *it->second;
+}
+
+std::map<int, TimerModel*>& models() {
+    static std::map<int, TimerModel*> timers;
+    return timers;
+}
+
+//The pin's entry in the PWM map, or the one for af
+const Output* findOutput(int name, int af = -1) {
+    for (int i = 0; i < numOutputs; i++) {
+        if (outputs[i].pin == name && (af < 0 ? outputs[i].pwmMap : outputs[i].af == af)) return &outputs[i];
+    }
+    return 0;
+}
+
+}
+
+TIM_TypeDef* timer(int n) { return &model(n).regs; }
+
+void nvicChanged() {
+    std::map<int, TimerModel*>& m = models();
+    for (std::map<int, TimerModel*>::iterator it = m.begin(); it != m.end(); ++it) {
+        it->second->schedule();
+    }
+}
+
+//What pwmout_init()/pwmout_period_us()/pwmout_write() leave in the registers:
+//PWM mode 1 with CCR preload on the channel, its CHx or CHxN output enabled, MOE
+//set, and a 1 us timer tick.
+bool pwmoutInit(int name) {
+    const Output* o = findOutput(name);
+    if (!o) return false;
+    pwmPins()[name] = o;
+    TimerModel& t = model(o->timer);
+    int shift = 4*(o->channel - 1);
+    t.quiet(t.regs.CCER, t.regs.CCER.v | ((o->complementary ? TIM_CCER_CC1NE : TIM_CCER_CC1E) << shift));
+    t.quiet(t.regs.BDTR, t.regs.BDTR.v | TIM_BDTR_MOE);
+    t.quiet(t.regs.CR1, t.regs.CR1.v | TIM_CR1_CEN);
+    return true;
+}
+
+void pwmoutPeriod(int name, int us) {
+    const Output* o = findOutput(name);
+    TimerModel& t = model(o->timer);
+    t.quiet(t.regs.PSC, 71);
+    t.quiet(t.regs.ARR, us - 1);
+}
+
+void pwmoutWrite(int name, float value) {
+    const Output* o = findOutput(name);
+    TimerModel& t = model(o->timer);
+    //HAL_TIM_PWM_ConfigChannel() rewrites the whole channel setup
+    Reg& ccmr = (o->channel <= 2) ? t.regs.CCMR1 : t.regs.CCMR2;
+    uint32_t shift = (o->channel & 1) ? 0 : 8;
+    uint32_t mode = (TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1PE) << shift;
+    t.quiet(ccmr, (ccmr.v & ~((TIM_CCMR1_OC1M | TIM_CCMR1_OC1PE) << shift)) | mode);
+    Reg* ccr[4] = {&t.regs.CCR1, &t.regs.CCR2, &t.regs.CCR3, &t.regs.CCR4};
+    t.quiet(*ccr[o->channel - 1], (uint32_t)(value*(t.regs.ARR.v + 1)));
+}
+
+void pinFunction(int name, int af) {
+    Pin& p = pin(name);
+    p.timer = 0;
+    const Output* o = (af >= 0) ? findOutput(name, af) : 0;
+    if (o) {
+        pwmPins()[name] = o;
+        model(o->timer).apply();
+    }
+    else {
+        pwmPins().erase(name);
+    }
+    for (int i = 0; i < numInputs; i++) {
+        if (inputs[i].pin != name || inputs[i].af != af) continue;
+        TimerModel& t = model(inputs[i].timer);
+        p.timer = &t;
+        t.inputsMuxed();
+    }
+}
+
+AddrReg& AddrReg::operator=(uintptr_t x) {
+    v = x;
+    advance(costs().regWrite);
+    return *this;
+}
+
+RCC_TypeDef* rcc() {
+    static RCC_TypeDef r;
+    return &r;
+}
+
+/////////////////////////////////DMA/////////////////////////////////////////////////////////
+//Channels 1-7, each with the flags and interrupt of its own. Enabling a channel
+//latches CNDTR and CMAR. Peripheral to memory (the ADC1 request on channel 1): each
+//request stores the peripheral value at the next memory location. Memory to
+//peripheral (DIR, USART1_TX on channel 4): the peripheral fetches the next value when
+//it is ready for one, and is told when the channel is enabled. The half and full
+//transfer flags raise DMA1_ChannelN_IRQn when their interrupts are enabled. Circular
+//mode reloads CNDTR after the last transfer.
+
+namespace {
+
+const int DMA_CHANNELS = 7;
+
+class DmaModel : public Peripheral {
+public:
+    DmaModel() : _isr(0) {
+        regs.ISR.owner = this;
+        regs.IFCR.owner = this;
+        for (int c = 0; c < DMA_CHANNELS; c++) {
+            channels[c].CCR.owner = this;
+            channels[c].CNDTR.owner = this;
+            _count[c] = 0;
+            _index[c] = 0;
+        }
+    }
+
+    virtual void written(Reg* reg) {
+        if (reg == &regs.IFCR) {
+            uint32_t clear = reg->v;
+            for (int c = 0; c < DMA_CHANNELS; c++) {
+                if (clear & (DMA_IFCR_CGIF1 << 4*c)) clear |= 0xFU << 4*c;
+            }
+            _isr &= ~clear;
+            for (int c = 0; c < DMA_CHANNELS; c++) {
+                if (!(_isr & ((DMA_ISR_TCIF1 | DMA_ISR_HTIF1 | DMA_ISR_TEIF1) << 4*c))) {
+                    _isr &= ~(DMA_ISR_GIF1 << 4*c);
+                }
+            }
+            regs.ISR.v = _isr;
+            reg->v = 0;
+            return;
+        }
+        if (reg == &regs.ISR) {
+            reg->v = _isr;              //read only
+            return;
+        }
+        for (int c = 0; c < DMA_CHANNELS; c++) {
+            if (reg != &channels[c].CCR) continue;
+            if ((reg->v & DMA_CCR_EN) && !_count[c]) {
+                _count[c] = channels[c].CNDTR.v & 0xFFFF;
+                _index[c] = 0;
+                if (_enabled[c]) _enabled[c]();
+            }
+            else if (!(reg->v & DMA_CCR_EN)) {
+                _count[c] = 0;
+            }
+        }
+    }
+
+    //One request from the peripheral on channel n (1-7), peripheral to memory
+    void request(int n, uint32_t value) {
+        uintptr_t addr;
+        if (!next(n, addr)) return;
+        uint32_t size = (channels[n - 1].CCR.v & DMA_CCR_MSIZE) >> 10;
+        if (size == 0) *(volatile uint8_t*)addr = (uint8_t)value;
+        else if (size == 1) *(volatile uint16_t*)addr = (uint16_t)value;
+        else *(volatile uint32_t*)addr = value;
+        transferred(n);
+    }
+
+    //The next value for the peripheral on channel n, memory to peripheral; false if
+    //the channel has none
+    bool fetch(int n, uint32_t& value) {
+        uintptr_t addr;
+        if (!(channels[n - 1].CCR.v & DMA_CCR_DIR) || !next(n, addr)) return false;
+        uint32_t size = (channels[n - 1].CCR.v & DMA_CCR_MSIZE) >> 10;
+        if (size == 0) value = *(volatile uint8_t*)addr;
+        else if (size == 1) value = *(volatile uint16_t*)addr;
+        else value = *(volatile uint32_t*)addr;
+        transferred(n);
+        return true;
+    }
+
+    //Called when channel n is enabled, for a peripheral that fetches
+    void onEnable(int n, const std::function<void()>& fn) { _enabled[n - 1] = fn; }
+
+    DMA_TypeDef regs;
+    DMA_Channel_TypeDef channels[DMA_CHANNELS];
+
+private:
+    //The memory address of channel n's next transfer
+    bool next(int n, uintptr_t& addr) {
+        DMA_Channel_TypeDef& ch = channels[n - 1];
+        uint32_t ccr = ch.CCR.v;
+        if (!(ccr & DMA_CCR_EN) || !(ch.CNDTR.v & 0xFFFF)) return false;
+        uint32_t size = (ccr & DMA_CCR_MSIZE) >> 10;
+        addr = ch.CMAR.v + ((ccr & DMA_CCR_MINC) ? _index[n - 1] << size : 0);
+        return true;
+    }
+
+    void transferred(int n) {
+        DMA_Channel_TypeDef& ch = channels[n - 1];
+        uint32_t ccr = ch.CCR.v;
+        _index[n - 1]++;
+        uint32_t left = (ch.CNDTR.v & 0xFFFF) - 1;
+        uint32_t flags = 0;
+        if (left == _count[n - 1]/2) flags |= DMA_ISR_HTIF1;
+        if (left == 0) {
+            flags |= DMA_ISR_TCIF1;
+            if (ccr & DMA_CCR_CIRC) {
+                left = _count[n - 1];
+                _index[n - 1] = 0;
+            }
+        }
+        ch.CNDTR.v = left;
+        if (!flags) return;
+        _isr |= (flags | DMA_ISR_GIF1) << 4*(n - 1);
+        regs.ISR.v = _isr;
+        if (((flags & DMA_ISR_TCIF1) && (ccr & DMA_CCR_TCIE)) ||
+            ((flags & DMA_ISR_HTIF1) && (ccr & DMA_CCR_HTIE))) {
+            raiseIrq((IRQn_Type)(DMA1_Channel1_IRQn + n - 1));
+        }
+    }
+
+    uint32_t _isr;
+    uint32_t _count[DMA_CHANNELS];      //CNDTR when enabled, for the circular reload
+    uint32_t _index[DMA_CHANNELS];
+    std::function<void()> _enabled[DMA_CHANNELS];
+};
+
+DmaModel& dmaModel() {
+    static DmaModel d;
+    return d;
+}
+
+}
+
+DMA_TypeDef* dma() { return &dmaModel().regs; }
+
+DMA_Channel_TypeDef* dmaChannel(int n) { return &dmaModel().channels[n - 1]; }
+
+/////////////////////////////////USART///////////////////////////////////////////////////////
+//USART1's transmitter, which the telemetry uses: a byte in TDR goes out over ten bit
+//times at PCLK2/BRR baud, into sim::uartCapture(). With CR3.DMAT it takes each next
+//byte from DMA1 channel 4 as the last starts shifting out. TC is set once the line
+//goes idle, and raises USART1_IRQn with CR1.TCIE. The console and its RX stay with
+//sim::uartPutc() and typeAt().
+
+namespace {
+
+const int USART1_TX_DMA = 4;
+
+class UsartModel : public Peripheral {
+public:
+    UsartModel() : _isr(USART_ISR_TXE | USART_ISR_TC), _sending(0), _queued(false) {
+        Reg* r = &regs.CR1;
+        for (size_t i = 0; i < sizeof(USART_TypeDef)/sizeof(Reg); i++) r[i].owner = this;
+        regs.ISR.v = _isr;
+        dmaModel().onEnable(USART1_TX_DMA, [this]() { start(); });
+    }
+
+    virtual void written(Reg* reg) {
+        if (reg == &regs.ICR) {
+            flags(_isr & ~(reg->v & USART_ICR_TCCF));
+            reg->v = 0;
+        }
+        else if (reg == &regs.ISR) {
+            reg->v = _isr;              //read only
+        }
+        else if (reg == &regs.TDR) {
+            _tdr = (uint8_t)reg->v;
+            _queued = true;
+            flags(_isr & ~(USART_ISR_TXE | USART_ISR_TC));
+            start();
+        }
+        else if (reg == &regs.CR3 || reg == &regs.CR1) {
+            start();
+        }
+    }
+
+    USART_TypeDef regs;
+
+private:
+    void flags(uint32_t isr) {
+        _isr = isr;
+        regs.ISR.v = isr;
+    }
+
+    bool enabled() const {
+        return (regs.CR1.v & (USART_CR1_UE | USART_CR1_TE)) == (USART_CR1_UE | USART_CR1_TE) && regs.BRR.v;
+    }
+
+    //The next byte: written to TDR, or from the DMA
+    bool take(uint8_t& b) {
+        if (_queued) {
+            _queued = false;
+            b = _tdr;
+            return true;
+        }
+        uint32_t v;
+        if (!(regs.CR3.v & USART_CR3_DMAT) || !dmaModel().fetch(USART1_TX_DMA, v)) return false;
+        b = (uint8_t)v;
+        return true;
+    }
+
+    //Shift the next byte out, if the line is idle and there is one
+    void start() {
+        uint8_t b;
+        if (_sending || !enabled() || !take(b)) return;
+        flags((_isr | USART_ISR_TXE) & ~USART_ISR_TC);
+        Time charTime = (Time)(10.0*regs.BRR.v*1e9/SystemCoreClock + 0.5);
+        _sending = at(now() + charTime, [this, b]() {
+            _sending = 0;
+            uartCapture().push_back((char)b);
+            start();
+            if (!_sending) {
+                flags(_isr | USART_ISR_TC);
+                if (regs.CR1.v & USART_CR1_TCIE) raiseIrq(USART1_IRQn);
+            }
+        }, false);
+    }
+
+    uint32_t _isr;
+    EventId _sending;
+    bool _queued;
+    uint8_t _tdr;
+};
+
+UsartModel& usartModel() {
+    static UsartModel u;
+    return u;
+}
+
+}
+
+USART_TypeDef* usart(int) { return &usartModel().regs; }
+
+void serialInit(int tx, int baud) {
+    if (tx != PA_9) return;
+    USART_TypeDef& u = usartModel().regs;
+    u.BRR.v = (SystemCoreClock + baud/2)/baud;
+    u.CR1.v = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+}
+
+/////////////////////////////////ADC/////////////////////////////////////////////////////////
+//Regular conversions of up to the four channels in SQR1, 12 bit, started by ADSTART
+//with software triggering or by the selected TRGO while ADSTART is set. Each takes the
+//channel's sample time plus 12.5 ADC clocks, and reads the pin voltage at the end of
+//it (the plant changes it in 10 us steps, so the sample instant doesn't matter).
+//Triggers that arrive during a sequence are ignored, as on the chip. DR goes to the
+//DMA when CFGR.DMAEN is set; EOC/EOS interrupts go to ADC1_2_IRQn.
+
+namespace {
+
+//ADC1 channels 1-4 and ADC2 channels 1-4, from the PeripheralPins.c ADC map
+int adcPin(int n, int channel) {
+    static const int adc1[5] = {-1, PA_0, PA_1, PA_2, PA_3};
+    static const int adc2[5] = {-1, PA_4, PA_5, PA_6, PA_7};
+    if (channel < 1 || channel > 4) return -1;
+    return (n == 1) ? adc1[channel] : adc2[channel];
+}
+
+//TIM1_TRGO in CFGR.EXTSEL for ADC1/2
+const uint32_t EXTSEL_TIM1_TRGO = 9;
+
+class AdcModel : public Peripheral {
+public:
+    AdcModel(int n) : _n(n), _isr(0), _busy(false) {
+        Reg* r = &regs.ISR;
+        for (size_t i = 0; i < sizeof(ADC_TypeDef)/sizeof(Reg); i++) r[i].owner = this;
+    }
+
+    virtual void written(Reg* reg) {
+        if (reg == &regs.ISR) {
+            _isr &= ~reg->v;            //flags are cleared by writing 1
+            reg->v = _isr;
+        }
+        else if (reg == &regs.CR) {
+            uint32_t cr = reg->v;
+            cr &= ~ADC_CR_ADCAL;        //calibration finishes at once
+            if (cr & ADC_CR_ADDIS) cr &= ~(ADC_CR_ADEN | ADC_CR_ADDIS | ADC_CR_ADSTART);
+            if (cr & ADC_CR_ADSTP) cr &= ~(ADC_CR_ADSTP | ADC_CR_ADSTART);
+            if (cr & ADC_CR_ADEN) _isr |= ADC_ISR_ADRDY;
+            reg->v = cr;
+            regs.ISR.v = _isr;
+            if ((cr & ADC_CR_ADSTART) && !(regs.CFGR.v & ADC_CFGR_EXTEN)) start();
+        }
+    }
+
+    void trigger(int timer) {
+        uint32_t cfgr = regs.CFGR.v;
+        if (!(regs.CR.v & ADC_CR_ADEN) || !(regs.CR.v & ADC_CR_ADSTART)) return;
+        if (!(cfgr & ADC_CFGR_EXTEN)) return;
+        if (timer == 1 && ((cfgr & ADC_CFGR_EXTSEL) >> 6) == EXTSEL_TIM1_TRGO) start();
+    }
+
+    ADC_TypeDef regs;
+
+private:
+    void start() {
+        if (_busy) return;
+        _busy = true;
+        convert(0, now());
+    }
+
+    //ADC clocks per second from CKMODE; the asynchronous clock is taken to be the PLL
+    double clock() {
+        switch ((adcCommon()->CCR.v & ADC12_CCR_CKMODE) >> 16) {
+            case 2: return SystemCoreClock/2.0;
+            case 3: return SystemCoreClock/4.0;
+            default: return SystemCoreClock;
+        }
+    }
+
+    double sampleCycles(int channel) {
+        static const double smp[8] = {1.5, 2.5, 4.5, 7.5, 19.5, 61.5, 181.5, 601.5};
+        const Reg& r = (channel <= 9) ? regs.SMPR1 : regs.SMPR2;
+        int shift = 3*((channel <= 9) ? channel : channel - 10);
+        return smp[(r.v >> shift) & 7];
+    }
+
+    void convert(int rank, Time from) {
+        int length = (regs.SQR1.v & 0xF) + 1;
+        if (length > 4) length = 4;
+        int channel = (regs.SQR1.v >> (6*(rank + 1))) & 0x1F;
+        double cycles = sampleCycles(channel) + 12.5;
+        Time t = from + (Time)(cycles*1e9/clock() + 0.5);
+        at(t, [this, rank, length, channel, t]() {
+            int name = adcPin(_n, channel);
+            double v = (name >= 0) ? pin(name).voltage : 0;
+            int code = (int)(v/3.3*4095 + 0.5);
+            code = code < 0 ? 0 : (code > 4095 ? 4095 : code);
+            uint32_t dr = (regs.CFGR.v & ADC_CFGR_ALIGN) ? (uint32_t)code << 4 : (uint32_t)code;
+            regs.DR.v = dr;
+            _isr |= ADC_ISR_EOC | ADC_ISR_EOSMP;
+            if (rank == length - 1) {
+                _isr |= ADC_ISR_EOS;
+                _busy = false;
+            }
+            if ((regs.CFGR.v & ADC_CFGR_DMAEN) && _n == 1) {
+                _isr &= ~ADC_ISR_EOC;   //the DMA read of DR clears it
+                dmaModel().request(1, dr);
+            }
+            regs.ISR.v = _isr;
+            if (regs.IER.v & _isr & (ADC_ISR_EOC | ADC_ISR_EOS)) raiseIrq(ADC1_2_IRQn);
+            if (rank < length - 1) convert(rank + 1, t);
+        }, false);
+    }
+
+    int _n;
+    uint32_t _isr;
+    bool _busy;
+};
+
+AdcModel& adcModel(int n) {
+    static AdcModel adc1(1), adc2(2);
+    return (n == 2) ? adc2 : adc1;
+}
+
+}
+
+ADC_TypeDef* adc(int n) { return &adcModel(n).regs; }
+
+ADC_Common_TypeDef* adcCommon() {
+    static ADC_Common_TypeDef c;
+    return &c;
+}
+
+void timerTrgo(int n) {
+    adcModel(1).trigger(n);
+    adcModel(2).trigger(n);
+}
+
+/////////////////////////////////COMP////////////////////////////////////////////////////////
+//COMP2, COMP4 and COMP6. Reading CSR gives COMPxOUT from the pin voltages at that
+//moment: the non-inverting input against the one INSEL picks, inverted by POL, 0
+//while COMPxEN is clear. No hysteresis, blanking or output routing.
+
+namespace {
+
+const double VREFINT = 1.2;
+
+//Non-inverting input of each comparator, and the IO1 choice of inverting input
+int compPlus(int n) {
+    return (n == 2) ? PA_7 : (n == 4) ? PB_0 : PIN_PB_11;
+}
+
+int compIo1(int n) {
+    return (n == 2) ? PA_2 : (n == 4) ? PIN_PB_2 : PIN_PB_15;
+}
+
+class CompModel : public Peripheral {
+public:
+    CompModel(int n) : _n(n) {
+        regs.CSR.owner = this;
+    }
+
+    virtual void written(Reg* reg) {
+        reg->v &= ~COMP_CSR_COMPxOUT;   //read only
+    }
+
+    virtual void read(Reg* reg) {
+        uint32_t csr = reg->v & ~COMP_CSR_COMPxOUT;
+        if (csr & COMP_CSR_COMPxEN) {
+            bool out = pin(compPlus(_n)).voltage > minus(csr);
+            if (csr & COMP_CSR_COMPxPOL) out = !out;
+            if (out) csr |= COMP_CSR_COMPxOUT;
+        }
+        reg->v = csr;
+    }
+
+    COMP_TypeDef regs;
+
+private:
+    double minus(uint32_t csr) {
+        int insel = ((csr >> 4) & 7) | (((csr >> 22) & 1) << 3);
+        switch (insel) {
+            case 0: return VREFINT/4;
+            case 1: return VREFINT/2;
+            case 2: return 3*VREFINT/4;
+            case 3: return VREFINT;
+            case 4: return pin(PA_4).voltage;   //or DAC1_CH1, which isn't modelled
+            case 5: return pin(PA_5).voltage;
+            case 6: return pin(compIo1(_n)).voltage;
+            default: return 0;
+        }
+    }
+
+    int _n;
+};
+
+}
+
+COMP_TypeDef* comp(int n) {
+    static CompModel comp2(2), comp4(4), comp6(6);
+    return (n == 2) ? &comp2.regs : (n == 4) ? &comp4.regs : &comp6.regs;
+}
+
+}
+
+/////////////////////////////////FLASH///////////////////////////////////////////////////////
+//Page erase and halfword programming times from the F303 datasheet (tERASE 20-40 ms,
+//tPROG 40-70 us), the longest.
+
+namespace sim {
+
+namespace {
+
+const Time FLASH_ERASE_TIME = 40*MS;
+const Time FLASH_PROGRAM_TIME = 70*US;
+
+bool flashUnlocked = false;
+
+//The CPU waits on the flash with nothing else running
+void flashBusy(Time t) {
+    bool enabled = irqEnabled();
+    disableIrq();
+    advance(t);
+    if (enabled) enableIrq();
+}
+
+//Mapped before main() so every forked scenario has it at the same place
+struct FlashMapping {
+    FlashMapping() { flash(); }
+} flashMapping;
+
+}
+
+uint8_t* flash() {
+    static uint8_t* memory = 0;
+    if (!memory) {
+        void* p = mmap((void*)(uintptr_t)FLASH_BASE, FLASH_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != (void*)(uintptr_t)FLASH_BASE) {
+            fprintf(stderr, "can't map the flash at 0x%08x\n", FLASH_BASE);
+            abort();
+        }
+        memory = (uint8_t*)p;
+        memset(memory, 0xFF, FLASH_SIZE);
+    }
+    return memory;
+}
+
+}
+
+//The linker's end of the image, which calibration.cpp keeps its pages above: 48 KB of
+//code and no initial data, as absolute symbols in the mapped flash
+__asm__(".globl __etext\n.set __etext, 0x0800C000\n"
+        ".globl __data_start__\n.set __data_start__, 0x20000000\n"
+        ".globl __data_end__\n.set __data_end__, 0x20000000\n");
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void) {
+    sim::flashUnlocked = true;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void) {
+    sim::flashUnlocked = false;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data) {
+    int halfwords = (TypeProgram == FLASH_TYPEPROGRAM_HALFWORD) ? 1 : (TypeProgram == FLASH_TYPEPROGRAM_WORD) ? 2 : 4;
+    if (!sim::flashUnlocked || (Address & 1) || Address < FLASH_BASE ||
+        Address + 2*halfwords > FLASH_BASE + sim::FLASH_SIZE) {
+        return HAL_ERROR;
+    }
+    uint16_t* p = (uint16_t*)(sim::flash() + (Address - FLASH_BASE));
+    for (int i = 0; i < halfwords; i++) {
+        uint16_t h = (uint16_t)(Data >> 16*i);
+        sim::flashBusy(sim::FLASH_PROGRAM_TIME);
+        if (p[i] != 0xFFFF && h != 0) return HAL_ERROR;
+        p[i] = h;
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef* pEraseInit, uint32_t* PageError) {
+    *PageError = 0xFFFFFFFFU;
+    uint32_t page = pEraseInit->PageAddress & ~(FLASH_PAGE_SIZE - 1);
+    for (uint32_t i = 0; i < pEraseInit->NbPages; i++, page += FLASH_PAGE_SIZE) {
+        if (!sim::flashUnlocked || page < FLASH_BASE || page >= FLASH_BASE + sim::FLASH_SIZE) {
+            *PageError = page;
+            return HAL_ERROR;
+        }
+        sim::flashBusy(sim::FLASH_ERASE_TIME);
+        memset(sim::flash() + (page - FLASH_BASE), 0xFF, FLASH_PAGE_SIZE);
+    }
+    return HAL_OK;
+}
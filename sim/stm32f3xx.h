@@ -0,0 +1,443 @@
+//Host stand-in for the STM32F303x8 device header: the peripheral registers the
+//firmware touches directly, backed by models in stm32f3xx.cpp that drive the sim
+//pins. Field names, bit names and values match CMSIS stm32f303x8.h so the same code
+//builds for the board.
+
+#ifndef SIM_STM32F3XX_H
+#define SIM_STM32F3XX_H
+
+#include <stdint.h>
+
+namespace sim {
+
+struct Peripheral;
+
+//A memory mapped register. Writes cost sim::costs().regWrite and tell the owning
+//peripheral model which register changed; reads let it bring the value up to date
+//first, for registers that change on their own (a counter, a comparator output).
+struct Reg {
+    Reg() : v(0), owner(0) {}
+    operator uint32_t() const { return get(); }
+    Reg& operator=(uint32_t x) { set(x); return *this; }
+    Reg& operator=(const Reg& r) { set(r.v); return *this; }
+    Reg& operator|=(uint32_t x) { set(v | x); return *this; }
+    Reg& operator&=(uint32_t x) { set(v & x); return *this; }
+    Reg& operator^=(uint32_t x) { set(v ^ x); return *this; }
+    void set(uint32_t x);
+    uint32_t get() const;
+
+    uint32_t v;
+    Peripheral* owner;
+};
+
+//A register that holds a bus address (DMA CPAR/CMAR). 32 bits on the board, pointer
+//sized here; firmware should cast with (uintptr_t) as for NVIC_SetVector().
+struct AddrReg {
+    AddrReg() : v(0) {}
+    operator uintptr_t() const { return v; }
+    AddrReg& operator=(uintptr_t x);
+
+    uintptr_t v;
+};
+
+struct Peripheral {
+    virtual void written(Reg* reg) = 0;
+    virtual void read(Reg*) {}
+    virtual ~Peripheral() {}
+};
+
+}
+
+/////////////////////////////////NVIC////////////////////////////////////////////////////////
+
+typedef enum {
+    DMA1_Channel1_IRQn          = 11,
+    DMA1_Channel4_IRQn          = 14,
+    ADC1_2_IRQn                 = 18,
+    TIM1_BRK_TIM15_IRQn         = 24,
+    TIM1_UP_TIM16_IRQn          = 25,
+    TIM1_TRG_COM_TIM17_IRQn     = 26,
+    TIM1_CC_IRQn                = 27,
+    TIM2_IRQn                   = 28,
+    TIM3_IRQn                   = 29,
+    USART1_IRQn                 = 37,
+    USART2_IRQn                 = 38,
+    COMP2_IRQn                  = 64,
+    COMP4_6_IRQn                = 65
+} IRQn_Type;
+
+//Vectors are function addresses, uint32_t on the board. Firmware should cast with
+//(uintptr_t) so the same line builds on a 64 bit host.
+void NVIC_SetVector(IRQn_Type irq, uintptr_t vector);
+uintptr_t NVIC_GetVector(IRQn_Type irq);
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority);
+
+namespace sim {
+//Pend the vector for irq on the interrupt path, if it is enabled
+void raiseIrq(IRQn_Type irq);
+bool irqEnabled(IRQn_Type irq);
+}
+
+//Core clock, also the TIM1/15/16/17 clock with the mbed clock setup
+extern uint32_t SystemCoreClock;
+
+/////////////////////////////////TIMERS//////////////////////////////////////////////////////
+
+typedef struct {
+    sim::Reg CR1, CR2, SMCR, DIER, SR, EGR, CCMR1, CCMR2, CCER, CNT, PSC, ARR, RCR;
+    sim::Reg CCR1, CCR2, CCR3, CCR4, BDTR, DCR, DMAR, OR, CCMR3, CCR5, CCR6;
+} TIM_TypeDef;
+
+namespace sim {
+TIM_TypeDef* timer(int n);
+
+//Register effects of the mbed pwmout_api calls, used by the PwmOut shim. pwmoutInit()
+//returns false for pins that aren't on a modelled timer.
+bool pwmoutInit(int pin);
+void pwmoutPeriod(int pin, int us);
+void pwmoutWrite(int pin, float value);
+
+//pin_function(): a pin's alternate function, -1 for none. Connects the timer inputs.
+void pinFunction(int pin, int af);
+}
+
+#define TIM1    (sim::timer(1))
+#define TIM2    (sim::timer(2))
+#define TIM3    (sim::timer(3))
+#define TIM15   (sim::timer(15))
+#define TIM16   (sim::timer(16))
+#define TIM17   (sim::timer(17))
+
+#define TIM_CR1_CEN         0x00000001U
+#define TIM_CR1_UDIS        0x00000002U
+#define TIM_CR1_URS         0x00000004U
+#define TIM_CR1_OPM         0x00000008U
+#define TIM_CR1_DIR         0x00000010U
+#define TIM_CR1_CMS         0x00000060U
+#define TIM_CR1_CMS_0       0x00000020U
+#define TIM_CR1_CMS_1       0x00000040U
+#define TIM_CR1_ARPE        0x00000080U
+#define TIM_CR1_CKD         0x00000300U
+#define TIM_CR1_CKD_0       0x00000100U
+#define TIM_CR1_CKD_1       0x00000200U
+
+#define TIM_CR2_CCPC        0x00000001U
+#define TIM_CR2_CCUS        0x00000004U
+#define TIM_CR2_CCDS        0x00000008U
+#define TIM_CR2_MMS         0x00000070U
+#define TIM_CR2_MMS_0       0x00000010U
+#define TIM_CR2_MMS_1       0x00000020U
+#define TIM_CR2_MMS_2       0x00000040U
+#define TIM_CR2_TI1S        0x00000080U
+
+#define TIM_SMCR_SMS        0x00010007U
+#define TIM_SMCR_SMS_0      0x00000001U
+#define TIM_SMCR_SMS_1      0x00000002U
+#define TIM_SMCR_SMS_2      0x00000004U
+#define TIM_SMCR_TS         0x00000070U
+#define TIM_SMCR_TS_0       0x00000010U
+#define TIM_SMCR_TS_1       0x00000020U
+#define TIM_SMCR_TS_2       0x00000040U
+
+#define TIM_DIER_UIE        0x00000001U
+#define TIM_DIER_CC1IE      0x00000002U
+#define TIM_DIER_CC2IE      0x00000004U
+#define TIM_DIER_CC3IE      0x00000008U
+#define TIM_DIER_CC4IE      0x00000010U
+#define TIM_DIER_COMIE      0x00000020U
+#define TIM_DIER_UDE        0x00000100U
+
+#define TIM_SR_UIF          0x00000001U
+#define TIM_SR_CC1IF        0x00000002U
+#define TIM_SR_CC2IF        0x00000004U
+#define TIM_SR_COMIF        0x00000020U
+
+#define TIM_EGR_UG          0x00000001U
+#define TIM_EGR_COMG        0x00000020U
+
+#define TIM_CCMR1_CC1S      0x00000003U
+#define TIM_CCMR1_CC1S_0    0x00000001U
+#define TIM_CCMR1_CC1S_1    0x00000002U
+#define TIM_CCMR1_IC1F      0x000000F0U
+#define TIM_CCMR1_IC1F_0    0x00000010U
+#define TIM_CCMR1_OC1FE     0x00000004U
+#define TIM_CCMR1_OC1PE     0x00000008U
+#define TIM_CCMR1_OC1M      0x00010070U
+#define TIM_CCMR1_OC1M_0    0x00000010U
+#define TIM_CCMR1_OC1M_1    0x00000020U
+#define TIM_CCMR1_OC1M_2    0x00000040U
+#define TIM_CCMR1_OC1M_3    0x00010000U
+#define TIM_CCMR1_OC2FE     0x00000400U
+#define TIM_CCMR1_OC2PE     0x00000800U
+#define TIM_CCMR1_OC2M      0x01007000U
+#define TIM_CCMR1_OC2M_0    0x00001000U
+#define TIM_CCMR1_OC2M_1    0x00002000U
+#define TIM_CCMR1_OC2M_2    0x00004000U
+#define TIM_CCMR1_OC2M_3    0x01000000U
+
+#define TIM_CCMR2_OC3PE     0x00000008U
+#define TIM_CCMR2_OC3M      0x00010070U
+#define TIM_CCMR2_OC3M_0    0x00000010U
+#define TIM_CCMR2_OC3M_1    0x00000020U
+#define TIM_CCMR2_OC3M_2    0x00000040U
+#define TIM_CCMR2_OC4PE     0x00000800U
+#define TIM_CCMR2_OC4M      0x01007000U
+#define TIM_CCMR2_OC4M_0    0x00001000U
+#define TIM_CCMR2_OC4M_1    0x00002000U
+#define TIM_CCMR2_OC4M_2    0x00004000U
+
+#define TIM_CCER_CC1E       0x00000001U
+#define TIM_CCER_CC1P       0x00000002U
+#define TIM_CCER_CC1NE      0x00000004U
+#define TIM_CCER_CC1NP      0x00000008U
+#define TIM_CCER_CC2E       0x00000010U
+#define TIM_CCER_CC2P       0x00000020U
+#define TIM_CCER_CC2NE      0x00000040U
+#define TIM_CCER_CC2NP      0x00000080U
+#define TIM_CCER_CC3E       0x00000100U
+#define TIM_CCER_CC3P       0x00000200U
+#define TIM_CCER_CC3NE      0x00000400U
+#define TIM_CCER_CC3NP      0x00000800U
+#define TIM_CCER_CC4E       0x00001000U
+#define TIM_CCER_CC4P       0x00002000U
+
+#define TIM_BDTR_DTG        0x000000FFU
+#define TIM_BDTR_OSSI       0x00000400U
+#define TIM_BDTR_OSSR       0x00000800U
+#define TIM_BDTR_AOE        0x00004000U
+#define TIM_BDTR_MOE        0x00008000U
+
+/////////////////////////////////RCC/////////////////////////////////////////////////////////
+//Plain storage: every clock the firmware asks for is already running in the sim
+
+typedef struct {
+    sim::Reg CR, CFGR, CIR, APB2RSTR, APB1RSTR, AHBENR, APB2ENR, APB1ENR, BDCR, CSR;
+    sim::Reg AHBRSTR, CFGR2, CFGR3;
+} RCC_TypeDef;
+
+namespace sim {
+RCC_TypeDef* rcc();
+}
+
+#define RCC     (sim::rcc())
+
+#define RCC_AHBENR_DMA1EN   0x00000001U
+#define RCC_AHBENR_ADC12EN  0x10000000U
+#define RCC_APB1ENR_TIM3EN  0x00000002U
+#define RCC_APB2ENR_SYSCFGEN 0x00000001U
+#define RCC_APB2ENR_TIM15EN 0x00010000U
+
+/////////////////////////////////ADC/////////////////////////////////////////////////////////
+
+typedef struct {
+    sim::Reg ISR, IER, CR, CFGR, SMPR1, SMPR2, TR1, TR2, TR3, SQR1, SQR2, SQR3, SQR4, DR;
+    sim::Reg JSQR, OFR1, OFR2, OFR3, OFR4, JDR1, JDR2, JDR3, JDR4, AWD2CR, AWD3CR;
+    sim::Reg DIFSEL, CALFACT;
+} ADC_TypeDef;
+
+typedef struct {
+    sim::Reg CSR, CCR, CDR;
+} ADC_Common_TypeDef;
+
+namespace sim {
+ADC_TypeDef* adc(int n);
+ADC_Common_TypeDef* adcCommon();
+//A timer's TRGO output, for the ADC external triggers
+void timerTrgo(int n);
+}
+
+#define ADC1            (sim::adc(1))
+#define ADC2            (sim::adc(2))
+#define ADC12_COMMON    (sim::adcCommon())
+
+#define ADC_ISR_ADRDY       0x00000001U
+#define ADC_ISR_EOSMP       0x00000002U
+#define ADC_ISR_EOC         0x00000004U
+#define ADC_ISR_EOS         0x00000008U
+#define ADC_ISR_OVR         0x00000010U
+
+#define ADC_IER_EOCIE       0x00000004U
+#define ADC_IER_EOSIE       0x00000008U
+
+#define ADC_CR_ADEN         0x00000001U
+#define ADC_CR_ADDIS        0x00000002U
+#define ADC_CR_ADSTART      0x00000004U
+#define ADC_CR_ADSTP        0x00000010U
+#define ADC_CR_ADVREGEN     0x30000000U
+#define ADC_CR_ADVREGEN_0   0x10000000U
+#define ADC_CR_ADVREGEN_1   0x20000000U
+#define ADC_CR_ADCALDIF     0x40000000U
+#define ADC_CR_ADCAL        0x80000000U
+
+#define ADC_CFGR_DMAEN      0x00000001U
+#define ADC_CFGR_DMACFG     0x00000002U
+#define ADC_CFGR_RES        0x00000018U
+#define ADC_CFGR_ALIGN      0x00000020U
+#define ADC_CFGR_EXTSEL     0x000003C0U
+#define ADC_CFGR_EXTSEL_0   0x00000040U
+#define ADC_CFGR_EXTSEL_1   0x00000080U
+#define ADC_CFGR_EXTSEL_2   0x00000100U
+#define ADC_CFGR_EXTSEL_3   0x00000200U
+#define ADC_CFGR_EXTEN      0x00000C00U
+#define ADC_CFGR_EXTEN_0    0x00000400U
+#define ADC_CFGR_EXTEN_1    0x00000800U
+#define ADC_CFGR_OVRMOD     0x00001000U
+#define ADC_CFGR_CONT       0x00002000U
+
+#define ADC_SQR1_L_Pos      0U
+#define ADC_SQR1_SQ1_Pos    6U
+#define ADC_SQR1_SQ2_Pos    12U
+#define ADC_SQR1_SQ3_Pos    18U
+#define ADC_SQR1_SQ4_Pos    24U
+
+#define ADC_SMPR1_SMP1_Pos  3U
+#define ADC_SMPR1_SMP2_Pos  6U
+#define ADC_SMPR1_SMP3_Pos  9U
+#define ADC_SMPR1_SMP4_Pos  12U
+
+#define ADC12_CCR_CKMODE    0x00030000U
+#define ADC12_CCR_CKMODE_0  0x00010000U
+#define ADC12_CCR_CKMODE_1  0x00020000U
+
+/////////////////////////////////DMA/////////////////////////////////////////////////////////
+
+typedef struct {
+    sim::Reg CCR, CNDTR;
+    sim::AddrReg CPAR, CMAR;
+} DMA_Channel_TypeDef;
+
+typedef struct {
+    sim::Reg ISR, IFCR;
+} DMA_TypeDef;
+
+namespace sim {
+DMA_TypeDef* dma();
+DMA_Channel_TypeDef* dmaChannel(int n);
+}
+
+#define DMA1            (sim::dma())
+#define DMA1_Channel1   (sim::dmaChannel(1))
+#define DMA1_Channel4   (sim::dmaChannel(4))
+
+#define DMA_ISR_GIF1        0x00000001U
+#define DMA_ISR_TCIF1       0x00000002U
+#define DMA_ISR_HTIF1       0x00000004U
+#define DMA_ISR_TEIF1       0x00000008U
+
+#define DMA_IFCR_CGIF1      0x00000001U
+#define DMA_IFCR_CTCIF1     0x00000002U
+#define DMA_IFCR_CHTIF1     0x00000004U
+#define DMA_IFCR_CTEIF1     0x00000008U
+
+#define DMA_ISR_GIF4        0x00001000U
+#define DMA_ISR_TCIF4       0x00002000U
+#define DMA_IFCR_CGIF4      0x00001000U
+
+#define DMA_CCR_EN          0x00000001U
+#define DMA_CCR_TCIE        0x00000002U
+#define DMA_CCR_HTIE        0x00000004U
+#define DMA_CCR_TEIE        0x00000008U
+#define DMA_CCR_DIR         0x00000010U
+#define DMA_CCR_CIRC        0x00000020U
+#define DMA_CCR_PINC        0x00000040U
+#define DMA_CCR_MINC        0x00000080U
+#define DMA_CCR_PSIZE       0x00000300U
+#define DMA_CCR_PSIZE_0     0x00000100U
+#define DMA_CCR_PSIZE_1     0x00000200U
+#define DMA_CCR_MSIZE       0x00000C00U
+#define DMA_CCR_MSIZE_0     0x00000400U
+#define DMA_CCR_MSIZE_1     0x00000800U
+#define DMA_CCR_PL          0x00003000U
+#define DMA_CCR_PL_0        0x00001000U
+#define DMA_CCR_PL_1        0x00002000U
+
+/////////////////////////////////USART///////////////////////////////////////////////////////
+
+typedef struct {
+    sim::Reg CR1, CR2, CR3, BRR, GTPR, RTOR, RQR, ISR, ICR, RDR, TDR;
+} USART_TypeDef;
+
+namespace sim {
+USART_TypeDef* usart(int n);
+//What serial_init() and serial_baud() leave in the registers of the port on tx
+void serialInit(int tx, int baud);
+}
+
+#define USART1  (sim::usart(1))
+
+#define USART_CR1_UE        0x00000001U
+#define USART_CR1_RE        0x00000004U
+#define USART_CR1_TE        0x00000008U
+#define USART_CR1_TCIE      0x00000040U
+#define USART_CR3_DMAT      0x00000080U
+#define USART_ISR_TC        0x00000040U
+#define USART_ISR_TXE       0x00000080U
+#define USART_ICR_TCCF      0x00000040U
+
+/////////////////////////////////COMP////////////////////////////////////////////////////////
+
+typedef struct {
+    sim::Reg CSR;
+} COMP_TypeDef;
+
+namespace sim {
+COMP_TypeDef* comp(int n);
+}
+
+#define COMP2   (sim::comp(2))
+#define COMP4   (sim::comp(4))
+#define COMP6   (sim::comp(6))
+
+#define COMP_CSR_COMPxEN        0x00000001U
+#define COMP_CSR_COMPxINSEL     0x00400070U
+#define COMP_CSR_COMPxINSEL_0   0x00000010U
+#define COMP_CSR_COMPxINSEL_1   0x00000020U
+#define COMP_CSR_COMPxINSEL_2   0x00000040U
+#define COMP_CSR_COMPxINSEL_3   0x00400000U
+#define COMP_CSR_COMPxOUTSEL    0x00003C00U
+#define COMP_CSR_COMPxPOL       0x00008000U
+#define COMP_CSR_COMPxBLANKING  0x001C0000U
+#define COMP_CSR_COMPxOUT       0x40000000U
+#define COMP_CSR_COMPxLOCK      0x80000000U
+
+/////////////////////////////////FLASH///////////////////////////////////////////////////////
+//The HAL calls rather than the FLASH registers. The 64 KB are host memory mapped at
+//FLASH_BASE, erased to begin with, so firmware reads them through a pointer as it
+//would on the board. Erasing a page or programming a halfword stalls the CPU with
+//interrupts held off, as a fetch from flash does while it is busy.
+
+#define FLASH_BASE                  0x08000000U
+#define FLASH_PAGE_SIZE             0x800U
+#define FLASH_TYPEERASE_PAGES       0x00U
+#define FLASH_TYPEPROGRAM_HALFWORD  0x01U
+#define FLASH_TYPEPROGRAM_WORD      0x02U
+#define FLASH_TYPEPROGRAM_DOUBLEWORD 0x03U
+
+typedef enum {
+    HAL_OK      = 0x00U,
+    HAL_ERROR   = 0x01U,
+    HAL_BUSY    = 0x02U,
+    HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+typedef struct {
+    uint32_t TypeErase;
+    uint32_t PageAddress;
+    uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+//Programming a halfword that isn't erased fails (PGERR), unless it is to 0
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef* pEraseInit, uint32_t* PageError);
+
+namespace sim {
+//The flash contents, for a scenario to carry them over a reset
+uint8_t* flash();
+const uint32_t FLASH_SIZE = 0x10000;
+}
+
+#endif
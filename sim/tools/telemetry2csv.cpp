@@ -0,0 +1,98 @@
+//Converts a capture of the telemetry UART (see Submission/telemetry.h) to CSV.
+//
+//  g++ -std=c++11 -O2 -ISubmission -o telemetry2csv sim/tools/telemetry2csv.cpp
+//  ./telemetry2csv capture.bin > telemetry.csv
+//
+//Reads stdin without a file name. Frames that fail the CRC are skipped; lost frames
+//(sequence gaps) and samples the firmware dropped are counted on stderr.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "frame.h"
+
+namespace {
+
+//Payload layout, as in telemetry.h
+const int FRAME_SAMPLES = 1;
+const int HEADER_BYTES = 5;
+const int SAMPLE_BYTES = 20;
+const int MAX_FRAME = 1024;
+
+uint32_t getU32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+float getFloat(const uint8_t* p) {
+    uint32_t u = getU32(p);
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+struct Stats {
+    long frames, bad, lost, samples;
+    unsigned dropped;
+};
+
+void frame(const uint8_t* payload, int n, FILE* out, Stats& st, int& lastSequence) {
+    if (n < HEADER_BYTES || payload[0] != FRAME_SAMPLES ||
+        n != HEADER_BYTES + payload[4]*SAMPLE_BYTES) {
+        st.bad++;
+        return;
+    }
+    st.frames++;
+    int sequence = payload[1];
+    if (lastSequence >= 0) st.lost += (sequence - lastSequence - 1) & 0xFF;
+    lastSequence = sequence;
+    st.dropped = payload[2] | (payload[3] << 8);
+    for (int i = 0; i < payload[4]; i++) {
+        const uint8_t* s = payload + HEADER_BYTES + i*SAMPLE_BYTES;
+        fprintf(out, "%.6f,%.4f,%.3f,%.4f,%.3f\n", getU32(s)*1e-6, getFloat(s + 4), getFloat(s + 8),
+                getFloat(s + 12), getFloat(s + 16));
+        st.samples++;
+    }
+}
+
+}
+
+int main(int argc, char** argv) {
+    FILE* in = stdin;
+    if (argc > 1 && !(in = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+    FILE* out = stdout;
+
+    Stats st;
+    memset(&st, 0, sizeof(st));
+    int lastSequence = -1;
+    std::vector<uint8_t> encoded;
+    uint8_t payload[MAX_FRAME];
+    bool overflow = false;
+
+    fprintf(out, "t,position,velocity,delta,error\n");
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        if (c != 0) {
+            if (encoded.size() < MAX_FRAME) encoded.push_back((uint8_t)c);
+            else overflow = true;
+            continue;
+        }
+        //the first frame may be cut off, and empty frames are line noise
+        if (!encoded.empty()) {
+            int n = overflow ? -1 : frameDecode(encoded.data(), (int)encoded.size(), payload);
+            if (n < 0) st.bad++;
+            else frame(payload, n, out, st, lastSequence);
+        }
+        encoded.clear();
+        overflow = false;
+    }
+    if (!encoded.empty()) st.bad++;
+
+    fprintf(stderr, "%ld frames, %ld samples, %ld bad frames, %ld lost frames, %u samples dropped by the firmware\n",
+            st.frames, st.samples, st.bad, st.lost, st.dropped);
+    return 0;
+}